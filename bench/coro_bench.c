@@ -0,0 +1,938 @@
+/** \file coro_bench.c
+ *
+ * Scheduler benchmarks for Linux hosts.
+ *
+ * Prints one CSV line per measurement to stdout:
+ *
+ *     benchmark,kind,coroutines,priorities,operations,ns_per_op
+ *
+ * Pass a benchmark name (\c yield, \c resume, \c resource, \c pass,
+ * \c scan, \c dispatch or \c pipeline) to run only that one.
+ *
+ * \c dispatch is also reported with kind \c <mode>_branch_misses, of
+ * branch misses per step instead of ns, where perf events are available.
+ * Build coro_bench_switch to compare #CONF_CORO_SWITCH_DISPATCH with a
+ * static dispatcher to the computed goto's of coro_bench.
+ *
+ * \c scan is reported with kind \c entries, as the scheduler scans the
+ * compact array of polled coroutines of each queue, and with kind \c states
+ * as a baseline, with queues that have no such array, so that the scan walks
+ * the states of the coroutines as it did before they had one.
+ *
+ * \c pipeline passes numbers through parse, filter and encode stages as
+ * generators (kind \c generator, or \c generator_span passing spans), or
+ * as coroutines handing them over through conditions (\c condition).
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include <assert.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef CONF_CORO_DISPATCH
+/** Whether coroutines are executed through dispatch_hoppers() */
+#define STATIC_DISPATCH 1
+#else
+#define STATIC_DISPATCH 0
+#endif
+#include "coro.h"
+
+#if !CONF_SLOT_POOL_WIDE
+#error "build with -DCONF_SLOT_POOL_WIDE=1 to fit MAX_COROUTINES"
+#endif
+
+
+/** Largest number of coroutines measured */
+#define MAX_COROUTINES 100000
+/** Room for the coroutines driving a measurement */
+#define N_HELPERS 64
+
+/* Queue p holds at most 1 / (p + 1) of the coroutines when they are spread
+ * round robin over at least p + 1 priorities */
+#define CAPACITY(p) (MAX_COROUTINES / ((p) + 1) + N_HELPERS)
+#define DEFINE_QUEUE(p)                                           \
+    static CoroState         states_##p[CAPACITY(p)];             \
+    static CoroScheduleQueue queue_##p = CORO_QUEUE_STATIC_INIT( \
+            queue_##p, CAPACITY(p), states_##p)
+
+DEFINE_QUEUE(0);
+DEFINE_QUEUE(1);
+DEFINE_QUEUE(2);
+DEFINE_QUEUE(3);
+DEFINE_QUEUE(4);
+DEFINE_QUEUE(5);
+DEFINE_QUEUE(6);
+DEFINE_QUEUE(7);
+DEFINE_QUEUE(8);
+DEFINE_QUEUE(9);
+DEFINE_QUEUE(10);
+DEFINE_QUEUE(11);
+DEFINE_QUEUE(12);
+DEFINE_QUEUE(13);
+DEFINE_QUEUE(14);
+DEFINE_QUEUE(15);
+DEFINE_QUEUE(16);
+DEFINE_QUEUE(17);
+DEFINE_QUEUE(18);
+DEFINE_QUEUE(19);
+DEFINE_QUEUE(20);
+DEFINE_QUEUE(21);
+DEFINE_QUEUE(22);
+DEFINE_QUEUE(23);
+DEFINE_QUEUE(24);
+DEFINE_QUEUE(25);
+DEFINE_QUEUE(26);
+DEFINE_QUEUE(27);
+DEFINE_QUEUE(28);
+DEFINE_QUEUE(29);
+DEFINE_QUEUE(30);
+DEFINE_QUEUE(31);
+
+static CoroScheduleQueue *const queues[CORO_MAX_PRIORITIES] = {
+        &queue_0,  &queue_1,  &queue_2,  &queue_3,  &queue_4,  &queue_5,
+        &queue_6,  &queue_7,  &queue_8,  &queue_9,  &queue_10, &queue_11,
+        &queue_12, &queue_13, &queue_14, &queue_15, &queue_16, &queue_17,
+        &queue_18, &queue_19, &queue_20, &queue_21, &queue_22, &queue_23,
+        &queue_24, &queue_25, &queue_26, &queue_27, &queue_28, &queue_29,
+        &queue_30, &queue_31,
+};
+
+/* The baseline of the scan benchmark: queues without room for polled
+ * coroutines in a compact array, which the scheduler then keeps in a list
+ * through their states */
+#define DEFINE_UNSPLIT_QUEUE(p)                                       \
+    static CoroState         unsplit_states_##p[CAPACITY(p)];         \
+    static CoroScheduleQueue unsplit_queue_##p = {                    \
+            .states      = SLOT_POOL_STATIC_INIT(sizeof(CoroState),   \
+                                                 CAPACITY(p),         \
+                                                 unsplit_states_##p), \
+            .ready       = WAIT_READY_QUEUE_INIT,                     \
+            .polls       = NULL,                                      \
+            .n_polls_max = 0,                                         \
+    }
+
+DEFINE_UNSPLIT_QUEUE(0);
+DEFINE_UNSPLIT_QUEUE(1);
+
+static CoroScheduleQueue *const unsplit_queues[] = {&unsplit_queue_0,
+                                                    &unsplit_queue_1};
+
+
+/** Set to make every benchmark coroutine return */
+static bool stopping;
+
+/** Never set, except to finish the coroutines waiting for it */
+static Condition     idle_condition;
+static WakeCondition idle_wake_condition = WAKE_CONDITION_INIT;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+
+static void report(const char *benchmark,
+                   const char *kind,
+                   size_t      n_coroutines,
+                   size_t      n_priorities,
+                   size_t      n_ops,
+                   uint64_t    elapsed_ns) {
+    printf("%s,%s,%zu,%zu,%zu,%.1f\n",
+           benchmark,
+           kind,
+           n_coroutines,
+           n_priorities,
+           n_ops,
+           (double)elapsed_ns / (double)n_ops);
+    fflush(stdout);
+}
+
+
+static void add(CoroSchedule *schedule, coroutine *function, int priority) {
+    CoroState *state = Coro_add_new(schedule, function, NULL, priority);
+    assert(state != NULL);
+    (void)state;
+}
+
+
+/** Let every coroutine of \p schedule return and give back its slot */
+static void finish_all(CoroSchedule *schedule) {
+    stopping = true;
+    Condition_set(&idle_condition);
+    WakeCondition_set(&idle_wake_condition);
+    while (schedule_run_steps(schedule, SIZE_MAX) != 0) {}
+    stopping = false;
+    Condition_clear(&idle_condition);
+    WakeCondition_clear(&idle_wake_condition);
+}
+
+
+typedef void yielderVars;
+static void yielder(CoroState *state, void *vars) {
+    CORO_INIT(yielder);
+    (void)v;
+    while (!stopping) { CORO_YIELD(); }
+    CORO_END();
+}
+
+
+typedef void condition_waiterVars;
+static void condition_waiter(CoroState *state, void *vars) {
+    CORO_INIT(condition_waiter);
+    (void)v;
+    CORO_AWAIT_CONDITION_EXPLICIT(state, &idle_condition);
+    CORO_END();
+}
+
+
+typedef void wake_waiterVars;
+static void wake_waiter(CoroState *state, void *vars) {
+    CORO_INIT(wake_waiter);
+    (void)v;
+    CORO_AWAIT_WAKE_CONDITION_EXPLICIT(state, &idle_wake_condition);
+    CORO_END();
+}
+
+
+/** ns per CORO_YIELD round trip with \p n_coroutines taking turns */
+static void bench_yield(size_t n_coroutines) {
+    CoroSchedule schedule = {.queues = queues, .n_priorities = 1, .ready = 0};
+    for (size_t i = 0; i < n_coroutines; i++) { add(&schedule, yielder, 0); }
+    schedule_run_steps(&schedule, n_coroutines);
+
+    size_t   n_steps = 1u << 22;
+    uint64_t start   = now_ns();
+    schedule_run_steps(&schedule, n_steps);
+    report("yield", "suspended", n_coroutines, 1, n_steps, now_ns() - start);
+    finish_all(&schedule);
+}
+
+
+/* Set to resume the measuring waiter */
+static Condition     resume_condition;
+static WakeCondition resume_wake_condition = WAKE_CONDITION_INIT;
+/** When the last set happened */
+static uint64_t      resume_set_at;
+static uint64_t      resume_total_ns;
+static size_t        n_resumes;
+
+
+typedef void resume_condition_waiterVars;
+static void resume_condition_waiter(CoroState *state, void *vars) {
+    CORO_INIT(resume_condition_waiter);
+    (void)v;
+    while (!stopping) {
+        CORO_AWAIT_CONDITION_EXPLICIT(state, &resume_condition);
+        resume_total_ns += now_ns() - resume_set_at;
+        n_resumes++;
+        Condition_clear(&resume_condition);
+    }
+    CORO_END();
+}
+
+
+typedef void resume_condition_setterVars;
+static void resume_condition_setter(CoroState *state, void *vars) {
+    CORO_INIT(resume_condition_setter);
+    (void)v;
+    while (!stopping) {
+        resume_set_at = now_ns();
+        Condition_set(&resume_condition);
+        CORO_YIELD();
+    }
+    CORO_END();
+}
+
+
+typedef void resume_wake_waiterVars;
+static void resume_wake_waiter(CoroState *state, void *vars) {
+    CORO_INIT(resume_wake_waiter);
+    (void)v;
+    while (!stopping) {
+        CORO_AWAIT_WAKE_CONDITION_EXPLICIT(state, &resume_wake_condition);
+        resume_total_ns += now_ns() - resume_set_at;
+        n_resumes++;
+        WakeCondition_clear(&resume_wake_condition);
+    }
+    CORO_END();
+}
+
+
+typedef void resume_wake_setterVars;
+static void resume_wake_setter(CoroState *state, void *vars) {
+    CORO_INIT(resume_wake_setter);
+    (void)v;
+    while (!stopping) {
+        resume_set_at = now_ns();
+        WakeCondition_set(&resume_wake_condition);
+        CORO_YIELD();
+    }
+    CORO_END();
+}
+
+
+/** \brief ns from setting a condition to resuming its waiter, while
+ * \p n_background other coroutines wait on the same kind of condition */
+static void bench_resume(bool wake_condition, size_t n_background) {
+    CoroSchedule schedule = {.queues = queues, .n_priorities = 2, .ready = 0};
+    for (size_t i = 0; i < n_background; i++) {
+        add(&schedule, wake_condition ? wake_waiter : condition_waiter, 1);
+    }
+    if (wake_condition) {
+        add(&schedule, resume_wake_waiter, 0);
+        add(&schedule, resume_wake_setter, 1);
+    } else {
+        add(&schedule, resume_condition_waiter, 0);
+        add(&schedule, resume_condition_setter, 1);
+    }
+
+    size_t n_ops    = 100000;
+    resume_total_ns = 0;
+    n_resumes       = 0;
+    while (n_resumes < n_ops) { schedule_run_steps(&schedule, 64); }
+    report("resume",
+           wake_condition ? "wake_condition" : "condition",
+           n_background + 2,
+           2,
+           n_resumes,
+           resume_total_ns);
+
+    stopping = true;
+    Condition_set(&resume_condition);
+    WakeCondition_set(&resume_wake_condition);
+    finish_all(&schedule);
+    Condition_clear(&resume_condition);
+    WakeCondition_clear(&resume_wake_condition);
+}
+
+
+static Resource contended;
+static size_t   n_attempts;
+static size_t   n_preempted;
+/** Gives every contender a different strength */
+static int32_t  next_owner_priority;
+
+
+typedef ResourceOwner contenderVars;
+static void contender(CoroState *state, void *vars) {
+    CORO_INIT(contender);
+    v->priority = next_owner_priority++;
+    while (!stopping) {
+        n_attempts++;
+        /* Not a switch, which may not hold a resume point */
+        RetResource_acquire acquired = Resource_acquire(&contended, v);
+        if (acquired == RESOURCE_ACQUIRE_PREEMPTED) { n_preempted++; }
+        if (acquired != RESOURCE_ACQUIRE_FAILED) {
+            /* Hold it across a switch */
+            CORO_YIELD();
+            Resource_release(&contended, v);
+        }
+        CORO_YIELD();
+    }
+    CORO_END();
+}
+
+
+/** ns per step of \p n_coroutines coroutines contending for one resource */
+static void bench_resource(size_t n_coroutines, size_t n_priorities) {
+    static ResourceOwner owners[N_HELPERS];
+    assert(n_coroutines <= N_HELPERS);
+    CoroSchedule schedule = {
+            .queues = queues, .n_priorities = n_priorities, .ready = 0};
+    next_owner_priority = 0;
+    for (size_t i = 0; i < n_coroutines; i++) {
+        CoroState *state = Coro_add_new(
+                &schedule, contender, &owners[i], (int)(i % n_priorities));
+        assert(state != NULL);
+        (void)state;
+    }
+
+    n_attempts       = 0;
+    n_preempted      = 0;
+    size_t   n_steps = 1u << 20;
+    uint64_t start   = now_ns();
+    schedule_run_steps(&schedule, n_steps);
+    uint64_t elapsed = now_ns() - start;
+    report("resource", "step", n_coroutines, n_priorities, n_steps, elapsed);
+    report("resource",
+           "attempt",
+           n_coroutines,
+           n_priorities,
+           n_attempts,
+           elapsed);
+    finish_all(&schedule);
+}
+
+
+/** \brief ns per scheduler pass (polling plus one step of a yielding
+ * coroutine) with \p n_waiting coroutines waiting on something that never
+ * happens, spread round robin over \p n_priorities priorities */
+static void bench_pass(bool listed, size_t n_waiting, size_t n_priorities) {
+    CoroSchedule schedule = {
+            .queues = queues, .n_priorities = n_priorities, .ready = 0};
+    for (size_t i = 0; i < n_waiting; i++) {
+        add(&schedule,
+            listed ? wake_waiter : condition_waiter,
+            (int)(i % n_priorities));
+    }
+    add(&schedule, yielder, (int)n_priorities - 1);
+    schedule_run_steps(&schedule, n_waiting + 1);
+
+    size_t n_passes = 20000000 / (n_waiting + 1);
+    if (n_passes < 100) { n_passes = 100; }
+    if (n_passes > 1000000) { n_passes = 1000000; }
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n_passes; i++) { schedule_run_steps(&schedule, 1); }
+    report("pass",
+           listed ? "wake_condition" : "condition",
+           n_waiting + 1,
+           n_priorities,
+           n_passes,
+           now_ns() - start);
+    finish_all(&schedule);
+}
+
+
+/** \brief ns per coroutine of scanning \p n_waiting coroutines waiting on a
+ * condition that is never set, with nothing ready
+ *
+ * With their states spread round robin over \p n_priorities priorities, a
+ * scan that walks the states misses the cache on every one of them.
+ *
+ * \param split whether the queues scan a compact array of the coroutines,
+ *              or walk their states (the baseline)
+ */
+static void bench_scan(bool split, size_t n_waiting, size_t n_priorities) {
+    assert(split || n_priorities <= CORO_ARRAY_SIZE(unsplit_queues));
+    CoroSchedule schedule = {.queues       = split ? queues : unsplit_queues,
+                             .n_priorities = n_priorities,
+                             .ready        = 0};
+    for (size_t i = 0; i < n_waiting; i++) {
+        add(&schedule, condition_waiter, (int)(i % n_priorities));
+    }
+    schedule_run_steps(&schedule, n_waiting);
+
+    size_t n_passes = 50000000 / n_waiting;
+    if (n_passes < 100) { n_passes = 100; }
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n_passes; i++) { schedule_run_steps(&schedule, 1); }
+    report("scan",
+           split ? "entries" : "states",
+           n_waiting,
+           n_priorities,
+           n_passes * n_waiting,
+           now_ns() - start);
+    finish_all(&schedule);
+}
+
+
+/** \brief Open a counter of the branch misses of this thread
+ * \return Its file descriptor, or -1 if perf events are not available
+ */
+static int open_branch_misses(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.size           = sizeof(attr);
+    attr.config         = PERF_COUNT_HW_BRANCH_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+static uint64_t read_counter(int fd) {
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) { return 0; }
+    return count;
+}
+
+
+/* Coroutines of as many functions, for the dispatch to tell apart */
+#define DEFINE_HOPPER(n)                                   \
+    typedef void hopper_##n##Vars;                         \
+    static void hopper_##n(CoroState *state, void *vars) { \
+        CORO_INIT(hopper_##n);                             \
+        (void)v;                                           \
+        while (!stopping) { CORO_YIELD(); }                \
+        CORO_END();                                        \
+    }
+
+DEFINE_HOPPER(0)
+DEFINE_HOPPER(1)
+DEFINE_HOPPER(2)
+DEFINE_HOPPER(3)
+DEFINE_HOPPER(4)
+DEFINE_HOPPER(5)
+DEFINE_HOPPER(6)
+DEFINE_HOPPER(7)
+DEFINE_HOPPER(8)
+DEFINE_HOPPER(9)
+DEFINE_HOPPER(10)
+DEFINE_HOPPER(11)
+DEFINE_HOPPER(12)
+DEFINE_HOPPER(13)
+DEFINE_HOPPER(14)
+DEFINE_HOPPER(15)
+
+static coroutine *const hoppers[] = {
+        hopper_0,  hopper_1,  hopper_2,  hopper_3,  hopper_4,  hopper_5,
+        hopper_6,  hopper_7,  hopper_8,  hopper_9,  hopper_10, hopper_11,
+        hopper_12, hopper_13, hopper_14, hopper_15,
+};
+
+#if STATIC_DISPATCH
+/** The dispatcher of CONF_CORO_DISPATCH, which knows the hoppers */
+void dispatch_hoppers(CoroState *state) {
+    CORO_DISPATCH_CASE(state, hopper_0);
+    CORO_DISPATCH_CASE(state, hopper_1);
+    CORO_DISPATCH_CASE(state, hopper_2);
+    CORO_DISPATCH_CASE(state, hopper_3);
+    CORO_DISPATCH_CASE(state, hopper_4);
+    CORO_DISPATCH_CASE(state, hopper_5);
+    CORO_DISPATCH_CASE(state, hopper_6);
+    CORO_DISPATCH_CASE(state, hopper_7);
+    CORO_DISPATCH_CASE(state, hopper_8);
+    CORO_DISPATCH_CASE(state, hopper_9);
+    CORO_DISPATCH_CASE(state, hopper_10);
+    CORO_DISPATCH_CASE(state, hopper_11);
+    CORO_DISPATCH_CASE(state, hopper_12);
+    CORO_DISPATCH_CASE(state, hopper_13);
+    CORO_DISPATCH_CASE(state, hopper_14);
+    CORO_DISPATCH_CASE(state, hopper_15);
+    CORO_DISPATCH_DEFAULT(state);
+}
+#endif
+
+
+/** ns and branch misses per step of \p n_coroutines coroutines of
+ * randomly interleaved functions that yield */
+static void bench_dispatch(size_t n_coroutines) {
+    static const char *const kinds[2][2] = {
+            {"goto", "goto_branch_misses"},
+            {"switch", "switch_branch_misses"},
+    };
+    const char *const *kind = kinds[CONF_CORO_SWITCH_DISPATCH != 0];
+
+    CoroSchedule schedule = {.queues = queues, .n_priorities = 1, .ready = 0};
+    uint32_t     random   = 1;
+    for (size_t i = 0; i < n_coroutines; i++) {
+        random = random * 1103515245u + 12345u;
+        add(&schedule, hoppers[(random >> 16) % CORO_ARRAY_SIZE(hoppers)], 0);
+    }
+    schedule_run_steps(&schedule, n_coroutines);
+
+    int      misses_fd = open_branch_misses();
+    size_t   n_steps   = 1u << 22;
+    uint64_t misses    = (misses_fd >= 0) ? read_counter(misses_fd) : 0;
+    uint64_t start     = now_ns();
+    schedule_run_steps(&schedule, n_steps);
+    uint64_t elapsed = now_ns() - start;
+    report("dispatch", kind[0], n_coroutines, 1, n_steps, elapsed);
+    if (misses_fd >= 0) {
+        misses = read_counter(misses_fd) - misses;
+        report("dispatch", kind[1], n_coroutines, 1, n_steps, misses);
+        close(misses_fd);
+    }
+    finish_all(&schedule);
+}
+
+
+/* Pipeline: parse numbers from text, keep the odd ones, encode them */
+
+/** Numbers parsed per measurement */
+#define PIPELINE_ITEMS (1u << 20)
+/** Numbers a stage passes on at once when passing spans */
+#define PIPELINE_SPAN 64
+
+/** Comma terminated numbers the parse stages read over and over */
+static char   pipeline_text[4096 * 11 + 1];
+static size_t pipeline_text_size;
+/** Sum of the codes the last pipeline encoded */
+static uint32_t pipeline_sum;
+
+
+static void make_pipeline_text(void) {
+    uint32_t random = 1;
+    for (size_t i = 0; i < 4096; i++) {
+        random = random * 1103515245u + 12345u;
+        pipeline_text_size += (size_t)sprintf(
+                &pipeline_text[pipeline_text_size], "%u,", random >> 2);
+    }
+}
+
+
+/** Parse the number at \p *at, moving it past the number and its comma */
+static uint32_t parse_number(size_t *at) {
+    uint32_t number = 0;
+    while (pipeline_text[*at] != ',') {
+        number = number * 10 + (uint32_t)(pipeline_text[(*at)++] - '0');
+    }
+    if (++*at == pipeline_text_size) { *at = 0; }
+    return number;
+}
+
+
+static bool keep_number(uint32_t number) { return number & 1; }
+
+
+static uint32_t encode_number(uint32_t number) {
+    return number * 2654435761u;
+}
+
+
+/* Generators, each awaiting the one before it */
+
+typedef struct {
+    size_t   at;
+    uint32_t n_left;
+    uint32_t number;
+} parse_genVars;
+static void parse_gen(CoroState *state, void *vars) {
+    CORO_INIT(parse_gen);
+    for (; v->n_left > 0; v->n_left--) {
+        v->number = parse_number(&v->at);
+        CORO_YIELD_VALUE(v->number);
+    }
+    CORO_END();
+}
+
+
+typedef struct {
+    CoroState     source;
+    parse_genVars source_vars;
+    uint32_t      number;
+} filter_genVars;
+static void filter_gen(CoroState *state, void *vars) {
+    CORO_INIT(filter_gen);
+    Coro_init_sub(&v->source, parse_gen, &v->source_vars);
+    while (true) {
+        CORO_AWAIT_NEXT(&v->source, &v->number);
+        if (Coro_is_finalized(&v->source)) { break; }
+        if (keep_number(v->number)) { CORO_YIELD_VALUE(v->number); }
+    }
+    CORO_END();
+}
+
+
+typedef struct {
+    CoroState      source;
+    filter_genVars source_vars;
+    uint32_t       number;
+} encode_genVars;
+static void encode_gen(CoroState *state, void *vars) {
+    CORO_INIT(encode_gen);
+    Coro_init_sub(&v->source, filter_gen, &v->source_vars);
+    while (true) {
+        CORO_AWAIT_NEXT(&v->source, &v->number);
+        if (Coro_is_finalized(&v->source)) { break; }
+        v->number = encode_number(v->number);
+        CORO_YIELD_VALUE(v->number);
+    }
+    CORO_END();
+}
+
+
+typedef struct {
+    CoroState      source;
+    encode_genVars source_vars;
+    uint32_t       code;
+} pipeline_sinkVars;
+static void pipeline_sink(CoroState *state, void *vars) {
+    CORO_INIT(pipeline_sink);
+    Coro_init_sub(&v->source, encode_gen, &v->source_vars);
+    while (true) {
+        CORO_AWAIT_NEXT(&v->source, &v->code);
+        if (Coro_is_finalized(&v->source)) { break; }
+        pipeline_sum += v->code;
+    }
+    CORO_END();
+}
+
+
+/* The same, passing spans of up to PIPELINE_SPAN numbers */
+
+typedef struct {
+    size_t   at;
+    uint32_t n_left;
+    uint32_t n_numbers;
+    uint32_t numbers[PIPELINE_SPAN];
+} parse_spansVars;
+static void parse_spans(CoroState *state, void *vars) {
+    CORO_INIT(parse_spans);
+    while (v->n_left > 0) {
+        for (v->n_numbers = 0;
+             v->n_numbers < PIPELINE_SPAN && v->n_left > 0;
+             v->n_left--) {
+            v->numbers[v->n_numbers++] = parse_number(&v->at);
+        }
+        CORO_YIELD_SPAN(v->numbers, v->n_numbers);
+    }
+    CORO_END();
+}
+
+
+typedef struct {
+    CoroState       source;
+    parse_spansVars source_vars;
+    CoroSpan        span;
+    uint32_t        n_kept;
+    uint32_t        kept[PIPELINE_SPAN];
+} filter_spansVars;
+static void filter_spans(CoroState *state, void *vars) {
+    CORO_INIT(filter_spans);
+    Coro_init_sub(&v->source, parse_spans, &v->source_vars);
+    while (true) {
+        CORO_AWAIT_NEXT(&v->source, &v->span);
+        if (Coro_is_finalized(&v->source)) { break; }
+        const uint32_t *numbers = v->span.items;
+        v->n_kept               = 0;
+        for (size_t i = 0; i < v->span.n_items; i++) {
+            if (keep_number(numbers[i])) { v->kept[v->n_kept++] = numbers[i]; }
+        }
+        if (v->n_kept > 0) { CORO_YIELD_SPAN(v->kept, v->n_kept); }
+    }
+    CORO_END();
+}
+
+
+typedef struct {
+    CoroState        source;
+    filter_spansVars source_vars;
+    CoroSpan         span;
+    uint32_t         codes[PIPELINE_SPAN];
+} encode_spansVars;
+static void encode_spans(CoroState *state, void *vars) {
+    CORO_INIT(encode_spans);
+    Coro_init_sub(&v->source, filter_spans, &v->source_vars);
+    while (true) {
+        CORO_AWAIT_NEXT(&v->source, &v->span);
+        if (Coro_is_finalized(&v->source)) { break; }
+        const uint32_t *numbers = v->span.items;
+        for (size_t i = 0; i < v->span.n_items; i++) {
+            v->codes[i] = encode_number(numbers[i]);
+        }
+        CORO_YIELD_SPAN(v->codes, v->span.n_items);
+    }
+    CORO_END();
+}
+
+
+typedef struct {
+    CoroState        source;
+    encode_spansVars source_vars;
+    CoroSpan         span;
+} pipeline_span_sinkVars;
+static void pipeline_span_sink(CoroState *state, void *vars) {
+    CORO_INIT(pipeline_span_sink);
+    Coro_init_sub(&v->source, encode_spans, &v->source_vars);
+    while (true) {
+        CORO_AWAIT_NEXT(&v->source, &v->span);
+        if (Coro_is_finalized(&v->source)) { break; }
+        const uint32_t *codes = v->span.items;
+        for (size_t i = 0; i < v->span.n_items; i++) {
+            pipeline_sum += codes[i];
+        }
+    }
+    CORO_END();
+}
+
+
+/* The same, as coroutines of the schedule passing numbers through shared
+ * variables and conditions */
+
+/** A number passed from a stage to the next */
+typedef struct {
+    /** Set while \c number (or \c end) is there to take */
+    Condition full;
+    /** Set while there is room for the next */
+    Condition empty;
+    uint32_t  number;
+    /** Set once there is no number left */
+    bool end;
+} Handoff;
+
+static Handoff handoffs[3];
+
+/* Pass number on through handoff_ptr, once it has room */
+#define HANDOFF_SEND(handoff_ptr, value)        \
+    {                                           \
+        CORO_AWAIT(&(handoff_ptr)->empty);      \
+        Condition_clear(&(handoff_ptr)->empty); \
+        (handoff_ptr)->number = (value);        \
+        Condition_set(&(handoff_ptr)->full);    \
+    }
+
+/* Take the number of handoff_ptr into number_lvalue, or break out of the
+ * enclosing loop once there is none left */
+#define HANDOFF_RECV(handoff_ptr, number_lvalue) \
+    CORO_AWAIT(&(handoff_ptr)->full);            \
+    Condition_clear(&(handoff_ptr)->full);       \
+    if ((handoff_ptr)->end) { break; }           \
+    (number_lvalue) = (handoff_ptr)->number;     \
+    Condition_set(&(handoff_ptr)->empty)
+
+/* Tell the next stage there is no number left */
+#define HANDOFF_END(handoff_ptr)             \
+    {                                        \
+        CORO_AWAIT(&(handoff_ptr)->empty);   \
+        (handoff_ptr)->end = true;           \
+        Condition_set(&(handoff_ptr)->full); \
+    }
+
+
+typedef parse_genVars parse_stageVars;
+static void parse_stage(CoroState *state, void *vars) {
+    CORO_INIT(parse_stage);
+    for (; v->n_left > 0; v->n_left--) {
+        v->number = parse_number(&v->at);
+        HANDOFF_SEND(&handoffs[0], v->number);
+    }
+    HANDOFF_END(&handoffs[0]);
+    CORO_END();
+}
+
+
+typedef uint32_t filter_stageVars;
+static void filter_stage(CoroState *state, void *vars) {
+    CORO_INIT(filter_stage);
+    while (true) {
+        HANDOFF_RECV(&handoffs[0], *v);
+        if (keep_number(*v)) { HANDOFF_SEND(&handoffs[1], *v); }
+    }
+    HANDOFF_END(&handoffs[1]);
+    CORO_END();
+}
+
+
+typedef uint32_t encode_stageVars;
+static void encode_stage(CoroState *state, void *vars) {
+    CORO_INIT(encode_stage);
+    while (true) {
+        HANDOFF_RECV(&handoffs[1], *v);
+        HANDOFF_SEND(&handoffs[2], encode_number(*v));
+    }
+    HANDOFF_END(&handoffs[2]);
+    CORO_END();
+}
+
+
+typedef uint32_t sink_stageVars;
+static void sink_stage(CoroState *state, void *vars) {
+    CORO_INIT(sink_stage);
+    while (true) {
+        HANDOFF_RECV(&handoffs[2], *v);
+        pipeline_sum += *v;
+    }
+    CORO_END();
+}
+
+
+/** \brief ns per number through parse, filter and encode stages, as
+ * \p kind: \c generator, \c generator_span or \c condition
+ *
+ * Items per second are 1e9 over it.
+ */
+static void bench_pipeline(const char *kind) {
+    static pipeline_sinkVars      sink;
+    static pipeline_span_sinkVars span_sink;
+    static parse_stageVars        parse;
+    static uint32_t               numbers[3];
+
+    CoroSchedule schedule = {.queues = queues, .n_priorities = 1, .ready = 0};
+    pipeline_sum   = 0;
+    uint64_t start = now_ns();
+    bool     added;
+    if (strcmp(kind, "generator") == 0) {
+        /* The states of the generators are in there, so it can only be
+         * initialized in place */
+        memset(&sink, 0, sizeof(sink));
+        sink.source_vars.source_vars.source_vars.n_left = PIPELINE_ITEMS;
+        added = Coro_add_new(&schedule, pipeline_sink, &sink, 0) != NULL;
+    } else if (strcmp(kind, "generator_span") == 0) {
+        memset(&span_sink, 0, sizeof(span_sink));
+        span_sink.source_vars.source_vars.source_vars.n_left = PIPELINE_ITEMS;
+        added = Coro_add_new(&schedule, pipeline_span_sink, &span_sink, 0)
+                != NULL;
+    } else {
+        for (size_t i = 0; i < 3; i++) {
+            handoffs[i] = (Handoff){.empty = true};
+        }
+        parse = (parse_stageVars){.n_left = PIPELINE_ITEMS};
+        added = Coro_add_new(&schedule, parse_stage, &parse, 0) != NULL
+                && Coro_add_new(&schedule, filter_stage, &numbers[0], 0)
+                           != NULL
+                && Coro_add_new(&schedule, encode_stage, &numbers[1], 0)
+                           != NULL
+                && Coro_add_new(&schedule, sink_stage, &numbers[2], 0)
+                           != NULL;
+    }
+    assert(added);
+    (void)added;
+    while (schedule_run_steps(&schedule, SIZE_MAX) != 0) {}
+    report("pipeline", kind, 4, 1, PIPELINE_ITEMS, now_ns() - start);
+}
+
+
+static bool selected(int argc, char **argv, const char *benchmark) {
+    return argc < 2 || strcmp(argv[1], benchmark) == 0;
+}
+
+
+int main(int argc, char **argv) {
+    static const size_t counts[] = {1, 10, 100, 1000, 10000, 100000};
+    static const size_t priorities[] = {1, 2, 8, 32};
+
+    printf("benchmark,kind,coroutines,priorities,operations,ns_per_op\n");
+    if (selected(argc, argv, "yield")) {
+        for (size_t i = 0; i < sizeof(counts) / sizeof(*counts); i++) {
+            bench_yield(counts[i]);
+        }
+    }
+    if (selected(argc, argv, "resume")) {
+        for (size_t i = 0; i < 5; i++) {
+            bench_resume(false, counts[i]);
+            bench_resume(true, counts[i]);
+        }
+    }
+    if (selected(argc, argv, "resource")) {
+        static const size_t contenders[] = {1, 2, 8, 32};
+        for (size_t i = 0; i < 4; i++) {
+            for (size_t j = 0; j < 4; j++) {
+                bench_resource(contenders[i], priorities[j]);
+            }
+        }
+    }
+    if (selected(argc, argv, "pass")) {
+        for (size_t i = 0; i < sizeof(counts) / sizeof(*counts); i++) {
+            for (size_t j = 0; j < 4; j++) {
+                bench_pass(false, counts[i], priorities[j]);
+                bench_pass(true, counts[i], priorities[j]);
+            }
+        }
+    }
+    if (selected(argc, argv, "scan")) {
+        for (size_t i = 3; i < sizeof(counts) / sizeof(*counts); i++) {
+            for (size_t j = 0; j < 2; j++) {
+                bench_scan(true, counts[i], priorities[j]);
+                bench_scan(false, counts[i], priorities[j]);
+            }
+        }
+    }
+    if (selected(argc, argv, "dispatch")) {
+        for (size_t i = 0; i < 5; i++) { bench_dispatch(counts[i]); }
+    }
+    if (selected(argc, argv, "pipeline")) {
+        make_pipeline_text();
+        bench_pipeline("generator");
+        bench_pipeline("generator_span");
+        bench_pipeline("condition");
+    }
+    return 0;
+}
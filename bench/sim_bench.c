@@ -0,0 +1,142 @@
+/** \file sim_bench.c
+ *
+ * Scheduler throughput under simulated timer and interrupt load (sim.h),
+ * for Linux hosts.
+ *
+ * Prints the same CSV lines as coro_bench to stdout:
+ *
+ *     benchmark,kind,coroutines,priorities,operations,ns_per_op
+ *
+ * with kind \c step (real ns per coroutine step) and \c virtual_ms (real ns
+ * per millisecond of virtual time). Pass a seed to change the scenario.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "coro.h"
+#include "sim.h"
+
+#if !CONF_SLOT_POOL_WIDE
+#error "build with -DCONF_SLOT_POOL_WIDE=1 to fit MAX_COROUTINES"
+#endif
+
+
+/** Largest number of coroutines measured */
+#define MAX_COROUTINES 10000
+/** Number of simulated interrupts */
+#define N_EVENTS 8
+
+_Static_assert(CONF_CORO_SIM_N_TIMERS >= MAX_COROUTINES + N_EVENTS,
+               "every coroutine runs a timer");
+
+static CoroState         states_0[MAX_COROUTINES + N_EVENTS];
+static CoroState         states_1[MAX_COROUTINES + N_EVENTS];
+static CoroScheduleQueue queue_0 = CORO_QUEUE_STATIC_INIT(
+        queue_0, MAX_COROUTINES + N_EVENTS, states_0);
+static CoroScheduleQueue queue_1 = CORO_QUEUE_STATIC_INIT(
+        queue_1, MAX_COROUTINES + N_EVENTS, states_1);
+static CoroScheduleQueue *const queues[] = {&queue_0, &queue_1};
+
+/** Set by the simulated interrupts, one per handler */
+static WakeCondition irqs[N_EVENTS];
+static CoroSimEvent  events[N_EVENTS];
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+
+static void report(const char *kind,
+                   size_t      n_coroutines,
+                   size_t      n_ops,
+                   uint64_t    elapsed_ns) {
+    printf("sim,%s,%zu,2,%zu,%.1f\n",
+           kind,
+           n_coroutines,
+           n_ops,
+           (double)elapsed_ns / (double)n_ops);
+    fflush(stdout);
+}
+
+
+typedef void sleeperVars;
+/** Sleeps between 1 and 100 ms at a time */
+static void sleeper(CoroState *state, void *vars) {
+    CORO_INIT(sleeper);
+    (void)v;
+    while (true) {
+        CORO_AWAIT_TIMED_EXPLICIT(state, 1 + CoroSim_random() % 100);
+    }
+    CORO_END();
+}
+
+
+typedef WakeCondition handlerVars;
+/** Handles one of the interrupts, giving up after 10 ms without one */
+static void handler(CoroState *state, void *vars) {
+    CORO_INIT(handler);
+    while (true) {
+        CORO_AWAIT_ATMOST(10, v);
+        WakeCondition_clear(v);
+    }
+    CORO_END();
+}
+
+
+/** Sleepers added so far */
+static size_t n_added;
+
+
+/** \brief Run \p n_sleepers sleepers and the handlers of #N_EVENTS
+ * interrupts for \p virtual_ms milliseconds of virtual time
+ *
+ * Every coroutine runs forever, so each run keeps those of the previous one.
+ */
+static void bench_sim(CoroSchedule *schedule,
+                      size_t        n_sleepers,
+                      timer_ms_t    virtual_ms) {
+    for (; n_added < n_sleepers; n_added++) {
+        CoroState *state = Coro_add_new(schedule, sleeper, NULL, 1);
+        assert(state != NULL);
+        (void)state;
+    }
+
+    uint64_t start   = now_ns();
+    size_t   n_steps = CoroSim_run_for(schedule, virtual_ms);
+    uint64_t elapsed = now_ns() - start;
+    report("step", n_sleepers + N_EVENTS, n_steps, elapsed);
+    report("virtual_ms", n_sleepers + N_EVENTS, virtual_ms, elapsed);
+}
+
+
+int main(int argc, char **argv) {
+    static const size_t counts[] = {10, 100, 1000, 10000};
+
+    CoroSim_seed((argc > 1) ? strtoull(argv[1], NULL, 0) : 1);
+    CoroIdle_set_strategy(&CoroIdle_sim_strategy);
+    printf("benchmark,kind,coroutines,priorities,operations,ns_per_op\n");
+
+    CoroSchedule schedule = {.queues = queues, .n_priorities = 2, .ready = 0};
+    for (size_t i = 0; i < N_EVENTS; i++) {
+        irqs[i]   = (WakeCondition)WAKE_CONDITION_INIT;
+        events[i] = (CoroSimEvent)CORO_SIM_EVENT_INIT(
+                CoroSim_set_wake_condition, &irqs[i], 50, 20000);
+        CoroSim_add_event(&events[i]);
+        CoroState *state = Coro_add_new(&schedule, handler, &irqs[i], 0);
+        assert(state != NULL);
+        (void)state;
+    }
+    for (size_t i = 0; i < sizeof(counts) / sizeof(*counts); i++) {
+        /* An hour of virtual time with 10 sleepers, less with more */
+        bench_sim(&schedule,
+                  counts[i],
+                  (timer_ms_t)(3600000 / (counts[i] / 10)));
+    }
+    return 0;
+}
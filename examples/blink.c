@@ -0,0 +1,97 @@
+/** \file blink.c
+ *
+ * Blinks an LED, and reacts to a button with a timeout, on a Linux host.
+ *
+ * The LED and the button are simulated: the LED prints its state and a
+ * coroutine presses the button now and then. The tick of timer_tick.h
+ * plays the timer interrupt, and the scheduler sleeps on a futex while
+ * nothing is ready.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "coro.h"
+#include "linux/idle_futex.h"
+#include "linux/timer_tick.h"
+
+
+static CoroState         states_0[4];
+static CoroState         states_1[4];
+static CoroScheduleQueue queue_0 =
+        CORO_QUEUE_STATIC_INIT(queue_0, 4, states_0);
+static CoroScheduleQueue queue_1 =
+        CORO_QUEUE_STATIC_INIT(queue_1, 4, states_1);
+static CoroScheduleQueue *const queues[] = {&queue_0, &queue_1};
+
+/** Set while the button is pressed */
+static Condition button;
+/** Set once the LED has blinked enough */
+static WakeCondition done = WAKE_CONDITION_INIT;
+
+
+typedef struct {
+    int n_blinks;
+} blinkVars;
+/** Toggles the LED every 250 ms */
+static void blink(CoroState *state, void *vars) {
+    CORO_INIT(blink);
+    for (v->n_blinks = 0; v->n_blinks < 8; v->n_blinks++) {
+        printf("LED %s\n", (v->n_blinks % 2) ? "off" : "on");
+        CORO_AWAIT_TIMED_EXPLICIT(state, 250);
+    }
+    WakeCondition_set(&done);
+    CORO_END();
+}
+
+
+typedef void watch_buttonVars;
+/** Reports presses of the button, or that there was none for a second */
+static void watch_button(CoroState *state, void *vars) {
+    CORO_INIT(watch_button);
+    (void)v;
+    while (true) {
+        CORO_AWAIT_ATMOST(1000, &button);
+        if (Condition_get(&button)) {
+            printf("button pressed\n");
+            Condition_clear(&button);
+        } else {
+            printf("no press for a second\n");
+        }
+    }
+    CORO_END();
+}
+
+
+typedef void presserVars;
+/** Presses the button after 300 ms, then every 1.5 s */
+static void presser(CoroState *state, void *vars) {
+    CORO_INIT(presser);
+    (void)v;
+    CORO_AWAIT_TIMED_EXPLICIT(state, 300);
+    while (true) {
+        Condition_set(&button);
+        CORO_AWAIT_TIMED_EXPLICIT(state, 1500);
+    }
+    CORO_END();
+}
+
+
+int main(void) {
+    static blinkVars blink_vars;
+    CoroSchedule     schedule = {
+            .queues = queues, .n_priorities = 2, .ready = 0};
+
+    if (!TimerTick_start()) {
+        perror("TimerTick_start");
+        return EXIT_FAILURE;
+    }
+    CoroIdle_set_strategy(&CoroIdle_futex_strategy);
+
+    /* Reacting to the button matters more than blinking on time */
+    Coro_add_new(&schedule, watch_button, NULL, 0);
+    Coro_add_new(&schedule, blink, &blink_vars, 1);
+    Coro_add_new(&schedule, presser, NULL, 1);
+    while (!WakeCondition_get(&done)) { schedule_run_once(&schedule); }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,132 @@
+/** \file pipeline.c
+ *
+ * Parses sensor readings from text, filters and encodes them, on a Linux
+ * host.
+ *
+ * Each stage is a generator that awaits the values of the one before it:
+ * a value is handed straight from one stage to the next, without going
+ * through the ready queue or any shared variables and conditions.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "coro.h"
+
+
+static CoroState         states_0[2];
+static CoroScheduleQueue queue_0 =
+        CORO_QUEUE_STATIC_INIT(queue_0, 2, states_0);
+static CoroScheduleQueue *const queues[] = {&queue_0};
+
+/** Readings as a sensor would send them, one per line */
+static const char *const input = "temp 21\n"
+                                 "temp 23\n"
+                                 "hum 40\n"
+                                 "temp 35\n"
+                                 "temp 19\n"
+                                 "hum 85\n";
+
+/** A parsed reading */
+typedef struct {
+    char kind[8];
+    int  value;
+} Reading;
+
+
+typedef struct {
+    const char *at;
+    Reading     reading;
+} parseVars;
+/** Yields the readings of the input */
+static void parse(CoroState *state, void *vars) {
+    CORO_INIT(parse);
+    while (true) {
+        int n_chars = 0;
+        if (sscanf(v->at,
+                   "%7s %d\n%n",
+                   v->reading.kind,
+                   &v->reading.value,
+                   &n_chars)
+            != 2) {
+            break;
+        }
+        v->at += n_chars;
+        CORO_YIELD_VALUE(v->reading);
+    }
+    CORO_END();
+}
+
+
+typedef struct {
+    CoroState source;
+    parseVars source_vars;
+    Reading   reading;
+} filterVars;
+/** Yields the readings out of their usual range */
+static void filter(CoroState *state, void *vars) {
+    CORO_INIT(filter);
+    Coro_init_sub(&v->source, parse, &v->source_vars);
+    while (true) {
+        CORO_AWAIT_NEXT(&v->source, &v->reading);
+        if (Coro_is_finalized(&v->source)) { break; }
+        if (v->reading.value < 20 || v->reading.value > 30) {
+            CORO_YIELD_VALUE(v->reading);
+        }
+    }
+    CORO_END();
+}
+
+
+typedef struct {
+    CoroState  source;
+    filterVars source_vars;
+    Reading    reading;
+    char       line[32];
+} encodeVars;
+/** Yields the filtered readings as lines of JSON */
+static void encode(CoroState *state, void *vars) {
+    CORO_INIT(encode);
+    Coro_init_sub(&v->source, filter, &v->source_vars);
+    while (true) {
+        CORO_AWAIT_NEXT(&v->source, &v->reading);
+        if (Coro_is_finalized(&v->source)) { break; }
+        snprintf(v->line,
+                 sizeof(v->line),
+                 "{\"%s\": %d}",
+                 v->reading.kind,
+                 v->reading.value);
+        CORO_YIELD_VALUE(&v->line[0]);
+    }
+    CORO_END();
+}
+
+
+typedef struct {
+    CoroState  source;
+    encodeVars source_vars;
+    char *     line;
+} reportVars;
+/** Prints the lines of the whole pipeline */
+static void report(CoroState *state, void *vars) {
+    CORO_INIT(report);
+    Coro_init_sub(&v->source, encode, &v->source_vars);
+    while (true) {
+        CORO_AWAIT_NEXT(&v->source, &v->line);
+        if (Coro_is_finalized(&v->source)) { break; }
+        printf("%s\n", v->line);
+    }
+    CORO_END();
+}
+
+
+int main(void) {
+    static reportVars report_vars;
+    CoroSchedule      schedule = {
+            .queues = queues, .n_priorities = 1, .ready = 0};
+
+    report_vars.source_vars.source_vars.source_vars.at = input;
+    Coro_add_new(&schedule, report, &report_vars, 0);
+    while (schedule_run_steps(&schedule, SIZE_MAX) != 0) {}
+    return EXIT_SUCCESS;
+}
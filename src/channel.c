@@ -0,0 +1,212 @@
+/** \file channel.c
+ *
+ * Lock-free async-interrupt-safe bounded channels.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include "channel.h"
+#include <assert.h>
+#include <string.h>
+
+
+static void *slot_at(Channel *channel, size_t index) {
+    return (char *)channel->data + index * channel->elem_size;
+}
+
+
+static size_t sequence(Channel *channel, size_t index) {
+    return atomic_load(&channel->stamps[index]) + index;
+}
+
+
+/** \brief How far the slot of position \p *cursor is ahead of being usable
+ * at that position
+ *
+ * \p ahead is 0 for the sender and 1 for the receiver. Negative if the
+ * channel is full (or empty), positive if the position was claimed by
+ * someone else.
+ */
+static ptrdiff_t lag(Channel *channel, size_t position, size_t ahead) {
+    assert((channel->n_elems & (channel->n_elems - 1)) == 0
+           && "the number of slots of a channel must be a power of 2");
+    size_t index = position & (channel->n_elems - 1);
+    return (ptrdiff_t)(sequence(channel, index) - (position + ahead));
+}
+
+
+/** \brief Claim the slot of the position at \p cursor
+ * \param single whether nobody else claims slots through \p cursor
+ * \return \c false if the channel is full (or empty)
+ */
+static bool claim(Channel *       channel,
+                  _Atomic size_t *cursor,
+                  size_t          ahead,
+                  bool            single,
+                  size_t *        claimed) {
+    size_t position = atomic_load(cursor);
+    while (true) {
+        ptrdiff_t diff = lag(channel, position, ahead);
+        if (diff < 0) { return false; }
+        if (diff > 0) {
+            position = atomic_load(cursor);
+        } else if (single) {
+            atomic_store(cursor, position + 1);
+            break;
+        } else if (atomic_compare_exchange_weak(
+                           cursor, &position, position + 1)) {
+            break;
+        }
+    }
+    *claimed = position;
+    return true;
+}
+
+
+/** Reverse the node list \p nodes, returning its new first node */
+static WaitNode *reverse(WaitNode *nodes) {
+    WaitNode *reversed = NULL;
+    while (nodes != NULL) {
+        WaitNode *next = nodes->next;
+        nodes->next    = reversed;
+        reversed       = nodes;
+        nodes          = next;
+    }
+    return reversed;
+}
+
+
+/** Wake the \p n oldest waiters of \p waiters, or all if there are fewer */
+static void wake_oldest(WaitList *waiters, size_t n) {
+    /* Newest first as taken */
+    WaitNode *node = reverse(WaitList_take_all(waiters));
+    while (node != NULL && n != 0) {
+        WaitNode *next = node->next;
+        /* Not counted if its wait ended otherwise meanwhile */
+        if (WaitNode_wake(node)) { n--; }
+        node = next;
+    }
+    if (node != NULL) {
+        /* In front of those that were pushed meanwhile, newest first again */
+        WaitNode *oldest = node;
+        WaitList_give_back(waiters, reverse(node), oldest);
+    }
+}
+
+
+/** \brief Wake \p n of \p waiters for as many slots that changed state
+ *
+ * The wakes of concurrent calls add up in \p owed, and the first of them
+ * does them all, so that none is lost for lack of the waiters another one
+ * holds off the list meanwhile. Those owed while nobody waits are dropped,
+ * as a waiter that registers later sees the change (see Channel_wait).
+ *
+ * A waiter that unlinks itself also holds the others off the list for a
+ * moment, and the check for an empty list may miss those held by another
+ * waker. Whoever gets a slot (or an item) next makes up for such a lost wake
+ * with #Channel_pass_wake, one at a time.
+ */
+static void wake(WaitList *waiters, _Atomic size_t *owed, size_t n) {
+    if (atomic_load(waiters) == NULL && atomic_load(owed) == 0) { return; }
+    size_t n_owed = atomic_fetch_add(owed, n) + n;
+    if (n_owed != n) { return; }
+    do {
+        wake_oldest(waiters, n_owed);
+        n_owed = atomic_fetch_sub(owed, n_owed) - n_owed;
+    } while (n_owed != 0);
+}
+
+
+void *Channel_reserve(Channel *channel) {
+    size_t position;
+    if (!claim(channel,
+               &channel->tail,
+               0,
+               channel->flags & CHANNEL_SINGLE_PRODUCER,
+               &position)) {
+        return NULL;
+    }
+    Channel_pass_wake(channel, true);
+    return slot_at(channel, position & (channel->n_elems - 1));
+}
+
+
+void Channel_commit(Channel *channel, void *item_slot) {
+    size_t index = (size_t)((char *)item_slot - (char *)channel->data)
+                   / channel->elem_size;
+    /* Only the sender that reserved it writes it now */
+    atomic_fetch_add(&channel->stamps[index], 1);
+    wake(&channel->receivers, &channel->receivers_owed, 1);
+}
+
+
+bool Channel_try_send(Channel *channel, const void *item) {
+    void *item_slot = Channel_reserve(channel);
+    if (item_slot == NULL) { return false; }
+    memcpy(item_slot, item, channel->elem_size);
+    Channel_commit(channel, item_slot);
+    return true;
+}
+
+
+/** Receive one item without waking the senders */
+static bool receive(Channel *channel, void *item) {
+    size_t position;
+    if (!claim(channel,
+               &channel->head,
+               1,
+               channel->flags & CHANNEL_SINGLE_CONSUMER,
+               &position)) {
+        return false;
+    }
+    size_t index = position & (channel->n_elems - 1);
+    memcpy(item, slot_at(channel, index), channel->elem_size);
+    /* Free for the sender of the same slot one lap later */
+    atomic_store(&channel->stamps[index], position + channel->n_elems - index);
+    return true;
+}
+
+
+bool Channel_try_recv(Channel *channel, void *item) {
+    if (!receive(channel, item)) { return false; }
+    wake(&channel->senders, &channel->senders_owed, 1);
+    Channel_pass_wake(channel, false);
+    return true;
+}
+
+
+size_t Channel_try_recv_many(Channel *channel, void *items, size_t max_items) {
+    size_t n_received = 0;
+    while (n_received < max_items
+           && receive(channel,
+                      (char *)items + n_received * channel->elem_size)) {
+        n_received++;
+    }
+    if (n_received != 0) {
+        wake(&channel->senders, &channel->senders_owed, n_received);
+        Channel_pass_wake(channel, false);
+    }
+    return n_received;
+}
+
+
+bool Channel_wait(Channel *channel, bool send, WaitNode *node) {
+    WaitList *waiters = send ? &channel->senders : &channel->receivers;
+    WaitList_push(waiters, node);
+    /* Whoever makes it ready after this looks at the list, so only a change
+     * from before needs to be checked */
+    size_t position = send ? atomic_load(&channel->tail)
+                           : atomic_load(&channel->head);
+    if (lag(channel, position, send ? 0 : 1) < 0) { return true; }
+    WaitNode_unlink(node);
+    return false;
+}
+
+
+void Channel_pass_wake(Channel *channel, bool send) {
+    WaitList *waiters = send ? &channel->senders : &channel->receivers;
+    if (atomic_load(waiters) == NULL) { return; }
+    size_t position = send ? atomic_load(&channel->tail)
+                           : atomic_load(&channel->head);
+    if (lag(channel, position, send ? 0 : 1) < 0) { return; }
+    wake(waiters, send ? &channel->senders_owed : &channel->receivers_owed, 1);
+}
@@ -0,0 +1,166 @@
+/** \file channel.h
+ *
+ * Lock-free async-interrupt-safe bounded channels.
+ *
+ * A channel is a ring of fixed size slots. Each slot carries a sequence
+ * number that tells whether it is free for the sender of a position or holds
+ * the item of a position for its receiver, so senders and receivers only
+ * ever contend on their own end. Coroutines blocked on a full or empty
+ * channel are parked on a wait list of that side and woken by the other
+ * side, oldest first and only as many as it made slots or items available.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+#ifndef CHANNEL_H
+#define CHANNEL_H 1
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "wait_list.h"
+
+
+/** Flags of a #Channel */
+enum {
+    /** Any number of senders and receivers */
+    CHANNEL_MPMC = 0,
+    /** Only one sender at a time, which then claims slots without a CAS */
+    CHANNEL_SINGLE_PRODUCER = 1,
+    /** Only one receiver at a time, which then claims slots without a CAS */
+    CHANNEL_SINGLE_CONSUMER = 2,
+    /** One sender and one receiver */
+    CHANNEL_SPSC = CHANNEL_SINGLE_PRODUCER | CHANNEL_SINGLE_CONSUMER,
+};
+
+
+/** \brief A bounded FIFO channel of fixed size items
+ *
+ * All operations are safe to call from any context, including interrupts,
+ * and never block. An interrupted sender or receiver never makes the other
+ * one fail, except that a slot that is reserved but not yet committed holds
+ * up the receivers of the positions after it.
+ *
+ * \note Use #CHANNEL_STATIC_INIT to initialize
+ */
+typedef struct {
+    /** Array of slots */
+    void *const data;
+    /** Size of each item */
+    const size_t elem_size;
+    /** Number of slots in \c data, a power of 2 */
+    const size_t n_elems;
+    /** #CHANNEL_MPMC, or the promises it is used with */
+    const unsigned flags;
+    /** Sequence number of each slot, less its index so that it starts at
+     * 0. Slot i is free for the sender of position p when its sequence is p
+     * and holds an item for the receiver of p when it is p + 1. */
+    _Atomic size_t *const stamps;
+    /** Position of the next item to receive */
+    _Atomic size_t head;
+    /** Position of the next item to send */
+    _Atomic size_t tail;
+    /** Waiting for a free slot */
+    WaitList senders;
+    /** Waiting for an item */
+    WaitList receivers;
+    /** Wakes owed to \c senders, done by the first of the concurrent
+     * wakers */
+    _Atomic size_t senders_owed;
+    /** Wakes owed to \c receivers, as \c senders_owed */
+    _Atomic size_t receivers_owed;
+} Channel;
+
+
+/** \brief Statically initialize an empty #Channel
+ *
+ * \param p_elem_size  size of each item
+ * \param p_n_elems    number of slots in \p p_data_array, a power of 2
+ * \param p_data_array array of \p p_n_elems slots
+ * \param p_flags      #CHANNEL_MPMC, or e.g. #CHANNEL_SPSC
+ *
+ * \code{.c}
+ * static Sample samples[64];
+ * static Channel adc_channel =
+ *         CHANNEL_STATIC_INIT(sizeof(Sample), 64, samples, CHANNEL_SPSC);
+ * \endcode
+ */
+#define CHANNEL_STATIC_INIT(p_elem_size, p_n_elems, p_data_array, p_flags) \
+    {                                                                       \
+        .data           = (p_data_array),                                   \
+        .elem_size      = (p_elem_size),                                    \
+        .n_elems        = (p_n_elems),                                      \
+        .flags          = (p_flags),                                        \
+        .stamps         = (_Atomic size_t[p_n_elems]){0},                   \
+        .head           = 0,                                                \
+        .tail           = 0,                                                \
+        .senders        = NULL,                                             \
+        .receivers      = NULL,                                             \
+        .senders_owed   = 0,                                                \
+        .receivers_owed = 0,                                                \
+    }
+
+
+/** \brief Send a copy of \p item if there is a free slot
+ *
+ * Wakes a coroutine waiting to receive.
+ *
+ * \return \c false if the channel is full
+ */
+bool Channel_try_send(Channel *channel, const void *item);
+
+/** \brief Reserve the next free slot to fill in place
+ *
+ * The item is sent by #Channel_commit, which must follow (possibly from
+ * another context). Receivers do not get past the reserved slot until then.
+ *
+ * \return Pointer to the slot
+ * \retval NULL if the channel is full
+ */
+void *Channel_reserve(Channel *channel);
+
+/** \brief Send the item filled in a \p slot taken with #Channel_reserve
+ *
+ * Wakes a coroutine waiting to receive.
+ */
+void Channel_commit(Channel *channel, void *slot);
+
+/** \brief Receive the oldest item into \p item if there is one
+ *
+ * Wakes a coroutine waiting to send.
+ *
+ * \return \c false if the channel is empty
+ */
+bool Channel_try_recv(Channel *channel, void *item);
+
+/** \brief Receive up to \p max_items of the oldest items into the array
+ * \p items
+ *
+ * Wakes as many coroutines waiting to send as it received items, at once.
+ *
+ * \return The number of items received, 0 if the channel is empty
+ */
+size_t Channel_try_recv_many(Channel *channel, void *items, size_t max_items);
+
+/** \brief Register \p node to be woken when the channel may have a free
+ * slot (if \p send) or an item (otherwise)
+ *
+ * A woken waiter should retry, as another one may have been faster. One that
+ * does not (e.g. as its wait timed out meanwhile) must call
+ * #Channel_pass_wake instead, as no other waiter is woken for the slot or
+ * item it was woken for.
+ *
+ * \return \c false if that is already the case, in which case \p node is
+ * not registered
+ */
+bool Channel_wait(Channel *channel, bool send, WaitNode *node);
+
+/** \brief Wake another waiter to send (if \p send) or receive, if the
+ * channel has a free slot (or an item) for it
+ *
+ * For a waiter that was woken, or may have been, but gives up instead of
+ * retrying. Each successful send and receive also calls it for its own side,
+ * to make up for a wake lost to a waiter unlinking itself meanwhile.
+ */
+void Channel_pass_wake(Channel *channel, bool send);
+
+#endif /* ifndef CHANNEL_H */
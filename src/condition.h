@@ -7,8 +7,12 @@
 #define CONDITION_H 1
 
 
+#include <inttypes.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include "idle.h"
+#include "trace.h"
+#include "wait_list.h"
 
 /** A condition can be set to true or cleared to false */
 typedef _Atomic bool Condition;
@@ -18,9 +22,14 @@ static inline bool Condition_get(Condition *condition) {
     return atomic_load(condition);
 }
 
-/** Atomically sets the condition to true */
+/** \brief Atomically sets the condition to true
+ *
+ * Raises a pending wake for the idle scheduler.
+ */
 static inline void Condition_set(Condition *condition) {
     atomic_store(condition, true);
+    CORO_TRACE(CORO_TRACE_CONDITION_SET, condition, 0);
+    CoroIdle_notify();
 }
 
 /** Atomically clears the condition to false */
@@ -28,4 +37,96 @@ static inline void Condition_clear(Condition *condition) {
     atomic_store(condition, false);
 }
 
+
+/** \brief A condition that parks its waiters instead of being polled
+ *
+ * Coroutines waiting on it are kept on a lock-free intrusive list and
+ * #WakeCondition_set moves all of them onto their ready queues at once, so the
+ * scheduler does not look at any of them until the condition is set.
+ *
+ * The condition is set exactly when its list is closed.
+ *
+ * \note Use #WAKE_CONDITION_INIT to initialize
+ */
+typedef struct {
+    /** Waiters while clear, #WAIT_LIST_CLOSED while set */
+    WaitList waiters;
+} WakeCondition;
+
+/** Static initializer for a cleared #WakeCondition */
+#define WAKE_CONDITION_INIT \
+    { .waiters = NULL }
+
+/** \brief Atomically gets the current value of the condition */
+static inline bool WakeCondition_get(WakeCondition *condition) {
+    return WaitList_is_closed(&condition->waiters);
+}
+
+/** \brief Atomically sets the condition to true and wakes all its waiters
+ *
+ * Safe to call from interrupts.
+ */
+static inline void WakeCondition_set(WakeCondition *condition) {
+    CORO_TRACE(CORO_TRACE_CONDITION_SET, condition, 0);
+    WaitNode_wake_all(WaitList_close(&condition->waiters));
+}
+
+/** Atomically clears the condition to false */
+static inline void WakeCondition_clear(WakeCondition *condition) {
+    WaitList_reopen(&condition->waiters);
+}
+
+/** \brief Register \p node to be woken when the condition is set
+ *
+ * \return \c false if the condition is already set, in which case \p node is
+ * not registered
+ */
+static inline bool WakeCondition_wait(WakeCondition *condition,
+                                      WaitNode *     node) {
+    return WaitList_push(&condition->waiters, node);
+}
+
+
+/** \brief A count of running tasks that can be awaited until it drops to 0
+ *
+ * Call #CoroGroup_add before starting tasks and #CoroGroup_done as each of
+ * them finishes. Coroutines await the group through \c done (with
+ * #CORO_AWAIT or as one of several waitables), so they cost nothing until
+ * the last task is done.
+ *
+ * \warning Do not add to a group with a count of 0 while it may be dropping
+ * to 0.
+ *
+ * \note Use #CORO_GROUP_INIT to initialize
+ */
+typedef struct {
+    /** Number of tasks not done yet */
+    _Atomic uint32_t pending;
+    /** Set while \c pending is 0 */
+    WakeCondition done;
+} CoroGroup;
+
+/** Static initializer for an empty #CoroGroup */
+#define CORO_GROUP_INIT                                      \
+    {                                                        \
+        .pending = 0, .done = {.waiters = WAIT_LIST_CLOSED}, \
+    }
+
+/** \brief Add \p n_tasks tasks to \p group */
+static inline void CoroGroup_add(CoroGroup *group, uint32_t n_tasks) {
+    if (atomic_fetch_add(&group->pending, n_tasks) == 0 && n_tasks != 0) {
+        WakeCondition_clear(&group->done);
+    }
+}
+
+/** \brief Mark one task of \p group done
+ *
+ * Wakes its waiters if it was the last one. Safe to call from interrupts.
+ */
+static inline void CoroGroup_done(CoroGroup *group) {
+    if (atomic_fetch_sub(&group->pending, 1) == 1) {
+        WakeCondition_set(&group->done);
+    }
+}
+
 #endif /* ifndef CONDITION_H */
@@ -7,91 +7,1569 @@
 #include "coro.h"
 #include <assert.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
 
-static void execute(CoroState *state);
-static void execute_once(CoroState *state);
+/** The #CoroState a #Waiter is embedded in */
+#define STATE_OF_WAITER(p_waiter) \
+    ((CoroState *)((char *)(p_waiter)-offsetof(CoroState, waiter)))
 
+/** The #CoroSchedule a ready queue summary bitmap belongs to */
+#define SCHEDULE_OF_SUMMARY(p_summary) \
+    ((CoroSchedule *)((char *)(p_summary)-offsetof(CoroSchedule, ready)))
 
-typedef int funcVars;
-void func(CoroState *state, void *vars) {
-    CORO_INIT(func);
+/** The #CoroScheduleQueue a ready queue is embedded in */
+#define QUEUE_OF_READY(p_ready)                  \
+    ((CoroScheduleQueue *)((char *)(p_ready)     \
+                           - offsetof(CoroScheduleQueue, ready)))
 
-    CORO_YIELD();
 
-    int  a  = 1;
-    CORO_YIELD();
-    CORO_YIELD();
+/* CoroState::continuation values of a finalizing and a finalized coroutine.
+ * Only their addresses matter. */
+static const max_align_t join_sentinels[2];
+#define JOINING ((Waiter *)&join_sentinels[0])
+#define JOINED ((Waiter *)&join_sentinels[1])
 
 
-    int b = 2;
-    CORO_YIELD();
+/** Bit of \p status in #DISABLED_WAITS */
+#define WAIT_BIT(status) (UINT32_C(1) << (status))
+
+/** Statuses of the waits left out by the CONF_CORO_WAIT_* options */
+#define DISABLED_WAITS                                                        \
+    ((CONF_CORO_WAIT_MANY ? 0                                                 \
+                          : WAIT_BIT(CORO_STATUS_WAIT_MANY)                   \
+                                    | WAIT_BIT(CORO_STATUS_WAIT_MANY_POLLED)) \
+     | (CONF_CORO_WAIT_QUEUED_RESOURCE                                        \
+                ? 0                                                           \
+                : WAIT_BIT(CORO_STATUS_WAIT_QUEUED_RESOURCE))                 \
+     | (CONF_CORO_WAIT_CHANNEL ? 0 : WAIT_BIT(CORO_STATUS_WAIT_CHANNEL))      \
+     | (CONF_CORO_WAIT_IO ? 0 : WAIT_BIT(CORO_STATUS_WAIT_IO)))
+
+/** Number of priority levels of \p schedule, a constant if configured */
+#define N_PRIORITIES(schedule)                               \
+    (CONF_CORO_N_PRIORITIES ? (size_t)CONF_CORO_N_PRIORITIES \
+                            : (schedule)->n_priorities)
+
+/** Whether the scheduler keeps track of the queues it passes over */
+#define TRACK_PASSED (CONF_CORO_STATS || CONF_CORO_POLICIES)
+
+/** Bit of the queue at \p index in the bitmaps of a #CoroSchedule */
+#define QUEUE_BIT(index) (UINT32_C(0x80000000) >> (index))
+
+
+/** Number of calls to #Coro_cancel so far, so that passes over polled waits
+ * know when to look past the condition of their entries */
+static _Atomic uint32_t n_cancels;
+
+
+static CoroStatus execute(CoroState *state, CoroState **sub);
+static CoroState *park(CoroState *state, CoroStatus status);
+static bool       unpark(CoroState *state);
+
+
+#if CONF_CORO_STATS
+/* Statistics are published under a sequence counter (a seqlock with a
+ * single writer), so readers never block the scheduler */
+
+static void stats_write_begin(_Atomic uint32_t *seq) {
+    uint32_t odd = atomic_load_explicit(seq, memory_order_relaxed) + 1;
+    atomic_store_explicit(seq, odd, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+
+static void stats_write_end(_Atomic uint32_t *seq) {
+    uint32_t even = atomic_load_explicit(seq, memory_order_relaxed) + 1;
+    atomic_store_explicit(seq, even, memory_order_release);
+}
+
+
+static bool stats_read(const _Atomic uint32_t *seq,
+                       const void *            stats,
+                       void *                  snapshot,
+                       size_t                  size) {
+    uint32_t before = atomic_load_explicit(seq, memory_order_acquire);
+    if (before & 1) { return false; }
+    memcpy(snapshot, stats, size);
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(seq, memory_order_relaxed) == before;
+}
+
+
+bool CoroStats_snapshot(const CoroState *state, CoroStats *snapshot) {
+    return stats_read(
+            &state->stats_seq, &state->stats, snapshot, sizeof(*snapshot));
+}
+
+
+bool CoroScheduleStats_snapshot(const CoroSchedule *schedule,
+                                CoroScheduleStats * snapshot) {
+    return stats_read(&schedule->stats_seq,
+                      &schedule->stats,
+                      snapshot,
+                      sizeof(*snapshot));
 }
+#endif
 
 
+/** \brief Make \p sub wake the armed \p waiter of \p state when it
+ * finalizes (or yields)
+ *
+ * A sub-coroutine that is not in any schedule is scheduled in place of
+ * \p state, at its priority, on the \p ready queue \p state parks for.
+ *
+ * \return \p sub if it was started that way, armed for the caller to wake
+ * (or to claim and execute), else \c NULL
+ */
+static CoroState *join(CoroState *     state,
+                       WaitReadyQueue *ready,
+                       Waiter *        waiter,
+                       CoroState *     sub) {
+    Waiter *expected = NULL;
+    if (sub->waiter.ready == NULL) {
+        atomic_store(&sub->continuation, waiter);
+        if (sub->deadline == NULL && state->deadline != NULL
+            && !(atomic_load(&state->cancel) & CORO_CANCEL_DELIVERED)) {
+            /* The tree shares the deadline of its root */
+            sub->deadline = state->deadline;
+            atomic_fetch_or(&sub->cancel, CORO_CANCEL_DEADLINE);
+        }
+        sub->priority     = state->priority;
+        sub->waiter.ready = ready;
+        Waiter_arm(&sub->waiter);
+        return sub;
+    }
+    if (!atomic_compare_exchange_strong(
+                &sub->continuation, &expected, waiter)) {
+        assert((expected == JOINING || expected == JOINED)
+               && "only one coroutine at a time may await a coroutine");
+        /* Already finalized */
+        Waiter_wake(waiter);
+    }
+    return NULL;
+}
+
+
+/** Undo #join for \p waiter, which may have been woken by something else */
+static void leave(Waiter *waiter, CoroState *sub) {
+    Waiter *expected = waiter;
+    if (!atomic_compare_exchange_strong(&sub->continuation, &expected, NULL)) {
+        /* Finalized meanwhile. Wait until it is done claiming the wake of
+         * waiter, so that it cannot take a later one. */
+        while (atomic_load(&sub->continuation) == JOINING) {}
+    }
+}
+
+
+/** \brief Resume the coroutine awaiting the just finalized (or yielded)
+ * \p state, leaving \p after as its continuation
+ * \return That coroutine if it should be executed right away, in place of
+ * \p state, because it belongs to the same \p ready queue
+ */
+static CoroState *finish(CoroState *     state,
+                         WaitReadyQueue *ready,
+                         Waiter *        after) {
+    Waiter *   awaiting = atomic_exchange(&state->continuation, JOINING);
+    CoroState *next     = NULL;
+    if (awaiting != NULL && awaiting->join != NULL) {
+        /* Awaited among other waitables */
+        Waiter_wake(awaiting);
+    } else if (awaiting != NULL && Waiter_claim(awaiting)) {
+        if (awaiting->ready == ready) {
+            next = STATE_OF_WAITER(awaiting);
+        } else {
+            Waiter_arm(awaiting);
+            Waiter_wake(awaiting);
+        }
+    }
+    /* Unless a coroutine awaits the yielded state again already */
+    Waiter *joining = JOINING;
+    atomic_compare_exchange_strong(&state->continuation, &joining, after);
+    return next;
+}
+
+
+/** \brief Hand the value just yielded by \p state to the coroutine
+ * awaiting it, as #finish, and take \p state off any schedule until it is
+ * awaited again
+ */
+static CoroState *hand_back(CoroState *state, WaitReadyQueue *ready) {
+    /* Started again by the next await */
+    state->waiter.ready = NULL;
+    return finish(state, ready, NULL);
+}
+
 
-static void execute(CoroState *state) {
+/** \brief Take over the sub-coroutine \p sub that was just started, to
+ * execute it in place of the coroutine awaiting it, if it runs on the
+ * \p ready queue and \p transfer
+ * \return \c NULL if it was woken onto its ready queue instead
+ */
+static CoroState *
+take_over(CoroState *sub, WaitReadyQueue *ready, bool transfer) {
+    if (transfer && sub->waiter.ready == ready
+        && Waiter_claim(&sub->waiter)) {
+        return sub;
+    }
+    Waiter_wake(&sub->waiter);
+    return NULL;
+}
+
+
+/** \brief The ready queue \p state should be scheduled on from now on
+ *
+ * The queue of its own priority in its current schedule, or of a higher one
+ * while coroutines of that priority wait for a queued resource it holds.
+ */
+static WaitReadyQueue *effective_ready(CoroState *state) {
+    WaitReadyQueue *ready = state->waiter.ready;
+    uint32_t        bits  = UINT32_C(1) << (31 - state->priority);
+    if (state->holding != NULL) {
+        if (QueuedResource_is_owned(state->holding, state->holding_as)) {
+            bits |= atomic_load(&state->holding->boost);
+        } else {
+            state->holding = NULL;
+        }
+    }
+    if (bits != ready->summary_bit && ready->summary != NULL) {
+        CoroSchedule *schedule = SCHEDULE_OF_SUMMARY(ready->summary);
+        ready = &schedule->queues[__builtin_clz(bits)]->ready;
+    }
+    if (state->holding != NULL) {
+        /* Where later waiters find it to raise */
+        atomic_store(&state->holding->owner_queue, ready);
+    }
+    return ready;
+}
+
+
+#if CONF_CORO_WAIT_QUEUED_RESOURCE
+/** \brief Serve the ready queue \p ready at the priority of \p bit until the
+ * holder of a queued resource on it runs
+ *
+ * For an owner that was already ready when a stronger coroutine started
+ * waiting for it.
+ */
+static void raise_queue(WaitReadyQueue *ready, uint32_t bit) {
+    if (ready == NULL || ready->summary == NULL || ready->summary_bit >= bit) {
+        return;
+    }
+    atomic_fetch_or(&QUEUE_OF_READY(ready)->raised, bit);
+    atomic_fetch_or(&SCHEDULE_OF_SUMMARY(ready->summary)->raised,
+                    ready->summary_bit);
+    CoroIdle_notify();
+}
+
+
+/** \brief Queue \p waiter on the queued resource of \p on
+ * \param ready the ready queue of the coroutine that parks
+ */
+static void queue_on(WaitReadyQueue *  ready,
+                     Waiter *          waiter,
+                     CoroResourceWait *on) {
+    /* Raises the owner to the priority this will run at */
+    on->owner->boost       = ready->summary_bit;
+    on->owner->node.waiter = waiter;
+    on->retval             = RESOURCE_ACQUIRE_FAILED;
+    if (!QueuedResource_wait(on->queued, on->owner)) {
+        /* Acquired right away */
+        Waiter_wake(waiter);
+    } else {
+        raise_queue(atomic_load(&on->queued->owner_queue), on->owner->boost);
+    }
+}
+
+
+/** Undo #queue_on for the resumed \p state */
+static void dequeue(CoroState *state, CoroResourceWait *on) {
+    if (QueuedResource_cancel_wait(on->queued, on->owner)) {
+        on->retval        = RESOURCE_ACQUIRE_SUCCESS;
+        state->holding    = on->queued;
+        state->holding_as = on->owner;
+    }
+}
+#endif
+
+
+#if CONF_CORO_WAIT_MANY
+/** \brief Register \p state, parking for \p ready, on every waitable of
+ * its wait on many
+ *
+ * Each waitable has its own member waiter in the join of the wait, so the
+ * wait ends with a single wake of \p state (or a single successful poll)
+ * however many of them are done.
+ */
+static void join_many(CoroState *state, WaitReadyQueue *ready) {
+    CoroWaitable *waitables = state->wait.many.waitables;
+    size_t        n         = state->wait.many.n_waitables;
+    WaitJoin *    counter   = &state->wait.many.join;
+
+    atomic_store(&counter->remaining,
+                 state->wait.many.any ? 1 : (int32_t)n);
+    atomic_store(&counter->forwarded, 0);
+    atomic_store(&counter->completed_by, NULL);
+    counter->waiter = &state->waiter;
+    for (size_t i = 0; i < n; i++) {
+        waitables[i].waiter.ready = NULL;
+        waitables[i].waiter.join  = counter;
+        waitables[i].node.waiter  = &waitables[i].waiter;
+        Waiter_arm(&waitables[i].waiter);
+    }
+    if (n == 0) {
+        /* Nothing to wait for */
+        atomic_store(&counter->remaining, 0);
+        Waiter_wake(&state->waiter);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        CoroWaitable *waitable = &waitables[i];
+        switch (waitable->kind) {
+        case CORO_WAITABLE_WAKE_CONDITION:
+            if (!WakeCondition_wait(waitable->on.wake_condition,
+                                    &waitable->node)) {
+                /* Already set */
+                Waiter_wake(&waitable->waiter);
+            }
+            break;
+        case CORO_WAITABLE_COROUTINE: {
+            CoroState *sub = join(
+                    state, ready, &waitable->waiter, waitable->on.coroutine);
+            if (sub != NULL) { Waiter_wake(&sub->waiter); }
+            break;
+        }
+        case CORO_WAITABLE_QUEUED_RESOURCE:
+#if CONF_CORO_WAIT_QUEUED_RESOURCE
+            queue_on(ready, &waitable->waiter, &waitable->on.resource);
+#endif
+            break;
+        case CORO_WAITABLE_CHANNEL:
+#if CONF_CORO_WAIT_CHANNEL
+            if (!Channel_wait(waitable->on.channel.channel,
+                              waitable->on.channel.send,
+                              &waitable->node)) {
+                /* Already possible */
+                Waiter_wake(&waitable->waiter);
+            }
+#endif
+            break;
+        case CORO_WAITABLE_IO:
+#if CONF_CORO_WAIT_IO
+            if (!CoroIo_submit(waitable->on.io, &waitable->waiter)) {
+                /* Completed at once */
+                Waiter_wake(&waitable->waiter);
+            }
+#endif
+            break;
+        case CORO_WAITABLE_RESOURCE:
+            waitable->on.resource.retval = RESOURCE_ACQUIRE_FAILED;
+            break;
+        case CORO_WAITABLE_CONDITION: break;
+        }
+    }
+}
+
+
+/** \brief Undo #join_many for the resumed \p state
+ *
+ * Waits until no waker looks at the join any more, so that it can be reused,
+ * and leaves the index of the waitable that ended the wait in
+ * CoroState::wait.many.winner.
+ */
+static void leave_many(CoroState *state) {
+    CoroWaitable *waitables = state->wait.many.waitables;
+    size_t        n         = state->wait.many.n_waitables;
+    WaitJoin *    counter   = &state->wait.many.join;
+    int32_t       n_woken   = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        CoroWaitable *waitable = &waitables[i];
+        if (waitable->kind == CORO_WAITABLE_WAKE_CONDITION
+            || waitable->kind == CORO_WAITABLE_CHANNEL) {
+            WaitNode_unlink(&waitable->node);
+        } else if (waitable->kind == CORO_WAITABLE_COROUTINE) {
+            leave(&waitable->waiter, waitable->on.coroutine);
+#if CONF_CORO_WAIT_QUEUED_RESOURCE
+        } else if (waitable->kind == CORO_WAITABLE_QUEUED_RESOURCE) {
+            dequeue(state, &waitable->on.resource);
+#endif
+#if CONF_CORO_WAIT_IO
+        } else if (waitable->kind == CORO_WAITABLE_IO) {
+            CoroIo_cancel(waitable->on.io);
+#endif
+        }
+        if (!Waiter_claim(&waitable->waiter)) { n_woken++; }
+    }
+    /* Wakes that claimed a member before may still be counting it */
+    while (atomic_load(&counter->forwarded) != n_woken) {}
+
+    Waiter *completed_by    = atomic_load(&counter->completed_by);
+    state->wait.many.winner = -1;
+    for (size_t i = 0; completed_by != NULL && i < n; i++) {
+        if (&waitables[i].waiter == completed_by) {
+            state->wait.many.winner = (int)i;
+        }
+    }
+}
+
+
+/** \brief Poll the waitables of a polled wait on many of \p state
+ * \return If the wait is over
+ */
+static bool poll_many(CoroState *state) {
+    CoroWaitable *waitables = state->wait.many.waitables;
+    WaitJoin *    counter   = &state->wait.many.join;
+
+    for (size_t i = 0; i < state->wait.many.n_waitables
+                       && atomic_load(&counter->remaining) > 0;
+         i++) {
+        CoroWaitable *waitable = &waitables[i];
+        if (!atomic_load(&waitable->waiter.armed)) { continue; }
+        if (waitable->kind == CORO_WAITABLE_CONDITION) {
+            if (Condition_get(waitable->on.condition)) {
+                Waiter_wake(&waitable->waiter);
+            }
+        } else if (waitable->kind == CORO_WAITABLE_RESOURCE) {
+            RetResource_acquire retval
+                    = Resource_acquire(waitable->on.resource.resource,
+                                       waitable->on.resource.owner);
+            if (retval != RESOURCE_ACQUIRE_FAILED) {
+                waitable->on.resource.retval = retval;
+                Waiter_wake(&waitable->waiter);
+            }
+        }
+    }
+    return atomic_load(&counter->remaining) <= 0;
+}
+#endif
+
+
+/** \brief Whether \p state, of cancellation bits \p cancel, should be
+ * resumed as cancelled */
+static bool cancel_due(const CoroState *state, uint8_t cancel) {
+    if (cancel & CORO_CANCEL_DELIVERED) { return false; }
+    return (cancel & CORO_CANCEL_REQUESTED)
+           || ((cancel & CORO_CANCEL_DEADLINE)
+               && Condition_get(&state->deadline->timed_out));
+}
+
+
+#if CONF_CORO_WAIT_CHANNEL
+/** \brief Pass on the wakes \p state, just taken off a wait with
+ * \p waited, may have got from channels it does not retry
+ *
+ * A channel only wakes as many waiters as it has slots (or items) for. A
+ * waiter retries unless its wait timed out or it is cancelled, or, waiting
+ * on many, another waitable ended the wait.
+ */
+static void pass_channel_wakes(CoroState *state, CoroStatus waited) {
+    if (waited != CORO_STATUS_WAIT_CHANNEL
+        && waited != CORO_STATUS_WAIT_MANY
+        && waited != CORO_STATUS_WAIT_MANY_POLLED) {
+        return;
+    }
+    bool giving_up
+            = (state->timed_wait && Condition_get(&state->timeout.timed_out))
+              || cancel_due(state, atomic_load(&state->cancel));
+    if (waited == CORO_STATUS_WAIT_CHANNEL && giving_up) {
+        Channel_pass_wake(state->wait.channel.channel,
+                          state->wait.channel.send);
+#if CONF_CORO_WAIT_MANY
+    } else if (waited == CORO_STATUS_WAIT_MANY
+               || waited == CORO_STATUS_WAIT_MANY_POLLED) {
+        for (size_t i = 0; i < state->wait.many.n_waitables; i++) {
+            CoroWaitable *waitable = &state->wait.many.waitables[i];
+            if (waitable->kind == CORO_WAITABLE_CHANNEL
+                && (giving_up || (int)i != state->wait.many.winner)) {
+                Channel_pass_wake(waitable->on.channel.channel,
+                                  waitable->on.channel.send);
+            }
+        }
+#endif
+    }
+}
+#endif
+
+
+/** \brief Resume the cancelled \p state, just taken off a wait with
+ * \p waited, at its clean up label if it has one
+ * \return \c false if it must not be executed
+ */
+static bool deliver_cancel(CoroState *state, CoroStatus waited) {
+    uint8_t cancel = atomic_load(&state->cancel);
+    if (cancel & CORO_CANCEL_FINALIZE) { return false; }
+    if (!cancel_due(state, cancel)) { return true; }
+    atomic_fetch_or(&state->cancel, CORO_CANCEL_DELIVERED);
+    if (state->deadline == &state->deadline_timer) {
+        Timer_cancel(&state->deadline_timer);
+    }
+
+    if (waited == CORO_STATUS_WAIT_SUBCORO) {
+        Coro_cancel(state->wait.sub_coroutine);
+#if CONF_CORO_WAIT_MANY
+    } else if (waited == CORO_STATUS_WAIT_MANY
+               || waited == CORO_STATUS_WAIT_MANY_POLLED) {
+        for (size_t i = 0; i < state->wait.many.n_waitables; i++) {
+            CoroWaitable *waitable = &state->wait.many.waitables[i];
+            if (waitable->kind == CORO_WAITABLE_COROUTINE) {
+                Coro_cancel(waitable->on.coroutine);
+            }
+        }
+#endif
+    }
+    if (state->holding != NULL
+        && QueuedResource_is_owned(state->holding, state->holding_as)) {
+        QueuedResource_release(state->holding, state->holding_as);
+    }
+    state->holding = NULL;
+
+    if (state->on_cancel != NULL) {
+        state->label     = state->on_cancel;
+        state->on_cancel = NULL;
+        return true;
+    }
+    if (waited == CORO_STATUS_WAIT_SUBCORO
+        && atomic_load(&state->wait.sub_coroutine->continuation) != JOINED) {
+        /* Await it again first, as it may be in the variables */
+        atomic_fetch_or(&state->cancel, CORO_CANCEL_FINALIZE);
+        state->status = CORO_STATUS_WAIT_SUBCORO;
+    }
+    return false;
+}
+
+
+/** \brief Execute one step of \p state and park it
+ * \param[out] sub the sub-coroutine it started awaiting, for the caller to
+ *                 wake or execute in place of it, or \c NULL
+ * \return The status it suspended with. Unless it must be polled or
+ * rescheduled by the caller, \p state may be executing elsewhere already.
+ */
+static CoroStatus execute(CoroState *state, CoroState **sub) {
+    /* It may have been woken before it was fully parked on another worker */
+    while (atomic_load(&state->parking)) {}
+    CORO_TRACE(CORO_TRACE_RESUME, state, state->func);
+#if CONF_CORO_STATS
+    uint64_t started = CONF_CORO_STATS_CYCLES();
+#endif
+    CoroStatus waited = state->status;
+    if (state->status == CORO_STATUS_WAIT_WAKE_CONDITION
+        || state->status == CORO_STATUS_WAIT_CHANNEL) {
+        /* Still registered if the timeout woke it */
+        WaitNode_unlink(&state->wait_node);
+    } else if (state->status == CORO_STATUS_WAIT_SUBCORO) {
+        leave(&state->waiter, state->wait.sub_coroutine);
+#if CONF_CORO_WAIT_MANY
+    } else if (state->status == CORO_STATUS_WAIT_MANY
+               || state->status == CORO_STATUS_WAIT_MANY_POLLED) {
+        leave_many(state);
+#endif
+#if CONF_CORO_WAIT_QUEUED_RESOURCE
+    } else if (state->status == CORO_STATUS_WAIT_QUEUED_RESOURCE) {
+        dequeue(state, &state->wait.resource);
+#endif
+#if CONF_CORO_WAIT_IO
+    } else if (state->status == CORO_STATUS_WAIT_IO) {
+        /* Still running if the timeout woke it */
+        CoroIo_cancel(state->wait.io);
+#endif
+    }
+#if CONF_CORO_WAIT_CHANNEL
+    pass_channel_wakes(state, waited);
+#endif
     if (state->timed_wait) {
         Timer_cancel(&state->timeout);
         state->timed_wait = false;
     }
     state->status = CORO_STATUS_FINALIZE;
-    state->func(state, state->vars);
+    if (atomic_load_explicit(&state->cancel, memory_order_relaxed) == 0
+        || deliver_cancel(state, waited)) {
+        CONF_CORO_DISPATCH(state);
+    }
+#if CONF_CORO_STATS
+    uint64_t stopped = CONF_CORO_STATS_CYCLES();
+    stats_write_begin(&state->stats_seq);
+    state->stats.n_resumes++;
+    state->stats.run_cycles += stopped - started;
+    state->stats.wait_cycles[waited] += started - state->stats_parked_at;
+    stats_write_end(&state->stats_seq);
+    state->stats_parked_at = stopped;
+#endif
+    CoroStatus status = state->status;
+    CORO_TRACE(CORO_TRACE_SUSPEND, state, status);
+    assert(!(DISABLED_WAITS & WAIT_BIT(status))
+           && "wait left out by its CONF_CORO_WAIT_* option");
+    if (status == CORO_STATUS_FINALIZE
+        && state->deadline == &state->deadline_timer) {
+        Timer_cancel(&state->deadline_timer);
+    }
+    *sub = park(state, status);
+    return status;
+}
+
+
+/** \brief Register a just suspended coroutine on whatever wakes it
+ * \return The sub-coroutine it started awaiting (see #join), or \c NULL
+ */
+static CoroState *park(CoroState *state, CoroStatus status) {
+    /* Once armed, the waiter may be woken and stolen at any time */
+    WaitReadyQueue *ready   = state->waiter.ready;
+    CoroState *     started = NULL;
+    switch (status) {
+    case CORO_STATUS_WAIT_TIMED:
+    case CORO_STATUS_WAIT_SUBCORO:
+    case CORO_STATUS_WAIT_WAKE_CONDITION:
+    case CORO_STATUS_WAIT_MANY:
+    case CORO_STATUS_WAIT_QUEUED_RESOURCE:
+    case CORO_STATUS_WAIT_CHANNEL:
+    case CORO_STATUS_WAIT_IO:
+        atomic_store(&state->parking, true);
+        ready               = effective_ready(state);
+        state->waiter.ready = ready;
+        Waiter_arm(&state->waiter);
+        break;
+    case CORO_STATUS_WAIT_MANY_POLLED:
+        /* Never woken, so only ever resumed by this scheduler */
+        break;
+    default: return NULL;
+    }
+
+    switch (status) {
+    case CORO_STATUS_WAIT_SUBCORO:
+        started = join(
+                state, ready, &state->waiter, state->wait.sub_coroutine);
+        break;
+#if CONF_CORO_WAIT_QUEUED_RESOURCE
+    case CORO_STATUS_WAIT_QUEUED_RESOURCE:
+        queue_on(ready, &state->waiter, &state->wait.resource);
+        break;
+#endif
+#if CONF_CORO_WAIT_MANY
+    case CORO_STATUS_WAIT_MANY:
+    case CORO_STATUS_WAIT_MANY_POLLED: join_many(state, ready); break;
+#endif
+    case CORO_STATUS_WAIT_WAKE_CONDITION:
+        if (!WakeCondition_wait(state->wait.wake_condition,
+                                &state->wait_node)) {
+            /* Already set */
+            Waiter_wake(&state->waiter);
+        }
+        break;
+#if CONF_CORO_WAIT_CHANNEL
+    case CORO_STATUS_WAIT_CHANNEL:
+        if (!Channel_wait(state->wait.channel.channel,
+                          state->wait.channel.send,
+                          &state->wait_node)) {
+            /* Already possible */
+            Waiter_wake(&state->waiter);
+        }
+        break;
+#endif
+#if CONF_CORO_WAIT_IO
+    case CORO_STATUS_WAIT_IO:
+        if (!CoroIo_submit(state->wait.io, &state->waiter)) {
+            /* Completed at once */
+            Waiter_wake(&state->waiter);
+        }
+        break;
+#endif
+    default: break;
+    }
+    if (state->timed_wait && Condition_get(&state->timeout.timed_out)) {
+        /* Expired before the waiter was armed */
+        Waiter_wake(&state->waiter);
+    }
+    if (cancel_due(state, atomic_load(&state->cancel))) {
+        /* Cancelled before the waiter was armed */
+        Waiter_wake(&state->waiter);
+    }
+    atomic_store(&state->parking, false);
+    return started;
 }
 
 
-static void execute_once(CoroState *state) {
+/** \brief Claim the resumption of a timed out coroutine
+ * \return \c false if it was woken in the meantime and will be resumed from
+ * its ready queue instead
+ */
+static bool unpark(CoroState *state) {
+    switch (state->status) {
+    case CORO_STATUS_WAIT_TIMED:
+    case CORO_STATUS_WAIT_SUBCORO:
+    case CORO_STATUS_WAIT_WAKE_CONDITION:
+    case CORO_STATUS_WAIT_MANY:
+    case CORO_STATUS_WAIT_QUEUED_RESOURCE:
+    case CORO_STATUS_WAIT_CHANNEL:
+    case CORO_STATUS_WAIT_IO:
+        return Waiter_claim(&state->waiter);
+    default: return true;
+    }
+}
+
+
+/** \brief Check if what \p state waits for is available
+ * \return If \p state can be resumed
+ */
+static bool wait_over(CoroState *state) {
     if (state->timed_wait && Condition_get(&state->timeout.timed_out)) {
-        execute(state);
+        return unpark(state);
+    }
+    if (cancel_due(state, atomic_load(&state->cancel))) {
+        return unpark(state);
+    }
+    switch (state->status) {
+    case CORO_STATUS_FINALIZE: return false;
+    case CORO_STATUS_SUSPENDED: return true;
+    case CORO_STATUS_WAIT_TIMED: return false;
+    case CORO_STATUS_WAIT_CONDITION:
+        return Condition_get(state->wait.condition);
+    case CORO_STATUS_WAIT_RESOURCE:
+        state->wait.resource.retval = Resource_acquire(
+                state->wait.resource.resource, state->wait.resource.owner);
+#if CONF_CORO_STATS
+        if (state->wait.resource.retval == RESOURCE_ACQUIRE_PREEMPTED) {
+            stats_write_begin(&state->stats_seq);
+            state->stats.n_preemptions++;
+            stats_write_end(&state->stats_seq);
+        }
+#endif
+        return state->wait.resource.retval != RESOURCE_ACQUIRE_FAILED;
+    case CORO_STATUS_WAIT_MANY_POLLED:
+#if CONF_CORO_WAIT_MANY
+        return poll_many(state);
+#endif
+    case CORO_STATUS_WAIT_SUBCORO:
+    case CORO_STATUS_WAIT_WAKE_CONDITION:
+    case CORO_STATUS_WAIT_MANY:
+    case CORO_STATUS_WAIT_QUEUED_RESOURCE:
+    case CORO_STATUS_WAIT_CHANNEL:
+    case CORO_STATUS_WAIT_IO:
+        /* Resumed from the ready queue instead */
+        return false;
+    case CORO_STATUS_YIELDED:
+        /* Resumed by the coroutine awaiting it */
+        return false;
+    }
+    return false;
+}
+
+
+/** \brief Whether \p state can only be resumed by polling it */
+static bool needs_polling(CoroStatus status) {
+    switch (status) {
+    case CORO_STATUS_FINALIZE:
+    case CORO_STATUS_SUSPENDED:
+    case CORO_STATUS_WAIT_TIMED:
+    case CORO_STATUS_WAIT_SUBCORO:
+    case CORO_STATUS_WAIT_WAKE_CONDITION:
+    case CORO_STATUS_WAIT_MANY:
+    case CORO_STATUS_WAIT_QUEUED_RESOURCE:
+    case CORO_STATUS_WAIT_CHANNEL:
+    case CORO_STATUS_WAIT_IO:
+    case CORO_STATUS_YIELDED: return false;
+    default: return true;
+    }
+}
+
+
+static void poll_later(CoroScheduleQueue *queue, CoroState *state) {
+    if (state->polled) { return; }
+    state->polled = true;
+    if (queue->n_polls < queue->n_polls_max) {
+        bool only_condition = state->status == CORO_STATUS_WAIT_CONDITION
+                              && !state->timed_wait
+                              && atomic_load(&state->cancel) == 0;
+        CoroPollEntry *entry = &queue->polls[queue->n_polls++];
+        entry->condition     = only_condition ? state->wait.condition : NULL;
+        entry->state         = state;
     } else {
-        switch (state->status) {
-        case CORO_STATUS_FINALIZE: break;
-        case CORO_STATUS_SUSPENDED: execute(state); break;
-        case CORO_STATUS_WAIT_TIMED: break;
-        case CORO_STATUS_WAIT_CONDITION:
-            if (Condition_get(state->wait.condition)) { execute(state); };
-            break;
-        case CORO_STATUS_WAIT_RESOURCE:
-            if ((state->wait.resource.retval =
-                         Resource_acquire(state->wait.resource.resource,
-                                          state->wait.resource.owner))
-                != RESOURCE_ACQUIRE_FAILED) {
-                execute(state);
+        state->next_polled = queue->polled;
+        queue->polled      = state;
+    }
+}
+
+
+/** \brief File a just executed \p state according to the \p status it
+ * suspended with
+ * \param shared whether to reschedule it where other workers can steal it
+ */
+static void settle(CoroScheduleQueue *queue,
+                   CoroState *        state,
+                   CoroStatus         status,
+                   bool               shared) {
+    if (status == CORO_STATUS_FINALIZE) {
+        if (state->storage != NULL) {
+            /* Keep the slot until the next pass, so that a coroutine that
+             * was just resumed by it may still look at it */
+            state->waiter.next = queue->finalized;
+            queue->finalized   = &state->waiter;
+            CoroIdle_notify();
+        }
+    } else if (status == CORO_STATUS_SUSPENDED) {
+        WaitReadyQueue *ready = effective_ready(state);
+        if (shared || ready != &queue->ready) {
+            state->waiter.ready = ready;
+            Waiter_arm(&state->waiter);
+            Waiter_wake(&state->waiter);
+        } else {
+            WaitReadyQueue_append(&queue->ready, &state->waiter);
+        }
+    } else if (needs_polling(status)) {
+        poll_later(queue, state);
+    }
+}
+
+
+/** Make ready every polled coroutine whose wait is over */
+static void run_polled(CoroScheduleQueue *queue) {
+    /* Any of them may have been cancelled since the last pass */
+    uint32_t cancels    = atomic_load(&n_cancels);
+    bool     look_past  = cancels != queue->cancels_seen;
+    queue->cancels_seen = cancels;
+
+    /* Compacted in place, keeping the order */
+    size_t n_kept = 0;
+    for (size_t i = 0; i < queue->n_polls; i++) {
+        CoroPollEntry entry = queue->polls[i];
+        CoroState *   state = entry.state;
+        /* The state is not touched while the condition is clear */
+        bool waiting = (entry.condition != NULL && !look_past)
+                               ? !Condition_get(entry.condition)
+                               : needs_polling(state->status)
+                                         && !wait_over(state);
+        if (waiting) {
+            queue->polls[n_kept++] = entry;
+            continue;
+        }
+        state->polled = false;
+        /* It may have been resumed from the ready queue in the meantime */
+        if (needs_polling(state->status)) {
+            WaitReadyQueue_append(&queue->ready, &state->waiter);
+        }
+    }
+    queue->n_polls = n_kept;
+
+    CoroState *state = queue->polled;
+    queue->polled    = NULL;
+    while (state != NULL) {
+        CoroState *next = state->next_polled;
+        state->polled   = false;
+        /* It may have been resumed from the ready queue in the meantime */
+        if (needs_polling(state->status)) {
+            if (wait_over(state)) {
+                WaitReadyQueue_append(&queue->ready, &state->waiter);
+            } else {
+                poll_later(queue, state);
             }
-            break;
-        case CORO_STATUS_WAIT_SUBCORO:
-            if (state->wait.sub_coroutine->status == CORO_STATUS_FINALIZE) {
-                execute(state);
+        }
+        state = next;
+    }
+}
+
+
+/** Give back the slots of finalized states, wherever they are */
+static void release_finalized(CoroScheduleQueue *queue) {
+    Waiter *waiter   = queue->finalized;
+    queue->finalized = NULL;
+    while (waiter != NULL) {
+        Waiter *next = waiter->next;
+        CoroState *state = STATE_OF_WAITER(waiter);
+        /* It may have been stolen from another worker */
+        SlotPool_free(state->storage, state);
+        waiter = next;
+    }
+}
+
+
+#if CONF_CORO_POLICIES
+void CoroScheduleQueue_set_policy(CoroScheduleQueue *queue,
+                                  CoroPolicy         policy,
+                                  int64_t            quantum) {
+    assert(policy == CORO_POLICY_STRICT || quantum > 0);
+    queue->policy  = policy;
+    queue->quantum = quantum;
+    queue->budget  = quantum;
+}
+
+
+void CoroScheduleQueue_set_max_wait(CoroScheduleQueue *queue,
+                                    uint64_t           cycles) {
+    queue->max_wait = cycles;
+}
+
+
+/** \brief The ready queue of \p schedule passed over for longer than its
+ * max_wait at \p now, the highest if several
+ * \return Its index, or -1 if there is none
+ */
+static int aged_queue(CoroSchedule *schedule, uint32_t ready, uint64_t now) {
+    uint32_t passed = schedule->passed & ready;
+    while (passed != 0) {
+        int                index = __builtin_clz(passed);
+        CoroScheduleQueue *queue = schedule->queues[index];
+        if (queue->max_wait != 0
+            && now - queue->passed_at >= queue->max_wait) {
+#if CONF_CORO_STATS
+            stats_write_begin(&schedule->stats_seq);
+            schedule->stats.n_aged++;
+            stats_write_end(&schedule->stats_seq);
+#endif
+            return index;
+        }
+        passed &= ~QUEUE_BIT(index);
+    }
+    return -1;
+}
+
+
+/** \brief Start a new round: give the exhausted queues of \p schedule
+ * their quantum again */
+static void new_round(CoroSchedule *schedule) {
+    uint32_t exhausted = schedule->exhausted;
+    while (exhausted != 0) {
+        int                index = __builtin_clz(exhausted);
+        CoroScheduleQueue *queue = schedule->queues[index];
+        if (queue->policy == CORO_POLICY_DEFICIT) {
+            /* An overrun of the last round is paid back */
+            queue->budget += queue->quantum;
+        } else {
+            queue->budget = queue->quantum;
+        }
+        if (queue->policy == CORO_POLICY_STRICT || queue->budget > 0) {
+            schedule->exhausted &= ~QUEUE_BIT(index);
+        }
+        exhausted &= ~QUEUE_BIT(index);
+    }
+}
+
+
+/** \brief Charge the step of \p cycles just served from the queue at
+ * \p index of \p schedule to its quantum */
+static void charge(CoroSchedule *schedule, int index, uint64_t cycles) {
+    CoroScheduleQueue *queue = schedule->queues[index];
+    switch (queue->policy) {
+    case CORO_POLICY_STRICT:
+        /* Only held back if served in place of exhausted higher queues */
+        if (schedule->exhausted & ~((QUEUE_BIT(index) << 1) - 1)) {
+            schedule->exhausted |= QUEUE_BIT(index);
+        }
+        return;
+    case CORO_POLICY_WEIGHTED: queue->budget -= 1; break;
+    case CORO_POLICY_DEFICIT: queue->budget -= (int64_t)cycles; break;
+    }
+    if (queue->budget <= 0) { schedule->exhausted |= QUEUE_BIT(index); }
+}
+#endif
+
+
+#if TRACK_PASSED
+/** \brief Note that the queue at \p index of \p schedule is served at
+ * \p now, and the other \p ready ones passed over */
+static void pass_over(CoroSchedule *schedule,
+                      int           index,
+                      uint32_t      ready,
+                      uint64_t      now) {
+#if CONF_CORO_STATS
+    /* Counted while they wait, so that those starving show */
+    uint32_t waited = schedule->passed;
+    if (waited != 0) { stats_write_begin(&schedule->stats_seq); }
+    for (uint32_t bits = waited; bits != 0;) {
+        int       next  = __builtin_clz(bits);
+        uint64_t  delay = now - schedule->queues[next]->passed_at;
+        uint64_t *max   = &schedule->stats.max_delay_cycles[next];
+        if (delay > *max) { *max = delay; }
+        bits &= ~QUEUE_BIT(next);
+    }
+    if (waited != 0) { stats_write_end(&schedule->stats_seq); }
+#endif
+    uint32_t newly = ready & ~schedule->passed & ~QUEUE_BIT(index);
+    for (uint32_t bits = newly; bits != 0;) {
+        int next = __builtin_clz(bits);
+        schedule->queues[next]->passed_at = now;
+        bits &= ~QUEUE_BIT(next);
+    }
+    /* Those no longer ready were served by someone else (stolen) */
+    schedule->passed = (schedule->passed | newly) & ready & ~QUEUE_BIT(index);
+}
+#endif
+
+
+/** \brief The queue of \p schedule to serve next at \p now, given its
+ * \p ready bitmap
+ *
+ * The highest priority ready queue, unless a raised one is higher. With
+ * #CONF_CORO_POLICIES, one that aged comes first, and those that used up
+ * their quantum wait for the next round.
+ */
+static int pick_queue(CoroSchedule *schedule, uint32_t ready, uint64_t now) {
+    if (CONF_CORO_N_PRIORITIES == 1) { return 0; }
+#if CONF_CORO_POLICIES
+    int aged = aged_queue(schedule, ready, now);
+    if (aged >= 0) { return aged; }
+    uint32_t open = ready & ~schedule->exhausted;
+    if (open == 0) {
+        new_round(schedule);
+        open = ready & ~schedule->exhausted;
+        /* Still paying back overruns */
+        if (open == 0) { open = ready; }
+    }
+    int best = __builtin_clz(open);
+#else
+    (void)now;
+    int best = __builtin_clz(ready);
+#endif
+    int      picked = best;
+    uint32_t raised = atomic_load(&schedule->raised) & ready;
+    while (raised != 0) {
+        int      index = __builtin_clz(raised);
+        uint32_t level = atomic_load(&schedule->queues[index]->raised);
+        if (level != 0 && __builtin_clz(level) < best) {
+            best   = __builtin_clz(level);
+            picked = index;
+        }
+        raised &= ~QUEUE_BIT(index);
+    }
+    return picked;
+}
+
+
+/** \brief Stop serving \p queue of \p schedule at a raised priority */
+static void lower(CoroSchedule *schedule, CoroScheduleQueue *queue) {
+    if (atomic_load(&queue->raised) != 0) {
+        atomic_store(&queue->raised, 0);
+        atomic_fetch_and(&schedule->raised, ~queue->ready.summary_bit);
+    }
+}
+
+
+/** \brief Execute one step of the oldest ready coroutine of the highest
+ * priority
+ * \return \c false if no coroutine is ready
+ */
+static bool run_highest(CoroSchedule *schedule, bool shared) {
+    uint32_t ready;
+    while ((ready = atomic_load(&schedule->ready)) != 0) {
+#if TRACK_PASSED
+        uint64_t started = CONF_CORO_STATS_CYCLES();
+#else
+        uint64_t started = 0;
+#endif
+        int                index  = pick_queue(schedule, ready, started);
+        CoroScheduleQueue *queue  = schedule->queues[index];
+        Waiter *           waiter = WaitReadyQueue_pop(&queue->ready);
+        if (waiter == NULL || STATE_OF_WAITER(waiter)->holding != NULL) {
+            /* The owner it was raised for has run (or has moved) */
+            lower(schedule, queue);
+        }
+        if (waiter != NULL) {
+            CoroState *state = STATE_OF_WAITER(waiter);
+#if TRACK_PASSED
+            pass_over(schedule, index, ready, started);
+#endif
+            size_t n_transfers = 0;
+            do {
+                CoroState *sub;
+                CoroStatus status = execute(state, &sub);
+                CoroState *next   = NULL;
+                if (status == CORO_STATUS_FINALIZE) {
+                    next = finish(state, &queue->ready, JOINED);
+                } else if (status == CORO_STATUS_YIELDED) {
+                    next = hand_back(state, &queue->ready);
+                } else if (sub != NULL) {
+                    next = take_over(sub,
+                                     &queue->ready,
+                                     n_transfers++ < CONF_CORO_MAX_TRANSFERS);
+                }
+                settle(queue, state, status, shared);
+                /* Symmetric transfer to the coroutine awaiting it, or to
+                 * the one it awaits */
+                state = next;
+            } while (state != NULL);
+#if TRACK_PASSED
+            uint64_t stopped = CONF_CORO_STATS_CYCLES();
+#endif
+#if CONF_CORO_POLICIES
+            charge(schedule, index, stopped - started);
+#endif
+#if CONF_CORO_STATS
+            stats_write_begin(&schedule->stats_seq);
+            schedule->stats.n_steps++;
+            schedule->stats.run_cycles += stopped - started;
+            stats_write_end(&schedule->stats_seq);
+#endif
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/** \brief Move about half of the coroutines \p victim has woken at
+ * \p priority to \p thief
+ * \return \c false if there were none
+ */
+static bool steal(CoroSchedule *victim, CoroSchedule *thief, int priority) {
+    WaitReadyQueue *from = &victim->queues[priority]->ready;
+    WaitReadyQueue *to   = &thief->queues[priority]->ready;
+    /* Only the owner pops from its local list, but anyone may take all of
+     * the incoming list at once */
+    Waiter *list = atomic_exchange(&from->incoming, NULL);
+    if (list == NULL) { return false; }
+
+    Waiter *first = NULL;
+    Waiter *last  = NULL;
+    bool    keep  = true;
+    while (list != NULL) {
+        Waiter *next = list->next;
+        if (keep) {
+            /* Not armed, so nobody else looks at it */
+            list->ready = to;
+            if (STATE_OF_WAITER(list)->holding != NULL) {
+                atomic_store(&STATE_OF_WAITER(list)->holding->owner_queue,
+                             to);
+            }
+            WaitReadyQueue_append(to, list);
+        } else {
+            if (last == NULL) {
+                first = list;
             } else {
-                execute_once(state->wait.sub_coroutine);
+                last->next = list;
             }
-            break;
+            last = list;
         }
+        keep = !keep;
+        list = next;
+    }
+    if (first != NULL) { WaitReadyQueue_give_back(from, first, last); }
+    return true;
+}
+
+
+/** \brief Steal from the worker with the highest priority ready coroutines
+ * if that is higher than any ready on worker \p self */
+static void steal_higher(CoroWorkers *workers, size_t self) {
+    CoroSchedule *mine = workers->schedules[self];
+    uint32_t      own  = atomic_load(&mine->ready);
+    int           best = (own != 0) ? __builtin_clz(own) : CORO_MAX_PRIORITIES;
+
+    for (size_t i = 1; i < workers->n_workers; i++) {
+        size_t        other  = (self + i) % workers->n_workers;
+        CoroSchedule *victim = workers->schedules[other];
+        uint32_t      theirs = atomic_load(&victim->ready);
+        /* Their bit may also stand for coroutines only they can pop */
+        if (theirs != 0 && __builtin_clz(theirs) < best
+            && steal(victim, mine, __builtin_clz(theirs))) {
+            best = __builtin_clz(theirs);
+        }
+    }
+}
+
+
+/** Poll the waits of \p schedule and give back its finalized states */
+static void poll_all(CoroSchedule *schedule) {
+#if CONF_CORO_STATS
+    stats_write_begin(&schedule->stats_seq);
+    schedule->stats.n_passes++;
+    stats_write_end(&schedule->stats_seq);
+#endif
+    /* Both return at once unless something is pending for them, e.g. a
+     * timer that is due, so that a wake costs no system call */
+    Timer_poll();
+    CoroIo_poll();
+    for (size_t i = 0; i < N_PRIORITIES(schedule); i++) {
+        run_polled(schedule->queues[i]);
     }
+    for (size_t i = 0; i < N_PRIORITIES(schedule); i++) {
+        release_finalized(schedule->queues[i]);
+    }
+}
+
+
+/** Sleep until a wake is raised after \p epoch or the next timer is due */
+static void idle_wait(CoroSchedule *schedule, uint32_t epoch) {
+#if CONF_CORO_STATS
+    uint64_t started = CONF_CORO_STATS_CYCLES();
+#else
+    (void)schedule;
+#endif
+    CoroIdle_wait(epoch, Timer_next_deadline());
+#if CONF_CORO_STATS
+    uint64_t stopped = CONF_CORO_STATS_CYCLES();
+    stats_write_begin(&schedule->stats_seq);
+    schedule->stats.n_idle_waits++;
+    schedule->stats.idle_cycles += stopped - started;
+    stats_write_end(&schedule->stats_seq);
+#endif
 }
 
 
 void __attribute__((noreturn)) schedule_mainloop(CoroSchedule *schedule) {
+    static const _Atomic bool never = false;
     do {
-        for (size_t i = 0; i < schedule->n_priorities; i++) {
-            /* For every priority queue */
-            CoroScheduleQueue *queue = schedule->queues[i];
-            /* Acquire all readable elements */
-            while (NestedQueue_read_acquire(queue) != NULL)
-                ;
-
-            /* And iterate over them all */
-            NestedQueueIterator iter  = NestedQueueIterator_init_read(queue);
-            CoroState *         state = NULL;
-            for (state = NestedQueueIterator_next(&iter); state != NULL;
-                 state = NestedQueueIterator_next(&iter)) {
-                execute_once(state);
-                if (state->status == CORO_STATUS_FINALIZE) {
-                    /* will silently fail if not the oldest inserted
-                     * state */
-                    NestedQueue_read_release(queue, state);
-                }
-            }
+        schedule_mainloop_until(schedule, &never);
+    } while (true);
+}
+
+
+void schedule_mainloop_until(CoroSchedule *      schedule,
+                             const _Atomic bool *stop) {
+    assert(schedule->n_priorities <= CORO_MAX_PRIORITIES
+           && schedule->n_priorities == N_PRIORITIES(schedule));
+    while (!atomic_load(stop)) {
+        /* Any wake raised from here on cancels the idle wait below */
+        uint32_t epoch = CoroIdle_epoch();
+        poll_all(schedule);
+
+        /* Polled waits can only end after a wake was raised, so there is no
+         * need to poll again until then */
+        bool idle = true;
+        while (!atomic_load(stop) && CoroIdle_epoch() == epoch
+               && run_highest(schedule, false)) {
+            idle = false;
+        }
+        if (idle) { idle_wait(schedule, epoch); }
+    }
+}
+
+
+size_t schedule_run_steps(CoroSchedule *schedule, size_t max_steps) {
+    assert(schedule->n_priorities <= CORO_MAX_PRIORITIES
+           && schedule->n_priorities == N_PRIORITIES(schedule));
+    size_t n_steps = 0;
+    while (n_steps < max_steps) {
+        uint32_t epoch = CoroIdle_epoch();
+        poll_all(schedule);
+        size_t n_before = n_steps;
+        while (n_steps < max_steps && CoroIdle_epoch() == epoch
+               && run_highest(schedule, false)) {
+            n_steps++;
+        }
+        /* A wake raised meanwhile may have ended a polled wait */
+        if (n_steps == n_before && CoroIdle_epoch() == epoch) { break; }
+    }
+    return n_steps;
+}
+
+
+bool schedule_run_once(CoroSchedule *schedule) {
+    assert(schedule->n_priorities <= CORO_MAX_PRIORITIES
+           && schedule->n_priorities == N_PRIORITIES(schedule));
+    uint32_t epoch = CoroIdle_epoch();
+    poll_all(schedule);
+    if (run_highest(schedule, false)) { return true; }
+    idle_wait(schedule, epoch);
+    return false;
+}
+
+
+/** \brief Make the ready queues of \p schedule flag it when not empty
+ *
+ * Coroutines may be stolen, or raised, onto queues nothing was ever added to.
+ * Only written once, as other workers may already be stealing from them.
+ */
+static void link_queues(CoroSchedule *schedule) {
+    for (size_t i = 0; i < N_PRIORITIES(schedule); i++) {
+        WaitReadyQueue *ready = &schedule->queues[i]->ready;
+        if (ready->summary != &schedule->ready) {
+            ready->summary     = &schedule->ready;
+            ready->summary_bit = UINT32_C(1) << (31 - i);
+        }
+    }
+}
+
+
+void __attribute__((noreturn))
+schedule_worker_mainloop(CoroWorkers *workers, size_t self) {
+    CoroSchedule *schedule = workers->schedules[self];
+    assert(self < workers->n_workers);
+    assert(schedule->n_priorities <= CORO_MAX_PRIORITIES
+           && schedule->n_priorities == N_PRIORITIES(schedule));
+    link_queues(schedule);
+    do {
+        uint32_t epoch = CoroIdle_epoch();
+        poll_all(schedule);
+
+        bool idle = true;
+        while (CoroIdle_epoch() == epoch) {
+            steal_higher(workers, self);
+            if (!run_highest(schedule, true)) { break; }
+            idle = false;
         }
+        if (idle) { idle_wait(schedule, epoch); }
     } while (true);
 }
+
+
+/** Initialize \p state to run \p function from the start */
+static void init_state(CoroState *     state,
+                       coroutine *     function,
+                       void *          vars,
+                       WaitReadyQueue *ready,
+                       int             priority,
+                       SlotPool *      storage) {
+    /* func is const, so the state can only be initialized as a whole */
+    memcpy(state,
+           &(CoroState){
+                   .label          = NULL,
+                   .vars           = vars,
+                   .func           = function,
+                   .status         = CORO_STATUS_SUSPENDED,
+                   .timed_wait     = false,
+                   .timeout        = {.waiter = &state->waiter},
+                   .waiter         = {.ready = ready},
+                   .wait_node      = {.waiter = &state->waiter},
+                   .storage        = storage,
+                   .continuation   = NULL,
+                   .parking        = false,
+                   .priority       = (uint8_t)priority,
+                   .holding        = NULL,
+                   .holding_as     = NULL,
+                   .cancel         = 0,
+                   .on_cancel      = NULL,
+                   .deadline_timer = {.waiter = &state->waiter},
+                   .deadline       = NULL,
+                   .frame_end      = NULL,
+                   .frames_end     = NULL,
+                   .yield_to       = NULL,
+                   .yield_size     = 0,
+           },
+           sizeof(*state));
+#if CONF_CORO_STATS
+    /* Ready from now on */
+    state->stats_parked_at = CONF_CORO_STATS_CYCLES();
+#endif
+}
+
+
+CoroState *Coro_add_new(CoroSchedule *schedule,
+                        coroutine *   function,
+                        void *        vars,
+                        int           priority) {
+    assert(priority >= 0 && (size_t)priority < N_PRIORITIES(schedule));
+    assert(priority < CORO_MAX_PRIORITIES);
+    CoroScheduleQueue *queue = schedule->queues[priority];
+    CoroState *        state = SlotPool_alloc(&queue->states);
+    if (state == NULL) { return NULL; }
+    link_queues(schedule);
+    init_state(state, function, vars, &queue->ready, priority, &queue->states);
+
+    /* Runs as soon as its priority is the highest ready one */
+    Waiter_arm(&state->waiter);
+    Waiter_wake(&state->waiter);
+    return state;
+}
+
+
+void Coro_init_sub(CoroState *state, coroutine *function, void *vars) {
+    /* Scheduled at the priority of the coroutine awaiting it */
+    init_state(state, function, vars, NULL, 0, NULL);
+}
+
+
+void Coro_cancel(CoroState *state) {
+    atomic_fetch_or(&state->cancel, CORO_CANCEL_REQUESTED);
+    atomic_fetch_add(&n_cancels, 1);
+    /* Ends a wait it is woken from. Polled ones end on the next pass. */
+    Waiter_wake(&state->waiter);
+    CoroIdle_notify();
+}
+
+
+bool Coro_is_finalized(CoroState *state) {
+    return atomic_load(&state->continuation) == JOINED;
+}
+
+
+bool Coro_set_deadline(CoroState *state, timer_ms_t milliseconds) {
+    if (state->deadline == &state->deadline_timer) {
+        Timer_cancel(&state->deadline_timer);
+    }
+    state->deadline = &state->deadline_timer;
+    bool started    = Timer_start_new(&state->deadline_timer, milliseconds);
+    /* Expired already otherwise, so cancelled as it resumes */
+    atomic_fetch_or(&state->cancel,
+                    started ? CORO_CANCEL_DEADLINE
+                            : CORO_CANCEL_DEADLINE | CORO_CANCEL_NO_TIMER);
+    return started;
+}
+
+
+
+/** \brief Take a new coroutine for \p queue of \p schedule from \p pool
+ * \param vars initial value of its variables, or \c NULL
+ * \return Its state, not made ready yet, or \c NULL if \p pool is exhausted
+ */
+static CoroState *take_pooled(CoroSchedule *schedule,
+                              CoroPool *    pool,
+                              int           priority,
+                              const void *  vars) {
+    CoroState *state = SlotPool_alloc(&pool->entries);
+    if (state == NULL) { return NULL; }
+    /* The state comes first in an entry, so finalizing it frees the entry */
+    void *state_vars = (char *)state + pool->vars_offset;
+    if (vars != NULL) { memcpy(state_vars, vars, pool->vars_size); }
+    init_state(state,
+               pool->function,
+               state_vars,
+               &schedule->queues[priority]->ready,
+               priority,
+               &pool->entries);
+    return state;
+}
+
+
+CoroState *Coro_add_pooled(CoroSchedule *schedule,
+                           CoroPool *    pool,
+                           int           priority,
+                           const void *  vars) {
+    assert(priority >= 0 && (size_t)priority < N_PRIORITIES(schedule));
+    assert(priority < CORO_MAX_PRIORITIES);
+    CoroState *state = take_pooled(schedule, pool, priority, vars);
+    if (state == NULL) { return NULL; }
+    link_queues(schedule);
+
+    Waiter_arm(&state->waiter);
+    Waiter_wake(&state->waiter);
+    return state;
+}
+
+
+/** \brief Place a frame of \p vars_size bytes of variables at \p start,
+ * before \p end
+ * \param vars initial value of the variables, or \c NULL for zeros
+ * \return Its state, or \c NULL if it does not fit
+ */
+static CoroState *place_frame(char *      start,
+                              char *      end,
+                              const void *vars,
+                              size_t      vars_size) {
+    char *state_vars = start + CORO_FRAME_ALIGN(sizeof(CoroState));
+    if (state_vars > end || vars_size > (size_t)(end - state_vars)) {
+        return NULL;
+    }
+    if (vars != NULL) {
+        memcpy(state_vars, vars, vars_size);
+    } else {
+        memset(state_vars, 0, vars_size);
+    }
+    return (CoroState *)start;
+}
+
+
+CoroState *Coro_add_framed(CoroSchedule *schedule,
+                           coroutine *   function,
+                           const void *  vars,
+                           size_t        vars_size,
+                           int           priority) {
+    assert(priority >= 0 && (size_t)priority < N_PRIORITIES(schedule));
+    assert(priority < CORO_MAX_PRIORITIES);
+    assert(schedule->arena != NULL);
+    char *slot = SlotPool_alloc(schedule->arena);
+    if (slot == NULL) { return NULL; }
+    char *     slot_end = slot + schedule->arena->elem_size;
+    CoroState *state    = place_frame(slot, slot_end, vars, vars_size);
+    if (state == NULL) {
+        assert(!"the frame does not fit a slot of the arena");
+        SlotPool_free(schedule->arena, slot);
+        return NULL;
+    }
+    link_queues(schedule);
+    /* The state comes first in the slot, so finalizing it frees the slot */
+    init_state(state,
+               function,
+               slot + CORO_FRAME_ALIGN(sizeof(CoroState)),
+               &schedule->queues[priority]->ready,
+               priority,
+               schedule->arena);
+    state->frame_end  = (char *)state->vars + CORO_FRAME_ALIGN(vars_size);
+    state->frames_end = slot_end;
+
+    Waiter_arm(&state->waiter);
+    Waiter_wake(&state->waiter);
+    return state;
+}
+
+
+CoroState *Coro_call_framed(CoroState * caller,
+                            coroutine * function,
+                            const void *vars,
+                            size_t      vars_size) {
+    assert(caller->frame_end != NULL
+           && "only coroutines added with Coro_add_framed may call");
+    /* It would go on without the call otherwise */
+    if (caller->frame_end == NULL) { abort(); }
+    CoroState *state = place_frame(
+            caller->frame_end, caller->frames_end, vars, vars_size);
+    if (state == NULL) {
+        /* Resumed at its clean up once it suspends, see execute() */
+        uint8_t cancel = atomic_load(&caller->cancel);
+        atomic_fetch_or(&caller->cancel,
+                        (cancel & CORO_CANCEL_DELIVERED)
+                                ? CORO_CANCEL_FINALIZE
+                                : CORO_CANCEL_REQUESTED
+                                          | CORO_CANCEL_NO_FRAME);
+        return NULL;
+    }
+    Coro_init_sub(state,
+                  function,
+                  caller->frame_end + CORO_FRAME_ALIGN(sizeof(CoroState)));
+    state->frame_end  = (char *)state->vars + CORO_FRAME_ALIGN(vars_size);
+    state->frames_end = caller->frames_end;
+    return state;
+}
+
+
+size_t Coro_add_batch(CoroSchedule *schedule,
+                      CoroPool *    pool,
+                      int           priority,
+                      const void *  vars,
+                      size_t        n_coroutines) {
+    assert(priority >= 0 && (size_t)priority < N_PRIORITIES(schedule));
+    assert(priority < CORO_MAX_PRIORITIES);
+    /* Chained newest first, like the incoming list of the ready queue */
+    Waiter *newest = NULL;
+    Waiter *oldest = NULL;
+    size_t  added  = 0;
+    for (; added < n_coroutines; added++) {
+        CoroState *state = take_pooled(
+                schedule,
+                pool,
+                priority,
+                (vars != NULL)
+                        ? (const char *)vars + added * pool->vars_size
+                        : NULL);
+        if (state == NULL) { break; }
+        /* Not armed, so nobody else looks at it */
+        state->waiter.next = newest;
+        newest             = &state->waiter;
+        if (oldest == NULL) { oldest = newest; }
+    }
+    if (newest != NULL) {
+        link_queues(schedule);
+        WaitReadyQueue_give_back(
+                &schedule->queues[priority]->ready, newest, oldest);
+    }
+    return added;
+}
+
+
+void Coro_park_restored(CoroSchedule *schedule,
+                        CoroState *   state,
+                        int           priority,
+                        SlotPool *    storage) {
+    assert(priority >= 0 && (size_t)priority < N_PRIORITIES(schedule));
+    assert(priority < CORO_MAX_PRIORITIES);
+    CoroScheduleQueue *queue = schedule->queues[priority];
+    link_queues(schedule);
+    state->priority     = (uint8_t)priority;
+    state->storage      = storage;
+    state->waiter.ready = &queue->ready;
+    if (state->status == CORO_STATUS_SUSPENDED) {
+        Waiter_arm(&state->waiter);
+        Waiter_wake(&state->waiter);
+    } else if (needs_polling(state->status)) {
+        poll_later(queue, state);
+    } else {
+        /* Never one that awaits a sub-coroutine */
+        (void)park(state, state->status);
+    }
+}
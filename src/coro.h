@@ -6,15 +6,15 @@
 #ifndef CORO_H
 #define CORO_H 1
 
+#include <assert.h>
 #include <stddef.h>
 #include <stdbool.h>
-#include "../lib/aint-safe/src/nested_queue.h"
+#include "slot_pool.h"
 #include "timer_interface.h"
 #include "resource.h"
-
-_Static_assert(
-        __GNUC__,
-        "gcc is required with support for computed goto's and labels as values");
+#include "channel.h"
+#include "event.h"
+#include "io.h"
 
 typedef enum {
     CORO_STATUS_FINALIZE,
@@ -23,8 +23,159 @@ typedef enum {
     CORO_STATUS_WAIT_CONDITION,
     CORO_STATUS_WAIT_RESOURCE,
     CORO_STATUS_WAIT_SUBCORO,
+    CORO_STATUS_WAIT_WAKE_CONDITION,
+    /** Waiting on several waitables that all wake it */
+    CORO_STATUS_WAIT_MANY,
+    /** Waiting on several waitables, some of which must be polled */
+    CORO_STATUS_WAIT_MANY_POLLED,
+    /** Queued on a #QueuedResource until it is handed over */
+    CORO_STATUS_WAIT_QUEUED_RESOURCE,
+    /** Waiting for a #Channel to have a free slot or an item */
+    CORO_STATUS_WAIT_CHANNEL,
+    /** Waiting for a #CoroIo to complete */
+    CORO_STATUS_WAIT_IO,
+    /** Yielded a value to the coroutine awaiting it (see
+     * #CORO_YIELD_VALUE_EXPLICIT), and off any schedule until awaited again */
+    CORO_STATUS_YIELDED,
 } CoroStatus;
 
+/** Number of #CoroStatus values (keep in sync with the last one) */
+#define CORO_N_STATUSES (CORO_STATUS_YIELDED + 1)
+
+
+#ifndef CONF_CORO_N_PRIORITIES
+/** Number of priority levels of every #CoroSchedule, if fixed at build time
+ * so that the scheduler loops over a constant and, with 1, skips priority
+ * inheritance. 0 leaves it to CoroSchedule::n_priorities. */
+#define CONF_CORO_N_PRIORITIES 0
+#endif
+
+/* The waits a build supports. The scheduler leaves out the handling of those
+ * set to 0, which must then not be used (as assertions check). */
+#ifndef CONF_CORO_WAIT_MANY
+/** Waits on several waitables (#CORO_AWAIT_ALL and #CORO_AWAIT_ANY) */
+#define CONF_CORO_WAIT_MANY 1
+#endif
+#ifndef CONF_CORO_WAIT_QUEUED_RESOURCE
+/** Waits on a #QueuedResource, alone or among others */
+#define CONF_CORO_WAIT_QUEUED_RESOURCE 1
+#endif
+#ifndef CONF_CORO_WAIT_CHANNEL
+/** Waits on a #Channel, alone or among others */
+#define CONF_CORO_WAIT_CHANNEL 1
+#endif
+#ifndef CONF_CORO_WAIT_IO
+/** Waits on a #CoroIo, alone or among others */
+#define CONF_CORO_WAIT_IO 1
+#endif
+
+
+#ifndef CONF_CORO_SWITCH_DISPATCH
+/** Resume coroutines through a \c switch on the line of their resume point
+ * instead of a computed goto to it, which needs labels as values. Every
+ * coroutine must then end with #CORO_END, and may not wait inside a
+ * \c switch of its own. */
+#define CONF_CORO_SWITCH_DISPATCH 0
+#endif
+
+#if !CONF_CORO_SWITCH_DISPATCH
+_Static_assert(
+        __GNUC__,
+        "gcc is required with support for computed goto's and labels as values");
+#endif
+
+
+#ifndef CONF_CORO_STATS
+/** Collect run time statistics of coroutines and schedules (see #CoroStats
+ * and #CoroScheduleStats). Nothing of it is compiled in when 0. */
+#define CONF_CORO_STATS 0
+#endif
+
+#ifndef CONF_CORO_POLICIES
+/** Scheduling policies besides strict priority, and aging, for the queues
+ * of a schedule (see #CoroScheduleQueue_set_policy). Nothing of it is
+ * compiled in when 0. */
+#define CONF_CORO_POLICIES 0
+#endif
+
+#ifndef CONF_CORO_MAX_TRANSFERS
+/** Number of sub-coroutines (e.g. generators, see #CORO_AWAIT_NEXT_EXPLICIT)
+ * a step may start in place of the coroutines awaiting them, before those
+ * it starts go through the ready queue and the scheduler chooses again */
+#define CONF_CORO_MAX_TRANSFERS 64
+#endif
+
+
+/** Maximum number of priority levels of a #CoroSchedule */
+#define CORO_MAX_PRIORITIES 32
+
+#if CONF_CORO_STATS || CONF_CORO_POLICIES
+#ifndef CONF_CORO_STATS_CYCLES
+#if defined(__x86_64__) || defined(__i386__)
+/** Expression reading a free running 64 bit cycle counter, e.g.
+ * \c DWT->CYCCNT on a Cortex-M (extended to 64 bits). The policies of
+ * #CONF_CORO_POLICIES measure time with it too. */
+#define CONF_CORO_STATS_CYCLES() __builtin_ia32_rdtsc()
+#elif defined(__aarch64__)
+static inline uint64_t CoroStats_cntvct(void) {
+    uint64_t count;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(count));
+    return count;
+}
+#define CONF_CORO_STATS_CYCLES() CoroStats_cntvct()
+#else
+#error "define CONF_CORO_STATS_CYCLES() to read a cycle counter"
+#endif
+#endif
+#endif
+
+#if CONF_CORO_STATS
+
+
+/** \brief Run time statistics of a coroutine
+ *
+ * Times are in units of #CONF_CORO_STATS_CYCLES. Read with
+ * #CoroStats_snapshot.
+ */
+typedef struct {
+    /** Number of times it was executed */
+    uint32_t n_resumes;
+    /** Number of times it acquired a resource by preempting its owner */
+    uint32_t n_preemptions;
+    /** Time spent executing it */
+    uint64_t run_cycles;
+    /** Time spent between two executions, by the status it waited in.
+     * \c CORO_STATUS_SUSPENDED is time spent ready to run. */
+    uint64_t wait_cycles[CORO_N_STATUSES];
+} CoroStats;
+
+
+/** \brief Run time statistics of a schedule
+ *
+ * Times are in units of #CONF_CORO_STATS_CYCLES. Read with
+ * #CoroScheduleStats_snapshot.
+ */
+typedef struct {
+    /** Number of passes polling the waits of the schedule */
+    uint32_t n_passes;
+    /** Number of coroutine steps executed */
+    uint32_t n_steps;
+    /** Number of times the schedule went idle */
+    uint32_t n_idle_waits;
+    /** Time spent executing coroutines */
+    uint64_t run_cycles;
+    /** Time spent idle */
+    uint64_t idle_cycles;
+    /** Longest time each priority had ready coroutines but was not served,
+     * from the first time another priority was served instead. Updated
+     * with every step while it waits, so that starvation shows. */
+    uint64_t max_delay_cycles[CORO_MAX_PRIORITIES];
+    /** Number of times a priority was served first because it had waited
+     * longer than CoroScheduleQueue::max_wait */
+    uint32_t n_aged;
+} CoroScheduleStats;
+#endif
+
 
 /* Forward declaration */
 typedef struct CoroState CoroState;
@@ -34,13 +185,109 @@ typedef struct CoroState CoroState;
 typedef void coroutine(CoroState *state, void *vars);
 
 
+/** \brief Data specific to wait on a resource */
+typedef struct {
+    /** The resource to acquire */
+    Resource *resource;
+    /** The queued resource to acquire instead */
+    QueuedResource *queued;
+    /** The owner instance acquiring the resource. Its priority orders the
+     * owners of the resource (the larger is the stronger), whatever the
+     * priority the coroutine is scheduled at. */
+    ResourceOwner *owner;
+    /** The return value if the resource is acquired passed to the
+     * coroutine */
+    RetResource_acquire retval;
+} CoroResourceWait;
+
+
+/** \brief Data specific to wait on a channel */
+typedef struct {
+    /** The channel */
+    Channel *channel;
+    /** Whether to wait for a free slot to send, instead of for an item */
+    bool send;
+} CoroChannelWait;
+
+
+/** Kinds of #CoroWaitable */
+typedef enum {
+    CORO_WAITABLE_CONDITION,
+    CORO_WAITABLE_WAKE_CONDITION,
+    CORO_WAITABLE_RESOURCE,
+    CORO_WAITABLE_QUEUED_RESOURCE,
+    CORO_WAITABLE_COROUTINE,
+    CORO_WAITABLE_CHANNEL,
+    CORO_WAITABLE_IO,
+} CoroWaitableKind;
+
+
+/** \brief One of several things awaited at once
+ *
+ * Make it with #CORO_WAITABLE and await an array of them with
+ * #CORO_AWAIT_ALL or #CORO_AWAIT_ANY. A #Condition or #Resource among them
+ * makes the whole wait polled, anything else wakes it.
+ *
+ * \note It must stay valid (e.g. in the variables of the coroutine) for the
+ * whole wait.
+ */
+typedef struct {
+    /** What it is */
+    CoroWaitableKind kind;
+    /** What to wait on */
+    union {
+        Condition *    condition;
+        WakeCondition *wake_condition;
+        /** The resource to acquire. \c retval is
+         * \c RESOURCE_ACQUIRE_FAILED unless it was acquired. */
+        CoroResourceWait resource;
+        /** A coroutine to wait for, started if it is a sub-coroutine */
+        CoroState *coroutine;
+        /** A channel to wait for a free slot or an item of */
+        CoroChannelWait channel;
+        /** An I/O operation to submit and wait for */
+        CoroIo *io;
+    } on;
+    /** Member of the join of the wait (private) */
+    Waiter waiter;
+    /** Registration on \c on.wake_condition or \c on.channel (private) */
+    WaitNode node;
+} CoroWaitable;
+
+
+/** Bits of CoroState::cancel */
+typedef enum {
+    /** #Coro_cancel was called on it */
+    CORO_CANCEL_REQUESTED = 1,
+    /** CoroState::deadline is set */
+    CORO_CANCEL_DEADLINE = 2,
+    /** It was resumed as cancelled. Its waits are no longer cut short. */
+    CORO_CANCEL_DELIVERED = 4,
+    /** It finalizes once the sub-coroutine it awaits again did */
+    CORO_CANCEL_FINALIZE = 8,
+    /** It was cancelled as the frame of a coroutine it called did not fit
+     * (see #Coro_call_framed) */
+    CORO_CANCEL_NO_FRAME = 16,
+    /** It was cancelled as no timer could be started for its timeout or
+     * deadline (see #Timer_start_new) */
+    CORO_CANCEL_NO_TIMER = 32,
+} CoroCancelBits;
+
+
 /** \brief Internal state of each coroutine
+ *
+ * Fields used to dispatch it come first and fit in one cache line, so a
+ * step of a coroutine that does not wait touches nothing else of its state.
+ * Polled waits are scanned through a #CoroPollEntry instead of the state.
  *
  * \note All instances of this struct should be treated as private. Use only
  * the functions exposed in this library to access this struct.
  */
 struct CoroState {
-    /** Pointer to the next label to resume from (computed goto) or NULL */
+    /* Dispatch: what a step of a coroutine that does not wait touches */
+
+    /** Pointer to the next label to resume from (computed goto), or its
+     * line with #CONF_CORO_SWITCH_DISPATCH, or NULL */
     void *label;
     /** Pointer to the function specific variables */
     void *vars;
@@ -50,36 +297,225 @@ struct CoroState {
     CoroStatus status;
     /** Whether a timeout is set */
     bool timed_wait;
-    /** The timer instance if a timeout is set */
+    /** Set while it is registered on what wakes it. It may be woken (onto
+     * the ready queue of another worker) meanwhile, but not executed. */
+    _Atomic bool parking;
+    /** Its cancellation, as #CoroCancelBits. Only looked at further when
+     * it is not 0. */
+    _Atomic uint8_t cancel;
+    /** Its own priority, 0 being the highest. It runs at a higher one while
+     * it holds \c holding and coroutines of that priority wait for it. */
+    uint8_t priority;
+    /** Link to the ready queue of the schedule (if any). A coroutine stolen
+     * by another worker moves to the ready queue of that worker. */
+    Waiter waiter;
+
+    /* Waits: only touched when it waits or is resumed from a wait */
+
+    /** The timer instance if a timeout is set. It wakes \c waiter. */
     Timer timeout;
+    /** Registration on the wait list of a #WakeCondition or #Channel */
+    WaitNode wait_node;
+    /** Whether this is on the polled coroutines of its queue */
+    bool polled;
+    /** Link in the list of polled coroutines of its queue that did not fit
+     * in its compact entries */
+    CoroState *next_polled;
+    /** The pool this state was taken from, \c NULL for a sub-coroutine
+     * initialized with #Coro_init_sub */
+    SlotPool *storage;
+    /** The waiter of the coroutine awaiting this one (or of a #CoroWaitable
+     * of it), woken as soon as this one finalizes */
+    Waiter *_Atomic continuation;
+    /** The queued resource it last acquired by awaiting it, or \c NULL */
+    QueuedResource *holding;
+    /** The owner instance it acquired \c holding as */
+    ResourceOwner *holding_as;
+    /** The label to resume from once cancelled (see
+     * #CORO_ON_CANCEL_EXPLICIT), or \c NULL to finalize instead */
+    void *on_cancel;
+    /** Its own deadline, if it set one. It wakes \c waiter. */
+    Timer deadline_timer;
+    /** The deadline it is cancelled at: \c deadline_timer, that of the
+     * coroutine it is a sub-coroutine of, or \c NULL */
+    Timer *deadline;
+    /** End of its frame (see #Coro_add_framed), where the frames of the
+     * coroutines it calls start, or \c NULL if it has none */
+    char *frame_end;
+    /** End of the arena slot its frame is in */
+    char *frames_end;
+    /** Where the coroutine awaiting it wants the next value it yields (see
+     * #CORO_AWAIT_NEXT_EXPLICIT) */
+    void *yield_to;
+    /** Size of what \c yield_to points to, which a yield must match */
+    size_t yield_size;
+#if CONF_CORO_STATS
+    /** Odd while \c stats is being updated */
+    _Atomic uint32_t stats_seq;
+    /** Statistics, only written by the scheduler executing it */
+    CoroStats stats;
+    /** When it last stopped executing */
+    uint64_t stats_parked_at;
+#endif
     /** Wait type specific data */
     union {
         /** The condition to wait for */
         Condition *condition;
+        /** The condition to be woken by */
+        WakeCondition *wake_condition;
         /** Data specific to wait on a resource */
-        struct {
-            /** The resource to acquire */
-            Resource *     resource;
-            /** The owner instance acquiring the resource */
-            ResourceOwner *owner;
-            /** The return value if the resource is acquired passed to the
-             * coroutine */
-            RetResource_acquire retval;
-        } resource;
+        CoroResourceWait resource;
+        /** Data specific to wait on a channel */
+        CoroChannelWait channel;
+        /** The I/O operation to wait for. It is cancelled if the wait
+         * times out. */
+        CoroIo *io;
         /** The coroutine to wait for
          *
-         * This may or may not be in the schedule and have any priority.
+         * This may be in any schedule at any priority, or be a sub-coroutine
+         * initialized with #Coro_init_sub, which then runs in place of the
+         * waiting coroutine.
          */
         CoroState *sub_coroutine;
+        /** Data specific to wait on several waitables */
+        struct {
+            /** The waitables */
+            CoroWaitable *waitables;
+            /** Number of \c waitables */
+            size_t n_waitables;
+            /** Whether any one of them is enough, instead of all */
+            bool any;
+            /** Counts their wakes down to the wake of this coroutine */
+            WaitJoin join;
+            /** When resumed, the index of the waitable that ended the wait,
+             * -1 if it timed out */
+            int winner;
+        } many;
     } wait;
 };
 
 
+#ifndef CONF_CORO_CACHE_LINE_SIZE
+/** Size of a cache line of the target, which the dispatch fields of a
+ * #CoroState must fit in */
+#define CONF_CORO_CACHE_LINE_SIZE 64
+#endif
+
+_Static_assert(offsetof(CoroState, waiter) + sizeof(Waiter)
+                       <= CONF_CORO_CACHE_LINE_SIZE,
+               "the dispatch fields of a CoroState must fit in a cache line");
+
+
+#ifndef CONF_CORO_DISPATCH
+/** Call that executes a step of \p state. Define it to the name of a
+ * dispatcher of the application (see #CORO_DISPATCH_CASE) to call the
+ * coroutines it knows directly, where it can inline them. */
+#define CONF_CORO_DISPATCH(state) ((state)->func((state), (state)->vars))
+#else
+/** The dispatcher of the application */
+void CONF_CORO_DISPATCH(CoroState *state);
+#endif
+
+/** \brief Execute \p state directly if it runs \p func_name, in a
+ * dispatcher of #CONF_CORO_DISPATCH
+ *
+ * \code{.c}
+ * void app_dispatch(CoroState *state) {
+ *     CORO_DISPATCH_CASE(state, blink);
+ *     CORO_DISPATCH_CASE(state, watch_button);
+ *     CORO_DISPATCH_DEFAULT(state);
+ * }
+ * \endcode
+ */
+#define CORO_DISPATCH_CASE(state, func_name) \
+    if ((state)->func == func_name) {        \
+        func_name((state), (state)->vars);   \
+        return;                              \
+    }
+
+/** \brief Execute \p state through its function pointer, for the
+ * coroutines a dispatcher does not know */
+#define CORO_DISPATCH_DEFAULT(state) (state)->func((state), (state)->vars)
+
+
+/** \brief Compact entry of a coroutine in a polled wait
+ *
+ * Each pass scans these instead of the (much larger) states, so waits that
+ * are not over cost a load of the entry and of what it polls. The state is
+ * only touched when the wait may be over, or for waits that need more than
+ * a look at a #Condition.
+ */
+typedef struct {
+    /** The #Condition of an untimed #CORO_STATUS_WAIT_CONDITION, the whole
+     * of what is polled. \c NULL if \c state must be looked at. */
+    Condition *condition;
+    /** The waiting coroutine */
+    CoroState *state;
+} CoroPollEntry;
+
+_Static_assert(sizeof(CoroPollEntry) <= 2 * sizeof(void *),
+               "a poll entry must stay within two pointers so that a cache "
+               "line holds several of them");
+
+
+#if CONF_CORO_POLICIES
+/** How a queue shares its schedule with lower priorities */
+typedef enum {
+    /** Served whenever it has ready coroutines (the default) */
+    CORO_POLICY_STRICT,
+    /** Served for CoroScheduleQueue::quantum steps per round at most */
+    CORO_POLICY_WEIGHTED,
+    /** Served for CoroScheduleQueue::quantum cycles per round, on average
+     * (deficit round robin: a step that overran is paid back next round) */
+    CORO_POLICY_DEFICIT,
+} CoroPolicy;
+#endif
+
+
 /** \brief A queue at a single priority
  *
  * \note Use #CORO_QUEUE_STATIC_INIT to initialize
  */
-typedef NestedQueue CoroScheduleQueue;
+typedef struct {
+    /** Storage for every #CoroState at this priority. The slot of a finalized
+     * state is given back as soon as coroutines polling it had a look. */
+    SlotPool states;
+    /** Coroutines that can run */
+    WaitReadyQueue ready;
+    /** Coroutines waiting on something that must be polled */
+    CoroPollEntry *const polls;
+    /** Number of entries \c polls has room for */
+    const size_t n_polls_max;
+    /** Number of entries of \c polls in use */
+    size_t n_polls;
+    /** Coroutines waiting on something that must be polled that did not fit
+     * in \c polls (e.g. sub-coroutines or coroutines of a #CoroPool) */
+    CoroState *polled;
+    /** Finalized states to give back to \c states */
+    Waiter *finalized;
+    /** Number of cancellations seen by the last pass over \c polls. Entries
+     * that only look at a #Condition are checked in full after another. */
+    uint32_t cancels_seen;
+    /** Priorities (bit 31 - priority) of coroutines waiting for a queued
+     * resource held by a coroutine on this queue. The queue is served at
+     * the highest of them until that coroutine runs. */
+    _Atomic uint32_t raised;
+#if CONF_CORO_POLICIES
+    /** How it shares the schedule, see #CoroScheduleQueue_set_policy */
+    CoroPolicy policy;
+    /** Steps or cycles (as of \c policy) it is served for per round */
+    int64_t quantum;
+    /** What is left of \c quantum this round */
+    int64_t budget;
+    /** Cycles it may wait to be served before it is served first, 0 for no
+     * limit (see #CoroScheduleQueue_set_max_wait) */
+    uint64_t max_wait;
+#endif
+#if CONF_CORO_STATS || CONF_CORO_POLICIES
+    /** When another queue was first served instead of this ready one */
+    uint64_t passed_at;
+#endif
+} CoroScheduleQueue;
 
 /** \brief Statically initialize a #CoroScheduleQueue
  *
@@ -90,7 +526,9 @@ typedef NestedQueue CoroScheduleQueue;
  *
  * \param p_queue the \e tentatively \e defined #CoroScheduleQueue to
  *                       initialize
- * \param p_n_elems      number of elements in \p data
+ * \param p_n_elems      number of elements in \p data (at most
+ *                       #SLOT_POOL_MAX_ELEMS), which is also the number of
+ *                       polled waits that are scanned compactly
  * \param p_data_array   data array (of #CoroState) of length \p p_n_elems
  *
  * \return A #CoroScheduleQueue static initialiizer
@@ -103,24 +541,67 @@ typedef NestedQueue CoroScheduleQueue;
  * \endcode
  */
 #define CORO_QUEUE_STATIC_INIT(p_queue, p_n_elems, p_data_array) \
-    NESTED_QUEUE_STATIC_INIT(p_queue,                            \
-                             sizeof(CoroState),                         \
-                             p_n_elems,                                 \
-                             p_data_array,                              \
-                             NESTED_QUEUE_OPERATION_ORDER_NESTED,       \
-                             NESTED_QUEUE_OPERATION_ORDER_FCFS)
-
-/** Collection of priority queues to schedule tasks from */
+    {                                                            \
+        .states       = SLOT_POOL_STATIC_INIT(                   \
+                sizeof(CoroState), p_n_elems, p_data_array),     \
+        .ready        = WAIT_READY_QUEUE_INIT,                   \
+        .polls        = (CoroPollEntry[p_n_elems]){{0}},         \
+        .n_polls_max  = p_n_elems,                               \
+        .n_polls      = 0,                                       \
+        .polled       = NULL,                                    \
+        .finalized    = NULL,                                    \
+        .cancels_seen = 0,                                       \
+        .raised       = 0,                                       \
+    }
+
+_Static_assert(CONF_CORO_N_PRIORITIES <= CORO_MAX_PRIORITIES,
+               "CONF_CORO_N_PRIORITIES is more than CORO_MAX_PRIORITIES");
+
+/** \brief Collection of priority queues to schedule tasks from
+ *
+ * Priority 0 is the highest.
+ *
+ * \note A #CoroScheduleQueue must be part of only one #CoroSchedule
+ */
 typedef struct {
     /** An array of #CoroScheduleQueue's, one for each priority */
     CoroScheduleQueue *const *const queues;
-    /** Total number of priority levels */
+    /** Total number of priority levels (at most #CORO_MAX_PRIORITIES) */
     const size_t n_priorities;
+    /** Bit (31 - priority) is set when that queue may have ready coroutines.
+     * Initialize to 0. */
+    _Atomic uint32_t ready;
+    /** Bit (31 - priority) is set when that queue is raised (see
+     * CoroScheduleQueue::raised). Initialize to 0. */
+    _Atomic uint32_t raised;
+    /** Slots of #CORO_FRAME_SIZE for the frames of #Coro_add_framed, or
+     * \c NULL (the default) */
+    SlotPool *arena;
+#if CONF_CORO_POLICIES
+    /** Bit (31 - priority) is set when that queue used up its quantum for
+     * this round. Initialize to 0. */
+    uint32_t exhausted;
+#endif
+#if CONF_CORO_STATS || CONF_CORO_POLICIES
+    /** Bit (31 - priority) is set while that queue is ready but passed over
+     * since CoroScheduleQueue::passed_at. Initialize to 0. */
+    uint32_t passed;
+#endif
+#if CONF_CORO_STATS
+    /** Odd while \c stats is being updated */
+    _Atomic uint32_t stats_seq;
+    /** Statistics, only written by the scheduler running the schedule */
+    CoroScheduleStats stats;
+#endif
 } CoroSchedule;
 
 
 
 /** \brief Start the main loop that executes coroutines
+ *
+ * Scheduling is strictly by priority: after every step of a coroutine the
+ * next one is taken from the highest priority with ready coroutines.
+ * Coroutines of the same priority run round robin.
  *
  * \param schedule A pre-initialized #CoroSchedule
  *
@@ -131,12 +612,124 @@ typedef struct {
 void __attribute__((noreturn)) schedule_mainloop(CoroSchedule *schedule);
 
 
+/** \brief Run the main loop until \p stop is set
+ *
+ * Same as #schedule_mainloop, but returns once \p *stop is found \c true
+ * between two coroutine steps. To cut an idle wait short, call
+ * #CoroIdle_notify after setting it (from any context).
+ *
+ * \param schedule A pre-initialized #CoroSchedule
+ * \param stop     the stop flag
+ */
+void schedule_mainloop_until(CoroSchedule *schedule, const _Atomic bool *stop);
+
+
+/** \brief Execute at most \p max_steps steps of coroutines, never idling
+ *
+ * Does what #schedule_mainloop does between its idle waits, but returns as
+ * soon as no coroutine is ready or \p max_steps steps were executed. Every
+ * call polls the waits of \p schedule once.
+ *
+ * \param schedule  A pre-initialized #CoroSchedule
+ * \param max_steps the maximum number of coroutine steps to execute
+ *
+ * \return The number of steps executed, less than \p max_steps only if no
+ * coroutine was ready
+ */
+size_t schedule_run_steps(CoroSchedule *schedule, size_t max_steps);
+
+
+/** \brief Execute a single step of the highest priority ready coroutine
+ *
+ * One step of #schedule_mainloop, for hosts that drive the scheduler
+ * themselves (e.g. a simulation, see sim.h): the waits of \p schedule are
+ * polled, then one coroutine step is executed. If none is ready, it waits
+ * as the main loop does when idle, at most until the next timer expires.
+ *
+ * \param schedule A pre-initialized #CoroSchedule
+ *
+ * \return \c true if a step was executed, \c false if it was idle
+ */
+bool schedule_run_once(CoroSchedule *schedule);
+
+
+#if CONF_CORO_POLICIES
+/** \brief Set how \p queue shares its schedule with lower priorities
+ *
+ * Queues are served in rounds. Within a round a #CORO_POLICY_WEIGHTED or
+ * #CORO_POLICY_DEFICIT queue is served as long as it is the highest ready
+ * one, until it used up its \p quantum. Lower priorities are served then,
+ * a #CORO_POLICY_STRICT one for a single step, and the next round starts
+ * once every ready queue had its turn. Strict queues above those that have
+ * a quantum are never held back, so strict priority stays the default.
+ *
+ * Call it before the schedule runs, or from its coroutines.
+ *
+ * \param quantum steps (#CORO_POLICY_WEIGHTED) or cycles of
+ *                #CONF_CORO_STATS_CYCLES (#CORO_POLICY_DEFICIT) per round,
+ *                more than 0. Ignored for #CORO_POLICY_STRICT.
+ */
+void CoroScheduleQueue_set_policy(CoroScheduleQueue *queue,
+                                  CoroPolicy         policy,
+                                  int64_t            quantum);
+
+/** \brief Serve \p queue ahead of any other (aging) once it was passed
+ * over for \p cycles of #CONF_CORO_STATS_CYCLES, whatever its priority and
+ * policy
+ *
+ * This bounds how long its coroutines wait behind busy higher priorities.
+ * \p cycles 0 (the default) removes the bound. Same rules as
+ * #CoroScheduleQueue_set_policy.
+ */
+void CoroScheduleQueue_set_max_wait(CoroScheduleQueue *queue,
+                                    uint64_t           cycles);
+#endif
+
+
+/** \brief Schedules run in parallel by several workers (threads or cores)
+ *
+ * Each worker runs its own #CoroSchedule with #schedule_worker_mainloop.
+ * Coroutines may be added to any of them. A worker that runs out of ready
+ * coroutines, or sees higher priority ones ready on another worker, steals
+ * about half of the coroutines that worker has woken at that priority.
+ *
+ * A stolen coroutine moves to the ready queue of its new worker at the same
+ * priority, so it is only ever executed by the worker that took it off a
+ * ready queue, or handed over from a sub-coroutine it awaits.
+ *
+ * \note Every schedule must have the same number of priorities. All workers
+ * share the timer and idle implementations.
+ */
+typedef struct {
+    /** One schedule per worker */
+    CoroSchedule *const *const schedules;
+    /** Number of workers */
+    const size_t n_workers;
+} CoroWorkers;
+
+
+/** \brief Start the main loop of worker \p self of \p workers
+ *
+ * Same as #schedule_mainloop, except that ready coroutines are also taken
+ * from the other workers. Rescheduled coroutines are published where the
+ * other workers can steal them.
+ *
+ * \param workers the workers
+ * \param self    index of the calling worker in \p workers->schedules
+ *
+ * \return This function does not return
+ */
+void __attribute__((noreturn))
+schedule_worker_mainloop(CoroWorkers *workers, size_t self);
+
+
 /** \brief Add a new coroutine to the schedule queue
  *
  * \param schedule the schedule to add the task to
  * \param function the coroutine to execute
  * \param vars     function specific structure to variables
- * \param priority the queue priority (0 to \p schedule->n_priorities -1)
+ * \param priority the queue priority, from 0 (the highest) to
+ *                 \p schedule->n_priorities - 1
  *
  * \return Pointer to internal state of the created coroutine
  * \retval NULL if creating the coroutine failed
@@ -146,31 +739,394 @@ CoroState *Coro_add_new(CoroSchedule *schedule,
                         void *        vars,
                         int           priority);
 
+
+/** \brief Initialize a sub-coroutine that is not in any schedule
+ *
+ * It does not run until a coroutine awaits it (see
+ * #CORO_AWAIT_SUB_COROUTINE_EXPLICIT). It then runs in place of that
+ * coroutine, at its priority, and hands control straight back to it when it
+ * finalizes, so awaiting a chain of sub-coroutines costs the same as awaiting
+ * one.
+ *
+ * \param state    storage for the sub-coroutine, e.g. in the variables of
+ *                 the awaiting coroutine. It must not be reused before the
+ *                 sub-coroutine finalized.
+ * \param function the coroutine to execute
+ * \param vars     function specific structure to variables
+ */
+void Coro_init_sub(CoroState *state, coroutine *function, void *vars);
+
+
+/** \brief Cancel \p state and the coroutines it awaits
+ *
+ * Cooperative: \p state is resumed from the wait it is in (or before its
+ * next step) with its timeout cancelled and the queued resource it holds
+ * released, but at the label it gave to #CORO_ON_CANCEL_EXPLICIT instead of
+ * where it waited. Without such a label it finalizes, though only once a
+ * sub-coroutine it awaits did, as that may keep its state in the variables
+ * of \p state. The coroutines it was awaiting are cancelled in turn.
+ *
+ * From then on its waits are no longer cut short, so that its clean up may
+ * await (e.g. the sub-coroutines it started, to let them clean up), and
+ * cancelling it again does nothing. Other resources are its own to release.
+ *
+ * Safe to call from any context, as long as \p state did not finalize.
+ */
+void Coro_cancel(CoroState *state);
+
+
+/** \brief Cancel \p state as with #Coro_cancel once \p milliseconds
+ * elapsed
+ *
+ * Sub-coroutines it awaits (see #Coro_init_sub) that have no deadline of
+ * their own share it, and so do theirs, so the whole tree is cancelled by
+ * then. Setting it again replaces the previous one. It is cancelled as
+ * \p state finalizes.
+ *
+ * Only call this from \p state itself (see #CORO_DEADLINE), or on a
+ * sub-coroutine before it is awaited.
+ *
+ * \retval false if no timer could be started, so that the deadline passed
+ * already, with #CORO_CANCEL_NO_TIMER
+ */
+bool Coro_set_deadline(CoroState *state, timer_ms_t milliseconds);
+
+
+/** \brief Start the timeout of a timed wait of \p state
+ *
+ * If no timer could be started, the wait times out at once, and \p state is
+ * cancelled with #CORO_CANCEL_NO_TIMER unless it is cleaning up already.
+ */
+static inline void Coro_start_timeout(CoroState *state,
+                                      timer_ms_t milliseconds) {
+    if (!Timer_start_new(&state->timeout, milliseconds)
+        && !(atomic_load(&state->cancel) & CORO_CANCEL_DELIVERED)) {
+        atomic_fetch_or(&state->cancel,
+                        CORO_CANCEL_REQUESTED | CORO_CANCEL_NO_TIMER);
+    }
+}
+
+
+/** \brief Whether \p state was resumed as cancelled (see #Coro_cancel) */
+static inline bool Coro_is_cancelled(const CoroState *state) {
+    return atomic_load(&state->cancel) & CORO_CANCEL_DELIVERED;
+}
+
+
+/** \brief Whether the sub-coroutine \p state finalized, e.g. a generator
+ * that has no more values (see #CORO_AWAIT_NEXT_EXPLICIT)
+ *
+ * Only meaningful once the coroutine awaiting it was resumed from the wait.
+ */
+bool Coro_is_finalized(CoroState *state);
+
+
+/** \brief Storage for coroutines of one function, each with its variables
+ * right after its state
+ *
+ * Coroutines added from a pool get their #CoroState and variables from it
+ * and give both back when they finalize, so spawning needs no bookkeeping.
+ *
+ * \note Define with #CORO_POOL_DEFINE, or initialize with
+ * #CORO_POOL_STATIC_INIT
+ */
+typedef struct {
+    /** Entries of a #CoroState followed by the variables */
+    SlotPool entries;
+    /** The function every coroutine of the pool executes */
+    coroutine *const function;
+    /** Offset of the variables in an entry */
+    const size_t vars_offset;
+    /** Size of the variables */
+    const size_t vars_size;
+} CoroPool;
+
+
+/** \brief Statically initialize a #CoroPool
+ *
+ * \param func_name     the coroutine function
+ * \param p_n_elems     number of entries in \p p_data_array
+ * \param p_data_array  array of structs of a #CoroState \c state (first)
+ *                      and the func_name##Vars \c vars
+ */
+#define CORO_POOL_STATIC_INIT(func_name, p_n_elems, p_data_array)     \
+    {                                                                 \
+        .entries     = SLOT_POOL_STATIC_INIT(                         \
+                sizeof((p_data_array)[0]), p_n_elems, p_data_array),  \
+        .function    = func_name,                                     \
+        .vars_offset = offsetof(__typeof__((p_data_array)[0]), vars), \
+        .vars_size   = sizeof((p_data_array)[0].vars),                \
+    }
+
+/** \brief Define a static #CoroPool \p name of \p p_n_elems coroutines of
+ * \p func_name
+ *
+ * \code{.c}
+ * CORO_POOL_DEFINE(handler_pool, handle_packet, 32);
+ * \endcode
+ */
+#define CORO_POOL_DEFINE(name, func_name, p_n_elems) \
+    static struct {                                  \
+        CoroState       state;                       \
+        func_name##Vars vars;                        \
+    } name##_entries[p_n_elems];                     \
+    static CoroPool name =                           \
+            CORO_POOL_STATIC_INIT(func_name, p_n_elems, name##_entries)
+
+
+/** \brief Add a new coroutine from \p pool to the schedule queue
+ *
+ * \param schedule the schedule to add the task to
+ * \param pool     the pool to take its state and variables from
+ * \param priority the queue priority, from 0 (the highest) to
+ *                 \p schedule->n_priorities - 1
+ * \param vars     initial value of its variables, or \c NULL to leave
+ *                 them as the last coroutine of that entry left them
+ *
+ * \return Pointer to internal state of the created coroutine
+ * \retval NULL if \p pool is exhausted
+ */
+CoroState *Coro_add_pooled(CoroSchedule *schedule,
+                           CoroPool *    pool,
+                           int           priority,
+                           const void *  vars);
+
+
+/** \brief Add up to \p n_coroutines new coroutines from \p pool at once
+ *
+ * Same as #Coro_add_pooled for each of them, except that they are made
+ * ready in order with a single update of the ready queue.
+ *
+ * \param vars array of the initial values of their variables, or \c NULL
+ *
+ * \return The number of coroutines added, less than \p n_coroutines only
+ * if \p pool was exhausted
+ */
+size_t Coro_add_batch(CoroSchedule *schedule,
+                      CoroPool *    pool,
+                      int           priority,
+                      const void *  vars,
+                      size_t        n_coroutines);
+
+
+/** \brief Make \p state, a coroutine of \p storage given the label, status
+ * and wait it was saved with, wait again at \p priority of \p schedule
+ * (private, see snapshot.h)
+ *
+ * \p state is initialized with #Coro_init_sub first.
+ */
+void Coro_park_restored(CoroSchedule *schedule,
+                        CoroState *   state,
+                        int           priority,
+                        SlotPool *    storage);
+
+
+/** \brief Define the coroutine \p func_name with its variables, the
+ * members of a struct given after it, as its frame
+ *
+ * Its variables keep their values across waits, unlike its locals.
+ *
+ * \code{.c}
+ * CORO_DEFINE(blink, { Led *led; int n_toggles; }) {
+ *     CORO_INIT(blink);
+ *     ...
+ *     CORO_END();
+ * }
+ * \endcode
+ */
+#define CORO_DEFINE(func_name, ...)             \
+    typedef struct __VA_ARGS__ func_name##Vars; \
+    static void func_name(CoroState *state, void *vars)
+
+/** \brief Round \p size up to the alignment of frames */
+#define CORO_FRAME_ALIGN(size)            \
+    (((size) + _Alignof(max_align_t) - 1) \
+     & ~(size_t)(_Alignof(max_align_t) - 1))
+
+/** \brief Size of the frame of \p func_name: its #CoroState and variables
+ *
+ * A slot of an arena must hold the frame of the coroutine added with it and
+ * those of the chain of coroutines it calls at most, e.g.
+ * <tt>CORO_FRAME_SIZE(server) + CORO_FRAME_SIZE(parse)</tt>.
+ */
+#define CORO_FRAME_SIZE(func_name)       \
+    (CORO_FRAME_ALIGN(sizeof(CoroState)) \
+     + CORO_FRAME_ALIGN(sizeof(func_name##Vars)))
+
+/** \brief Define a static arena \p name of \p p_n_frames slots of
+ * \p p_frame_size bytes, to be the CoroSchedule::arena of schedules
+ *
+ * Several schedules (e.g. of #CoroWorkers) may share it.
+ *
+ * \code{.c}
+ * CORO_ARENA_DEFINE(arena, 16, CORO_FRAME_SIZE(server)
+ *                                      + CORO_FRAME_SIZE(parse));
+ * CoroSchedule schedule = {.queues = queues, .n_priorities = 2,
+ *                          .arena = &arena};
+ * \endcode
+ */
+#define CORO_ARENA_DEFINE(name, p_n_frames, p_frame_size)  \
+    static union {                                         \
+        CoroState   state;                                 \
+        max_align_t align;                                 \
+        char        bytes[CORO_FRAME_ALIGN(p_frame_size)]; \
+    } name##_frames[p_n_frames];                           \
+    static SlotPool name = SLOT_POOL_STATIC_INIT(          \
+            sizeof(name##_frames[0]), p_n_frames, name##_frames)
+
+
+/** \brief Add a new coroutine with its frame in a slot of
+ * CoroSchedule::arena
+ *
+ * Its #CoroState and variables come first in the slot, and the frames of
+ * the coroutines it calls (see #Coro_call_framed) follow. The whole slot is
+ * given back when it finalizes. Nothing is allocated from the heap.
+ *
+ * \param schedule  the schedule to add the task to, with an arena
+ * \param function  the coroutine to execute
+ * \param vars      initial value of its variables, or \c NULL for zeros
+ * \param vars_size size of its variables
+ * \param priority  the queue priority, from 0 (the highest) to
+ *                  \p schedule->n_priorities - 1
+ *
+ * \return Pointer to internal state of the created coroutine
+ * \retval NULL if the arena is exhausted, or the frame does not fit a slot
+ */
+CoroState *Coro_add_framed(CoroSchedule *schedule,
+                           coroutine *   function,
+                           const void *  vars,
+                           size_t        vars_size,
+                           int           priority);
+
+/** \brief #Coro_add_framed for a coroutine of #CORO_DEFINE, with the
+ * initializer of its variables after \p priority */
+#define CORO_ADD_FRAMED(schedule, func_name, priority, ...) \
+    Coro_add_framed((schedule),                             \
+                    func_name,                              \
+                    &(func_name##Vars){__VA_ARGS__},        \
+                    sizeof(func_name##Vars),                \
+                    (priority))
+
+
+/** \brief Initialize a sub-coroutine with its frame right after that of
+ * \p caller
+ *
+ * As #Coro_init_sub, for \p caller to await it. Frames nest last in, first
+ * out in the slot of the coroutine added with #Coro_add_framed: the frame
+ * of a call starts where that of its caller ends, so it is gone once the
+ * call finalized and the next call reuses it. A coroutine may thus have
+ * only one call in flight, and must await it before calling again (also
+ * from its #CORO_ON_CANCEL_EXPLICIT clean up, while
+ * <tt>state->wait.sub_coroutine</tt> did not finalize).
+ *
+ * If the slot has no room left for the frame, \p caller is cancelled
+ * instead, with #CORO_CANCEL_NO_FRAME, or finalizes if it is cleaning up
+ * from a cancel already. It must then suspend right away, as
+ * #CORO_CALL_EXPLICIT does, to be resumed at its clean up.
+ *
+ * \param caller    a coroutine added with #Coro_add_framed, or called so;
+ *                  any other one stops the program, whether or not
+ *                  \c NDEBUG is defined
+ * \param function  the coroutine to execute
+ * \param vars      initial value of its variables, or \c NULL for zeros
+ * \param vars_size size of its variables
+ *
+ * \return Pointer to internal state of the sub-coroutine
+ * \retval NULL if the slot has no room left, and \p caller is cancelled
+ */
+CoroState *Coro_call_framed(CoroState * caller,
+                            coroutine * function,
+                            const void *vars,
+                            size_t      vars_size);
+
+#if CONF_CORO_STATS
+/** \brief Copy the statistics of \p state without stopping its scheduler
+ *
+ * Safe to call from any context. Fails if the scheduler is updating them at
+ * that moment, in which case retry later (an interrupt that preempted the
+ * update cannot succeed before returning).
+ *
+ * \return \c false if no consistent copy could be taken
+ */
+bool CoroStats_snapshot(const CoroState *state, CoroStats *snapshot);
+
+/** \brief Copy the statistics of \p schedule without stopping it
+ *
+ * Same rules as #CoroStats_snapshot.
+ *
+ * \return \c false if no consistent copy could be taken
+ */
+bool CoroScheduleStats_snapshot(const CoroSchedule *schedule,
+                                CoroScheduleStats * snapshot);
+#endif
+
 #define JOIN(a, b) a##b
 #define JOIN1(a, b) JOIN(a, b)
 #define JOIN2(a, b) JOIN1(a, b)
 #define CORO_LINE_LABEL() JOIN1(coroutine_state_, __LINE__)
+#if CONF_CORO_SWITCH_DISPATCH
+/* Resume points are case labels of the line they are on */
+#define CORO_LINE_RESUME_POINT() \
+    case __LINE__:
+#define CORO_INLINE_SAVE_STATE_EXPLICIT(state) \
+    { state->label = (void *)(uintptr_t)__LINE__; }
+#else
+#define CORO_LINE_RESUME_POINT() \
+    CORO_LINE_LABEL() :
 #define CORO_INLINE_SAVE_STATE_EXPLICIT(state) \
     { state->label = &&CORO_LINE_LABEL(); }
+#endif
 
 
 #define CORO_SAVE_STATE_EXPLICIT(state)         \
     {                                           \
         CORO_INLINE_SAVE_STATE_EXPLICIT(state); \
-        CORO_LINE_LABEL() :;                    \
+        CORO_LINE_RESUME_POINT();               \
     }
 
 
+#if CONF_CORO_SWITCH_DISPATCH
+/* Opens the switch that CORO_END_EXPLICIT closes */
+#define CORO_INIT_EXPLICIT(state)      \
+    switch ((uintptr_t)state->label) { \
+        case 0:;
+
+
+#define CORO_END_EXPLICIT(state) }
+
+
+/* Resume at label (of the same function) once cancelled instead of where
+ * it waits, see Coro_cancel. It stays in effect until the next one. */
+#define CORO_ON_CANCEL_EXPLICIT(state, label)           \
+    {                                                   \
+        state->on_cancel = (void *)(uintptr_t)__LINE__; \
+        if (false) {                                    \
+            case __LINE__:                              \
+                goto label;                             \
+        }                                               \
+    }
+#else
 #define CORO_INIT_EXPLICIT(state)                          \
     {                                                      \
         if (state->label != NULL) { goto * state->label; } \
     }
 
 
-#define CORO_IMPLICIT_TIMED                             \
-    {                                                   \
-        state->timed_wait = true;                       \
-        Timer_start_new(&state->timeout, milliseconds); \
+/* Ends the body of a coroutine (needed with CONF_CORO_SWITCH_DISPATCH) */
+#define CORO_END_EXPLICIT(state)
+
+
+/* Resume at label (of the same function) once cancelled instead of where
+ * it waits, see Coro_cancel. It stays in effect until the next one. */
+#define CORO_ON_CANCEL_EXPLICIT(state, label) \
+    { state->on_cancel = &&label; }
+#endif
+
+
+#define CORO_IMPLICIT_TIMED(state, milliseconds)   \
+    {                                              \
+        state->timed_wait = true;                  \
+        Coro_start_timeout(state, (milliseconds)); \
     }
 
 
@@ -181,7 +1137,7 @@ CoroState *Coro_add_new(CoroSchedule *schedule,
 #define CORO_IMPLICIT_RETURN_AND_LABEL \
     {                                  \
         return;                        \
-        CORO_LINE_LABEL() :;           \
+        CORO_LINE_RESUME_POINT();      \
     }
 
 
@@ -197,8 +1153,8 @@ CoroState *Coro_add_new(CoroSchedule *schedule,
 #define CORO_AWAIT_TIMED_EXPLICIT(state, milliseconds) \
     {                                                  \
         CORO_INLINE_SAVE_STATE_EXPLICIT(state);        \
-        state->status = CORO_STATUS_SUSPENDED;        \
-        CORO_IMPLICIT_TIMED;                           \
+        state->status = CORO_STATUS_WAIT_TIMED;        \
+        CORO_IMPLICIT_TIMED(state, milliseconds);      \
         CORO_IMPLICIT_RETURN_AND_LABEL;                \
     }
 
@@ -218,40 +1174,131 @@ CoroState *Coro_add_new(CoroSchedule *schedule,
         CORO_INLINE_SAVE_STATE_EXPLICIT(state);             \
         state->status         = CORO_STATUS_WAIT_CONDITION; \
         state->wait.condition = condition_ptr;              \
-        CORO_IMPLICIT_TIMED;                                \
+        CORO_IMPLICIT_TIMED(state, milliseconds);           \
         CORO_IMPLICIT_RETURN_AND_LABEL;                     \
     }
 
 
-#define CORO_AWAIT_RESOURCE_EXPLICIT(state, resource_ptr, owner_ptr)       \
-    (                                                                      \
-            {                                                              \
-                CORO_INLINE_SAVE_STATE_EXPLICIT(state);                    \
-                state->status                 = CORO_STATUS_WAIT_RESOURCE; \
-                state->wait.resource.resource = resource_ptr;              \
-                state->wait.resource.owner    = owner_ptr;                 \
-                CORO_IMPLICIT_NOT_TIMED;                                   \
-                CORO_IMPLICIT_RETURN_AND_LABEL;                            \
-            },                                                             \
-            state->wait.resource.retval)
+#define CORO_AWAIT_WAKE_CONDITION_EXPLICIT(state, condition_ptr)      \
+    {                                                                 \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state);                       \
+        state->status              = CORO_STATUS_WAIT_WAKE_CONDITION; \
+        state->wait.wake_condition = condition_ptr;                   \
+        CORO_IMPLICIT_NOT_TIMED;                                      \
+        CORO_IMPLICIT_RETURN_AND_LABEL;                               \
+    }
+
+
+#define CORO_AWAIT_WAKE_CONDITION_TIMED_EXPLICIT(                     \
+        state, condition_ptr, milliseconds)                           \
+    {                                                                 \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state);                       \
+        state->status              = CORO_STATUS_WAIT_WAKE_CONDITION; \
+        state->wait.wake_condition = condition_ptr;                   \
+        CORO_IMPLICIT_TIMED(state, milliseconds);                     \
+        CORO_IMPLICIT_RETURN_AND_LABEL;                               \
+    }
+
+
+/* The result of acquiring the resource is left in
+ * state->wait.resource.retval */
+#define CORO_AWAIT_RESOURCE_EXPLICIT(state, resource_ptr, owner_ptr) \
+    {                                                                \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state);                      \
+        state->status                 = CORO_STATUS_WAIT_RESOURCE;   \
+        state->wait.resource.resource = resource_ptr;                \
+        state->wait.resource.owner    = owner_ptr;                   \
+        CORO_IMPLICIT_NOT_TIMED;                                     \
+        CORO_IMPLICIT_RETURN_AND_LABEL;                              \
+    }
+
+
+#define CORO_AWAIT_RESOURCE_TIMED_EXPLICIT(                        \
+        state, resource_ptr, owner_ptr, milliseconds)              \
+    {                                                              \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state);                    \
+        state->status                 = CORO_STATUS_WAIT_RESOURCE; \
+        state->wait.resource.resource = resource_ptr;              \
+        state->wait.resource.owner    = owner_ptr;                 \
+        CORO_IMPLICIT_TIMED(state, milliseconds);                  \
+        CORO_IMPLICIT_RETURN_AND_LABEL;                            \
+    }
+
+
+/* The result of acquiring the resource is left in
+ * state->wait.resource.retval */
+#define CORO_AWAIT_QUEUED_RESOURCE_EXPLICIT(                            \
+        state, resource_ptr, owner_ptr)                                 \
+    {                                                                   \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state);                         \
+        state->status               = CORO_STATUS_WAIT_QUEUED_RESOURCE; \
+        state->wait.resource.queued = resource_ptr;                     \
+        state->wait.resource.owner  = owner_ptr;                        \
+        CORO_IMPLICIT_NOT_TIMED;                                        \
+        CORO_IMPLICIT_RETURN_AND_LABEL;                                 \
+    }
+
+
+#define CORO_AWAIT_QUEUED_RESOURCE_TIMED_EXPLICIT(                      \
+        state, resource_ptr, owner_ptr, milliseconds)                   \
+    {                                                                   \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state);                         \
+        state->status               = CORO_STATUS_WAIT_QUEUED_RESOURCE; \
+        state->wait.resource.queued = resource_ptr;                     \
+        state->wait.resource.owner  = owner_ptr;                        \
+        CORO_IMPLICIT_TIMED(state, milliseconds);                       \
+        CORO_IMPLICIT_RETURN_AND_LABEL;                                 \
+    }
+
+
+#define CORO_AWAIT_CHANNEL_EXPLICIT(state, channel_ptr, sending) \
+    {                                                            \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state);                  \
+        state->status               = CORO_STATUS_WAIT_CHANNEL;  \
+        state->wait.channel.channel = channel_ptr;               \
+        state->wait.channel.send    = sending;                   \
+        CORO_IMPLICIT_NOT_TIMED;                                 \
+        CORO_IMPLICIT_RETURN_AND_LABEL;                          \
+    }
+
+
+#define CORO_AWAIT_CHANNEL_TIMED_EXPLICIT(                      \
+        state, channel_ptr, sending, milliseconds)              \
+    {                                                           \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state);                 \
+        state->status               = CORO_STATUS_WAIT_CHANNEL; \
+        state->wait.channel.channel = channel_ptr;              \
+        state->wait.channel.send    = sending;                  \
+        CORO_IMPLICIT_TIMED(state, milliseconds);               \
+        CORO_IMPLICIT_RETURN_AND_LABEL;                         \
+    }
 
 
-#define CORO_AWAIT_RESOURCE_TIMED_EXPLICIT(                                \
-        state, resource_ptr, owner_ptr, milliseconds)                      \
-    (                                                                      \
-            {                                                              \
-                CORO_INLINE_SAVE_STATE_EXPLICIT(state);                    \
-                state->status                 = CORO_STATUS_WAIT_RESOURCE; \
-                state->wait.resource.resource = resource_ptr;              \
-                state->wait.resource.owner    = owner_ptr;                 \
-                CORO_IMPLICIT_TIMED;                                       \
-                CORO_IMPLICIT_RETURN_AND_LABEL;                            \
-            },                                                             \
-            state->wait.resource.retval)
+/* Submits the operation, which is cancelled if the wait times out. Whether
+ * it completed is left in io_ptr->done. */
+#define CORO_AWAIT_IO_EXPLICIT(state, io_ptr)   \
+    {                                           \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state); \
+        state->status  = CORO_STATUS_WAIT_IO;   \
+        state->wait.io = io_ptr;                \
+        CORO_IMPLICIT_NOT_TIMED;                \
+        CORO_IMPLICIT_RETURN_AND_LABEL;         \
+    }
+
+
+#define CORO_AWAIT_IO_TIMED_EXPLICIT(state, io_ptr, milliseconds) \
+    {                                                             \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state);                   \
+        state->status  = CORO_STATUS_WAIT_IO;                     \
+        state->wait.io = io_ptr;                                  \
+        CORO_IMPLICIT_TIMED(state, milliseconds);                 \
+        CORO_IMPLICIT_RETURN_AND_LABEL;                           \
+    }
 
 
 #define CORO_AWAIT_SUB_COROUTINE_EXPLICIT(state, sub_state_ptr) \
     {                                                           \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state);                 \
         state->status             = CORO_STATUS_WAIT_SUBCORO;   \
         state->wait.sub_coroutine = sub_state_ptr;              \
         CORO_IMPLICIT_NOT_TIMED;                                \
@@ -262,13 +1309,281 @@ CoroState *Coro_add_new(CoroSchedule *schedule,
 #define CORO_AWAIT_SUB_COROUTINE_TIMED_EXPLICIT(              \
         state, sub_state_ptr, milliseconds)                   \
     {                                                         \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state);               \
         state->status             = CORO_STATUS_WAIT_SUBCORO; \
         state->wait.sub_coroutine = sub_state_ptr;            \
-        CORO_IMPLICIT_TIMED;                                  \
+        CORO_IMPLICIT_TIMED(state, milliseconds);             \
         CORO_IMPLICIT_RETURN_AND_LABEL;                       \
     }
 
 
+/* Call the coroutine func_name of CORO_DEFINE in a frame after that of
+ * state and await it, see Coro_call_framed. The initializer of its
+ * variables follows. If its frame does not fit, state is cancelled instead
+ * and resumes at its clean up (or finalizes). */
+#define CORO_CALL_EXPLICIT(state, func_name, ...)                      \
+    {                                                                  \
+        state->wait.sub_coroutine =                                    \
+                Coro_call_framed(state,                                \
+                                 func_name,                            \
+                                 &(func_name##Vars){__VA_ARGS__},      \
+                                 sizeof(func_name##Vars));             \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state);                        \
+        /* Only suspended, to be resumed at its clean up, without it */ \
+        state->status = (state->wait.sub_coroutine != NULL)            \
+                                ? CORO_STATUS_WAIT_SUBCORO             \
+                                : CORO_STATUS_SUSPENDED;               \
+        CORO_IMPLICIT_NOT_TIMED;                                       \
+        CORO_IMPLICIT_RETURN_AND_LABEL;                                \
+    }
+
+
+/** \brief Items a generator yields at once with #CORO_YIELD_SPAN_EXPLICIT,
+ * valid until it is awaited again */
+typedef struct {
+    /** The first item */
+    const void *items;
+    /** Number of items */
+    size_t n_items;
+} CoroSpan;
+
+
+/* Generators are sub-coroutines (see Coro_init_sub) that yield values
+ * straight to the coroutine awaiting them. Awaiting one starts it in place
+ * of the awaiting coroutine, and its yield hands control straight back with
+ * the value, so neither goes through a ready queue.
+ *
+ * Await the next value of the generator gen_ptr into *out_ptr. Once
+ * resumed, Coro_is_finalized(gen_ptr) tells if it finalized instead, and
+ * *out_ptr is left as it was. */
+#define CORO_AWAIT_NEXT_EXPLICIT(state, gen_ptr, out_ptr)    \
+    {                                                        \
+        (gen_ptr)->yield_to   = (out_ptr);                   \
+        (gen_ptr)->yield_size = sizeof(*(out_ptr));          \
+        CORO_AWAIT_SUB_COROUTINE_EXPLICIT(state, (gen_ptr)); \
+    }
+
+
+/* Yield a copy of value to the coroutine awaiting the generator state, to
+ * the *out_ptr of the same type it awaits with (asserted to be of the same
+ * size), and suspend until awaited again */
+#define CORO_YIELD_VALUE_EXPLICIT(state, value)                      \
+    {                                                                \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state);                      \
+        assert(sizeof(value) == state->yield_size                    \
+               && "yielded a value of another type than awaited");   \
+        *(__typeof__(value) *)state->yield_to = (value);             \
+        state->status                         = CORO_STATUS_YIELDED; \
+        CORO_IMPLICIT_NOT_TIMED;                                     \
+        CORO_IMPLICIT_RETURN_AND_LABEL;                              \
+    }
+
+
+/* Yield the p_n_items items at p_items at once, as a CoroSpan the awaiting
+ * coroutine awaits with. They must stay valid (e.g. in the variables of the
+ * generator) until it is awaited again. */
+#define CORO_YIELD_SPAN_EXPLICIT(state, p_items, p_n_items)             \
+    {                                                                   \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state);                         \
+        assert(sizeof(CoroSpan) == state->yield_size                    \
+               && "yielded a span to a coroutine awaiting a value");    \
+        *(CoroSpan *)state->yield_to =                                  \
+                (CoroSpan){.items = (p_items), .n_items = (p_n_items)}; \
+        state->status = CORO_STATUS_YIELDED;                            \
+        CORO_IMPLICIT_NOT_TIMED;                                        \
+        CORO_IMPLICIT_RETURN_AND_LABEL;                                 \
+    }
+
+
+/* Wait setup for CORO_AWAIT and CORO_AWAIT_ATMOST, selected by _Generic */
+
+static inline void CoroWait_condition(CoroState *state, Condition *condition) {
+    state->status         = CORO_STATUS_WAIT_CONDITION;
+    state->wait.condition = condition;
+}
+
+static inline void CoroWait_wake_condition(CoroState *    state,
+                                           WakeCondition *condition) {
+    state->status              = CORO_STATUS_WAIT_WAKE_CONDITION;
+    state->wait.wake_condition = condition;
+}
+
+static inline void CoroWait_resource(CoroState *    state,
+                                     Resource *     resource,
+                                     ResourceOwner *owner) {
+    state->status                 = CORO_STATUS_WAIT_RESOURCE;
+    state->wait.resource.resource = resource;
+    state->wait.resource.owner    = owner;
+}
+
+static inline void CoroWait_queued_resource(CoroState *     state,
+                                            QueuedResource *resource,
+                                            ResourceOwner * owner) {
+    state->status               = CORO_STATUS_WAIT_QUEUED_RESOURCE;
+    state->wait.resource.queued = resource;
+    state->wait.resource.owner  = owner;
+}
+
+static inline void CoroWait_sub_coroutine(CoroState *state, CoroState *sub) {
+    state->status             = CORO_STATUS_WAIT_SUBCORO;
+    state->wait.sub_coroutine = sub;
+}
+
+static inline void CoroWait_io(CoroState *state, CoroIo *io) {
+    state->status  = CORO_STATUS_WAIT_IO;
+    state->wait.io = io;
+}
+
+static inline void CoroWait_group(CoroState *state, CoroGroup *group) {
+    CoroWait_wake_condition(state, &group->done);
+}
+
+static inline void CoroWait_event(CoroState *state, CoroEvent *event) {
+    CoroWait_wake_condition(state, &event->pending);
+}
+
+static inline void CoroWait_many(CoroState *   state,
+                                 CoroWaitable *waitables,
+                                 size_t        n_waitables,
+                                 bool          any) {
+    bool polled = false;
+    for (size_t i = 0; i < n_waitables; i++) {
+        polled = polled || waitables[i].kind == CORO_WAITABLE_CONDITION
+                 || waitables[i].kind == CORO_WAITABLE_RESOURCE;
+    }
+    state->status = polled ? CORO_STATUS_WAIT_MANY_POLLED
+                           : CORO_STATUS_WAIT_MANY;
+    state->wait.many.waitables   = waitables;
+    state->wait.many.n_waitables = n_waitables;
+    state->wait.many.any         = any;
+}
+
+#define CORO_WAIT_SETUP(on)                            \
+    _Generic((on), /* ------------------------------*/ \
+             Condition *                               \
+             : CoroWait_condition,                     \
+               WakeCondition *                         \
+             : CoroWait_wake_condition,                \
+               Resource *                              \
+             : CoroWait_resource,                      \
+               QueuedResource *                        \
+             : CoroWait_queued_resource,               \
+               CoroState *                             \
+             : CoroWait_sub_coroutine,                 \
+               CoroGroup *                             \
+             : CoroWait_group,                         \
+               CoroEvent *                             \
+             : CoroWait_event,                         \
+               CoroIo *                                \
+             : CoroWait_io)
+
+
+/* Constructors of a #CoroWaitable, selected by _Generic */
+
+static inline CoroWaitable CoroWaitable_condition(Condition *condition) {
+    return (CoroWaitable){.kind         = CORO_WAITABLE_CONDITION,
+                          .on.condition = condition};
+}
+
+static inline CoroWaitable CoroWaitable_wake_condition(
+        WakeCondition *condition) {
+    return (CoroWaitable){.kind              = CORO_WAITABLE_WAKE_CONDITION,
+                          .on.wake_condition = condition};
+}
+
+static inline CoroWaitable CoroWaitable_resource(Resource *     resource,
+                                                 ResourceOwner *owner) {
+    return (CoroWaitable){.kind                 = CORO_WAITABLE_RESOURCE,
+                          .on.resource.resource = resource,
+                          .on.resource.owner    = owner};
+}
+
+static inline CoroWaitable CoroWaitable_queued_resource(
+        QueuedResource *resource, ResourceOwner *owner) {
+    return (CoroWaitable){.kind               = CORO_WAITABLE_QUEUED_RESOURCE,
+                          .on.resource.queued = resource,
+                          .on.resource.owner  = owner};
+}
+
+static inline CoroWaitable CoroWaitable_coroutine(CoroState *coroutine) {
+    return (CoroWaitable){.kind         = CORO_WAITABLE_COROUTINE,
+                          .on.coroutine = coroutine};
+}
+
+static inline CoroWaitable CoroWaitable_group(CoroGroup *group) {
+    return CoroWaitable_wake_condition(&group->done);
+}
+
+static inline CoroWaitable CoroWaitable_event(CoroEvent *event) {
+    return CoroWaitable_wake_condition(&event->pending);
+}
+
+static inline CoroWaitable CoroWaitable_io(CoroIo *io) {
+    return (CoroWaitable){.kind = CORO_WAITABLE_IO, .on.io = io};
+}
+
+/** \brief A #CoroWaitable done when \p channel may have a free slot
+ *
+ * Not selected by #CORO_WAITABLE, as a channel can be waited on either way.
+ */
+static inline CoroWaitable CoroWaitable_channel_send(Channel *channel) {
+    return (CoroWaitable){.kind               = CORO_WAITABLE_CHANNEL,
+                          .on.channel.channel = channel,
+                          .on.channel.send    = true};
+}
+
+/** \brief A #CoroWaitable done when \p channel may have an item */
+static inline CoroWaitable CoroWaitable_channel_recv(Channel *channel) {
+    return (CoroWaitable){.kind               = CORO_WAITABLE_CHANNEL,
+                          .on.channel.channel = channel,
+                          .on.channel.send    = false};
+}
+
+/** \brief Make a #CoroWaitable of anything #CORO_AWAIT can wait on
+ *
+ * A Resource takes the owner as extra argument.
+ */
+#define CORO_WAITABLE(on, ...)                                 \
+    _Generic((on), /* --------------------------------------*/ \
+             Condition *                                       \
+             : CoroWaitable_condition,                         \
+               WakeCondition *                                 \
+             : CoroWaitable_wake_condition,                    \
+               Resource *                                      \
+             : CoroWaitable_resource,                          \
+               QueuedResource *                                \
+             : CoroWaitable_queued_resource,                   \
+               CoroState *                                     \
+             : CoroWaitable_coroutine,                         \
+               CoroGroup *                                     \
+             : CoroWaitable_group,                             \
+               CoroEvent *                                     \
+             : CoroWaitable_event,                             \
+               CoroIo *                                        \
+             : CoroWaitable_io)((on), ##__VA_ARGS__)
+
+
+/* The index of the waitable that ended the wait is left in
+ * state->wait.many.winner, -1 if it timed out */
+#define CORO_AWAIT_MANY_EXPLICIT(state, waitables, n_waitables, any) \
+    {                                                                \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state);                      \
+        CoroWait_many(state, waitables, n_waitables, any);           \
+        CORO_IMPLICIT_NOT_TIMED;                                     \
+        CORO_IMPLICIT_RETURN_AND_LABEL;                              \
+    }
+
+
+#define CORO_AWAIT_MANY_TIMED_EXPLICIT(                    \
+        state, waitables, n_waitables, any, milliseconds)  \
+    {                                                      \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state);            \
+        CoroWait_many(state, waitables, n_waitables, any); \
+        CORO_IMPLICIT_TIMED(state, milliseconds);          \
+        CORO_IMPLICIT_RETURN_AND_LABEL;                    \
+    }
+
+
 #define CONF_CORO_ENABLE_IMPLICIT_MACROS 1
 
 #if CONF_CORO_ENABLE_IMPLICIT_MACROS
@@ -278,29 +1593,131 @@ CoroState *Coro_add_new(CoroSchedule *schedule,
     func_name ## Vars *v = vars;                 \
     CORO_INIT_EXPLICIT(state);
 
+#define CORO_END() CORO_END_EXPLICIT(state)
+
 #define CORO_YIELD() CORO_YIELD_EXPLICIT(state)
 
-#define CORO_AWAIT(on, ...)                                             \
-    _Generic(on, /* -----------------------------------------------*/   \
-             Condition *                                                \
-             : CORO_AWAIT_CONDITION_EXPLICIT(state, on, ##__VA_ARGS__), \
-               Resource *                                               \
-             : CORO_AWAIT_RESOURCE_EXPLICIT(state, on, ##__VA_ARGS__),  \
-               CoroState *                                              \
-             : CORO_AWAIT_SUB_COROUTINE_EXPLICIT(state, on, ##__VA_ARGS__))
-
-
-#define CORO_AWAIT_ATMOST(milliseconds, on, ...)                \
-    _Generic(on, /* ----------------------------------------*/  \
-             Condition *                                        \
-             : CORO_AWAIT_CONDITION_TIMED_EXPLICIT(             \
-                       state, on, ##__VA_ARGS__, milliseconds), \
-               Resource *                                       \
-             : CORO_AWAIT_RESOURCE_TIMED_EXPLICIT(              \
-                       state, on, ##__VA_ARGS__, milliseconds), \
-               CoroState *                                      \
-             : CORO_AWAIT_SUB_COROUTINE_TIMED_EXPLICIT(         \
-                     state, on, ##__VA_ARGS__, milliseconds))
+/* Call a coroutine of CORO_DEFINE with its frame after this one */
+#define CORO_CALL(func_name, ...) \
+    CORO_CALL_EXPLICIT(state, func_name, ##__VA_ARGS__)
+
+/* Generators, see CORO_AWAIT_NEXT_EXPLICIT */
+#define CORO_AWAIT_NEXT(gen_ptr, out_ptr) \
+    CORO_AWAIT_NEXT_EXPLICIT(state, gen_ptr, out_ptr)
+#define CORO_YIELD_VALUE(value) CORO_YIELD_VALUE_EXPLICIT(state, value)
+#define CORO_YIELD_SPAN(items, n_items) \
+    CORO_YIELD_SPAN_EXPLICIT(state, items, n_items)
+
+/* Cancellation, see Coro_cancel */
+#define CORO_ON_CANCEL(label) CORO_ON_CANCEL_EXPLICIT(state, label)
+#define CORO_DEADLINE(milliseconds) Coro_set_deadline(state, (milliseconds))
+#define CORO_CANCELLED() Coro_is_cancelled(state)
+
+/* Awaiting a Resource takes the owner as extra argument and leaves the
+ * result in state->wait.resource.retval */
+#define CORO_AWAIT(on, ...)                              \
+    {                                                    \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state);          \
+        CORO_WAIT_SETUP(on)(state, (on), ##__VA_ARGS__); \
+        CORO_IMPLICIT_NOT_TIMED;                         \
+        CORO_IMPLICIT_RETURN_AND_LABEL;                  \
+    }
+
+
+#define CORO_AWAIT_ATMOST(milliseconds, on, ...)         \
+    {                                                    \
+        CORO_INLINE_SAVE_STATE_EXPLICIT(state);          \
+        CORO_WAIT_SETUP(on)(state, (on), ##__VA_ARGS__); \
+        CORO_IMPLICIT_TIMED(state, milliseconds);        \
+        CORO_IMPLICIT_RETURN_AND_LABEL;                  \
+    }
+
+
+/** Number of elements of an array */
+#define CORO_ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+
+/* Await every, or the first, of a static array of #CoroWaitable's. The
+ * index of the one that ended the wait is left in state->wait.many.winner,
+ * -1 if it timed out. */
+#define CORO_AWAIT_ALL(waitables) \
+    CORO_AWAIT_MANY_EXPLICIT(     \
+            state, (waitables), CORO_ARRAY_SIZE(waitables), false)
+
+#define CORO_AWAIT_ANY(waitables) \
+    CORO_AWAIT_MANY_EXPLICIT(     \
+            state, (waitables), CORO_ARRAY_SIZE(waitables), true)
+
+#define CORO_AWAIT_ALL_ATMOST(milliseconds, waitables)         \
+    CORO_AWAIT_MANY_TIMED_EXPLICIT(state,                      \
+                                   (waitables),                \
+                                   CORO_ARRAY_SIZE(waitables), \
+                                   false,                      \
+                                   milliseconds)
+
+#define CORO_AWAIT_ANY_ATMOST(milliseconds, waitables)         \
+    CORO_AWAIT_MANY_TIMED_EXPLICIT(state,                      \
+                                   (waitables),                \
+                                   CORO_ARRAY_SIZE(waitables), \
+                                   true,                       \
+                                   milliseconds)
+
+
+/* Channels. Each retries until it succeeds and suspends in between, so a
+ * coroutine costs nothing while the channel stays full (or empty). */
+
+/* Send a copy of *item_ptr */
+#define CORO_AWAIT_SEND(channel_ptr, item_ptr)                   \
+    while (!Channel_try_send((channel_ptr), (item_ptr))) {       \
+        CORO_AWAIT_CHANNEL_EXPLICIT(state, (channel_ptr), true); \
+    }
+
+/* Reserve a free slot, left in slot_lvalue, to fill and send with
+ * Channel_commit */
+#define CORO_AWAIT_RESERVE(channel_ptr, slot_lvalue)                 \
+    while (((slot_lvalue) = Channel_reserve(channel_ptr)) == NULL) { \
+        CORO_AWAIT_CHANNEL_EXPLICIT(state, (channel_ptr), true);     \
+    }
+
+/* Receive the oldest item into *item_ptr */
+#define CORO_AWAIT_RECV(channel_ptr, item_ptr)                    \
+    while (!Channel_try_recv((channel_ptr), (item_ptr))) {        \
+        CORO_AWAIT_CHANNEL_EXPLICIT(state, (channel_ptr), false); \
+    }
+
+/* Receive at least one and up to max_items items into the array items.
+ * Their number is left in n_lvalue. */
+#define CORO_AWAIT_RECV_MANY(channel_ptr, items, max_items, n_lvalue) \
+    while (((n_lvalue) = Channel_try_recv_many(                       \
+                    (channel_ptr), (items), (max_items)))             \
+           == 0) {                                                    \
+        CORO_AWAIT_CHANNEL_EXPLICIT(state, (channel_ptr), false);     \
+    }
+
+
+/* File descriptors, through the #CoroIo at io_ptr (in the variables of the
+ * coroutine). The number of bytes, the events that occurred, or a negative
+ * error number is left in io_ptr->result. */
+
+/* Wait for CORO_IO_READABLE and/or CORO_IO_WRITABLE events on fd */
+#define CORO_AWAIT_POLL(io_ptr, fd, events)         \
+    {                                               \
+        CoroIo_poll_init((io_ptr), (fd), (events)); \
+        CORO_AWAIT_IO_EXPLICIT(state, (io_ptr));    \
+    }
+
+/* Read up to size bytes of fd into buffer */
+#define CORO_AWAIT_READ(io_ptr, fd, buffer, size)           \
+    {                                                       \
+        CoroIo_read_init((io_ptr), (fd), (buffer), (size)); \
+        CORO_AWAIT_IO_EXPLICIT(state, (io_ptr));            \
+    }
+
+/* Write up to size bytes of buffer to fd */
+#define CORO_AWAIT_WRITE(io_ptr, fd, buffer, size)           \
+    {                                                        \
+        CoroIo_write_init((io_ptr), (fd), (buffer), (size)); \
+        CORO_AWAIT_IO_EXPLICIT(state, (io_ptr));             \
+    }
 
 
 #endif
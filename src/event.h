@@ -0,0 +1,158 @@
+/** \file event.h
+ *
+ * Events posted from interrupts to a coroutine, counted and optionally
+ * carrying data, without losing any of them.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+#ifndef EVENT_H
+#define EVENT_H 1
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "channel.h"
+#include "condition.h"
+
+
+/** \brief Events posted from any context (e.g. interrupts) for coroutines
+ * to handle in batches
+ *
+ * Unlike a #Condition, every post is counted, so an event posted twice
+ * before its coroutine runs is seen twice. Posts may also carry an item,
+ * kept in a bounded ring (a #Channel with a single consumer) until the
+ * coroutine takes it. Coroutines await the event through \c pending (with
+ * #CORO_AWAIT or as one of several waitables), so any number of posts
+ * before they run make a single wake, and they take everything posted so
+ * far in that one resume:
+ *
+ * \code{.c}
+ * while (true) {
+ *     CORO_AWAIT(&uart_event);
+ *     while ((v->n = CoroEvent_recv_many(&uart_event, v->bytes, 64)) > 0) {
+ *         handle(v->bytes, v->n);
+ *     }
+ * }
+ * \endcode
+ *
+ * An event either carries an item with every post (it has a ring) or none
+ * (it has none), and is taken from accordingly.
+ *
+ * Posting never blocks and is safe from interrupts. It retries only when
+ * another post to the same event interleaves, e.g. from a nested interrupt.
+ *
+ * \note Use #CORO_EVENT_STATIC_INIT or #CORO_EVENT_DEFINE to initialize
+ */
+typedef struct {
+    /** Number of posts without an item not taken yet */
+    _Atomic uint32_t count;
+    /** Number of items that did not fit \c ring (see #CoroEvent_n_lost) */
+    _Atomic uint32_t n_lost;
+    /** Items of the posts not taken yet, or \c NULL for posts without */
+    Channel *const ring;
+    /** Set when something may have been posted since it was last taken */
+    WakeCondition pending;
+} CoroEvent;
+
+/** \brief Statically initialize a #CoroEvent with nothing posted
+ *
+ * \param p_ring a #Channel (#CHANNEL_SINGLE_CONSUMER is enough) for the
+ *               items of posts, or \c NULL if only counted
+ */
+#define CORO_EVENT_STATIC_INIT(p_ring)             \
+    {                                              \
+        .count = 0, .n_lost = 0, .ring = (p_ring), \
+        .pending = WAKE_CONDITION_INIT,            \
+    }
+
+/** \brief Define a static #CoroEvent \p name whose posts carry an item of
+ * \p item_type, with room for \p p_n_items (a power of 2) not yet taken
+ *
+ * \code{.c}
+ * CORO_EVENT_DEFINE(uart_event, uint8_t, 256);
+ * \endcode
+ */
+#define CORO_EVENT_DEFINE(name, item_type, p_n_items)   \
+    static item_type name##_items[p_n_items];           \
+    static Channel   name##_ring = CHANNEL_STATIC_INIT( \
+            sizeof(item_type), p_n_items, name##_items, \
+            CHANNEL_SINGLE_CONSUMER);                   \
+    static CoroEvent name = CORO_EVENT_STATIC_INIT(&name##_ring)
+
+
+/** \brief Post \p event once, without an item
+ *
+ * Wakes its waiters. Safe to call from interrupts.
+ */
+static inline void CoroEvent_post(CoroEvent *event) {
+    assert(event->ring == NULL);
+    atomic_fetch_add(&event->count, 1);
+    WakeCondition_set(&event->pending);
+}
+
+/** \brief Post \p event with a copy of \p item
+ *
+ * Wakes its waiters. Safe to call from interrupts.
+ *
+ * \return \c false if the ring of \p event was full, in which case the
+ * item is counted as lost
+ */
+static inline bool CoroEvent_post_item(CoroEvent *event, const void *item) {
+    assert(event->ring != NULL);
+    bool sent = Channel_try_send(event->ring, item);
+    if (!sent) { atomic_fetch_add(&event->n_lost, 1); }
+    WakeCondition_set(&event->pending);
+    return sent;
+}
+
+/** \brief Take every post of \p event without an item so far
+ *
+ * \return Their number, 0 if there was none
+ */
+static inline uint32_t CoroEvent_take_all(CoroEvent *event) {
+    /* Cleared first, so that a post from here on sets it again */
+    WakeCondition_clear(&event->pending);
+    return atomic_exchange(&event->count, 0);
+}
+
+/** \brief Take a single post of \p event without an item, as from a
+ * counting semaphore
+ *
+ * \return \c false if there was none
+ */
+static inline bool CoroEvent_take(CoroEvent *event) {
+    WakeCondition_clear(&event->pending);
+    uint32_t count = atomic_load(&event->count);
+    do {
+        if (count == 0) { return false; }
+    } while (!atomic_compare_exchange_weak(&event->count, &count, count - 1));
+    /* Wake the next waiter for the rest */
+    if (count > 1) { WakeCondition_set(&event->pending); }
+    return true;
+}
+
+/** \brief Take up to \p max_items of the oldest items posted to \p event
+ * into the array \p items
+ *
+ * Call it again until it returns 0 to take all of them. If it leaves some
+ * behind, the next await of \p event does not wait.
+ *
+ * \return The number of items taken, 0 if there was none
+ */
+static inline size_t CoroEvent_recv_many(CoroEvent *event,
+                                         void *     items,
+                                         size_t     max_items) {
+    WakeCondition_clear(&event->pending);
+    size_t n_items = Channel_try_recv_many(event->ring, items, max_items);
+    if (n_items == max_items) { WakeCondition_set(&event->pending); }
+    return n_items;
+}
+
+/** \brief Number of items posted to \p event that were lost as its ring
+ * was full, since the last call */
+static inline uint32_t CoroEvent_n_lost(CoroEvent *event) {
+    return atomic_exchange(&event->n_lost, 0);
+}
+
+#endif /* ifndef EVENT_H */
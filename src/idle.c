@@ -0,0 +1,36 @@
+/** \file idle.c
+ *
+ * Pluggable strategy to put the scheduler to sleep while nothing can run.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include "idle.h"
+#include <stddef.h>
+
+
+_Atomic uint32_t CoroIdle_wake_epoch;
+
+static const CoroIdleStrategy *_Atomic idle_strategy;
+
+
+void CoroIdle_set_strategy(const CoroIdleStrategy *strategy) {
+    atomic_store(&idle_strategy, strategy);
+}
+
+
+void CoroIdle_notify(void) {
+    atomic_fetch_add(&CoroIdle_wake_epoch, 1);
+    const CoroIdleStrategy *strategy = atomic_load(&idle_strategy);
+    if (strategy != NULL && strategy->wake != NULL) {
+        strategy->wake(strategy->context);
+    }
+}
+
+
+void CoroIdle_wait(uint32_t epoch, uint32_t timeout_ms) {
+    const CoroIdleStrategy *strategy = atomic_load(&idle_strategy);
+    if (strategy != NULL && strategy->wait != NULL) {
+        strategy->wait(
+                strategy->context, &CoroIdle_wake_epoch, epoch, timeout_ms);
+    }
+}
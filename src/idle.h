@@ -0,0 +1,93 @@
+/** \file idle.h
+ *
+ * Pluggable strategy to put the scheduler to sleep while nothing can run.
+ *
+ * Every event that can make a coroutine runnable (#Condition_set,
+ * #Waiter_wake, #Resource_release, ...) calls #CoroIdle_notify, which bumps a
+ * wake epoch. The scheduler reads the epoch before a pass and, if the pass
+ * executed nothing, sleeps only while the epoch is unchanged. An event racing
+ * with the end of the pass therefore always cancels the sleep.
+ *
+ * The sleep is also bounded by the time until the next timer expires.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+#ifndef IDLE_H
+#define IDLE_H 1
+
+#include <inttypes.h>
+#include <stdatomic.h>
+
+
+/** A timeout for #CoroIdle_wait that never elapses */
+#define CORO_IDLE_WAIT_FOREVER UINT32_MAX
+
+/** \brief A way to sleep until #CoroIdle_notify is called
+ *
+ * \code{.c}
+ * // Cortex-M: the interrupt calling CoroIdle_notify() ends the WFI itself
+ * static void wfi_wait(void *context,
+ *                      const _Atomic uint32_t *epoch_ptr,
+ *                      uint32_t epoch,
+ *                      uint32_t timeout_ms) {
+ *     // The timer tick interrupt ends the WFI at the deadline
+ *     __disable_irq();
+ *     if (atomic_load(epoch_ptr) == epoch) { __WFI(); }
+ *     __enable_irq();
+ * }
+ * static const CoroIdleStrategy wfi = {.wait = wfi_wait};
+ * CoroIdle_set_strategy(&wfi);
+ * \endcode
+ */
+typedef struct {
+    /** Sleep while \p *epoch_ptr equals \p epoch, for at most
+     * \p timeout_ms milliseconds (or forever if #CORO_IDLE_WAIT_FOREVER).
+     *
+     * Checking the epoch and going to sleep must be atomic with respect to
+     * #CoroIdle_notify (e.g. interrupts disabled around WFI, or a futex).
+     * Returning early is allowed.
+     */
+    void (*wait)(void *                  context,
+                 const _Atomic uint32_t *epoch_ptr,
+                 uint32_t                epoch,
+                 uint32_t                timeout_ms);
+    /** Wake a sleeping \c wait after the epoch was bumped. May be \c NULL
+     * if notifying always ends the sleep anyway (as an interrupt does for
+     * WFI). Must be safe to call from interrupts if they notify. */
+    void (*wake)(void *context);
+    /** Passed to \c wait and \c wake */
+    void *context;
+} CoroIdleStrategy;
+
+
+/** \brief The wake epoch, only for use by #CoroIdle_epoch */
+extern _Atomic uint32_t CoroIdle_wake_epoch;
+
+
+/** \brief Set the strategy used by the scheduler when idle
+ * \param strategy the strategy, or \c NULL to busy loop (the default)
+ * \note \p strategy must be valid as long as it is set
+ */
+void CoroIdle_set_strategy(const CoroIdleStrategy *strategy);
+
+
+/** \brief Current wake epoch, to be read before looking for work */
+static inline uint32_t CoroIdle_epoch(void) {
+    return atomic_load(&CoroIdle_wake_epoch);
+}
+
+
+/** \brief Raise a pending wake for the scheduler
+ *
+ * Safe to call from any context, including interrupts.
+ */
+void CoroIdle_notify(void);
+
+
+/** \brief Sleep until a wake is raised after \p epoch was read
+ * \param epoch      value of #CoroIdle_epoch from before the last search for
+ *                   work
+ * \param timeout_ms longest time to sleep, or #CORO_IDLE_WAIT_FOREVER
+ */
+void CoroIdle_wait(uint32_t epoch, uint32_t timeout_ms);
+
+#endif /* ifndef IDLE_H */
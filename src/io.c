@@ -0,0 +1,47 @@
+/** \file io.c
+ *
+ * File descriptor I/O that coroutines can await, through a pluggable reactor.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include "io.h"
+#include <assert.h>
+
+
+static const CoroReactor *_Atomic io_reactor;
+
+
+void CoroIo_set_reactor(const CoroReactor *reactor) {
+    atomic_store(&io_reactor, reactor);
+}
+
+
+bool CoroIo_submit(CoroIo *io, Waiter *waiter) {
+    const CoroReactor *reactor = atomic_load(&io_reactor);
+    assert(reactor != NULL && "set a reactor before awaiting I/O");
+    io->waiter = waiter;
+    atomic_store(&io->done, false);
+    if (reactor == NULL) {
+        io->waiter = NULL;
+        CoroIo_complete(io, -1);
+        return false;
+    }
+    return reactor->submit(reactor->context, io);
+}
+
+
+void CoroIo_cancel(CoroIo *io) {
+    const CoroReactor *reactor = atomic_load(&io_reactor);
+    if (reactor != NULL && !atomic_load(&io->done)) {
+        reactor->cancel(reactor->context, io);
+    }
+    io->waiter = NULL;
+}
+
+
+void CoroIo_poll(void) {
+    const CoroReactor *reactor = atomic_load(&io_reactor);
+    if (reactor != NULL && reactor->poll != NULL) {
+        reactor->poll(reactor->context);
+    }
+}
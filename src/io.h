@@ -0,0 +1,183 @@
+/** \file io.h
+ *
+ * File descriptor I/O that coroutines can await, through a pluggable reactor.
+ *
+ * A #CoroIo describes a single operation on a file descriptor: waiting for
+ * it to become readable or writable, or reading or writing a buffer. The
+ * reactor set with #CoroIo_set_reactor performs it in the background and
+ * completes it with #CoroIo_complete, which wakes exactly the coroutine
+ * awaiting it.
+ *
+ * The reactor usually is the idle strategy as well (see idle.h), so that the
+ * scheduler sleeps in the system call that waits for I/O.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+#ifndef IO_H
+#define IO_H 1
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "wait_list.h"
+
+
+/** Operations of a #CoroIo */
+typedef enum {
+    /** Wait for CoroIo::events on the descriptor */
+    CORO_IO_POLL,
+    /** Read up to CoroIo::size bytes into CoroIo::buffer */
+    CORO_IO_READ,
+    /** Write up to CoroIo::size bytes of CoroIo::buffer */
+    CORO_IO_WRITE,
+} CoroIoOp;
+
+
+/** Events of a #CORO_IO_POLL operation */
+enum {
+    /** Data can be read without blocking */
+    CORO_IO_READABLE = 1,
+    /** Data can be written without blocking */
+    CORO_IO_WRITABLE = 2,
+    /** An error condition (always reported, never needs to be asked for) */
+    CORO_IO_ERROR = 4,
+    /** The peer hung up (always reported, never needs to be asked for) */
+    CORO_IO_HANGUP = 8,
+};
+
+
+/** \brief An I/O operation
+ *
+ * Set it up with #CoroIo_poll_init, #CoroIo_read_init or
+ * #CoroIo_write_init and await it.
+ *
+ * \warning It must stay valid (e.g. in the variables of the coroutine) until
+ * it is done or cancelled.
+ */
+typedef struct CoroIo CoroIo;
+struct CoroIo {
+    /** The file descriptor */
+    int fd;
+    /** What to do */
+    CoroIoOp op;
+    /** The #CORO_IO_READABLE and #CORO_IO_WRITABLE events to wait for */
+    uint32_t events;
+    /** Buffer to read into or write from */
+    void *buffer;
+    /** Size of \c buffer */
+    size_t size;
+    /** Once done, the events that occurred for #CORO_IO_POLL or the number
+     * of bytes transferred. A negative error number (\c -errno on POSIX
+     * hosts) if it failed. */
+    intptr_t result;
+    /** Set once it completed */
+    _Atomic bool done;
+    /** Set while the reactor has it (private to the reactor) */
+    bool submitted;
+    /** The waiter to wake on completion, or \c NULL (private) */
+    Waiter *waiter;
+    /** Link in a list of the reactor (private) */
+    CoroIo *next;
+};
+
+
+/** \brief Make \p io wait for \p events (#CORO_IO_READABLE and/or
+ * #CORO_IO_WRITABLE) on \p fd */
+static inline void CoroIo_poll_init(CoroIo *io, int fd, uint32_t events) {
+    io->fd     = fd;
+    io->op     = CORO_IO_POLL;
+    io->events = events;
+    io->buffer = NULL;
+    io->size   = 0;
+}
+
+/** \brief Make \p io read up to \p size bytes of \p fd into \p buffer */
+static inline void CoroIo_read_init(CoroIo *io,
+                                    int     fd,
+                                    void *  buffer,
+                                    size_t  size) {
+    io->fd     = fd;
+    io->op     = CORO_IO_READ;
+    io->events = CORO_IO_READABLE;
+    io->buffer = buffer;
+    io->size   = size;
+}
+
+/** \brief Make \p io write up to \p size bytes of \p buffer to \p fd */
+static inline void CoroIo_write_init(CoroIo *    io,
+                                     int         fd,
+                                     const void *buffer,
+                                     size_t      size) {
+    io->fd     = fd;
+    io->op     = CORO_IO_WRITE;
+    io->events = CORO_IO_WRITABLE;
+    io->buffer = (void *)buffer;
+    io->size   = size;
+}
+
+
+/** \brief A way to perform #CoroIo operations
+ *
+ * Every function may be called from any thread running a scheduler.
+ */
+typedef struct {
+    /** Start \p io, and complete it with #CoroIo_complete when it is done.
+     * It may be completed before this returns.
+     * \return \c false if it was completed already */
+    bool (*submit)(void *context, CoroIo *io);
+    /** Make sure \p io is not completed after this returns, if it was
+     * submitted and not completed yet. It may still be completed before
+     * this returns (e.g. if the data was already read). */
+    void (*cancel)(void *context, CoroIo *io);
+    /** Complete the operations that are done, without blocking. Called by
+     * the scheduler before every pass, so it should return at once unless
+     * it has completions pending. May be \c NULL if operations are
+     * completed from elsewhere. */
+    void (*poll)(void *context);
+    /** Passed to the functions */
+    void *context;
+} CoroReactor;
+
+
+/** \brief Set the reactor that performs #CoroIo operations
+ * \note \p reactor must be valid as long as it is set
+ */
+void CoroIo_set_reactor(const CoroReactor *reactor);
+
+
+/** \brief Complete \p io with \p result
+ *
+ * Only for use by reactors, once per submission. \p io is not touched after
+ * it is marked done.
+ */
+static inline void CoroIo_complete(CoroIo *io, intptr_t result) {
+    Waiter *waiter = io->waiter;
+    io->result     = result;
+    io->submitted  = false;
+    atomic_store(&io->done, true);
+    if (waiter != NULL) { Waiter_wake(waiter); }
+}
+
+
+/** \brief Start \p io with the reactor
+ * \param waiter the waiter to wake once it is done, or \c NULL
+ * \return \c false if it was completed already
+ */
+bool CoroIo_submit(CoroIo *io, Waiter *waiter);
+
+
+/** \brief Stop \p io if it is still running
+ *
+ * Safe to call if \p io is done. Afterwards, CoroIo::done tells whether it
+ * completed anyway.
+ */
+void CoroIo_cancel(CoroIo *io);
+
+
+/** \brief Complete the operations of the reactor that are done
+ *
+ * Called by the scheduler before every pass.
+ */
+void CoroIo_poll(void);
+
+#endif /* ifndef IO_H */
@@ -0,0 +1,64 @@
+/** \file idle_futex.c
+ *
+ * Linux futex based #CoroIdleStrategy
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include "idle_futex.h"
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/** Number of threads in (or about to enter) FUTEX_WAIT */
+static _Atomic uint32_t n_sleepers;
+
+
+static void futex_wait(void *                  context,
+                       const _Atomic uint32_t *epoch_ptr,
+                       uint32_t                epoch,
+                       uint32_t                timeout_ms) {
+    (void)context;
+    struct timespec  timeout = {
+            .tv_sec  = timeout_ms / 1000,
+            .tv_nsec = (long)(timeout_ms % 1000) * 1000000L,
+    };
+    struct timespec *p_timeout =
+            (timeout_ms == CORO_IDLE_WAIT_FOREVER) ? NULL : &timeout;
+    /* Paired with the epoch increment before futex_wake() reads n_sleepers:
+     * either the notifier sees us sleeping or we see the new epoch. */
+    atomic_fetch_add(&n_sleepers, 1);
+    if (atomic_load(epoch_ptr) == epoch) {
+        syscall(SYS_futex,
+                (const uint32_t *)epoch_ptr,
+                FUTEX_WAIT_PRIVATE,
+                epoch,
+                p_timeout,
+                NULL,
+                0);
+    }
+    atomic_fetch_sub(&n_sleepers, 1);
+}
+
+
+static void futex_wake(void *context) {
+    (void)context;
+    if (atomic_load(&n_sleepers) != 0) {
+        syscall(SYS_futex,
+                (const uint32_t *)&CoroIdle_wake_epoch,
+                FUTEX_WAKE_PRIVATE,
+                INT_MAX,
+                NULL,
+                NULL,
+                0);
+    }
+}
+
+
+const CoroIdleStrategy CoroIdle_futex_strategy = {
+        .wait    = futex_wait,
+        .wake    = futex_wake,
+        .context = NULL,
+};
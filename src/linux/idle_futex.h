@@ -0,0 +1,23 @@
+/** \file idle_futex.h
+ *
+ * Linux futex based #CoroIdleStrategy
+ */
+/* Copyright 2018 Gaurav Juvekar */
+#ifndef IDLE_FUTEX_H
+#define IDLE_FUTEX_H 1
+
+#include "../idle.h"
+
+
+/** \brief Sleeps the scheduler thread on a futex on the wake epoch
+ *
+ * #CoroIdle_notify only makes a system call while the scheduler is actually
+ * asleep, so it may be called from any thread or signal handler.
+ *
+ * \code{.c}
+ * CoroIdle_set_strategy(&CoroIdle_futex_strategy);
+ * \endcode
+ */
+extern const CoroIdleStrategy CoroIdle_futex_strategy;
+
+#endif /* ifndef IDLE_FUTEX_H */
@@ -0,0 +1,342 @@
+/** \file reactor_epoll.c
+ *
+ * Linux epoll based #CoroReactor and #CoroIdleStrategy
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include "reactor_epoll.h"
+#include "idle_futex.h"
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/** The operations waiting on a descriptor */
+typedef struct {
+    /** Oldest first */
+    CoroIo *head;
+    /** Whether the descriptor is in the epoll set */
+    bool added;
+} Watch;
+
+
+static Watch watches[CONF_CORO_REACTOR_MAX_FDS];
+/** Guards \c watches and the submitted operations */
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Number of operations in \c watches */
+static _Atomic uint32_t n_watched;
+/** Millisecond of the last look at the epoll set of a busy scheduler */
+static _Atomic uint64_t polled_at;
+
+static int epoll_fd = -1;
+/** An eventfd that is readable while a sleeping scheduler must wake */
+static int wake_fd = -1;
+/** Set while a thread sleeps in epoll_wait. As epoll wakes only one of the
+ * threads sleeping on it, the others sleep on the futex of
+ * #CoroIdle_futex_strategy meanwhile. */
+static _Atomic bool polling;
+
+
+static uint32_t to_epoll(uint32_t events) {
+    return ((events & CORO_IO_READABLE) ? EPOLLIN : 0)
+           | ((events & CORO_IO_WRITABLE) ? EPOLLOUT : 0);
+}
+
+
+/** Also takes poll() events, which have the same values on Linux */
+static uint32_t from_epoll(uint32_t events) {
+    return ((events & EPOLLIN) ? CORO_IO_READABLE : 0)
+           | ((events & EPOLLOUT) ? CORO_IO_WRITABLE : 0)
+           | ((events & EPOLLERR) ? CORO_IO_ERROR : 0)
+           | ((events & EPOLLHUP) ? CORO_IO_HANGUP : 0);
+}
+
+
+/** \brief Perform \p io if \p events (of epoll) say it may not block
+ * \return If it completed
+ */
+static bool attempt(CoroIo *io, uint32_t events) {
+    uint32_t ready = from_epoll(events)
+                     & (io->events | CORO_IO_ERROR | CORO_IO_HANGUP);
+    if (ready == 0) { return false; }
+
+    ssize_t n;
+    switch (io->op) {
+    case CORO_IO_POLL: CoroIo_complete(io, (intptr_t)ready); return true;
+    case CORO_IO_READ: n = read(io->fd, io->buffer, io->size); break;
+    case CORO_IO_WRITE: n = write(io->fd, io->buffer, io->size); break;
+    default:
+        n     = -1;
+        errno = EINVAL;
+        break;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return false;
+    }
+    CoroIo_complete(io, (n < 0) ? -errno : (intptr_t)n);
+    return true;
+}
+
+
+/** Complete every operation of \p watch with the error number \p error */
+static void fail_all(Watch *watch, int error) {
+    CoroIo *io = watch->head;
+    watch->head = NULL;
+    while (io != NULL) {
+        /* It may be reused as soon as it is done */
+        CoroIo *next = io->next;
+        atomic_fetch_sub(&n_watched, 1);
+        CoroIo_complete(io, -error);
+        io = next;
+    }
+}
+
+
+/** \brief Ask epoll for one report of the events the operations of \p watch
+ * wait for
+ * \return 0, or the error number
+ */
+static int rearm(int fd, Watch *watch) {
+    uint32_t events = 0;
+    for (CoroIo *io = watch->head; io != NULL; io = io->next) {
+        events |= io->events;
+    }
+    if (events == 0) { return 0; }
+
+    struct epoll_event event = {
+            .events  = to_epoll(events) | EPOLLONESHOT,
+            .data.fd = fd,
+    };
+    if (epoll_ctl(epoll_fd,
+                  watch->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                  fd,
+                  &event)
+        != 0) {
+        /* The descriptor was closed (and possibly reused) meanwhile */
+        int op = (errno == ENOENT) ? EPOLL_CTL_ADD
+                                   : (errno == EEXIST) ? EPOLL_CTL_MOD : -1;
+        if (op < 0 || epoll_ctl(epoll_fd, op, fd, &event) != 0) {
+            return errno;
+        }
+    }
+    watch->added = true;
+    return 0;
+}
+
+
+/** Make the thread sleeping in epoll_wait return */
+static void raise_wake(void) {
+    uint64_t one = 1;
+    ssize_t  n   = write(wake_fd, &one, sizeof(one));
+    (void)n;
+}
+
+
+static void reset_wake(void) {
+    uint64_t count;
+    ssize_t  n = read(wake_fd, &count, sizeof(count));
+    (void)n;
+}
+
+
+/** \brief Complete the operations of the descriptors \p events report
+ * \param woken whether the thread slept in epoll_wait, and must reset the
+ *              wake
+ */
+static void dispatch(const struct epoll_event *events,
+                     int                       n_events,
+                     bool                      woken) {
+    for (int i = 0; i < n_events; i++) {
+        int fd = events[i].data.fd;
+        if (fd == wake_fd) {
+            if (woken) { reset_wake(); }
+            continue;
+        }
+
+        pthread_mutex_lock(&watch_lock);
+        Watch *  watch = &watches[fd];
+        CoroIo **link  = &watch->head;
+        while (*link != NULL) {
+            CoroIo *io   = *link;
+            CoroIo *next = io->next;
+            if (attempt(io, events[i].events)) {
+                *link = next;
+                atomic_fetch_sub(&n_watched, 1);
+            } else {
+                link = &io->next;
+            }
+        }
+        /* Reports are one-shot */
+        int error = rearm(fd, watch);
+        if (error != 0) { fail_all(watch, error); }
+        pthread_mutex_unlock(&watch_lock);
+    }
+}
+
+
+/** Whether an operation of \p watch waits for any of \p events */
+static bool waited_for(const Watch *watch, uint32_t events) {
+    for (CoroIo *io = watch->head; io != NULL; io = io->next) {
+        if ((io->events & events) != 0) { return true; }
+    }
+    return false;
+}
+
+
+/** \brief Perform \p io at once if it may not block
+ * \return If it completed
+ */
+static bool attempt_now(CoroIo *io) {
+    uint32_t events = EPOLLIN | EPOLLOUT;
+    if (io->op == CORO_IO_POLL) {
+        struct pollfd pollfd = {
+                .fd     = io->fd,
+                .events = (short)to_epoll(io->events),
+        };
+        events = (poll(&pollfd, 1, 0) == 1) ? (uint32_t)pollfd.revents : 0;
+    }
+    return attempt(io, events);
+}
+
+
+static bool epoll_submit(void *context, CoroIo *io) {
+    (void)context;
+    if (io->fd < 0 || io->fd >= CONF_CORO_REACTOR_MAX_FDS) {
+        if (!attempt_now(io)) {
+            CoroIo_complete(io, (io->fd < 0) ? -EBADF : -EMFILE);
+        }
+        return false;
+    }
+
+    pthread_mutex_lock(&watch_lock);
+    Watch *watch = &watches[io->fd];
+    /* Not ahead of those already waiting for the same events */
+    if (!waited_for(watch, io->events) && attempt_now(io)) {
+        pthread_mutex_unlock(&watch_lock);
+        return false;
+    }
+    CoroIo **tail = &watch->head;
+    while (*tail != NULL) { tail = &(*tail)->next; }
+    io->next      = NULL;
+    io->submitted = true;
+    *tail         = io;
+    atomic_fetch_add(&n_watched, 1);
+    int error = rearm(io->fd, watch);
+    if (error != 0) { fail_all(watch, error); }
+    pthread_mutex_unlock(&watch_lock);
+    return error == 0;
+}
+
+
+static void epoll_cancel(void *context, CoroIo *io) {
+    (void)context;
+    pthread_mutex_lock(&watch_lock);
+    if (io->submitted) {
+        /* A report for nobody just re-arms what is left */
+        CoroIo **link = &watches[io->fd].head;
+        while (*link != io) { link = &(*link)->next; }
+        *link         = io->next;
+        io->submitted = false;
+        atomic_fetch_sub(&n_watched, 1);
+    }
+    pthread_mutex_unlock(&watch_lock);
+}
+
+
+static uint64_t now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+
+static void epoll_poll(void *context) {
+    (void)context;
+    if (atomic_load(&n_watched) == 0) { return; }
+    /* Only the kernel knows whether anything is ready, so ask it once per
+     * interval rather than on every wake of the scheduler */
+    uint64_t now  = now_ms();
+    uint64_t last = atomic_load(&polled_at);
+    if (now - last < CONF_CORO_REACTOR_BUSY_POLL_MS
+        || !atomic_compare_exchange_strong(&polled_at, &last, now)) {
+        return;
+    }
+    struct epoll_event events[CONF_CORO_REACTOR_N_EVENTS];
+    dispatch(events,
+             epoll_wait(epoll_fd, events, CONF_CORO_REACTOR_N_EVENTS, 0),
+             false);
+}
+
+
+const CoroReactor CoroReactor_epoll = {
+        .submit  = epoll_submit,
+        .cancel  = epoll_cancel,
+        .poll    = epoll_poll,
+        .context = NULL,
+};
+
+
+static void epoll_idle_wait(void *                  context,
+                            const _Atomic uint32_t *epoch_ptr,
+                            uint32_t                epoch,
+                            uint32_t                timeout_ms) {
+    (void)context;
+    bool expected = false;
+    if (!atomic_compare_exchange_strong(&polling, &expected, true)) {
+        CoroIdle_futex_strategy.wait(NULL, epoch_ptr, epoch, timeout_ms);
+        return;
+    }
+
+    struct epoll_event events[CONF_CORO_REACTOR_N_EVENTS];
+    int                n_events = 0;
+    int                timeout  = (timeout_ms > INT_MAX) ? INT_MAX
+                                                          : (int)timeout_ms;
+    if (timeout_ms == CORO_IDLE_WAIT_FOREVER) { timeout = -1; }
+    /* Paired with the epoch increment before epoll_wake() reads polling:
+     * either the notifier sees us polling or we see the new epoch. */
+    if (atomic_load(epoch_ptr) == epoch) {
+        n_events = epoll_wait(
+                epoll_fd, events, CONF_CORO_REACTOR_N_EVENTS, timeout);
+    }
+    atomic_store(&polling, false);
+    dispatch(events, n_events, true);
+}
+
+
+static void epoll_wake(void *context) {
+    (void)context;
+    if (atomic_load(&polling)) { raise_wake(); }
+    CoroIdle_futex_strategy.wake(NULL);
+}
+
+
+const CoroIdleStrategy CoroIdle_epoll_strategy = {
+        .wait    = epoll_idle_wait,
+        .wake    = epoll_wake,
+        .context = NULL,
+};
+
+
+bool CoroReactor_epoll_start(void) {
+    int fd = epoll_create1(EPOLL_CLOEXEC);
+    if (fd < 0) { return false; }
+
+    int                wake  = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = wake};
+    if (wake < 0 || epoll_ctl(fd, EPOLL_CTL_ADD, wake, &event) != 0) {
+        int error = errno;
+        if (wake >= 0) { close(wake); }
+        close(fd);
+        errno = error;
+        return false;
+    }
+    wake_fd  = wake;
+    epoll_fd = fd;
+    return true;
+}
@@ -0,0 +1,62 @@
+/** \file reactor_epoll.h
+ *
+ * Linux epoll based #CoroReactor and #CoroIdleStrategy
+ */
+/* Copyright 2018 Gaurav Juvekar */
+#ifndef REACTOR_EPOLL_H
+#define REACTOR_EPOLL_H 1
+
+#include <stdbool.h>
+#include "../idle.h"
+#include "../io.h"
+
+
+#ifndef CONF_CORO_REACTOR_MAX_FDS
+/** File descriptors at or above this cannot be awaited */
+#define CONF_CORO_REACTOR_MAX_FDS 1024
+#endif
+
+#ifndef CONF_CORO_REACTOR_BUSY_POLL_MS
+/** Milliseconds between two looks at the epoll set by schedulers that are
+ * busy. Idle ones sleep in \c epoll_wait and see events at once. */
+#define CONF_CORO_REACTOR_BUSY_POLL_MS 1
+#endif
+
+#ifndef CONF_CORO_REACTOR_N_EVENTS
+/** Most events taken from the kernel by a single system call */
+#define CONF_CORO_REACTOR_N_EVENTS 64
+#endif
+
+
+/** \brief Performs #CoroIo operations with epoll
+ *
+ * Reads and writes are attempted at once, and once more whenever epoll
+ * reports the descriptor ready, so their descriptors must be non-blocking
+ * (\c O_NONBLOCK). Waiters for the same events of a descriptor are served
+ * oldest first, one submitted meanwhile included.
+ */
+extern const CoroReactor CoroReactor_epoll;
+
+/** \brief Sleeps the scheduler thread in \c epoll_wait
+ *
+ * Completes the operations of #CoroReactor_epoll that are done as it wakes.
+ * One thread at a time sleeps in \c epoll_wait, other workers sleep as with
+ * #CoroIdle_futex_strategy. #CoroIdle_notify only makes system calls while a
+ * scheduler is actually asleep.
+ */
+extern const CoroIdleStrategy CoroIdle_epoll_strategy;
+
+
+/** \brief Create the epoll instance of #CoroReactor_epoll
+ *
+ * \code{.c}
+ * if (!CoroReactor_epoll_start()) { perror("epoll"); }
+ * CoroIo_set_reactor(&CoroReactor_epoll);
+ * CoroIdle_set_strategy(&CoroIdle_epoll_strategy);
+ * \endcode
+ *
+ * \return \c false (with \c errno set) if it could not be created
+ */
+bool CoroReactor_epoll_start(void);
+
+#endif /* ifndef REACTOR_EPOLL_H */
@@ -0,0 +1,456 @@
+/** \file reactor_uring.c
+ *
+ * Linux io_uring based #CoroReactor and #CoroIdleStrategy
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include "reactor_uring.h"
+#include "idle_futex.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+/** user_data of the poll of \c wake_fd */
+#define TAG_WAKE 1u
+/** user_data of completions that need no handling */
+#define TAG_IGNORE 2u
+/** Set in the user_data (a #CoroIo pointer) of the poll that a read or
+ * write which found nothing to transfer waits for before it is retried */
+#define TAG_POLL_FIRST 1u
+
+
+/** The rings shared with the kernel, guarded by \c ring_lock */
+static struct {
+    int                  fd;
+    uint32_t             sq_entries;
+    uint32_t             sq_mask;
+    _Atomic uint32_t *   sq_head;
+    _Atomic uint32_t *   sq_tail;
+    uint32_t *           sq_array;
+    struct io_uring_sqe *sqes;
+    uint32_t             cq_mask;
+    _Atomic uint32_t *   cq_head;
+    _Atomic uint32_t *   cq_tail;
+    struct io_uring_cqe *cqes;
+} ring = {.fd = -1};
+
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Entries queued but not submitted yet */
+static uint32_t n_unsubmitted;
+/** The operation being cancelled, whose cancelled completion only ends
+ * its submission */
+static CoroIo *cancelling;
+/** Number of submitted operations */
+static _Atomic uint32_t n_submitted;
+
+/** An eventfd polled through the ring, to wake a thread waiting on it */
+static int wake_fd = -1;
+/** Set while a thread sleeps in io_uring_enter */
+static _Atomic bool polling;
+
+
+static int enter(uint32_t    to_submit,
+                 uint32_t    min_complete,
+                 uint32_t    flags,
+                 const void *arg,
+                 size_t      arg_size) {
+    return (int)syscall(__NR_io_uring_enter,
+                        ring.fd,
+                        to_submit,
+                        min_complete,
+                        flags,
+                        arg,
+                        arg_size);
+}
+
+
+/** poll events as io_uring takes them */
+static uint32_t poll32(uint32_t events) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    events = (events << 16) | (events >> 16);
+#endif
+    return events;
+}
+
+
+static uint32_t to_poll(uint32_t events) {
+    return ((events & CORO_IO_READABLE) ? POLLIN : 0)
+           | ((events & CORO_IO_WRITABLE) ? POLLOUT : 0);
+}
+
+
+static uint32_t from_poll(uint32_t events) {
+    return ((events & POLLIN) ? CORO_IO_READABLE : 0)
+           | ((events & POLLOUT) ? CORO_IO_WRITABLE : 0)
+           | ((events & POLLERR) ? CORO_IO_ERROR : 0)
+           | ((events & POLLHUP) ? CORO_IO_HANGUP : 0);
+}
+
+
+/** Free entries of the submission queue */
+static uint32_t sq_room(void) {
+    uint32_t head = atomic_load_explicit(ring.sq_head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(ring.sq_tail, memory_order_relaxed);
+    return ring.sq_entries - (tail - head);
+}
+
+
+/** Queue \p sqe for submission, in an entry made room for first */
+static void push(const struct io_uring_sqe *sqe) {
+    uint32_t tail  = atomic_load_explicit(ring.sq_tail, memory_order_relaxed);
+    uint32_t index = tail & ring.sq_mask;
+    ring.sqes[index]     = *sqe;
+    ring.sq_array[index] = index;
+    atomic_store_explicit(ring.sq_tail, tail + 1, memory_order_release);
+    n_unsubmitted++;
+}
+
+
+static void push_wake_poll(void) {
+    struct io_uring_sqe sqe = {
+            .opcode        = IORING_OP_POLL_ADD,
+            .fd            = wake_fd,
+            .poll32_events = poll32(POLLIN),
+            .user_data     = TAG_WAKE,
+    };
+    push(&sqe);
+}
+
+
+/** \brief Queue \p io, or the poll it waits for first if \p poll_first */
+static void push_io(CoroIo *io, bool poll_first) {
+    struct io_uring_sqe sqe = {
+            .fd        = io->fd,
+            .user_data = (uintptr_t)io | (poll_first ? TAG_POLL_FIRST : 0),
+    };
+    if (io->op == CORO_IO_POLL || poll_first) {
+        sqe.opcode        = IORING_OP_POLL_ADD;
+        sqe.poll32_events = poll32(to_poll(io->events));
+    } else {
+        sqe.opcode = (io->op == CORO_IO_READ) ? IORING_OP_READ
+                                              : IORING_OP_WRITE;
+        sqe.addr   = (uintptr_t)io->buffer;
+        sqe.len    = (io->size > UINT32_MAX) ? UINT32_MAX
+                                             : (uint32_t)io->size;
+        /* At the file position, as read() and write() */
+        sqe.off = UINT64_MAX;
+    }
+    push(&sqe);
+}
+
+
+static void push_cancel(uint64_t user_data) {
+    struct io_uring_sqe sqe = {
+            .opcode    = IORING_OP_ASYNC_CANCEL,
+            .fd        = -1,
+            .addr      = user_data,
+            .user_data = TAG_IGNORE,
+    };
+    push(&sqe);
+}
+
+
+static void reset_wake(void) {
+    uint64_t count;
+    ssize_t  n = read(wake_fd, &count, sizeof(count));
+    (void)n;
+}
+
+
+/** Handle the completion of an entry with \p user_data */
+static void handle(uint64_t user_data, int32_t res) {
+    if (user_data == TAG_WAKE) {
+        reset_wake();
+        push_wake_poll();
+        return;
+    }
+    if (user_data == TAG_IGNORE) { return; }
+
+    uintptr_t address    = (uintptr_t)user_data;
+    CoroIo *  io         = (CoroIo *)(address & ~(uintptr_t)TAG_POLL_FIRST);
+    bool      poll_first = (address & TAG_POLL_FIRST) != 0;
+    /* A read or write is retried once the poll it waited for reports, and
+     * waits for one if it found nothing to transfer */
+    bool retry = poll_first ? (res >= 0)
+                            : (io->op != CORO_IO_POLL && res == -EAGAIN);
+    if (io == cancelling && (retry || res == -ECANCELED || res == -EINTR)) {
+        io->submitted = false;
+        atomic_fetch_sub(&n_submitted, 1);
+    } else if (retry) {
+        /* Now that it is ready, or to wait until it is */
+        push_io(io, !poll_first);
+    } else {
+        atomic_fetch_sub(&n_submitted, 1);
+        if (res >= 0 && io->op == CORO_IO_POLL) {
+            res = (int32_t)(from_poll((uint32_t)res)
+                            & (io->events | CORO_IO_ERROR | CORO_IO_HANGUP));
+        }
+        CoroIo_complete(io, res);
+    }
+}
+
+
+/** \brief Submit the queued entries, without handling completions
+ * \return 0, or the error number
+ */
+static int submit(void) {
+    while (n_unsubmitted != 0) {
+        int n = enter(n_unsubmitted, 0, 0, NULL, 0);
+        if (n >= 0) {
+            n_unsubmitted -= (uint32_t)n;
+        } else if (errno != EINTR) {
+            return errno;
+        }
+    }
+    return 0;
+}
+
+
+/** \brief Handle every completion in the ring
+ *
+ * Handling one queues at most one entry, so they are handled as many at a
+ * time as the submission queue has room for, and what they queued is
+ * submitted in between. Those left if it could not be are handled later.
+ *
+ * \return The number of them
+ */
+static uint32_t reap(void) {
+    uint32_t n_reaped = 0;
+    for (;;) {
+        uint32_t head = atomic_load_explicit(ring.cq_head,
+                                             memory_order_relaxed);
+        uint32_t tail = atomic_load_explicit(ring.cq_tail,
+                                             memory_order_acquire);
+        if (head == tail) { break; }
+        if (sq_room() == 0 && submit() != 0) { break; }
+        uint32_t n    = tail - head;
+        uint32_t room = sq_room();
+        if (n > room) { n = room; }
+        for (uint32_t i = head; i != head + n; i++) {
+            struct io_uring_cqe cqe = ring.cqes[i & ring.cq_mask];
+            /* Free the entry first, handling it may queue another one */
+            atomic_store_explicit(ring.cq_head, i + 1, memory_order_release);
+            handle(cqe.user_data, cqe.res);
+        }
+        n_reaped += n;
+    }
+    return n_reaped;
+}
+
+
+/** \brief Submit the queued entries, handling completions if the kernel
+ * needs them handled first
+ * \return 0, or the error number
+ */
+static int flush(void) {
+    int error;
+    while ((error = submit()) == EAGAIN || error == EBUSY) {
+        /* The completion queue is full */
+        reap();
+    }
+    return error;
+}
+
+
+/** \brief Make room for \p n entries in the submission queue
+ * \return 0, or the error number
+ */
+static int reserve(uint32_t n) {
+    return (sq_room() >= n) ? 0 : flush();
+}
+
+
+static bool uring_submit(void *context, CoroIo *io) {
+    (void)context;
+    pthread_mutex_lock(&ring_lock);
+    int error = reserve(1);
+    if (error == 0) {
+        io->submitted = true;
+        atomic_fetch_add(&n_submitted, 1);
+        push_io(io, false);
+        error = flush();
+        if (error != 0) { atomic_fetch_sub(&n_submitted, 1); }
+    }
+    if (error != 0) { CoroIo_complete(io, -error); }
+    pthread_mutex_unlock(&ring_lock);
+    return error == 0;
+}
+
+
+static void uring_cancel(void *context, CoroIo *io) {
+    (void)context;
+    pthread_mutex_lock(&ring_lock);
+    if (io->submitted && reserve(2) == 0) {
+        /* Whichever of the two is in flight */
+        cancelling = io;
+        push_cancel((uintptr_t)io);
+        push_cancel((uintptr_t)io | TAG_POLL_FIRST);
+        /* Nobody else reaps meanwhile, so this ends with its completion */
+        while (flush() == 0 && io->submitted) {
+            if (reap() == 0) { enter(0, 1, IORING_ENTER_GETEVENTS, NULL, 0); }
+        }
+        cancelling = NULL;
+    }
+    pthread_mutex_unlock(&ring_lock);
+}
+
+
+static void uring_poll(void *context) {
+    (void)context;
+    if (atomic_load(&n_submitted) == 0
+        || atomic_load(ring.cq_head) == atomic_load(ring.cq_tail)) {
+        return;
+    }
+    /* Whoever holds it reaps them anyway */
+    if (pthread_mutex_trylock(&ring_lock) != 0) { return; }
+    reap();
+    flush();
+    pthread_mutex_unlock(&ring_lock);
+}
+
+
+const CoroReactor CoroReactor_uring = {
+        .submit  = uring_submit,
+        .cancel  = uring_cancel,
+        .poll    = uring_poll,
+        .context = NULL,
+};
+
+
+static void uring_idle_wait(void *                  context,
+                            const _Atomic uint32_t *epoch_ptr,
+                            uint32_t                epoch,
+                            uint32_t                timeout_ms) {
+    (void)context;
+    bool expected = false;
+    if (!atomic_compare_exchange_strong(&polling, &expected, true)) {
+        CoroIdle_futex_strategy.wait(NULL, epoch_ptr, epoch, timeout_ms);
+        return;
+    }
+
+    struct __kernel_timespec timeout = {
+            .tv_sec  = timeout_ms / 1000,
+            .tv_nsec = (long long)(timeout_ms % 1000) * 1000000LL,
+    };
+    struct io_uring_getevents_arg arg = {.ts = (uintptr_t)&timeout};
+    if (timeout_ms == CORO_IDLE_WAIT_FOREVER) { arg.ts = 0; }
+    /* Paired with the epoch increment before uring_wake() reads polling:
+     * either the notifier sees us polling or we see the new epoch. */
+    if (atomic_load(epoch_ptr) == epoch) {
+        enter(0,
+              1,
+              IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+              &arg,
+              sizeof(arg));
+    }
+    atomic_store(&polling, false);
+
+    pthread_mutex_lock(&ring_lock);
+    reap();
+    flush();
+    pthread_mutex_unlock(&ring_lock);
+}
+
+
+static void uring_wake(void *context) {
+    (void)context;
+    if (atomic_load(&polling)) {
+        uint64_t one = 1;
+        ssize_t  n   = write(wake_fd, &one, sizeof(one));
+        (void)n;
+    }
+    CoroIdle_futex_strategy.wake(NULL);
+}
+
+
+const CoroIdleStrategy CoroIdle_uring_strategy = {
+        .wait    = uring_idle_wait,
+        .wake    = uring_wake,
+        .context = NULL,
+};
+
+
+/** \brief Map the rings of the io_uring \p fd
+ * \return \c false (with \c errno set) if they could not be mapped
+ */
+static bool map_rings(int fd, const struct io_uring_params *params) {
+    size_t sq_size = params->sq_off.array
+                     + params->sq_entries * sizeof(uint32_t);
+    size_t cq_size = params->cq_off.cqes
+                     + params->cq_entries * sizeof(struct io_uring_cqe);
+    size_t sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+
+    /* Both rings are in one mapping (IORING_FEAT_SINGLE_MMAP) */
+    char *rings = mmap(NULL,
+                       (sq_size > cq_size) ? sq_size : cq_size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE,
+                       fd,
+                       IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) { return false; }
+    void *sqes = mmap(NULL,
+                      sqes_size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE,
+                      fd,
+                      IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        int error = errno;
+        munmap(rings, (sq_size > cq_size) ? sq_size : cq_size);
+        errno = error;
+        return false;
+    }
+
+    ring.fd         = fd;
+    ring.sq_entries = params->sq_entries;
+    ring.sq_mask    = *(uint32_t *)(rings + params->sq_off.ring_mask);
+    ring.sq_head    = (_Atomic uint32_t *)(rings + params->sq_off.head);
+    ring.sq_tail    = (_Atomic uint32_t *)(rings + params->sq_off.tail);
+    ring.sq_array   = (uint32_t *)(rings + params->sq_off.array);
+    ring.sqes       = sqes;
+    ring.cq_mask    = *(uint32_t *)(rings + params->cq_off.ring_mask);
+    ring.cq_head    = (_Atomic uint32_t *)(rings + params->cq_off.head);
+    ring.cq_tail    = (_Atomic uint32_t *)(rings + params->cq_off.tail);
+    ring.cqes       = (struct io_uring_cqe *)(rings + params->cq_off.cqes);
+    return true;
+}
+
+
+bool CoroReactor_uring_start(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(
+            __NR_io_uring_setup, CONF_CORO_REACTOR_URING_ENTRIES, &params);
+    if (fd < 0) { return false; }
+
+    int error = 0;
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0
+        || (params.features & IORING_FEAT_EXT_ARG) == 0) {
+        error = ENOSYS;
+    } else if ((wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        error = errno;
+    } else if (!map_rings(fd, &params)) {
+        error = errno;
+        close(wake_fd);
+    }
+    if (error != 0) {
+        close(fd);
+        errno = error;
+        return false;
+    }
+
+    pthread_mutex_lock(&ring_lock);
+    push_wake_poll();
+    error = flush();
+    pthread_mutex_unlock(&ring_lock);
+    errno = error;
+    return error == 0;
+}
@@ -0,0 +1,56 @@
+/** \file reactor_uring.h
+ *
+ * Linux io_uring based #CoroReactor and #CoroIdleStrategy
+ *
+ * An alternative to reactor_epoll.h that needs Linux 5.11 or later, but no
+ * library. Reads and writes are submitted to the kernel as they are, so they
+ * take a single system call and their descriptors may be blocking.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+#ifndef REACTOR_URING_H
+#define REACTOR_URING_H 1
+
+#include <stdbool.h>
+#include "../idle.h"
+#include "../io.h"
+
+
+#ifndef CONF_CORO_REACTOR_URING_ENTRIES
+/** Number of entries of the submission queue, a power of 2. They are
+ * submitted whenever it fills, so the operations in flight are only bounded
+ * by the kernel. */
+#define CONF_CORO_REACTOR_URING_ENTRIES 64
+#endif
+
+
+/** \brief Performs #CoroIo operations with io_uring
+ *
+ * Completions are taken from the completion queue without a system call
+ * whenever the scheduler polls.
+ */
+extern const CoroReactor CoroReactor_uring;
+
+/** \brief Sleeps the scheduler thread until io_uring completes an operation
+ *
+ * One thread at a time sleeps in \c io_uring_enter, other workers sleep as
+ * with #CoroIdle_futex_strategy. #CoroIdle_notify only makes system calls
+ * while a scheduler is actually asleep.
+ */
+extern const CoroIdleStrategy CoroIdle_uring_strategy;
+
+
+/** \brief Create the io_uring instance of #CoroReactor_uring
+ *
+ * \code{.c}
+ * if (CoroReactor_uring_start()) {
+ *     CoroIo_set_reactor(&CoroReactor_uring);
+ *     CoroIdle_set_strategy(&CoroIdle_uring_strategy);
+ * }
+ * \endcode
+ *
+ * \return \c false (with \c errno set) if it could not be created, e.g. with
+ * \c ENOSYS if the kernel lacks io_uring or a feature it needs
+ */
+bool CoroReactor_uring_start(void);
+
+#endif /* ifndef REACTOR_URING_H */
@@ -0,0 +1,57 @@
+/** \file timer_tick.c
+ *
+ * Periodic tick for timer_wheel.h on Linux hosts
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include "timer_tick.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+
+static void *tick_thread(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    do {
+        uint64_t n_expirations;
+        if (read(fd, &n_expirations, sizeof(n_expirations))
+            == sizeof(n_expirations)) {
+            TimerWheel_advance((uint32_t)n_expirations);
+        }
+    } while (true);
+    return NULL;
+}
+
+
+bool TimerTick_start(void) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (fd < 0) { return false; }
+
+    const struct timespec period = {
+            .tv_sec  = CONF_TIMER_WHEEL_TICK_MS / 1000,
+            .tv_nsec = (CONF_TIMER_WHEEL_TICK_MS % 1000) * 1000000L,
+    };
+    const struct itimerspec spec = {.it_interval = period, .it_value = period};
+    if (timerfd_settime(fd, 0, &spec, NULL) != 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return false;
+    }
+
+    pthread_t      thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int error = pthread_create(
+            &thread, &attr, tick_thread, (void *)(intptr_t)fd);
+    pthread_attr_destroy(&attr);
+    if (error != 0) {
+        close(fd);
+        errno = error;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,23 @@
+/** \file timer_tick.h
+ *
+ * Periodic tick for timer_wheel.h on Linux hosts
+ */
+/* Copyright 2018 Gaurav Juvekar */
+#ifndef TIMER_TICK_H
+#define TIMER_TICK_H 1
+
+#include <stdbool.h>
+#include "../timer_wheel.h"
+
+
+/** \brief Start a thread calling #TimerWheel_advance every
+ * #CONF_TIMER_WHEEL_TICK_MS milliseconds
+ *
+ * The thread plays the role of the tick interrupt. It reads a \c timerfd, so
+ * ticks missed while it was not scheduled are accounted for at once.
+ *
+ * \return \c false (with \c errno set) if the thread could not be started
+ */
+bool TimerTick_start(void);
+
+#endif /* ifndef TIMER_TICK_H */
@@ -0,0 +1,51 @@
+/** \file workers_pthread.c
+ *
+ * Runs the workers of a #CoroWorkers on POSIX threads on Linux hosts
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include "workers_pthread.h"
+#include <errno.h>
+#include <pthread.h>
+
+
+/** Argument of a worker thread */
+typedef struct {
+    CoroWorkers *workers;
+    size_t       self;
+} WorkerArg;
+
+static WorkerArg args[CONF_WORKERS_PTHREAD_MAX];
+static size_t    n_args;
+
+
+static void *worker_thread(void *arg) {
+    WorkerArg *worker = arg;
+    schedule_worker_mainloop(worker->workers, worker->self);
+}
+
+
+bool CoroWorkers_start_pthreads(CoroWorkers *workers) {
+    if (n_args + workers->n_workers > CONF_WORKERS_PTHREAD_MAX) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int error = 0;
+    for (size_t i = 1; i < workers->n_workers && error == 0; i++) {
+        WorkerArg *arg = &args[n_args++];
+        arg->workers   = workers;
+        arg->self      = i;
+        pthread_t thread;
+        error = pthread_create(&thread, &attr, worker_thread, arg);
+    }
+    pthread_attr_destroy(&attr);
+    if (error != 0) {
+        errno = error;
+        return false;
+    }
+    return true;
+}
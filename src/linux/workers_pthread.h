@@ -0,0 +1,37 @@
+/** \file workers_pthread.h
+ *
+ * Runs the workers of a #CoroWorkers on POSIX threads on Linux hosts
+ */
+/* Copyright 2018 Gaurav Juvekar */
+#ifndef WORKERS_PTHREAD_H
+#define WORKERS_PTHREAD_H 1
+
+#include <stdbool.h>
+#include "../coro.h"
+
+
+#ifndef CONF_WORKERS_PTHREAD_MAX
+/** Maximum number of workers started with #CoroWorkers_start_pthreads */
+#define CONF_WORKERS_PTHREAD_MAX 64
+#endif
+
+
+/** \brief Start one detached thread per worker of \p workers except worker 0
+ *
+ * The calling thread is expected to become worker 0 afterwards:
+ *
+ * \code{.c}
+ * CoroIdle_set_strategy(&CoroIdle_futex_strategy);
+ * TimerTick_start();
+ * CoroWorkers_start_pthreads(&workers);
+ * schedule_worker_mainloop(&workers, 0);
+ * \endcode
+ *
+ * \param workers the workers, at most #CONF_WORKERS_PTHREAD_MAX of them. It
+ *                must outlive the threads.
+ * \return \c false (with \c errno set) if a thread could not be started.
+ * The threads started until then keep running.
+ */
+bool CoroWorkers_start_pthreads(CoroWorkers *workers);
+
+#endif /* ifndef WORKERS_PTHREAD_H */
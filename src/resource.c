@@ -5,6 +5,9 @@
 /* Copyright 2018 Gaurav Juvekar */
 
 #include "resource.h"
+#include <stddef.h>
+#include "idle.h"
+#include "trace.h"
 
 RetResource_acquire Resource_acquire(Resource *     resource,
                                      ResourceOwner *owner) {
@@ -16,14 +19,17 @@ RetResource_acquire Resource_acquire(Resource *     resource,
             cmp_xchg_done = atomic_compare_exchange_strong(
                     resource, &current_owner, owner);
         } else {
+            CORO_TRACE(CORO_TRACE_RESOURCE_ACQUIRE,
+                       resource,
+                       RESOURCE_ACQUIRE_FAILED);
             return RESOURCE_ACQUIRE_FAILED;
         }
     } while (!cmp_xchg_done);
-    if (current_owner == NULL) {
-        return RESOURCE_ACQUIRE_SUCCESS;
-    } else {
-        return RESOURCE_ACQUIRE_PREEMPTED;
-    }
+    RetResource_acquire ret = (current_owner == NULL)
+                                      ? RESOURCE_ACQUIRE_SUCCESS
+                                      : RESOURCE_ACQUIRE_PREEMPTED;
+    CORO_TRACE(CORO_TRACE_RESOURCE_ACQUIRE, resource, ret);
+    return ret;
 }
 
 
@@ -39,9 +45,158 @@ void Resource_release(Resource *resource, ResourceOwner *owner) {
             return;
         }
     } while (!cmp_xchg_done);
+    /* Waiters are polled, let them retry */
+    CoroIdle_notify();
 }
 
 
 bool Resource_is_owned(Resource *resource, ResourceOwner *owner) {
     return owner == atomic_load(resource);
 }
+
+
+/** The #ResourceOwner of a #QueuedResource being handed over */
+static ResourceOwner handing_over;
+#define HANDING_OVER (&handing_over)
+
+/** The #ResourceOwner a ResourceOwner::node belongs to */
+#define OWNER_OF_NODE(p_node) \
+    ((ResourceOwner *)((char *)(p_node)-offsetof(ResourceOwner, node)))
+
+
+/** \brief Raise the priority inherited by the owner of \p resource to that
+ * of \p waiting if it is larger, and its scheduling priority by the boost of
+ * \p waiting */
+static void inherit(QueuedResource *resource, const ResourceOwner *waiting) {
+    int32_t inherited = atomic_load(&resource->inherited);
+    while (inherited < waiting->priority
+           && !atomic_compare_exchange_weak(
+                   &resource->inherited, &inherited, waiting->priority)) {}
+    atomic_fetch_or(&resource->boost, waiting->boost);
+}
+
+
+/** \brief Take the waiter with the largest priority off \p nodes
+ * \return Its node, or \c NULL if \p nodes is empty
+ */
+static WaitNode *take_best(WaitNode **nodes) {
+    WaitNode **best = NULL;
+    for (WaitNode **link = nodes; *link != NULL; link = &(*link)->next) {
+        /* Newest first, so the oldest of equals comes last */
+        if (best == NULL
+            || OWNER_OF_NODE(*link)->priority
+                       >= OWNER_OF_NODE(*best)->priority) {
+            best = link;
+        }
+    }
+    if (best == NULL) { return NULL; }
+    WaitNode *node = *best;
+    *best          = node->next;
+    return node;
+}
+
+
+/** \brief Hand \p resource to its best waiter, or leave it free
+ * \pre resource->owner is #HANDING_OVER
+ */
+static void hand_over(QueuedResource *resource) {
+    do {
+        WaitNode *     taken = WaitList_take_all(&resource->waiters);
+        ResourceOwner *best  = NULL;
+        WaitNode *     node;
+        while (best == NULL && (node = take_best(&taken)) != NULL) {
+            if (atomic_exchange(&node->list, WAIT_NODE_WAKING)
+                != WAIT_NODE_UNLINKING) {
+                best = OWNER_OF_NODE(node);
+            } else {
+                /* It stops waiting */
+                atomic_store(&node->list, NULL);
+            }
+        }
+        if (taken != NULL) {
+            WaitNode *last = taken;
+            inherit(resource, OWNER_OF_NODE(last));
+            while (last->next != NULL) {
+                last = last->next;
+                inherit(resource, OWNER_OF_NODE(last));
+            }
+            WaitList_give_back(&resource->waiters, taken, last);
+        }
+        atomic_store(&resource->owner_queue, NULL);
+        if (best != NULL) {
+            atomic_store(&resource->owner, best);
+            Waiter_wake(best->node.waiter);
+            /* Done with the node, see WaitNode_unlink */
+            atomic_store(&best->node.list, NULL);
+            return;
+        }
+
+        atomic_store(&resource->inherited, INT32_MIN);
+        atomic_store(&resource->boost, 0);
+        atomic_store(&resource->owner, NULL);
+        /* A waiter queued meanwhile may have found it still owned */
+        ResourceOwner *expected = NULL;
+        if (atomic_load(&resource->waiters) == NULL
+            || !atomic_compare_exchange_strong(
+                    &resource->owner, &expected, HANDING_OVER)) {
+            return;
+        }
+    } while (true);
+}
+
+
+RetResource_acquire QueuedResource_try_acquire(QueuedResource *resource,
+                                               ResourceOwner * owner) {
+    ResourceOwner *     expected = NULL;
+    RetResource_acquire ret      = RESOURCE_ACQUIRE_FAILED;
+    if (atomic_compare_exchange_strong(&resource->owner, &expected, owner)) {
+        ret = RESOURCE_ACQUIRE_SUCCESS;
+    }
+    CORO_TRACE(CORO_TRACE_RESOURCE_ACQUIRE, resource, ret);
+    return ret;
+}
+
+
+bool QueuedResource_wait(QueuedResource *resource, ResourceOwner *owner) {
+    if (QueuedResource_try_acquire(resource, owner)
+        == RESOURCE_ACQUIRE_SUCCESS) {
+        return false;
+    }
+    WaitList_push(&resource->waiters, &owner->node);
+    inherit(resource, owner);
+    /* It may have been released before this waiter could be seen */
+    ResourceOwner *expected = NULL;
+    if (atomic_compare_exchange_strong(
+                &resource->owner, &expected, HANDING_OVER)) {
+        hand_over(resource);
+    }
+    return true;
+}
+
+
+bool QueuedResource_cancel_wait(QueuedResource *resource,
+                                ResourceOwner * owner) {
+    WaitNode_unlink(&owner->node);
+    return atomic_load(&resource->owner) == owner;
+}
+
+
+void QueuedResource_release(QueuedResource *resource, ResourceOwner *owner) {
+    ResourceOwner *expected = owner;
+    if (atomic_compare_exchange_strong(
+                &resource->owner, &expected, HANDING_OVER)) {
+        hand_over(resource);
+    }
+}
+
+
+bool QueuedResource_is_owned(QueuedResource *resource, ResourceOwner *owner) {
+    return owner == atomic_load(&resource->owner);
+}
+
+
+int32_t QueuedResource_priority(QueuedResource *resource,
+                                ResourceOwner * owner) {
+    int32_t inherited = atomic_load(&resource->inherited);
+    return (inherited > owner->priority) ? inherited : owner->priority;
+}
@@ -1,6 +1,13 @@
 /** \file resource.h
  *
- * Priority based "partial" lock for controlling access to resources
+ * Priority based "partial" lock for controlling access to resources, and a
+ * queued lock with priority inheritance
+ *
+ * The priority of a #ResourceOwner is stronger the larger it is. It only
+ * orders the owners of a resource, and is unrelated to the priority a
+ * coroutine is scheduled at (see coro.h, where 0 is the highest): the
+ * scheduler raises the owner of a #QueuedResource by ResourceOwner::boost
+ * instead.
  */
 /* Copyright 2018 Gaurav Juvekar */
 #ifndef RESOURCE_H
@@ -9,6 +16,7 @@
 #include <stdatomic.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include "wait_list.h"
 
 
 /** A object that is referred to as the current owner for each #Resource
@@ -18,9 +26,17 @@
  */
 typedef struct {
     /** The target priority of the current owner that determines preemption of
-     * the #Resource.
+     * the #Resource, and the order in which a #QueuedResource is handed
+     * over. The larger is the stronger.
      */
     int32_t priority;
+    /** Scheduling priority mask of the waiting side (bit 31 - priority, so
+     * the larger is the stronger here too), ORed into QueuedResource::boost
+     * while it waits (set by the scheduler) */
+    uint32_t boost;
+    /** Registration while waiting for a #QueuedResource. Its waiter is woken
+     * when ownership is handed over. */
+    WaitNode node;
 } ResourceOwner;
 
 
@@ -52,7 +68,8 @@ typedef enum {
 
 /** Acquire a resource
  * \param resource the resource to acquire
- * \param owner    a #ResourceOwner object with desired priority set
+ * \param owner    a #ResourceOwner object with desired priority set. It
+ *                 preempts an owner of a smaller one.
  *
  * \note \p owner must be valid (not de-allocated) while \p resource is held
  * and until #Resource_release is called.
@@ -80,4 +97,90 @@ void Resource_release(Resource *resource, ResourceOwner *owner);
  */
 bool Resource_is_owned(Resource *resource, ResourceOwner *owner);
 
+
+/** \brief A resource that queues its waiters instead of being preempted
+ *
+ * Waiters are registered through ResourceOwner::node. On release, ownership
+ * is handed straight to the waiter with the largest ResourceOwner::priority
+ * (the oldest among equals) and its waiter is woken, so nobody retries.
+ *
+ * Instead of being preempted, the owner inherits the priority of waiters:
+ * #QueuedResource_priority is the largest priority of the owner and of every
+ * waiter since the resource was last free, and \c boost accumulates their
+ * ResourceOwner::boost masks (which the scheduler uses to raise the priority
+ * of the owning coroutine).
+ *
+ * \note Use #QUEUED_RESOURCE_INIT to initialize
+ */
+typedef struct {
+    /** The current owner */
+    ResourceOwner *_Atomic owner;
+    /** Owners waiting for it */
+    WaitList waiters;
+    /** Largest ResourceOwner::priority inherited from waiters, or
+     * \c INT32_MIN */
+    _Atomic int32_t inherited;
+    /** ResourceOwner::boost of every waiter, ORed */
+    _Atomic uint32_t boost;
+    /** The ready queue the owner was last placed on, if the scheduler
+     * published it. Reset when ownership changes. */
+    WaitReadyQueue *_Atomic owner_queue;
+} QueuedResource;
+
+/** Static initializer for a free #QueuedResource */
+#define QUEUED_RESOURCE_INIT                                    \
+    {                                                           \
+        .owner = NULL, .waiters = NULL, .inherited = INT32_MIN, \
+        .boost = 0, .owner_queue = NULL,                        \
+    }
+
+
+/** \brief Acquire \p resource if it is free, without waiting
+ * \return #RESOURCE_ACQUIRE_SUCCESS or #RESOURCE_ACQUIRE_FAILED
+ */
+RetResource_acquire QueuedResource_try_acquire(QueuedResource *resource,
+                                               ResourceOwner * owner);
+
+
+/** \brief Acquire \p resource, or queue \p owner to be handed it
+ *
+ * \pre owner->node.waiter is armed
+ *
+ * \return \c false if it was acquired right away, in which case \p owner
+ * is not queued. Otherwise, owner->node.waiter is woken once it is handed
+ * over.
+ */
+bool QueuedResource_wait(QueuedResource *resource, ResourceOwner *owner);
+
+
+/** \brief Stop waiting for \p resource
+ *
+ * Safe to call even if \p owner was never queued or was handed the resource.
+ *
+ * \return If \p owner owns \p resource, in which case it must release it
+ */
+bool QueuedResource_cancel_wait(QueuedResource *resource,
+                                ResourceOwner * owner);
+
+
+/** \brief Release \p resource and hand it to the best waiter, if any
+ * \param resource the resource to release
+ * \param owner    the owner (self) of the resource
+ */
+void QueuedResource_release(QueuedResource *resource, ResourceOwner *owner);
+
+
+/** \brief Check if \p resource is currently owned by \p owner */
+bool QueuedResource_is_owned(QueuedResource *resource, ResourceOwner *owner);
+
+
+/** \brief The effective priority of \p owner, the owner of \p resource
+ *
+ * The priority of \p owner raised to the largest priority inherited from
+ * the waiters of \p resource, as ResourceOwner::priority (the larger is the
+ * stronger).
+ */
+int32_t QueuedResource_priority(QueuedResource *resource,
+                                ResourceOwner * owner);
+
 #endif /* ifndef RESOURCE_H */
@@ -0,0 +1,277 @@
+/** \file sim.c
+ *
+ * Deterministic simulation of timers and interrupts.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include "sim.h"
+#include <assert.h>
+#include <stddef.h>
+#include "slot_pool.h"
+
+/** Microseconds in a millisecond */
+#define US_PER_MS 1000u
+/** TimerInternal::index of a timer that is not on the heap */
+#define NOT_RUNNING SIZE_MAX
+
+
+struct TimerInternal {
+    /** Virtual time at which the timer expires */
+    uint64_t expiry;
+    /** Order in which it was started, breaking ties between expiries */
+    uint64_t order;
+    /** The timer this node runs for */
+    Timer *timer;
+    /** Index in \c heap, or NOT_RUNNING once expired */
+    size_t index;
+};
+
+
+static TimerInternal pool_nodes[CONF_CORO_SIM_N_TIMERS];
+static SlotPool      pool = SLOT_POOL_STATIC_INIT(
+        sizeof(TimerInternal), CONF_CORO_SIM_N_TIMERS, pool_nodes);
+
+/** Running timers, a binary min-heap on expiry then order */
+static TimerInternal *heap[CONF_CORO_SIM_N_TIMERS];
+static size_t         n_running;
+static uint64_t       n_started;
+
+/** The virtual clock, in microseconds */
+static uint64_t now;
+/** End of the current #CoroSim_run_for, which idle jumps stop at */
+static uint64_t run_until = UINT64_MAX;
+/** Simulated events, in the order they were added */
+static CoroSimEvent *events;
+/** State of the generator (splitmix64) */
+static uint64_t random_state;
+
+
+static uint64_t next_random(void) {
+    uint64_t z = (random_state += UINT64_C(0x9E3779B97F4A7C15));
+    z          = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    z          = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return z ^ (z >> 31);
+}
+
+
+/** Draw the time until the next occurrence of \p event */
+static uint64_t interval(const CoroSimEvent *event) {
+    uint64_t span = (uint64_t)event->max_interval_us
+                    - event->min_interval_us + 1;
+    return event->min_interval_us + next_random() % span;
+}
+
+
+static bool earlier(const TimerInternal *a, const TimerInternal *b) {
+    return a->expiry < b->expiry
+           || (a->expiry == b->expiry && a->order < b->order);
+}
+
+
+static void place(TimerInternal *node, size_t index) {
+    heap[index] = node;
+    node->index = index;
+}
+
+
+static void sift_up(TimerInternal *node, size_t index) {
+    while (index > 0 && earlier(node, heap[(index - 1) / 2])) {
+        place(heap[(index - 1) / 2], index);
+        index = (index - 1) / 2;
+    }
+    place(node, index);
+}
+
+
+static void sift_down(TimerInternal *node, size_t index) {
+    while (2 * index + 1 < n_running) {
+        size_t child = 2 * index + 1;
+        if (child + 1 < n_running && earlier(heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!earlier(heap[child], node)) { break; }
+        place(heap[child], index);
+        index = child;
+    }
+    place(node, index);
+}
+
+
+static void heap_remove(TimerInternal *node) {
+    size_t         index = node->index;
+    TimerInternal *last  = heap[--n_running];
+    node->index          = NOT_RUNNING;
+    if (last == node) { return; }
+    if (index > 0 && earlier(last, heap[(index - 1) / 2])) {
+        sift_up(last, index);
+    } else {
+        sift_down(last, index);
+    }
+}
+
+
+/** The event that occurs first (the first added among equals), or NULL */
+static CoroSimEvent *first_event(void) {
+    CoroSimEvent *first = events;
+    for (CoroSimEvent *event = events; event != NULL; event = event->next) {
+        if (event->next_at < first->next_at) { first = event; }
+    }
+    return first;
+}
+
+
+/** When the next timer expires or event occurs, UINT64_MAX if never */
+static uint64_t next_due(void) {
+    uint64_t      due   = (n_running > 0) ? heap[0]->expiry : UINT64_MAX;
+    CoroSimEvent *event = first_event();
+    if (event != NULL && event->next_at < due) { due = event->next_at; }
+    return due;
+}
+
+
+/** Move the clock to what is due next, but not past \p limit */
+static void jump(uint64_t limit) {
+    uint64_t due = next_due();
+    if (due > limit) { due = limit; }
+    if (due != UINT64_MAX && due > now) { now = due; }
+}
+
+
+bool Timer_start_new(Timer *instance, timer_ms_t milliseconds) {
+    CORO_TRACE(CORO_TRACE_TIMER_START, instance, milliseconds);
+    Condition_clear(&instance->timed_out);
+    TimerInternal *node = SlotPool_alloc(&pool);
+    if (node == NULL) {
+        /* Better early than never, see CONF_CORO_SIM_N_TIMERS */
+        instance->internal = NULL;
+        Timer_expire(instance);
+        return false;
+    }
+    node->expiry       = now + (uint64_t)milliseconds * US_PER_MS;
+    node->order        = n_started++;
+    node->timer        = instance;
+    instance->internal = node;
+    sift_up(node, n_running++);
+    return true;
+}
+
+
+void Timer_cancel(Timer *instance) {
+    TimerInternal *node = instance->internal;
+    if (node == NULL) { return; }
+    instance->internal = NULL;
+    if (node->index != NOT_RUNNING) {
+        CORO_TRACE(CORO_TRACE_TIMER_CANCEL, instance, 0);
+        heap_remove(node);
+    }
+    SlotPool_free(&pool, node);
+}
+
+
+void Timer_poll(void) {
+    /* Timers and events occur in the order of their time */
+    while (true) {
+        TimerInternal *timer     = (n_running > 0) ? heap[0] : NULL;
+        CoroSimEvent * event     = first_event();
+        bool           timer_due = timer != NULL && timer->expiry <= now;
+        bool           event_due = event != NULL && event->next_at <= now;
+        if (timer_due && (!event_due || timer->expiry <= event->next_at)) {
+            heap_remove(timer);
+            Timer_expire(timer->timer);
+        } else if (event_due) {
+            event->next_at += interval(event);
+            event->fire(event->context);
+        } else {
+            return;
+        }
+    }
+}
+
+
+timer_ms_t Timer_next_deadline(void) {
+    uint64_t due = next_due();
+    if (due == UINT64_MAX) { return TIMER_MS_NEVER; }
+    if (due <= now) { return 0; }
+    uint64_t ms = (due - now + US_PER_MS - 1) / US_PER_MS;
+    return (ms >= TIMER_MS_NEVER) ? TIMER_MS_NEVER - 1 : (timer_ms_t)ms;
+}
+
+
+static void sim_idle_wait(void *                  context,
+                          const _Atomic uint32_t *epoch_ptr,
+                          uint32_t                epoch,
+                          uint32_t                timeout_ms) {
+    (void)context;
+    if (atomic_load(epoch_ptr) != epoch) { return; }
+    uint64_t limit = run_until;
+    if (timeout_ms != CORO_IDLE_WAIT_FOREVER
+        && now + (uint64_t)timeout_ms * US_PER_MS < limit) {
+        limit = now + (uint64_t)timeout_ms * US_PER_MS;
+    }
+    jump(limit);
+}
+
+
+const CoroIdleStrategy CoroIdle_sim_strategy = {
+        .wait    = sim_idle_wait,
+        .wake    = NULL,
+        .context = NULL,
+};
+
+
+void CoroSim_seed(uint64_t seed) {
+    random_state = seed;
+}
+
+
+uint32_t CoroSim_random(void) {
+    return (uint32_t)(next_random() >> 32);
+}
+
+
+uint64_t CoroSim_now_us(void) {
+    return now;
+}
+
+
+void CoroSim_advance(uint64_t microseconds) {
+    now += microseconds;
+    if (next_due() <= now) { CoroIdle_notify(); }
+}
+
+
+void CoroSim_add_event(CoroSimEvent *event) {
+    assert(event->min_interval_us <= event->max_interval_us
+           && event->max_interval_us > 0);
+    event->next_at = now + interval(event);
+    event->next    = NULL;
+    CoroSimEvent **tail = &events;
+    while (*tail != NULL) { tail = &(*tail)->next; }
+    *tail = event;
+}
+
+
+void CoroSim_remove_event(CoroSimEvent *event) {
+    CoroSimEvent **link = &events;
+    while (*link != NULL && *link != event) { link = &(*link)->next; }
+    if (*link != NULL) { *link = event->next; }
+}
+
+
+size_t CoroSim_run_for(CoroSchedule *schedule, timer_ms_t milliseconds) {
+    uint64_t end     = now + (uint64_t)milliseconds * US_PER_MS;
+    size_t   n_steps = 0;
+    run_until        = end;
+    while (now < end) {
+        uint64_t before = now;
+        if (schedule_run_once(schedule)) {
+            n_steps++;
+            now += CONF_CORO_SIM_STEP_US;
+        } else if (now == before) {
+            /* Idle without CoroIdle_sim_strategy */
+            jump(end);
+        }
+    }
+    run_until = UINT64_MAX;
+    return n_steps;
+}
@@ -0,0 +1,151 @@
+/** \file sim.h
+ *
+ * Deterministic simulation of timers and interrupts.
+ *
+ * An implementation of timer_interface.h on a virtual clock, to link instead
+ * of timer_wheel.c. The clock only moves when told to: by
+ * #CONF_CORO_SIM_STEP_US per step executed by #CoroSim_run_for, and straight
+ * to the next deadline whenever the scheduler goes idle with
+ * #CoroIdle_sim_strategy. Interrupts are simulated by #CoroSimEvent's that
+ * occur at intervals drawn from a seeded generator.
+ *
+ * The same seed and the same sequence of calls replay the exact same
+ * interleaving of steps, expiries and events, however fast the host is.
+ *
+ * \warning Everything runs in a single thread, which must not use any other
+ * timer or idle implementation.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+#ifndef SIM_H
+#define SIM_H 1
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "coro.h"
+#include "idle.h"
+#include "timer_interface.h"
+
+
+#ifndef CONF_CORO_SIM_N_TIMERS
+/** Maximum number of timers running at once */
+#define CONF_CORO_SIM_N_TIMERS 64
+#endif
+
+#ifndef CONF_CORO_SIM_STEP_US
+/** Virtual microseconds each coroutine step takes in #CoroSim_run_for, so
+ * that time passes even while coroutines are always ready */
+#define CONF_CORO_SIM_STEP_US 1
+#endif
+
+
+/* Forward declaration */
+typedef struct CoroSimEvent CoroSimEvent;
+
+/** \brief A simulated interrupt, occurring again and again at random
+ * intervals
+ *
+ * \note Initialize with #CORO_SIM_EVENT_INIT
+ */
+struct CoroSimEvent {
+    /** Called at each occurrence, as an interrupt handler would be */
+    void (*fire)(void *context);
+    /** Passed to \c fire */
+    void *context;
+    /** Shortest time between two occurrences, in microseconds */
+    uint32_t min_interval_us;
+    /** Longest time between two occurrences, in microseconds */
+    uint32_t max_interval_us;
+    /** When it occurs next (private) */
+    uint64_t next_at;
+    /** Link in the list of events (private) */
+    CoroSimEvent *next;
+};
+
+/** \brief Static initializer for a #CoroSimEvent calling \p p_fire with
+ * \p p_context every \p p_min_us to \p p_max_us microseconds
+ *
+ * \code{.c}
+ * static Condition    rx_ready;
+ * static CoroSimEvent rx_irq = CORO_SIM_EVENT_INIT(
+ *         CoroSim_set_condition, &rx_ready, 100, 5000);
+ * CoroSim_add_event(&rx_irq);
+ * \endcode
+ */
+#define CORO_SIM_EVENT_INIT(p_fire, p_context, p_min_us, p_max_us) \
+    {                                                              \
+        .fire            = p_fire,                                 \
+        .context         = p_context,                              \
+        .min_interval_us = p_min_us,                               \
+        .max_interval_us = p_max_us,                               \
+        .next_at         = 0,                                      \
+        .next            = NULL,                                   \
+    }
+
+
+/** \brief A #CoroSimEvent::fire setting the #Condition \p condition */
+static inline void CoroSim_set_condition(void *condition) {
+    Condition_set((Condition *)condition);
+}
+
+
+/** \brief A #CoroSimEvent::fire setting the #WakeCondition \p condition */
+static inline void CoroSim_set_wake_condition(void *condition) {
+    WakeCondition_set((WakeCondition *)condition);
+}
+
+
+/** \brief Jumps the virtual clock to the next timer expiry or event instead
+ * of sleeping
+ *
+ * Without either, it returns at once (or jumps to the end of
+ * #CoroSim_run_for).
+ */
+extern const CoroIdleStrategy CoroIdle_sim_strategy;
+
+
+/** \brief Seed the generator behind the intervals of events and
+ * #CoroSim_random
+ *
+ * Call before adding events. A seed of 0 is as good as any other.
+ */
+void CoroSim_seed(uint64_t seed);
+
+
+/** \brief Next number of the seeded generator, for scenarios to draw from
+ * so that they replay along with the simulation */
+uint32_t CoroSim_random(void);
+
+
+/** \brief The virtual clock, in microseconds since the start */
+uint64_t CoroSim_now_us(void);
+
+
+/** \brief Move the virtual clock \p microseconds forward
+ *
+ * Timers and events that are due by then occur in order at the next
+ * #Timer_poll, i.e. at the next pass of the scheduler.
+ */
+void CoroSim_advance(uint64_t microseconds);
+
+
+/** \brief Start simulating \p event, first after a random interval
+ * \note \p event must stay valid until removed
+ */
+void CoroSim_add_event(CoroSimEvent *event);
+
+
+/** \brief Stop simulating \p event */
+void CoroSim_remove_event(CoroSimEvent *event);
+
+
+/** \brief Run \p schedule for \p milliseconds of virtual time
+ *
+ * Executes one step at a time with #schedule_run_once, each taking
+ * #CONF_CORO_SIM_STEP_US. Idle time is skipped, whether or not
+ * #CoroIdle_sim_strategy is set.
+ *
+ * \return The number of steps executed
+ */
+size_t CoroSim_run_for(CoroSchedule *schedule, timer_ms_t milliseconds);
+
+#endif /* ifndef SIM_H */
@@ -0,0 +1,69 @@
+/** \file slot_pool.c
+ *
+ * Lock-free async-interrupt-safe pool of fixed size slots.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include "slot_pool.h"
+#include <assert.h>
+#include <stdbool.h>
+
+#define INDEX_BITS (8 * sizeof(SlotPoolIndex))
+#define HEAD_INDEX(head) ((SlotPoolIndex)(head))
+#define HEAD_TAG(head) ((head) >> INDEX_BITS)
+#define HEAD(tag, index) \
+    ((SlotPoolHead)(((SlotPoolHead)(tag) << INDEX_BITS) | (index)))
+
+
+static void *slot(SlotPool *pool, size_t index) {
+    return (char *)pool->data + index * pool->elem_size;
+}
+
+
+void *SlotPool_alloc(SlotPool *pool) {
+    SlotPoolHead head = atomic_load(&pool->free_head);
+    while (HEAD_INDEX(head) != 0) {
+        size_t index = HEAD_INDEX(head) - 1;
+        /* The tag changes on every pop, so the CAS fails if this slot was
+         * popped (and pushed again) in the meantime */
+        SlotPoolHead next =
+                HEAD(HEAD_TAG(head) + 1, atomic_load(&pool->links[index]));
+        if (atomic_compare_exchange_weak(&pool->free_head, &head, next)) {
+            return slot(pool, index);
+        }
+    }
+
+    size_t fresh = atomic_load(&pool->n_fresh);
+    while (fresh < pool->n_elems) {
+        if (atomic_compare_exchange_weak(&pool->n_fresh, &fresh, fresh + 1)) {
+            return slot(pool, fresh);
+        }
+    }
+    return NULL;
+}
+
+
+void SlotPool_free(SlotPool *pool, void *elem) {
+    size_t index = SlotPool_index(pool, elem);
+    assert(index < pool->n_elems);
+    SlotPoolHead head = atomic_load(&pool->free_head);
+    do {
+        atomic_store(&pool->links[index], HEAD_INDEX(head));
+    } while (!atomic_compare_exchange_weak(
+            &pool->free_head,
+            &head,
+            HEAD(HEAD_TAG(head), (SlotPoolIndex)(index + 1))));
+}
+
+
+void *SlotPool_alloc_at(SlotPool *pool, size_t index) {
+    assert(index < pool->n_elems);
+    size_t fresh = atomic_load(&pool->n_fresh);
+    if (index < fresh) { return NULL; }
+    for (; fresh < index; fresh++) {
+        atomic_store(&pool->n_fresh, fresh + 1);
+        SlotPool_free(pool, slot(pool, fresh));
+    }
+    atomic_store(&pool->n_fresh, index + 1);
+    return slot(pool, index);
+}
@@ -0,0 +1,114 @@
+/** \file slot_pool.h
+ *
+ * Lock-free async-interrupt-safe pool of fixed size slots.
+ *
+ * Unlike a queue, any slot can be given back at any time regardless of how
+ * old it is. Free slots are kept on a lock-free LIFO list whose head carries
+ * a tag against ABA. Slots that were never used are handed out first.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+#ifndef SLOT_POOL_H
+#define SLOT_POOL_H 1
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+
+#ifndef CONF_SLOT_POOL_WIDE
+/** Use 32 bit slot indices (and 64 bit atomics) instead of 16 bit ones
+ * (and 32 bit atomics) to allow more than #SLOT_POOL_MAX_ELEMS slots */
+#define CONF_SLOT_POOL_WIDE 0
+#endif
+
+#if CONF_SLOT_POOL_WIDE
+/** Index of a slot, plus one (0 terminates the free list) */
+typedef uint32_t SlotPoolIndex;
+/** A free list head: a tag and a #SlotPoolIndex */
+typedef uint64_t SlotPoolHead;
+#else
+typedef uint16_t SlotPoolIndex;
+typedef uint32_t SlotPoolHead;
+#endif
+
+/** Maximum number of slots in a #SlotPool */
+#define SLOT_POOL_MAX_ELEMS ((SlotPoolIndex)-1)
+
+
+/** \brief A pool of fixed size slots
+ *
+ * \note Use #SLOT_POOL_STATIC_INIT to initialize
+ */
+typedef struct {
+    /** Array of slots */
+    void *const data;
+    /** Size of each slot */
+    const size_t elem_size;
+    /** Number of slots in \c data */
+    const size_t n_elems;
+    /** Next free slot of each slot on the free list */
+    _Atomic SlotPoolIndex *const links;
+    /** Tagged head of the free list */
+    _Atomic SlotPoolHead free_head;
+    /** Number of slots ever handed out */
+    _Atomic size_t n_fresh;
+} SlotPool;
+
+
+/** \brief Statically initialize a #SlotPool
+ *
+ * \param p_elem_size  size of each slot
+ * \param p_n_elems    number of slots in \p p_data_array, at most
+ *                     #SLOT_POOL_MAX_ELEMS
+ * \param p_data_array array of \p p_n_elems slots
+ *
+ * \code{.c}
+ * static Packet packets[16];
+ * static SlotPool packet_pool =
+ *         SLOT_POOL_STATIC_INIT(sizeof(Packet), 16, packets);
+ * \endcode
+ */
+#define SLOT_POOL_STATIC_INIT(p_elem_size, p_n_elems, p_data_array) \
+    {                                                               \
+        .data      = (p_data_array),                                \
+        .elem_size = (p_elem_size),                                 \
+        .n_elems   = (p_n_elems),                                   \
+        .links     = (_Atomic SlotPoolIndex[p_n_elems]){0},         \
+        .free_head = 0,                                             \
+        .n_fresh   = 0,                                             \
+    }
+
+
+/** \brief Take a free slot
+ *
+ * Safe to call from any context, including interrupts.
+ *
+ * \return Pointer to the slot
+ * \retval NULL if all slots are in use
+ */
+void *SlotPool_alloc(SlotPool *pool);
+
+/** \brief Give back a slot taken with #SlotPool_alloc
+ *
+ * Safe to call from any context, including interrupts.
+ */
+void SlotPool_free(SlotPool *pool, void *elem);
+
+/** \brief Take the slot at \p index, e.g. to put back what was in it
+ *
+ * Slots before it that were never handed out are put on the free list, so
+ * take slots in increasing order of \p index, from a single context before
+ * any other use of \p pool.
+ *
+ * \return Pointer to the slot
+ * \retval NULL if it was handed out already
+ */
+void *SlotPool_alloc_at(SlotPool *pool, size_t index);
+
+/** \brief Index of \p elem in the slot array of \p pool */
+static inline size_t SlotPool_index(const SlotPool *pool, const void *elem) {
+    return (size_t)((const char *)elem - (const char *)pool->data)
+           / pool->elem_size;
+}
+
+#endif /* ifndef SLOT_POOL_H */
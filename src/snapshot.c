@@ -0,0 +1,329 @@
+/** \file snapshot.c
+ *
+ * Saving the coroutines of pools to a binary image, and restoring them.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include "snapshot.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define FNV_OFFSET UINT32_C(2166136261)
+#define FNV_PRIME UINT32_C(16777619)
+
+
+/** What waits are saved relative to. Labels are relative to
+ * #CoroSnapshot_save. */
+static char data_anchor;
+
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++) { hash = (hash ^ bytes[i]) * FNV_PRIME; }
+    return hash;
+}
+
+
+static uint64_t function_offset(coroutine *function) {
+    return (uint64_t)((uintptr_t)function - (uintptr_t)&CoroSnapshot_save);
+}
+
+
+/** \brief CoroSnapshotRecord::label of \p label, 0 for \c NULL */
+static uint64_t label_offset(const void *label) {
+#if CONF_CORO_SWITCH_DISPATCH
+    /* A line */
+    return (uint64_t)(uintptr_t)label;
+#else
+    if (label == NULL) { return 0; }
+    return (uint64_t)((uintptr_t)label - (uintptr_t)&CoroSnapshot_save);
+#endif
+}
+
+
+static void *label_address(uint64_t offset) {
+#if CONF_CORO_SWITCH_DISPATCH
+    return (void *)(uintptr_t)offset;
+#else
+    if (offset == 0) { return NULL; }
+    return (void *)((uintptr_t)&CoroSnapshot_save + (uintptr_t)offset);
+#endif
+}
+
+
+static uint64_t data_offset(const void *data) {
+    return (uint64_t)((uintptr_t)data - (uintptr_t)&data_anchor);
+}
+
+
+static void *data_address(uint64_t offset) {
+    return (void *)((uintptr_t)&data_anchor + (uintptr_t)offset);
+}
+
+
+/** CoroSnapshotHeader::layout of an image of \p pools */
+static uint32_t layout_of(CoroPool *const *pools, size_t n_pools) {
+    uint64_t build[] = {sizeof(CoroState), CONF_CORO_SWITCH_DISPATCH, n_pools};
+    uint32_t hash    = fnv1a(FNV_OFFSET, build, sizeof(build));
+    for (size_t i = 0; i < n_pools; i++) {
+        uint64_t pool[] = {
+                function_offset(pools[i]->function),
+                pools[i]->entries.n_elems,
+                pools[i]->entries.elem_size,
+                pools[i]->vars_offset,
+                pools[i]->vars_size,
+        };
+        hash = fnv1a(hash, pool, sizeof(pool));
+    }
+    return hash;
+}
+
+
+/** Size of a record of a coroutine of \p pool, with its variables */
+static size_t record_size(const CoroPool *pool) {
+    return sizeof(CoroSnapshotRecord) + ((pool->vars_size + 7) & ~(size_t)7);
+}
+
+
+static CoroState *slot_state(CoroPool *pool, size_t index) {
+    return (CoroState *)((char *)pool->entries.data
+                         + index * pool->entries.elem_size);
+}
+
+
+/** \brief Whether a coroutine may be saved with \p status */
+static bool is_restorable(CoroStatus status) {
+    switch (status) {
+    case CORO_STATUS_SUSPENDED:
+    case CORO_STATUS_WAIT_CONDITION:
+    case CORO_STATUS_WAIT_WAKE_CONDITION:
+#if CONF_CORO_WAIT_CHANNEL
+    case CORO_STATUS_WAIT_CHANNEL:
+#endif
+        return true;
+    default: return false;
+    }
+}
+
+
+/** \brief The status to save \p state with
+ * \retval CORO_STATUS_FINALIZE if it is not quiescent
+ */
+static CoroStatus saved_status(CoroState *state) {
+    if (state->timed_wait || atomic_load(&state->cancel) != 0
+        || state->holding != NULL || !is_restorable(state->status)) {
+        return CORO_STATUS_FINALIZE;
+    }
+    /* Woken, but not resumed yet: it resumes from its label all the same */
+    if (state->status == CORO_STATUS_WAIT_CONDITION) {
+        return (state->polled && !Condition_get(state->wait.condition))
+                       ? CORO_STATUS_WAIT_CONDITION
+                       : CORO_STATUS_SUSPENDED;
+    }
+    if (state->status != CORO_STATUS_SUSPENDED) {
+        /* Disarmed once woken */
+        return atomic_load(&state->waiter.armed) ? state->status
+                                                 : CORO_STATUS_SUSPENDED;
+    }
+    return CORO_STATUS_SUSPENDED;
+}
+
+
+/** \brief What \p state waits on with \p status, \c NULL if it is ready */
+static void *wait_target(CoroState *state, CoroStatus status) {
+    switch (status) {
+    case CORO_STATUS_WAIT_CONDITION: return state->wait.condition;
+    case CORO_STATUS_WAIT_WAKE_CONDITION: return state->wait.wake_condition;
+    case CORO_STATUS_WAIT_CHANNEL: return state->wait.channel.channel;
+    default: return NULL;
+    }
+}
+
+
+size_t CoroSnapshot_size(CoroPool *const *pools, size_t n_pools) {
+    size_t size = sizeof(CoroSnapshotHeader);
+    for (size_t i = 0; i < n_pools; i++) {
+        size += pools[i]->entries.n_elems * record_size(pools[i]);
+    }
+    return size;
+}
+
+
+size_t CoroSnapshot_save(CoroPool *const *pools,
+                         size_t           n_pools,
+                         void *           image,
+                         size_t           size) {
+    assert(((uintptr_t)image & 7) == 0);
+    assert(n_pools <= UINT16_MAX);
+    if (size < sizeof(CoroSnapshotHeader)) { return 0; }
+    char *   out       = (char *)image + sizeof(CoroSnapshotHeader);
+    char *   end       = (char *)image + size;
+    uint32_t n_records = 0;
+    for (size_t p = 0; p < n_pools; p++) {
+        CoroPool *pool    = pools[p];
+        size_t    n_fresh = atomic_load(&pool->entries.n_fresh);
+        for (size_t i = 0; i < n_fresh; i++) {
+            CoroState *state = slot_state(pool, i);
+            /* A free slot, or one about to be */
+            if (state->status == CORO_STATUS_FINALIZE) { continue; }
+            CoroStatus status = saved_status(state);
+            if (status == CORO_STATUS_FINALIZE) { return 0; }
+            if ((size_t)(end - out) < record_size(pool)) { return 0; }
+
+            CoroSnapshotRecord record;
+            memset(&record, 0, sizeof(record));
+            record.label     = label_offset(state->label);
+            record.on_cancel = label_offset(state->on_cancel);
+            if (status != CORO_STATUS_SUSPENDED) {
+                record.target = data_offset(wait_target(state, status));
+            }
+            record.slot     = (uint32_t)i;
+            record.pool     = (uint16_t)p;
+            record.status   = (uint8_t)status;
+            record.priority = state->priority;
+            record.send     = status == CORO_STATUS_WAIT_CHANNEL
+                              && state->wait.channel.send;
+            memset(out, 0, record_size(pool));
+            memcpy(out, &record, sizeof(record));
+            memcpy(out + sizeof(record), state->vars, pool->vars_size);
+            out += record_size(pool);
+            n_records++;
+        }
+    }
+
+    CoroSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CORO_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.byte_order  = 0x01020304;
+    header.version     = CORO_SNAPSHOT_VERSION;
+    header.record_size = sizeof(CoroSnapshotRecord);
+    header.build_id    = CONF_CORO_SNAPSHOT_BUILD_ID;
+    header.layout      = layout_of(pools, n_pools);
+    header.n_records   = n_records;
+    header.size        = (uint32_t)(out - (char *)image);
+    header.checksum    = fnv1a(FNV_OFFSET,
+                            (char *)image + sizeof(header),
+                            header.size - sizeof(header));
+    memcpy(image, &header, sizeof(header));
+    return header.size;
+}
+
+
+/** \brief Whether the records of \p image, of \p header, are consistent and
+ * fit \p pools and \p schedule */
+static bool check_records(const CoroSchedule *      schedule,
+                          CoroPool *const *         pools,
+                          size_t                    n_pools,
+                          const char *              image,
+                          const CoroSnapshotHeader *header) {
+    const char *in        = image + sizeof(*header);
+    const char *end       = image + header->size;
+    size_t      last_pool = 0;
+    size_t      next_slot = 0;
+    for (uint32_t i = 0; i < header->n_records; i++) {
+        CoroSnapshotRecord record;
+        if ((size_t)(end - in) < sizeof(record)) { return false; }
+        memcpy(&record, in, sizeof(record));
+        if (record.pool >= n_pools || record.pool < last_pool) {
+            return false;
+        }
+        if (record.pool != last_pool) {
+            last_pool = record.pool;
+            next_slot = 0;
+        }
+        CoroPool *pool = pools[record.pool];
+        if (record.slot < next_slot || record.slot >= pool->entries.n_elems
+            || !is_restorable(record.status)
+            || (record.status == CORO_STATUS_SUSPENDED)
+                       != (record.target == 0)
+            || record.priority >= schedule->n_priorities
+            || (size_t)(end - in) < record_size(pool)) {
+            return false;
+        }
+        next_slot = record.slot + 1;
+        in += record_size(pool);
+    }
+    return in == end;
+}
+
+
+/** \brief Restore the coroutine of \p record with its variables \p vars */
+static void restore(CoroSchedule *            schedule,
+                    CoroPool *                pool,
+                    const CoroSnapshotRecord *record,
+                    const void *              vars) {
+    /* Slots skipped are free, as their states say */
+    size_t fresh = atomic_load(&pool->entries.n_fresh);
+    for (; fresh < record->slot; fresh++) {
+        slot_state(pool, fresh)->status = CORO_STATUS_FINALIZE;
+    }
+    CoroState *state = SlotPool_alloc_at(&pool->entries, record->slot);
+    assert(state != NULL);
+    void *state_vars = (char *)state + pool->vars_offset;
+    memcpy(state_vars, vars, pool->vars_size);
+
+    Coro_init_sub(state, pool->function, state_vars);
+    state->label     = label_address(record->label);
+    state->on_cancel = label_address(record->on_cancel);
+    state->status    = (CoroStatus)record->status;
+    switch (state->status) {
+    case CORO_STATUS_WAIT_CONDITION:
+        state->wait.condition = data_address(record->target);
+        break;
+    case CORO_STATUS_WAIT_WAKE_CONDITION:
+        state->wait.wake_condition = data_address(record->target);
+        break;
+    case CORO_STATUS_WAIT_CHANNEL:
+        state->wait.channel.channel = data_address(record->target);
+        state->wait.channel.send    = record->send != 0;
+        break;
+    default: break;
+    }
+    Coro_park_restored(schedule, state, record->priority, &pool->entries);
+}
+
+
+RetCoroSnapshot_restore CoroSnapshot_restore(CoroSchedule *    schedule,
+                                             CoroPool *const * pools,
+                                             size_t            n_pools,
+                                             const void *      image,
+                                             size_t            size) {
+    CoroSnapshotHeader header;
+    if (size < sizeof(header)) { return CORO_SNAPSHOT_RESTORE_CORRUPT; }
+    memcpy(&header, image, sizeof(header));
+    if (memcmp(header.magic, CORO_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+        || header.byte_order != 0x01020304) {
+        return CORO_SNAPSHOT_RESTORE_CORRUPT;
+    }
+    if (header.version != CORO_SNAPSHOT_VERSION
+        || header.record_size != sizeof(CoroSnapshotRecord)
+        || header.build_id != CONF_CORO_SNAPSHOT_BUILD_ID
+        || header.layout != layout_of(pools, n_pools)) {
+        return CORO_SNAPSHOT_RESTORE_STALE;
+    }
+    const char *bytes = image;
+    if (header.size < sizeof(header) || header.size > size
+        || header.checksum
+                   != fnv1a(FNV_OFFSET,
+                            bytes + sizeof(header),
+                            header.size - sizeof(header))
+        || !check_records(schedule, pools, n_pools, bytes, &header)) {
+        return CORO_SNAPSHOT_RESTORE_CORRUPT;
+    }
+    for (size_t i = 0; i < n_pools; i++) {
+        if (atomic_load(&pools[i]->entries.n_fresh) != 0) {
+            return CORO_SNAPSHOT_RESTORE_BUSY;
+        }
+    }
+
+    const char *in = bytes + sizeof(header);
+    for (uint32_t i = 0; i < header.n_records; i++) {
+        CoroSnapshotRecord record;
+        memcpy(&record, in, sizeof(record));
+        CoroPool *pool = pools[record.pool];
+        restore(schedule, pool, &record, in + sizeof(record));
+        in += record_size(pool);
+    }
+    return CORO_SNAPSHOT_RESTORE_SUCCESS;
+}
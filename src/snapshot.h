@@ -0,0 +1,154 @@
+/** \file snapshot.h
+ *
+ * Saving the coroutines of pools to a binary image, and restoring them from
+ * it on the next boot instead of starting them over.
+ *
+ * An image is written into any buffer the application keeps across the
+ * reset, e.g. a section of RAM retained in low power modes or a file mapped
+ * with mmap(). It is tied to the build that wrote it: another build (or a
+ * torn or corrupt image) is rejected, and the application starts cold.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H 1
+
+#include <inttypes.h>
+#include <stddef.h>
+#include "coro.h"
+
+
+#ifndef CONF_CORO_SNAPSHOT_BUILD_ID
+/** Identifier of the build, e.g. the hash of its commit, stored in images
+ * so that those of another build are rejected as #CORO_SNAPSHOT_STALE.
+ * Layout and code changes are caught without it as far as they move the
+ * coroutines of the pools, but not every change does. */
+#define CONF_CORO_SNAPSHOT_BUILD_ID 0
+#endif
+
+
+/** \brief Start of an image, followed by \c n_records #CoroSnapshotRecord's,
+ * each followed by the variables of its coroutine
+ *
+ * Images are in the byte order of the target, as given by \c byte_order.
+ */
+typedef struct {
+    /** #CORO_SNAPSHOT_MAGIC */
+    char magic[8];
+    /** 0x01020304 */
+    uint32_t byte_order;
+    /** #CORO_SNAPSHOT_VERSION */
+    uint16_t version;
+    /** sizeof(#CoroSnapshotRecord) */
+    uint16_t record_size;
+    /** #CONF_CORO_SNAPSHOT_BUILD_ID */
+    uint32_t build_id;
+    /** Hash of the layout of the states and pools, and of where the
+     * functions of the pools are */
+    uint32_t layout;
+    /** Number of records that follow */
+    uint32_t n_records;
+    /** Size of the whole image */
+    uint32_t size;
+    /** FNV-1a hash of what follows the header */
+    uint32_t checksum;
+    /** Zero */
+    uint32_t reserved;
+} CoroSnapshotHeader;
+
+/** CoroSnapshotHeader::magic */
+#define CORO_SNAPSHOT_MAGIC "CORO-SNP"
+/** CoroSnapshotHeader::version */
+#define CORO_SNAPSHOT_VERSION 1
+
+
+/** \brief A saved coroutine, followed by its variables padded to 8 bytes
+ *
+ * Labels are saved as offsets from code of the library, and what the
+ * coroutine waits on as an offset from data of the library, so that they
+ * are fixed up if the build is loaded elsewhere (e.g. a position independent
+ * executable). With #CONF_CORO_SWITCH_DISPATCH, labels are lines and saved
+ * as they are.
+ */
+typedef struct {
+    /** Where it resumes, 0 if it never ran */
+    uint64_t label;
+    /** Where it resumes once cancelled, 0 if it finalizes instead */
+    uint64_t on_cancel;
+    /** The #Condition, #WakeCondition or #Channel it waits on, or 0 */
+    uint64_t target;
+    /** Index of its slot in its pool */
+    uint32_t slot;
+    /** Index of its pool, records of a pool coming in order of \c slot */
+    uint16_t pool;
+    /** Its #CoroStatus */
+    uint8_t status;
+    /** Its priority, 0 being the highest */
+    uint8_t priority;
+    /** CoroChannelWait::send */
+    uint8_t send;
+    /** Zero */
+    uint8_t reserved[7];
+} CoroSnapshotRecord;
+
+
+/** Outcomes of #CoroSnapshot_restore */
+typedef enum {
+    /** The coroutines of the image were restored */
+    CORO_SNAPSHOT_RESTORE_SUCCESS,
+    /** Not an image, or a torn or corrupt one */
+    CORO_SNAPSHOT_RESTORE_CORRUPT,
+    /** An image of another build or version */
+    CORO_SNAPSHOT_RESTORE_STALE,
+    /** A pool was used already */
+    CORO_SNAPSHOT_RESTORE_BUSY,
+} RetCoroSnapshot_restore;
+
+
+/** \brief Largest size of an image of \p pools */
+size_t CoroSnapshot_size(CoroPool *const *pools, size_t n_pools);
+
+
+/** \brief Save every coroutine of \p pools to \p image
+ *
+ * Only coroutines that are quiescent can be saved: ready, never started, or
+ * waiting without a timeout on a #Condition, a #WakeCondition or a
+ * #Channel. Those woken but not resumed yet are saved as ready. Call it
+ * between steps of their schedule, from the context running it, e.g. once
+ * #schedule_run_steps ran none before a low power mode or a shutdown.
+ *
+ * The variables of the coroutines are saved byte for byte: pointers in them
+ * stay valid only as far as what they point to is at the same address on
+ * the next boot. Coroutines not of \p pools are not saved and are the
+ * application's to start again, as on a cold boot.
+ *
+ * \param image 8 byte aligned buffer of \p size bytes, see
+ *              #CoroSnapshot_size
+ * \return The size of the image
+ * \retval 0 if a coroutine of \p pools is not quiescent, or \p size is too
+ * small
+ */
+size_t CoroSnapshot_save(CoroPool *const *pools,
+                         size_t           n_pools,
+                         void *           image,
+                         size_t           size);
+
+
+/** \brief Restore the coroutines of \p image into \p pools, added to
+ * \p schedule
+ *
+ * \p pools must be the same as when it was saved, and not used yet. Each
+ * coroutine is given back the slot of its pool, variables, priority and wait
+ * it had, so that its wait is over as soon as what it waits on is set
+ * again. The image is checked in full first, so nothing is restored unless
+ * all of it is.
+ *
+ * Restoring leaves \p image as it is: invalidate it (e.g. clear its magic)
+ * before the coroutines run, if it must not be restored again.
+ */
+RetCoroSnapshot_restore CoroSnapshot_restore(CoroSchedule *    schedule,
+                                             CoroPool *const * pools,
+                                             size_t            n_pools,
+                                             const void *      image,
+                                             size_t            size);
+
+#endif /* ifndef SNAPSHOT_H */
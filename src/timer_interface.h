@@ -2,18 +2,37 @@
  *
  * Timer interface required by coroutine scheduler. This should be implemeted
  * specific to each hardware
+ *
+ * Implementations written before the scheduler woke timed waits must now:
+ * - expire timers through #Timer_expire instead of setting
+ *   Timer::timed_out, so that the coroutine waiting is woken (a timed wait is
+ *   no longer polled),
+ * - leave Timer::waiter alone, which the scheduler sets before starting a
+ *   timer,
+ * - provide #Timer_poll, which may be empty if timers expire from
+ *   interrupts,
+ * - provide #Timer_next_deadline, which may return #TIMER_MS_NEVER if timers
+ *   expire from interrupts, as #Timer_expire wakes the scheduler,
+ * - return from #Timer_start_new whether the timer started.
+ *
+ * timer_wheel.c implements all of it from a tick interrupt, and may be used
+ * instead of a port of its own.
  */
 /* Copyright 2018 Gaurav Juvekar */
 #ifndef TIMER_INTERFACE_H
 #define TIMER_INTERFACE_H 1
 
 #include <inttypes.h>
+#include <stdbool.h>
 #include "condition.h"
 
 
 /** Number of milliseconds */
 typedef uint32_t timer_ms_t;
 
+/** A #timer_ms_t that never elapses */
+#define TIMER_MS_NEVER UINT32_MAX
+
 /** Forward declaration for internal implementation of the timer */
 typedef struct TimerInternal TimerInternal;
 
@@ -28,14 +47,32 @@ typedef struct {
     /** Pointer to any required internal representation. This will not be
      * modified by any user of the implementation. */
     TimerInternal *internal;
+    /** A waiter to wake when the timer expires, or \c NULL. This is owned by
+     * the user and must not be modified by the implementation. */
+    Waiter *waiter;
 } Timer;
 
+
+/** \brief Signal the expiry of \p instance
+ *
+ * Implementations must call this (from any context) when a timer expires,
+ * instead of setting \p instance->timed_out themselves.
+ */
+static inline void Timer_expire(Timer *instance) {
+    CORO_TRACE(CORO_TRACE_TIMER_FIRE, instance, 0);
+    Condition_set(&instance->timed_out);
+    if (instance->waiter != NULL) { Waiter_wake(instance->waiter); }
+}
+
 /** \brief Start a new timer
  * \param instance The timer instance and condition variable that wil be set
  *                 when milliseconds have elapsed.
  * \param milliseconds the number of milliseconds after which
- *                     \p instance->timed_out will be set
- * \return A pointer that can be later passed to #Timer_cancel.
+ *                     \p instance->timed_out will be set (through
+ *                     #Timer_expire)
+ * \retval true if the timer started
+ * \retval false if the implementation has no room for another running timer.
+ * \p instance is expired at once then, so that a wait on it still ends.
  *
  * The \p instance->timed_out condition must be cleared by the implementation
  * before starting the timer.
@@ -44,7 +81,7 @@ typedef struct {
  * deallocated, otherwise it will be asynchronously overwritten when the timer
  * eventually expires. This will lead to \b undefined \b behaviour.
  */
-extern void Timer_start_new(Timer *instance, timer_ms_t milliseconds);
+extern bool Timer_start_new(Timer *instance, timer_ms_t milliseconds);
 
 /** \brief Cancel a started (or expired) timer
  * \param instance The timer instance to cancel
@@ -56,4 +93,23 @@ extern void Timer_start_new(Timer *instance, timer_ms_t milliseconds);
  */
 extern void Timer_cancel(Timer *instance);
 
+/** \brief Expire due timers from the scheduler context
+ *
+ * Called by the scheduler before every pass, so it should return at once
+ * unless a timer is due. Implementations that expire timers from interrupts
+ * may leave this empty.
+ */
+extern void Timer_poll(void);
+
+/** \brief Time until the next timer may expire
+ *
+ * Called by the scheduler before it goes idle, so that it sleeps no longer
+ * than this. Returning an earlier time than the actual expiry is allowed.
+ *
+ * \return Milliseconds until the earliest running timer expires, or
+ * #TIMER_MS_NEVER if there is none (or if timers are expired from interrupts
+ * which wake the scheduler themselves)
+ */
+extern timer_ms_t Timer_next_deadline(void);
+
 #endif /* ifndef TIMER_INTERFACE_H */
@@ -0,0 +1,363 @@
+/** \file timer_wheel.c
+ *
+ * Reference implementation of timer_interface.h as a hierarchical timing
+ * wheel.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include "timer_wheel.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "slot_pool.h"
+
+/** log2 of the number of slots per level */
+#define LEVEL_BITS 6
+#define N_SLOTS (1u << LEVEL_BITS)
+#define SLOT_MASK (N_SLOTS - 1)
+/** Enough levels to cover every 32 bit expiry */
+#define N_LEVELS ((32 + LEVEL_BITS - 1) / LEVEL_BITS)
+
+_Static_assert(N_SLOTS == 64, "occupancy masks are 64 bit");
+
+
+/** Life cycle of a #TimerInternal */
+enum {
+    /** Started, not yet on the wheel */
+    NODE_PENDING,
+    /** On the wheel */
+    NODE_LINKED,
+    /** Taken off the wheel, being expired */
+    NODE_FIRING,
+    /** Expired */
+    NODE_FIRED,
+    /** Cancelled by its timer */
+    NODE_CANCELLED,
+};
+
+
+struct TimerInternal {
+    /** Link in the slot list */
+    TimerInternal *next;
+    /** The link pointing to this node, \c NULL while not on the wheel */
+    TimerInternal **pprev;
+    /** Link in the \c pending or \c cancelled request list */
+    TimerInternal *next_request;
+    /** One of the NODE_ values */
+    _Atomic uint8_t state;
+    /** The timer this node runs for */
+    Timer *timer;
+    /** Tick at which the timer expires */
+    uint32_t expiry;
+    /** Level of the slot list */
+    uint8_t level;
+    /** Index of the slot list */
+    uint8_t slot;
+};
+
+
+/** Ticks elapsed, counted by the tick interrupt */
+static _Atomic uint32_t elapsed;
+/** Tick at which the tick interrupt should wake the scheduler */
+static _Atomic uint32_t due;
+/** Whether \c due is valid */
+static _Atomic bool due_valid;
+
+/** Started nodes to link, newest first */
+static TimerInternal *_Atomic pending;
+/** Cancelled nodes to unlink, newest first */
+static TimerInternal *_Atomic cancelled;
+/** Held by the context processing the wheel */
+static atomic_flag busy = ATOMIC_FLAG_INIT;
+/** Set once a timer is due or a start or cancellation was requested, so
+ * that #Timer_poll has something to do */
+static _Atomic bool poll_pending;
+
+static TimerInternal pool_nodes[CONF_TIMER_WHEEL_N_TIMERS];
+static SlotPool      pool = SLOT_POOL_STATIC_INIT(
+        sizeof(TimerInternal), CONF_TIMER_WHEEL_N_TIMERS, pool_nodes);
+
+/* The rest is only accessed while holding busy */
+
+/** The next tick to process */
+static uint32_t       now;
+static TimerInternal *wheel[N_LEVELS][N_SLOTS];
+/** Bit \c i is set if \c wheel[level][i] is not empty */
+static uint64_t       occupied[N_LEVELS];
+static size_t         n_running;
+
+
+static void request(TimerInternal *_Atomic *list, TimerInternal *node) {
+    TimerInternal *head = atomic_load(list);
+    do {
+        node->next_request = head;
+    } while (!atomic_compare_exchange_weak(list, &head, node));
+    atomic_store(&poll_pending, true);
+}
+
+
+static void slot_link(TimerInternal *node) {
+    uint32_t delta = node->expiry - now;
+    uint8_t  level = 0;
+    while (level < N_LEVELS - 1
+           && delta >= ((uint64_t)1 << (LEVEL_BITS * (level + 1)))) {
+        level++;
+    }
+    uint8_t slot = (node->expiry >> (LEVEL_BITS * level)) & SLOT_MASK;
+
+    TimerInternal **head = &wheel[level][slot];
+    node->level          = level;
+    node->slot           = slot;
+    node->next           = *head;
+    node->pprev          = head;
+    if (*head != NULL) { (*head)->pprev = &node->next; }
+    *head = node;
+    occupied[level] |= (uint64_t)1 << slot;
+}
+
+
+static void slot_unlink(TimerInternal *node) {
+    *node->pprev = node->next;
+    if (node->next != NULL) { node->next->pprev = node->pprev; }
+    node->pprev = NULL;
+    if (wheel[node->level][node->slot] == NULL) {
+        occupied[node->level] &= ~((uint64_t)1 << node->slot);
+    }
+}
+
+
+/** Take the whole list of a slot */
+static TimerInternal *take_slot(uint8_t level, uint8_t slot) {
+    TimerInternal *list  = wheel[level][slot];
+    wheel[level][slot]   = NULL;
+    occupied[level]     &= ~((uint64_t)1 << slot);
+    for (TimerInternal *node = list; node != NULL; node = node->next) {
+        node->pprev = NULL;
+    }
+    return list;
+}
+
+
+static uint64_t rotate_right(uint64_t bits, unsigned n) {
+    n &= 63;
+    return (n == 0) ? bits : ((bits >> n) | (bits << (64 - n)));
+}
+
+
+/** \brief Earliest tick at which a timer may expire, relative to \c now
+ * \return \c false if no timer is running
+ */
+static bool next_expiry(uint32_t *delta) {
+    if (n_running == 0) { return false; }
+    uint32_t earliest = UINT32_MAX;
+    if (occupied[0] != 0) {
+        /* Level 0 holds exactly the expiries in [now, now + N_SLOTS) */
+        earliest = __builtin_ctzll(rotate_right(occupied[0], now & SLOT_MASK));
+    }
+    for (uint8_t level = 1; level < N_LEVELS; level++) {
+        if (occupied[level] == 0) { continue; }
+        /* A slot is moved down when the levels below it wrap into it, which
+         * is no later than its earliest expiry. The slot of the current block
+         * is still pending if now is exactly at its start. */
+        unsigned shift = LEVEL_BITS * level;
+        uint32_t first = (now >> shift) + ((now & ((1u << shift) - 1)) != 0);
+        uint32_t k     = __builtin_ctzll(
+                rotate_right(occupied[level], first & SLOT_MASK));
+        uint32_t at = ((first + k) << shift) - now;
+        if (at < earliest) { earliest = at; }
+    }
+    *delta = earliest;
+    return true;
+}
+
+
+/** Tell the tick interrupt when to wake the scheduler next */
+static void update_due(void) {
+    uint32_t delta;
+    if (next_expiry(&delta)) {
+        atomic_store(&due, now + delta);
+        atomic_store(&due_valid, true);
+    } else {
+        atomic_store(&due_valid, false);
+    }
+}
+
+
+/** Move the timers of the slot that just became current one level down */
+static void cascade(uint8_t level) {
+    uint8_t        slot = (now >> (LEVEL_BITS * level)) & SLOT_MASK;
+    TimerInternal *list = take_slot(level, slot);
+    while (list != NULL) {
+        TimerInternal *next = list->next;
+        slot_link(list);
+        list = next;
+    }
+    if (slot == 0 && level + 1 < N_LEVELS) { cascade(level + 1); }
+}
+
+
+/** Expire every timer of the current level 0 slot */
+static void expire_current(void) {
+    TimerInternal *list = take_slot(0, now & SLOT_MASK);
+    while (list != NULL) {
+        TimerInternal *next     = list->next;
+        uint8_t        expected = NODE_LINKED;
+        n_running--;
+        /* A cancelled node is freed from the cancelled list */
+        if (atomic_compare_exchange_strong(
+                    &list->state, &expected, NODE_FIRING)) {
+            Timer_expire(list->timer);
+            /* From here on Timer_cancel may free it */
+            atomic_store(&list->state, NODE_FIRED);
+        }
+        list = next;
+    }
+}
+
+
+/** Apply the starts and cancellations requested since the last call */
+static void take_requests(void) {
+    /* Nothing to walk through in the ticks nobody polled for */
+    if (n_running == 0) { now = atomic_load(&elapsed) + 1; }
+    TimerInternal *list = atomic_exchange(&pending, NULL);
+    while (list != NULL) {
+        TimerInternal *next     = list->next_request;
+        uint8_t        expected = NODE_PENDING;
+        if (atomic_compare_exchange_strong(
+                    &list->state, &expected, NODE_LINKED)) {
+            /* The wheel may have moved past it meanwhile */
+            if ((int32_t)(list->expiry - now) < 0) { list->expiry = now; }
+            n_running++;
+            slot_link(list);
+        } else {
+            /* Cancelled before it was ever linked */
+            SlotPool_free(&pool, list);
+        }
+        list = next;
+    }
+
+    list = atomic_exchange(&cancelled, NULL);
+    while (list != NULL) {
+        TimerInternal *next = list->next_request;
+        if (list->pprev != NULL) {
+            slot_unlink(list);
+            n_running--;
+        }
+        SlotPool_free(&pool, list);
+        list = next;
+    }
+}
+
+
+void TimerWheel_tick(void) {
+    TimerWheel_advance(1);
+}
+
+
+void TimerWheel_advance(uint32_t n_ticks) {
+    uint32_t ticks = atomic_fetch_add(&elapsed, n_ticks) + n_ticks;
+    if (atomic_load(&due_valid) && (int32_t)(ticks - atomic_load(&due)) >= 0) {
+        atomic_store(&poll_pending, true);
+        CoroIdle_notify();
+    }
+}
+
+
+bool Timer_start_new(Timer *instance, timer_ms_t milliseconds) {
+    CORO_TRACE(CORO_TRACE_TIMER_START, instance, milliseconds);
+    Condition_clear(&instance->timed_out);
+    TimerInternal *node = SlotPool_alloc(&pool);
+    if (node == NULL) {
+        /* Better early than never, see CONF_TIMER_WHEEL_N_TIMERS */
+        instance->internal = NULL;
+        Timer_expire(instance);
+        return false;
+    }
+    uint32_t n_ticks = milliseconds / CONF_TIMER_WHEEL_TICK_MS
+                       + (milliseconds % CONF_TIMER_WHEEL_TICK_MS != 0);
+    /* The current tick is already partly over */
+    node->expiry       = atomic_load(&elapsed) + n_ticks + 1;
+    node->timer        = instance;
+    node->pprev        = NULL;
+    atomic_store(&node->state, NODE_PENDING);
+    instance->internal = node;
+    /* Linked by the next Timer_poll or Timer_next_deadline */
+    request(&pending, node);
+    return true;
+}
+
+
+void Timer_cancel(Timer *instance) {
+    TimerInternal *node = instance->internal;
+    if (node == NULL) { return; }
+    instance->internal = NULL;
+    uint8_t state      = atomic_load(&node->state);
+    do {
+        while (state == NODE_FIRING) {
+            /* Wait for Timer_expire to be done with instance */
+            state = atomic_load(&node->state);
+        }
+    } while (!atomic_compare_exchange_weak(
+            &node->state, &state, NODE_CANCELLED));
+
+    if (state != NODE_FIRED) {
+        CORO_TRACE(CORO_TRACE_TIMER_CANCEL, instance, 0);
+    }
+    switch (state) {
+    case NODE_LINKED: request(&cancelled, node); break;
+    case NODE_FIRED: SlotPool_free(&pool, node); break;
+    default: /* Still on the pending list, which frees it */ break;
+    }
+}
+
+
+void Timer_poll(void) {
+    if (!atomic_load(&poll_pending)) { return; }
+    /* Whoever holds it processes the requests made meanwhile later on */
+    if (atomic_flag_test_and_set(&busy)) { return; }
+    /* Set again by whatever comes after the requests and ticks taken */
+    atomic_store(&poll_pending, false);
+    take_requests();
+    uint32_t target = atomic_load(&elapsed);
+    while ((int32_t)(target - now) >= 0) {
+        if (n_running == 0) {
+            now = target + 1;
+            break;
+        }
+        unsigned index = now & SLOT_MASK;
+        if (index == 0) { cascade(1); }
+        if (!(occupied[0] & ((uint64_t)1 << index))) {
+            /* Skip to the next occupied slot, at most to the end of the
+             * current turn of level 0 where the next cascade is due */
+            uint64_t later = occupied[0] & (~(uint64_t)0 << index);
+            uint32_t skip  = (later != 0) ? __builtin_ctzll(later) - index
+                                          : N_SLOTS - index;
+            if (skip > target - now) { skip = target - now + 1; }
+            now += skip;
+            continue;
+        }
+        expire_current();
+        now++;
+    }
+    update_due();
+    atomic_flag_clear(&busy);
+}
+
+
+timer_ms_t Timer_next_deadline(void) {
+    /* Another context is processing the wheel, and may link a timer due
+     * before the tick that wakes the scheduler knows of it */
+    if (atomic_flag_test_and_set(&busy)) { return CONF_TIMER_WHEEL_TICK_MS; }
+    take_requests();
+    update_due();
+    uint32_t delta;
+    bool     running = next_expiry(&delta);
+    /* The wheel may lag the ticks that already elapsed */
+    int32_t remaining = (int32_t)(now + delta - atomic_load(&elapsed));
+    atomic_flag_clear(&busy);
+
+    if (!running) { return TIMER_MS_NEVER; }
+    if (remaining <= 0) { return 0; }
+    uint64_t ms = (uint64_t)remaining * CONF_TIMER_WHEEL_TICK_MS;
+    return (ms >= TIMER_MS_NEVER) ? TIMER_MS_NEVER - 1 : (timer_ms_t)ms;
+}
@@ -0,0 +1,53 @@
+/** \file timer_wheel.h
+ *
+ * Reference implementation of timer_interface.h as a hierarchical timing
+ * wheel.
+ *
+ * A single periodic tick interrupt calls #TimerWheel_tick (or
+ * #TimerWheel_advance), which is one atomic add. Starting and cancelling a
+ * timer only post a request on a lock-free list. The wheel itself is only
+ * touched by #Timer_poll and #Timer_next_deadline, one context at a time,
+ * so several schedulers (e.g. the workers of a #CoroWorkers) may share it.
+ * The tick only wakes the idle schedulers when a timer is actually due, and
+ * #Timer_poll returns at once unless one is or a timer was started or
+ * cancelled since.
+ *
+ * Starting and cancelling a timer is O(1). Each timer is moved down at most
+ * once per wheel level before it expires.
+ *
+ * \warning #Timer_start_new and #Timer_cancel must only be called from
+ * scheduler contexts (i.e. from coroutines), never from interrupts. An expired
+ * timer keeps its node until it is cancelled.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H 1
+
+#include <inttypes.h>
+#include "timer_interface.h"
+
+
+#ifndef CONF_TIMER_WHEEL_N_TIMERS
+/** Maximum number of timers running at once */
+#define CONF_TIMER_WHEEL_N_TIMERS 64
+#endif
+
+#ifndef CONF_TIMER_WHEEL_TICK_MS
+/** Milliseconds between two calls to #TimerWheel_tick */
+#define CONF_TIMER_WHEEL_TICK_MS 1
+#endif
+
+
+/** \brief Account for one elapsed tick
+ *
+ * Call this from the periodic tick interrupt.
+ */
+void TimerWheel_tick(void);
+
+/** \brief Account for \p n_ticks elapsed ticks
+ *
+ * Same as calling #TimerWheel_tick \p n_ticks times.
+ */
+void TimerWheel_advance(uint32_t n_ticks);
+
+#endif /* ifndef TIMER_WHEEL_H */
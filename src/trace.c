@@ -0,0 +1,69 @@
+/** \file trace.c
+ *
+ * Timeline of scheduler events in a lock-free ring buffer.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include "trace.h"
+#include <stdbool.h>
+#include <string.h>
+
+#if CONF_CORO_TRACE
+CoroTraceEvent   CoroTrace_ring[CONF_CORO_TRACE_N_EVENTS];
+_Atomic uint32_t CoroTrace_n_recorded;
+
+
+/** \brief Copy the event with sequence number \p sequence into \p record
+ * \return \c false if it was overwritten or is being written
+ */
+static bool read_event(uint32_t sequence, CoroTraceRecord *record) {
+    CoroTraceEvent *event =
+            &CoroTrace_ring[(sequence - 1) & (CONF_CORO_TRACE_N_EVENTS - 1)];
+    if (atomic_load_explicit(&event->sequence, memory_order_acquire)
+        != sequence) {
+        return false;
+    }
+    memset(record, 0, sizeof(*record));
+    record->cycles   = event->cycles;
+    record->object   = (uint64_t)(uintptr_t)event->object;
+    record->detail   = (uint64_t)event->detail;
+    record->sequence = sequence;
+    record->kind     = event->kind;
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&event->sequence, memory_order_relaxed)
+           == sequence;
+}
+
+
+size_t CoroTrace_dump(void (*write)(void *context, const void *data,
+                                    size_t size),
+                      void *context) {
+    uint32_t last   = atomic_load(&CoroTrace_n_recorded);
+    uint32_t n_kept = (last < CONF_CORO_TRACE_N_EVENTS)
+                              ? last
+                              : CONF_CORO_TRACE_N_EVENTS;
+
+    CoroTraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CORO_TRACE_MAGIC, sizeof(header.magic));
+    header.byte_order    = 0x01020304;
+    header.version       = CORO_TRACE_VERSION;
+    header.record_size   = sizeof(CoroTraceRecord);
+    header.n_records     = n_kept;
+    header.cycles_per_us = CONF_CORO_TRACE_CYCLES_PER_US;
+    write(context, &header, sizeof(header));
+
+    size_t n_written = 0;
+    for (uint32_t sequence = last - n_kept + 1; n_kept > 0; n_kept--) {
+        CoroTraceRecord record;
+        if (read_event(sequence++, &record)) {
+            n_written++;
+        } else {
+            /* Lost to a newer event, left as a record of no kind */
+            memset(&record, 0, sizeof(record));
+        }
+        write(context, &record, sizeof(record));
+    }
+    return n_written;
+}
+#endif
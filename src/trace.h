@@ -0,0 +1,192 @@
+/** \file trace.h
+ *
+ * Timeline of scheduler events in a lock-free ring buffer.
+ *
+ * With #CONF_CORO_TRACE set, the scheduler, conditions, resources and timers
+ * record compact binary events with a cycle count into a ring of the last
+ * #CONF_CORO_TRACE_N_EVENTS of them. Recording takes a fetch-and-add and a
+ * few stores, never blocks and is safe from interrupts and any thread.
+ * #CoroTrace_dump writes the ring out, and \c tools/coro_trace.py turns the
+ * dump into Chrome trace JSON (which Perfetto opens as well).
+ *
+ * Without #CONF_CORO_TRACE, #CORO_TRACE compiles to nothing.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+#ifndef TRACE_H
+#define TRACE_H 1
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+
+#ifndef CONF_CORO_TRACE
+/** Record a timeline of scheduler events (see #CoroTrace_dump). Nothing of
+ * it is compiled in when 0. */
+#define CONF_CORO_TRACE 0
+#endif
+
+
+/** Kinds of traced events, and what their object and detail are */
+typedef enum {
+    /** A coroutine is executed: its #CoroState and its function */
+    CORO_TRACE_RESUME = 1,
+    /** A coroutine returned to the scheduler: its #CoroState and the
+     * #CoroStatus it returned with */
+    CORO_TRACE_SUSPEND,
+    /** A #Condition or #WakeCondition was set: the condition and 0 */
+    CORO_TRACE_CONDITION_SET,
+    /** A #Resource or #QueuedResource acquisition was attempted: the
+     * resource and the #RetResource_acquire outcome */
+    CORO_TRACE_RESOURCE_ACQUIRE,
+    /** A timer was started: the #Timer and its milliseconds */
+    CORO_TRACE_TIMER_START,
+    /** A running timer was cancelled: the #Timer and 0 */
+    CORO_TRACE_TIMER_CANCEL,
+    /** A timer expired: the #Timer and 0 */
+    CORO_TRACE_TIMER_FIRE,
+} CoroTraceKind;
+
+
+/** \brief One event of a #CoroTrace_dump, the same on every host
+ *
+ * Records are stored in the byte order of the target, as given by
+ * CoroTraceHeader::byte_order.
+ */
+typedef struct {
+    /** Cycle count when it was recorded */
+    uint64_t cycles;
+    /** Address of the object concerned */
+    uint64_t object;
+    /** Depends on \c kind */
+    uint64_t detail;
+    /** Position in the sequence of all recorded events, from 1 */
+    uint32_t sequence;
+    /** A #CoroTraceKind */
+    uint8_t kind;
+    /** Zero */
+    uint8_t reserved[3];
+} CoroTraceRecord;
+
+
+/** \brief Start of a #CoroTrace_dump, followed by \c n_records
+ * #CoroTraceRecord's, oldest first
+ *
+ * Records of events overwritten while dumping are all zero.
+ */
+typedef struct {
+    /** #CORO_TRACE_MAGIC */
+    char magic[8];
+    /** 0x01020304 */
+    uint32_t byte_order;
+    /** #CORO_TRACE_VERSION */
+    uint16_t version;
+    /** sizeof(#CoroTraceRecord) */
+    uint16_t record_size;
+    /** Number of records that follow */
+    uint32_t n_records;
+    /** #CONF_CORO_TRACE_CYCLES_PER_US, 0 if unknown */
+    uint32_t cycles_per_us;
+} CoroTraceHeader;
+
+/** CoroTraceHeader::magic */
+#define CORO_TRACE_MAGIC "CORO-TRC"
+/** CoroTraceHeader::version */
+#define CORO_TRACE_VERSION 1
+
+
+#if CONF_CORO_TRACE
+#ifndef CONF_CORO_TRACE_N_EVENTS
+/** Number of the most recent events kept. Must be a power of 2. */
+#define CONF_CORO_TRACE_N_EVENTS 4096
+#endif
+
+#ifndef CONF_CORO_TRACE_CYCLES_PER_US
+/** Rate of #CONF_CORO_TRACE_CYCLES, for the converter to show real times.
+ * Leave 0 if not known at compile time and pass it to the converter. */
+#define CONF_CORO_TRACE_CYCLES_PER_US 0
+#endif
+
+#ifndef CONF_CORO_TRACE_CYCLES
+#if defined(__x86_64__) || defined(__i386__)
+/** Expression reading a free running 64 bit cycle counter, e.g.
+ * \c DWT->CYCCNT on a Cortex-M (extended to 64 bits) */
+#define CONF_CORO_TRACE_CYCLES() __builtin_ia32_rdtsc()
+#elif defined(__aarch64__)
+static inline uint64_t CoroTrace_cntvct(void) {
+    uint64_t count;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(count));
+    return count;
+}
+#define CONF_CORO_TRACE_CYCLES() CoroTrace_cntvct()
+#else
+#error "define CONF_CORO_TRACE_CYCLES() to read a cycle counter"
+#endif
+#endif
+
+_Static_assert((CONF_CORO_TRACE_N_EVENTS & (CONF_CORO_TRACE_N_EVENTS - 1))
+                       == 0,
+               "CONF_CORO_TRACE_N_EVENTS must be a power of 2");
+
+
+/** An event in the ring (private) */
+typedef struct {
+    uint64_t    cycles;
+    const void *object;
+    uintptr_t   detail;
+    /** CoroTraceRecord::sequence once written, 0 while being written */
+    _Atomic uint32_t sequence;
+    uint8_t          kind;
+} CoroTraceEvent;
+
+/** The ring (private) */
+extern CoroTraceEvent CoroTrace_ring[CONF_CORO_TRACE_N_EVENTS];
+/** Number of events ever recorded (private) */
+extern _Atomic uint32_t CoroTrace_n_recorded;
+
+
+/** \brief Record an event of \p kind for \p object
+ *
+ * Use #CORO_TRACE instead, which compiles to nothing without
+ * #CONF_CORO_TRACE.
+ */
+static inline void CoroTrace_record(CoroTraceKind kind,
+                                    const void *  object,
+                                    uintptr_t     detail) {
+    uint32_t index = atomic_fetch_add_explicit(
+            &CoroTrace_n_recorded, 1, memory_order_relaxed);
+    CoroTraceEvent *event =
+            &CoroTrace_ring[index & (CONF_CORO_TRACE_N_EVENTS - 1)];
+    /* Published like the statistics of coro.h, under a sequence number */
+    atomic_store_explicit(&event->sequence, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    event->cycles = CONF_CORO_TRACE_CYCLES();
+    event->object = object;
+    event->detail = detail;
+    event->kind   = (uint8_t)kind;
+    atomic_store_explicit(&event->sequence, index + 1, memory_order_release);
+}
+
+/** \brief Record an event of \p kind for \p object with \p detail (see
+ * #CoroTraceKind) */
+#define CORO_TRACE(kind, object, detail) \
+    CoroTrace_record(kind, object, (uintptr_t)(detail))
+
+
+/** \brief Write the header and the recorded events through \p write
+ *
+ * Events may be recorded meanwhile: those overwritten before they are read
+ * are dumped as records of no kind. Call it from a single context at a time.
+ *
+ * \param write called with successive chunks of the dump, e.g. to send them
+ *              over a UART or to fwrite() them
+ * \return The number of events dumped
+ */
+size_t CoroTrace_dump(void (*write)(void *context, const void *data,
+                                    size_t size),
+                      void *context);
+#else
+#define CORO_TRACE(kind, object, detail) ((void)0)
+#endif
+
+#endif /* ifndef TRACE_H */
@@ -0,0 +1,114 @@
+/** \file wait_list.c
+ *
+ * Lock-free intrusive lists of suspended waiters and the ready queues they are
+ * woken onto.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include "wait_list.h"
+
+
+WaitNode WaitList_closed_sentinel;
+
+
+void WaitList_give_back(WaitList *list, WaitNode *first, WaitNode *last) {
+    WaitNode *head = atomic_load(list);
+    do {
+        if (head == WAIT_LIST_CLOSED) {
+            WaitNode_wake_all(first);
+            return;
+        }
+        last->next = head;
+    } while (!atomic_compare_exchange_weak(list, &head, first));
+}
+
+
+void WaitNode_unlink(WaitNode *node) {
+    WaitList *list = atomic_exchange(&node->list, WAIT_NODE_UNLINKING);
+    if (list == NULL) {
+        /* Not on any list */
+        atomic_store(&node->list, NULL);
+        return;
+    }
+    if (list == WAIT_NODE_WAKING) {
+        /* Taken off already, wait until its waker is done with it */
+        while (atomic_load(&node->list) != NULL) {}
+        return;
+    }
+
+    do {
+        WaitNode *taken = WaitList_take_all(list);
+        WaitNode *first = NULL;
+        WaitNode *last  = NULL;
+        bool      found = false;
+        while (taken != NULL) {
+            WaitNode *next = taken->next;
+            if (taken == node) {
+                found = true;
+            } else {
+                if (last == NULL) {
+                    first = taken;
+                } else {
+                    last->next = taken;
+                }
+                last = taken;
+            }
+            taken = next;
+        }
+        if (first != NULL) { WaitList_give_back(list, first, last); }
+        if (found) {
+            atomic_store(&node->list, NULL);
+            return;
+        }
+        /* Either a waker took it, which clears node->list once done, or
+         * another unlink holds it for a moment and puts it back */
+    } while (atomic_load(&node->list) != NULL);
+}
+
+
+/** Move incoming waiters behind the local ones, oldest first */
+static void collect_incoming(WaitReadyQueue *queue) {
+    /* incoming is newest first, reverse it behind what is already local */
+    Waiter *incoming = atomic_exchange(&queue->incoming, NULL);
+    Waiter *oldest   = NULL;
+    Waiter *newest   = incoming;
+    while (incoming != NULL) {
+        Waiter *next   = incoming->next;
+        incoming->next = oldest;
+        oldest         = incoming;
+        incoming       = next;
+    }
+    if (oldest != NULL) {
+        if (queue->tail == NULL) {
+            queue->head = oldest;
+        } else {
+            queue->tail->next = oldest;
+        }
+        queue->tail = newest;
+    }
+}
+
+
+Waiter *WaitReadyQueue_pop(WaitReadyQueue *queue) {
+    /* Queue woken waiters behind the local ones every time, or local waiters
+     * that keep yielding would starve them */
+    if (atomic_load(&queue->incoming) != NULL) { collect_incoming(queue); }
+    if (queue->head == NULL) {
+        if (queue->summary != NULL) {
+            /* Clear before checking again, so that a racing wake sets it
+             * again */
+            atomic_fetch_and(queue->summary, ~queue->summary_bit);
+            collect_incoming(queue);
+            if (queue->head != NULL) {
+                atomic_fetch_or(queue->summary, queue->summary_bit);
+            }
+        }
+    }
+
+    Waiter *waiter = queue->head;
+    if (waiter != NULL) {
+        queue->head = waiter->next;
+        if (queue->head == NULL) { queue->tail = NULL; }
+    }
+    return waiter;
+}
@@ -0,0 +1,360 @@
+/** \file wait_list.h
+ *
+ * Lock-free intrusive lists of suspended waiters and the ready queues they are
+ * woken onto.
+ *
+ * A #Waiter is the suspended side (one per coroutine). It registers itself on
+ * a #WaitList through a #WaitNode. A waker takes the whole list at once and
+ * moves every #Waiter onto its #WaitReadyQueue, so the scheduler only ever
+ * looks at waiters that can make progress.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+#ifndef WAIT_LIST_H
+#define WAIT_LIST_H 1
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "idle.h"
+
+
+/* Forward declarations */
+typedef struct Waiter         Waiter;
+typedef struct WaitNode       WaitNode;
+typedef struct WaitReadyQueue WaitReadyQueue;
+typedef struct WaitJoin       WaitJoin;
+
+
+/** \brief A lock-free LIFO list of #WaitNode's
+ *
+ * Nodes are pushed one at a time by the waiting side and popped all at once by
+ * the waking side. There is no single element pop, so there is no ABA problem.
+ *
+ * A list may also be \e closed (see #WaitList_close), after which no node can
+ * be pushed until it is re-opened.
+ *
+ * \note Initialize to \c NULL
+ */
+typedef WaitNode *_Atomic WaitList;
+
+
+/** \brief Multi-producer single-consumer queue of woken #Waiter's
+ *
+ * Any context (including interrupts) may push through #Waiter_wake. Only the
+ * scheduler owning the queue may pop from it, but another scheduler may steal
+ * the whole of \c incoming at once.
+ *
+ * Each queue may own a bit of a \e summary bitmap shared between several
+ * queues. The bit is set whenever a waiter is added, so the consumer can find
+ * a non-empty queue without looking at every queue. Only the consumer clears
+ * it (see #WaitReadyQueue_pop).
+ *
+ * \note Initialize with #WAIT_READY_QUEUE_INIT
+ */
+struct WaitReadyQueue {
+    /** Waiters woken asynchronously, newest first */
+    Waiter *_Atomic incoming;
+    /** Oldest waiter already taken from \c incoming (consumer only) */
+    Waiter *head;
+    /** Newest waiter already taken from \c incoming (consumer only) */
+    Waiter *tail;
+    /** The summary bitmap, or \c NULL */
+    _Atomic uint32_t *summary;
+    /** The bit of this queue in \c summary */
+    uint32_t summary_bit;
+};
+
+/** Static initializer for an empty #WaitReadyQueue */
+#define WAIT_READY_QUEUE_INIT                         \
+    {                                                 \
+        .incoming = NULL, .head = NULL, .tail = NULL, \
+        .summary = NULL, .summary_bit = 0,            \
+    }
+
+
+/** \brief The suspended side of a wait
+ *
+ * \note All instances of this struct should be treated as private.
+ */
+struct Waiter {
+    /** Link in a #WaitReadyQueue */
+    Waiter *next;
+    /** The queue to place this waiter on when woken, or \c NULL if nobody
+     * schedules it (it is then polled through \c armed instead) */
+    WaitReadyQueue *ready;
+    /** The join this waiter is a member of, or \c NULL. A member is never
+     * scheduled, its wake is counted by the join instead. */
+    WaitJoin *join;
+    /** Set while a wake is expected. The first waker to clear it owns the
+     * wake, so a waiter is made ready exactly once per wait. */
+    _Atomic bool armed;
+};
+
+
+/** \brief Turns the wakes of several member #Waiter's into a single wake
+ *
+ * Waking a member counts \c remaining down, and the wake that brings it to 0
+ * wakes \c waiter. Counting down from 1 thus wakes it on the first member
+ * wake, counting down from N on the last one.
+ *
+ * \note All instances of this struct should be treated as private.
+ */
+struct WaitJoin {
+    /** Member wakes still needed. Goes below 0 with wakes after the last. */
+    _Atomic int32_t remaining;
+    /** Member wakes that are done with the join */
+    _Atomic int32_t forwarded;
+    /** The member whose wake brought \c remaining to 0 */
+    Waiter *_Atomic completed_by;
+    /** The waiter to wake */
+    Waiter *waiter;
+};
+
+
+/** \brief Registration of a #Waiter on a single #WaitList
+ *
+ * \note All instances of this struct should be treated as private.
+ */
+struct WaitNode {
+    /** Link in \c list */
+    WaitNode *next;
+    /** The waiter to wake */
+    Waiter *waiter;
+    /** The list this node is on, \c NULL once a waker took it off,
+     * #WAIT_NODE_WAKING while that waker wakes \c waiter, or
+     * #WAIT_NODE_UNLINKING while #WaitNode_unlink looks for it */
+    WaitList *_Atomic list;
+};
+
+
+/** \brief Sentinel head of a closed #WaitList
+ *
+ * \warning Never link or dereference it, only compare against it.
+ */
+extern WaitNode WaitList_closed_sentinel;
+
+/** Head value of a closed #WaitList */
+#define WAIT_LIST_CLOSED (&WaitList_closed_sentinel)
+
+/** WaitNode::list value while #WaitNode_unlink looks for the node */
+#define WAIT_NODE_UNLINKING ((WaitList *)&WaitList_closed_sentinel)
+
+/** WaitNode::list value while a waker wakes the waiter of the node */
+#define WAIT_NODE_WAKING ((WaitList *)&WaitList_closed_sentinel.waiter)
+
+
+/** \brief Push \p node on \p list
+ * \return \c false without pushing if \p list is closed
+ */
+static inline bool WaitList_push(WaitList *list, WaitNode *node) {
+    WaitNode *head = atomic_load(list);
+    atomic_store(&node->list, list);
+    do {
+        if (head == WAIT_LIST_CLOSED) {
+            atomic_store(&node->list, NULL);
+            return false;
+        }
+        node->next = head;
+    } while (!atomic_compare_exchange_weak(list, &head, node));
+    return true;
+}
+
+
+/** \brief Atomically take every node off \p list and leave it empty
+ * \return The taken nodes, newest first, or \c NULL if \p list was empty or
+ * closed
+ */
+static inline WaitNode *WaitList_take_all(WaitList *list) {
+    WaitNode *head = atomic_load(list);
+    do {
+        if (head == NULL || head == WAIT_LIST_CLOSED) { return NULL; }
+    } while (!atomic_compare_exchange_weak(list, &head, NULL));
+    return head;
+}
+
+
+/** \brief Atomically take every node off \p list and close it
+ * \return The taken nodes, newest first, or \c NULL if there were none
+ */
+static inline WaitNode *WaitList_close(WaitList *list) {
+    WaitNode *head = atomic_exchange(list, WAIT_LIST_CLOSED);
+    return (head == WAIT_LIST_CLOSED) ? NULL : head;
+}
+
+
+/** \brief Re-open \p list if it is closed */
+static inline void WaitList_reopen(WaitList *list) {
+    WaitNode *closed = WAIT_LIST_CLOSED;
+    atomic_compare_exchange_strong(list, &closed, NULL);
+}
+
+
+/** \brief Check if \p list is closed */
+static inline bool WaitList_is_closed(WaitList *list) {
+    return atomic_load(list) == WAIT_LIST_CLOSED;
+}
+
+
+/** \brief Push nodes taken off \p list back in front of it
+ *
+ * If \p list was closed meanwhile, its waker missed these nodes, so they are
+ * woken instead.
+ *
+ * \param list  the list
+ * \param first first node of a list linked through WaitNode::next
+ * \param last  last node of that list
+ */
+void WaitList_give_back(WaitList *list, WaitNode *first, WaitNode *last);
+
+
+/** \brief Unlink \p node from the list it was pushed on, if still there
+ *
+ * The whole list is taken, filtered and put back in front of whatever was
+ * pushed in the meantime. If the list was closed in the meantime, the other
+ * taken nodes are woken as the closing waker would have done. Safe against
+ * concurrent wakers and pushers, including on other cores.
+ *
+ * Once it returns, no waker looks at \p node any more, so its waiter may be
+ * re-armed.
+ */
+void WaitNode_unlink(WaitNode *node);
+
+
+/** \brief Expect a wake for \p waiter
+ *
+ * \pre \p waiter is not on any #WaitReadyQueue
+ */
+static inline void Waiter_arm(Waiter *waiter) {
+    atomic_store(&waiter->armed, true);
+}
+
+
+/** \brief Take ownership of the pending wake of \p waiter
+ * \return \c true if no one else has woken \p waiter since it was armed
+ */
+static inline bool Waiter_claim(Waiter *waiter) {
+    return atomic_exchange(&waiter->armed, false);
+}
+
+
+/** \brief Wake \p waiter onto its #WaitReadyQueue
+ *
+ * Safe to call from any context. Does nothing if \p waiter was already woken
+ * since it was armed. Raises a pending wake for the idle scheduler.
+ *
+ * The wake of a member of a #WaitJoin is counted instead, and wakes the
+ * waiter of the join if it completes it.
+ *
+ * \return \c true if this call woke \p waiter
+ */
+static inline bool Waiter_wake(Waiter *waiter) {
+    if (!Waiter_claim(waiter)) { return false; }
+    WaitJoin *join = waiter->join;
+    if (join != NULL) {
+        bool completes = atomic_fetch_sub(&join->remaining, 1) == 1;
+        if (completes) { atomic_store(&join->completed_by, waiter); }
+        Waiter *joined = join->waiter;
+        /* The join may be reused from here on */
+        atomic_fetch_add(&join->forwarded, 1);
+        if (!completes || !Waiter_claim(joined)) {
+            /* A polled join sees it on its next pass */
+            CoroIdle_notify();
+            return true;
+        }
+        waiter = joined;
+    }
+    WaitReadyQueue *ready = waiter->ready;
+    if (ready != NULL) {
+        Waiter *head = atomic_load(&ready->incoming);
+        do {
+            waiter->next = head;
+        } while (!atomic_compare_exchange_weak(
+                &ready->incoming, &head, waiter));
+        if (ready->summary != NULL) {
+            atomic_fetch_or(ready->summary, ready->summary_bit);
+        }
+    }
+    CoroIdle_notify();
+    return true;
+}
+
+
+/** \brief Wake the waiter of \p node, taken off a #WaitList
+ *
+ * \warning \p node may be reused as soon as this releases it, so read its
+ * link first.
+ *
+ * \return \c true if this call woke the waiter (see #Waiter_wake)
+ */
+static inline bool WaitNode_wake(WaitNode *node) {
+    Waiter *waiter = node->waiter;
+    bool    woken  = false;
+    if (atomic_exchange(&node->list, WAIT_NODE_WAKING)
+        != WAIT_NODE_UNLINKING) {
+        woken = Waiter_wake(waiter);
+    }
+    atomic_store(&node->list, NULL);
+    return woken;
+}
+
+
+/** \brief Wake every waiter of a node list taken off a #WaitList */
+static inline void WaitNode_wake_all(WaitNode *nodes) {
+    while (nodes != NULL) {
+        WaitNode *next = nodes->next;
+        WaitNode_wake(nodes);
+        nodes = next;
+    }
+}
+
+
+/** \brief Append an already runnable \p waiter (consumer only) */
+static inline void WaitReadyQueue_append(WaitReadyQueue *queue,
+                                         Waiter *        waiter) {
+    waiter->next = NULL;
+    if (queue->tail == NULL) {
+        queue->head = waiter;
+    } else {
+        queue->tail->next = waiter;
+    }
+    queue->tail = waiter;
+    if (queue->summary != NULL) {
+        atomic_fetch_or(queue->summary, queue->summary_bit);
+    }
+}
+
+
+/** \brief Push a list of waiters taken off \p queue back on it, or of
+ * new unarmed waiters of \p queue, at once
+ *
+ * Safe to call from any context.
+ *
+ * \param queue  the queue
+ * \param first  first (newest) waiter of a list linked through
+ *               Waiter::next
+ * \param last   last (oldest) waiter of that list
+ */
+static inline void WaitReadyQueue_give_back(WaitReadyQueue *queue,
+                                            Waiter *        first,
+                                            Waiter *        last) {
+    Waiter *head = atomic_load(&queue->incoming);
+    do {
+        last->next = head;
+    } while (!atomic_compare_exchange_weak(&queue->incoming, &head, first));
+    if (queue->summary != NULL) {
+        atomic_fetch_or(queue->summary, queue->summary_bit);
+    }
+    CoroIdle_notify();
+}
+
+
+/** \brief Take the oldest ready waiter (consumer only)
+ *
+ * If the queue is found empty, its summary bit is cleared.
+ *
+ * \return The waiter or \c NULL if the queue is empty
+ */
+Waiter *WaitReadyQueue_pop(WaitReadyQueue *queue);
+
+#endif /* ifndef WAIT_LIST_H */
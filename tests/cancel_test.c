@@ -0,0 +1,255 @@
+/** \file cancel_test.c
+ *
+ * Coroutines cancelled in each kind of wait resume at their clean up label,
+ * and deadlines cancel whole trees of sub-coroutines, on the virtual clock
+ * of sim.h.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include "check.h"
+#include "coro.h"
+#include "sim.h"
+
+
+static CoroState         states_0[16];
+static CoroScheduleQueue queue_0 =
+        CORO_QUEUE_STATIC_INIT(queue_0, 16, states_0);
+static CoroScheduleQueue *const queues[] = {&queue_0};
+static CoroSchedule             schedule = {
+        .queues = queues, .n_priorities = 1, .ready = 0};
+
+
+/** Never set, so that the waits on them only end once cancelled */
+static Condition     never_condition;
+static WakeCondition never = WAKE_CONDITION_INIT;
+/** Held by the test throughout */
+static Resource       resource;
+static QueuedResource queued = QUEUED_RESOURCE_INIT;
+static ResourceOwner  test_owner = {.priority = 100};
+/** Free, but held by a waiter while it waits */
+static QueuedResource held = QUEUED_RESOURCE_INIT;
+/** Empty */
+static uint32_t channel_data[2];
+static Channel  channel = CHANNEL_STATIC_INIT(
+        sizeof(uint32_t), 2, channel_data, CHANNEL_MPMC);
+
+
+typedef struct {
+    bool     cancelled;
+    uint64_t cancelled_at;
+} foreverVars;
+/** Awaits \c never until cancelled */
+static void forever(CoroState *state, void *vars) {
+    CORO_INIT(forever);
+    CORO_ON_CANCEL(cancelled);
+    CORO_AWAIT(&never);
+    CHECK(!"forever resumed without a cancel");
+cancelled:
+    v->cancelled    = CORO_CANCELLED();
+    v->cancelled_at = CoroSim_now_us();
+    CORO_END();
+}
+
+
+/** The waits of \c waiter */
+enum {
+    SLEEP,
+    CONDITION,
+    RESOURCE,
+    WAKE_CONDITION,
+    QUEUED_RESOURCE,
+    SUB_COROUTINE,
+    CHANNEL,
+    MANY,
+    /** Waits on \c never holding \c held */
+    HOLDING,
+    N_WAITS,
+};
+
+typedef struct {
+    int           wait;
+    /** Resumed where it waited */
+    bool          resumed;
+    bool          cancelled;
+    ResourceOwner owner;
+    CoroState     sub;
+    foreverVars   sub_vars;
+    CoroWaitable  waitables[2];
+    uint32_t      item;
+} waiterVars;
+/** Waits in its way until cancelled */
+static void waiter(CoroState *state, void *vars) {
+    CORO_INIT(waiter);
+    CORO_ON_CANCEL(cancelled);
+    if (v->wait == SLEEP) {
+        CORO_AWAIT_TIMED_EXPLICIT(state, 100000);
+    } else if (v->wait == CONDITION) {
+        CORO_AWAIT(&never_condition);
+    } else if (v->wait == RESOURCE) {
+        CORO_AWAIT(&resource, &v->owner);
+    } else if (v->wait == WAKE_CONDITION) {
+        CORO_AWAIT(&never);
+    } else if (v->wait == QUEUED_RESOURCE) {
+        CORO_AWAIT(&queued, &v->owner);
+    } else if (v->wait == SUB_COROUTINE) {
+        Coro_init_sub(&v->sub, forever, &v->sub_vars);
+        CORO_AWAIT(&v->sub);
+    } else if (v->wait == CHANNEL) {
+        CORO_AWAIT_RECV(&channel, &v->item);
+    } else if (v->wait == MANY) {
+        v->waitables[0] = CORO_WAITABLE(&never_condition);
+        v->waitables[1] = CORO_WAITABLE(&never);
+        CORO_AWAIT_ANY(v->waitables);
+    } else {
+        CORO_AWAIT(&held, &v->owner);
+        CHECK(QueuedResource_is_owned(&held, &v->owner));
+        CORO_AWAIT(&never);
+    }
+    v->resumed = true;
+cancelled:
+    v->cancelled = CORO_CANCELLED();
+    if (v->wait == SUB_COROUTINE) {
+        /* Cancelled in turn: let it clean up, as it lives in vars */
+        CORO_AWAIT(&v->sub);
+    }
+    CORO_END();
+}
+
+
+/** Cancelling a coroutine ends any of its waits, at its clean up label */
+static void test_cancel_each_wait(void) {
+    static waiterVars vars[N_WAITS];
+    static CoroState *states[N_WAITS];
+    CHECK_EQ(Resource_acquire(&resource, &test_owner),
+             RESOURCE_ACQUIRE_SUCCESS);
+    CHECK_EQ(QueuedResource_try_acquire(&queued, &test_owner),
+             RESOURCE_ACQUIRE_SUCCESS);
+    for (int i = 0; i < N_WAITS; i++) {
+        vars[i].wait = i;
+        states[i] = Coro_add_new(&schedule, waiter, &vars[i], 0);
+        CHECK(states[i] != NULL);
+    }
+    CoroSim_run_for(&schedule, 10);
+    for (int i = 0; i < N_WAITS; i++) {
+        CHECK(!vars[i].resumed && !vars[i].cancelled);
+    }
+
+    for (int i = 0; i < N_WAITS; i++) { Coro_cancel(states[i]); }
+    CoroSim_run_for(&schedule, 1);
+    for (int i = 0; i < N_WAITS; i++) {
+        CHECK(!vars[i].resumed);
+        CHECK(vars[i].cancelled);
+    }
+    CHECK(vars[SUB_COROUTINE].sub_vars.cancelled);
+    CHECK(Coro_is_finalized(&vars[SUB_COROUTINE].sub));
+
+    /* Released by the cancel */
+    CHECK_EQ(QueuedResource_try_acquire(&held, &test_owner),
+             RESOURCE_ACQUIRE_SUCCESS);
+    QueuedResource_release(&held, &test_owner);
+    /* No longer queued for or waiting on it */
+    QueuedResource_release(&queued, &test_owner);
+    CHECK(QueuedResource_is_owned(&queued, NULL));
+    Resource_release(&resource, &test_owner);
+    uint32_t item = 7;
+    CHECK(Channel_try_send(&channel, &item));
+    CHECK(Channel_try_recv(&channel, &item));
+    CHECK_EQ(item, 7);
+}
+
+
+typedef struct {
+    timer_ms_t  deadline;
+    timer_ms_t  work;
+    uint64_t    started_at;
+    uint64_t    ended_at;
+    bool        cancelled;
+    CoroState   sub;
+    foreverVars sub_vars;
+} deadlinedVars;
+/** Sleeps for \c work, then awaits a sub-coroutine that never ends, under
+ * a deadline */
+static void deadlined(CoroState *state, void *vars) {
+    CORO_INIT(deadlined);
+    v->started_at = CoroSim_now_us();
+    CORO_DEADLINE(v->deadline);
+    CORO_ON_CANCEL(cancelled);
+    CORO_AWAIT_TIMED_EXPLICIT(state, v->work);
+    Coro_init_sub(&v->sub, forever, &v->sub_vars);
+    CORO_AWAIT(&v->sub);
+    CHECK(!"a sub-coroutine awaiting never finalized");
+cancelled:
+    v->ended_at  = CoroSim_now_us();
+    v->cancelled = CORO_CANCELLED();
+    if (v->work < v->deadline) { CORO_AWAIT(&v->sub); }
+    CORO_END();
+}
+
+
+/** A deadline cancels the coroutine in whichever wait it is once due, and
+ * the sub-coroutine it awaits with it */
+static void test_deadline(void) {
+    static deadlinedVars in_sub   = {.deadline = 20, .work = 5};
+    static deadlinedVars in_sleep = {.deadline = 5, .work = 50};
+
+    CHECK(Coro_add_new(&schedule, deadlined, &in_sub, 0) != NULL);
+    CoroSim_run_for(&schedule, 19);
+    CHECK(!in_sub.cancelled && !in_sub.sub_vars.cancelled);
+    CoroSim_run_for(&schedule, 2);
+    CHECK(in_sub.cancelled);
+    CHECK(in_sub.ended_at - in_sub.started_at >= 20000);
+    CHECK(in_sub.ended_at - in_sub.started_at < 21000);
+    /* Inherited by the sub-coroutine */
+    CHECK(in_sub.sub_vars.cancelled);
+    CHECK(in_sub.sub_vars.cancelled_at - in_sub.started_at >= 20000);
+    CHECK(Coro_is_finalized(&in_sub.sub));
+
+    /* Cut short in its sleep, before it started the sub-coroutine */
+    CHECK(Coro_add_new(&schedule, deadlined, &in_sleep, 0) != NULL);
+    CoroSim_run_for(&schedule, 60);
+    CHECK(in_sleep.cancelled);
+    CHECK(in_sleep.ended_at - in_sleep.started_at < 6000);
+    CHECK(!in_sleep.sub_vars.cancelled);
+}
+
+
+/** Without a timer left, a timed wait or a deadline cancels the coroutine
+ * at once, rather than letting it run without its bound */
+static void test_no_timer(void) {
+    static Timer      hogs[CONF_CORO_SIM_N_TIMERS + 1];
+    static waiterVars sleeper = {.wait = SLEEP};
+    static waiterVars bounded = {.wait = CONDITION};
+    size_t            n_hogs  = 0;
+    while (n_hogs < CORO_ARRAY_SIZE(hogs)
+           && Timer_start_new(&hogs[n_hogs], 100000)) {
+        n_hogs++;
+    }
+    CHECK(n_hogs < CORO_ARRAY_SIZE(hogs));
+    /* Expired at once, so that a wait on it would not hang */
+    CHECK(Condition_get(&hogs[n_hogs].timed_out));
+
+    CoroState *sleeping = Coro_add_new(&schedule, waiter, &sleeper, 0);
+    CoroState *waiting  = Coro_add_new(&schedule, waiter, &bounded, 0);
+    CHECK(sleeping != NULL && waiting != NULL);
+    CHECK(!Coro_set_deadline(waiting, 100));
+    uint64_t started = CoroSim_now_us();
+    CoroSim_run_for(&schedule, 1);
+    CHECK(CoroSim_now_us() - started < 2000);
+    CHECK(sleeper.cancelled && !sleeper.resumed);
+    CHECK(atomic_load(&sleeping->cancel) & CORO_CANCEL_NO_TIMER);
+    /* Cancelled before its first step, so that it never ran */
+    CHECK(!bounded.cancelled && !bounded.resumed);
+    CHECK(atomic_load(&waiting->cancel) & CORO_CANCEL_DELIVERED);
+    CHECK(atomic_load(&waiting->cancel) & CORO_CANCEL_NO_TIMER);
+
+    for (size_t i = 0; i <= n_hogs; i++) { Timer_cancel(&hogs[i]); }
+}
+
+
+int main(void) {
+    CoroIdle_set_strategy(&CoroIdle_sim_strategy);
+    RUN_TEST(test_cancel_each_wait);
+    RUN_TEST(test_deadline);
+    RUN_TEST(test_no_timer);
+    return EXIT_SUCCESS;
+}
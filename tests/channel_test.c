@@ -0,0 +1,304 @@
+/** \file channel_test.c
+ *
+ * Items sent over channels by coroutines, and the waiters of a full or empty
+ * channel woken oldest first and only as many as there are slots (or items)
+ * for, on the virtual clock of sim.h.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include <string.h>
+#include "check.h"
+#include "coro.h"
+#include "sim.h"
+
+
+static CoroState         states_0[16];
+static CoroScheduleQueue queue_0 =
+        CORO_QUEUE_STATIC_INIT(queue_0, 16, states_0);
+static CoroScheduleQueue *const queues[] = {&queue_0};
+static CoroSchedule             schedule = {
+        .queues = queues, .n_priorities = 1, .ready = 0};
+
+
+#define N_SENDERS 4
+#define N_RECEIVERS 4
+/** Items each sender sends */
+#define N_ITEMS 500
+
+static uint32_t spsc_data[4];
+static Channel  spsc = CHANNEL_STATIC_INIT(
+        sizeof(uint32_t), 4, spsc_data, CHANNEL_SPSC);
+static uint32_t mpmc_data[4];
+static Channel  mpmc = CHANNEL_STATIC_INIT(
+        sizeof(uint32_t), 4, mpmc_data, CHANNEL_MPMC);
+
+/** Times the item of each sender and sequence number was received */
+static uint32_t received[N_SENDERS][N_ITEMS];
+
+static uint32_t item_of(uint32_t sender, uint32_t seq) {
+    return sender * N_ITEMS + seq;
+}
+
+
+typedef struct {
+    Channel *channel;
+    uint32_t self;
+    uint32_t seq;
+    uint32_t item;
+} senderVars;
+/** Sends its N_ITEMS items in order, yielding now and then */
+static void sender(CoroState *state, void *vars) {
+    CORO_INIT(sender);
+    for (v->seq = 0; v->seq < N_ITEMS; v->seq++) {
+        v->item = item_of(v->self, v->seq);
+        CORO_AWAIT_SEND(v->channel, &v->item);
+        if ((v->seq + v->self) % 3 == 0) { CORO_YIELD(); }
+    }
+    CORO_END();
+}
+
+typedef struct {
+    Channel *channel;
+    uint32_t self;
+    uint32_t n_expected;
+    uint32_t n_received;
+    /** Next sequence number expected of each sender, at least */
+    uint32_t next[N_SENDERS];
+    uint32_t items[3];
+    size_t   max;
+    size_t   n;
+} receiverVars;
+
+/** Count \p item, which must come after those of its sender it received */
+static void check_received(receiverVars *v, uint32_t item) {
+    uint32_t from = item / N_ITEMS;
+    uint32_t seq  = item % N_ITEMS;
+    CHECK(from < N_SENDERS);
+    CHECK(seq >= v->next[from]);
+    v->next[from] = seq + 1;
+    received[from][seq]++;
+    v->n_received++;
+}
+
+/** Receives until it got n_expected items, one or a few at a time */
+static void receiver(CoroState *state, void *vars) {
+    CORO_INIT(receiver);
+    while (v->n_received < v->n_expected) {
+        if (v->n_received % 2 == 0) {
+            CORO_AWAIT_RECV(v->channel, &v->items[0]);
+            check_received(v, v->items[0]);
+        } else {
+            /* No more than its share, which the others wait for */
+            v->max = v->n_expected - v->n_received;
+            if (v->max > 3) { v->max = 3; }
+            CORO_AWAIT_RECV_MANY(v->channel, v->items, v->max, v->n);
+            for (size_t i = 0; i < v->n; i++) {
+                check_received(v, v->items[i]);
+            }
+        }
+        if ((v->n_received + v->self) % 5 == 0) { CORO_YIELD(); }
+    }
+    CORO_END();
+}
+
+
+/** One sender and one receiver: every item arrives once, in order */
+static void test_spsc(void) {
+    static senderVars   sender_vars;
+    static receiverVars receiver_vars;
+    memset(received, 0, sizeof(received));
+    sender_vars   = (senderVars){.channel = &spsc, .self = 0};
+    receiver_vars = (receiverVars){.channel = &spsc, .n_expected = N_ITEMS};
+    CHECK(Coro_add_new(&schedule, receiver, &receiver_vars, 0) != NULL);
+    CHECK(Coro_add_new(&schedule, sender, &sender_vars, 0) != NULL);
+    CoroSim_run_for(&schedule, 100);
+    CHECK_EQ(receiver_vars.n_received, N_ITEMS);
+    for (uint32_t seq = 0; seq < N_ITEMS; seq++) {
+        CHECK_EQ(received[0][seq], 1);
+    }
+}
+
+
+/** Several senders and receivers: every item is received exactly once, each
+ * receiver getting those of a sender in the order they were sent */
+static void test_mpmc(void) {
+    static senderVars   sender_vars[N_SENDERS];
+    static receiverVars receiver_vars[N_RECEIVERS];
+    memset(received, 0, sizeof(received));
+    for (uint32_t i = 0; i < N_RECEIVERS; i++) {
+        receiver_vars[i] = (receiverVars){
+                .channel    = &mpmc,
+                .self       = i,
+                .n_expected = N_SENDERS * N_ITEMS / N_RECEIVERS};
+        CHECK(Coro_add_new(&schedule, receiver, &receiver_vars[i], 0)
+              != NULL);
+    }
+    for (uint32_t i = 0; i < N_SENDERS; i++) {
+        sender_vars[i] = (senderVars){.channel = &mpmc, .self = i};
+        CHECK(Coro_add_new(&schedule, sender, &sender_vars[i], 0) != NULL);
+    }
+    CoroSim_run_for(&schedule, 100);
+    for (uint32_t i = 0; i < N_RECEIVERS; i++) {
+        CHECK_EQ(receiver_vars[i].n_received, receiver_vars[i].n_expected);
+    }
+    for (uint32_t i = 0; i < N_SENDERS; i++) {
+        for (uint32_t seq = 0; seq < N_ITEMS; seq++) {
+            CHECK_EQ(received[i][seq], 1);
+        }
+    }
+}
+
+
+/** The order in which the waiters of a test got through */
+static char   order[16];
+static size_t n_order;
+
+typedef struct {
+    char     name;
+    uint32_t item;
+    /** Times it was resumed without getting through */
+    int      n_retries;
+    bool     waited;
+    /** Of the wait of a blocked_sender, in ms, if not 0 */
+    uint32_t timeout;
+    bool     timed_out;
+    bool     cancelled;
+} waiterVars;
+
+typedef waiterVars lone_receiverVars;
+/** Receives one item off \c mpmc, counting its futile wakes */
+static void lone_receiver(CoroState *state, void *vars) {
+    CORO_INIT(lone_receiver);
+    while (!Channel_try_recv(&mpmc, &v->item)) {
+        if (v->waited) { v->n_retries++; }
+        v->waited = true;
+        CORO_AWAIT_CHANNEL_EXPLICIT(state, &mpmc, false);
+    }
+    order[n_order++] = v->name;
+    CORO_END();
+}
+
+
+/** Each item wakes only the oldest waiter, and no other one retries */
+static void test_wakes_oldest(void) {
+    static waiterVars vars[3];
+    n_order = 0;
+    memset(order, 0, sizeof(order));
+    for (size_t i = 0; i < 3; i++) {
+        vars[i] = (waiterVars){.name = (char)('a' + i)};
+        CHECK(Coro_add_new(&schedule, lone_receiver, &vars[i], 0) != NULL);
+    }
+    CoroSim_run_for(&schedule, 1);
+    CHECK_EQ(n_order, 0);
+
+    uint32_t item = 1;
+    CHECK(Channel_try_send(&mpmc, &item));
+    CoroSim_run_for(&schedule, 1);
+    CHECK(strcmp(order, "a") == 0);
+    CHECK_EQ(vars[1].n_retries + vars[2].n_retries, 0);
+
+    item = 2;
+    CHECK(Channel_try_send(&mpmc, &item));
+    CHECK(Channel_try_send(&mpmc, &item));
+    CoroSim_run_for(&schedule, 1);
+    CHECK(strcmp(order, "abc") == 0);
+    for (size_t i = 0; i < 3; i++) { CHECK_EQ(vars[i].n_retries, 0); }
+}
+
+
+typedef waiterVars blocked_senderVars;
+/** Sends one item into the full \c mpmc, unless it is cancelled or its wait
+ * of \c timeout ms, if any, times out */
+static void blocked_sender(CoroState *state, void *vars) {
+    CORO_INIT(blocked_sender);
+    CORO_ON_CANCEL(cancelled);
+    v->item = (uint32_t)v->name;
+    while (!v->timed_out && !Channel_try_send(&mpmc, &v->item)) {
+        if (v->waited) { v->n_retries++; }
+        v->waited = true;
+        if (v->timeout == 0) {
+            CORO_AWAIT_CHANNEL_EXPLICIT(state, &mpmc, true);
+        } else {
+            CORO_AWAIT_CHANNEL_TIMED_EXPLICIT(state, &mpmc, true, v->timeout);
+            v->timed_out = Condition_get(&state->timeout.timed_out);
+        }
+    }
+    if (!v->timed_out) { order[n_order++] = v->name; }
+cancelled:
+    v->cancelled = CORO_CANCELLED();
+    CORO_END();
+}
+
+
+/** A sender woken for a free slot but timed out before it could take it
+ * passes the wake on to the next one */
+static void test_timed_out_sender(void) {
+    static waiterVars vars[2];
+    uint32_t          item = 0;
+    n_order                = 0;
+    memset(order, 0, sizeof(order));
+    while (Channel_try_send(&mpmc, &item)) {}
+    vars[0] = (waiterVars){.name = 'a', .timeout = 3};
+    vars[1] = (waiterVars){.name = 'b'};
+    for (size_t i = 0; i < 2; i++) {
+        CHECK(Coro_add_new(&schedule, blocked_sender, &vars[i], 0) != NULL);
+    }
+    CoroSim_run_for(&schedule, 1);
+    CHECK(vars[0].waited && vars[1].waited);
+
+    /* Wakes a, whose wait times out before it runs */
+    CHECK(Channel_try_recv(&mpmc, &item));
+    CoroSim_advance(4000);
+    Timer_poll();
+    CoroSim_run_for(&schedule, 1);
+    CHECK(vars[0].timed_out);
+    CHECK(strcmp(order, "b") == 0);
+    CHECK_EQ(vars[1].n_retries, 0);
+
+    uint32_t last = 0;
+    while (Channel_try_recv(&mpmc, &item)) { last = item; }
+    CHECK_EQ(last, 'b');
+}
+
+
+/** A sender woken for a free slot but cancelled before it could take it
+ * passes the wake on to the next one */
+static void test_cancel_blocked_sender(void) {
+    static waiterVars vars[2];
+    uint32_t          item = 0;
+    n_order                = 0;
+    memset(order, 0, sizeof(order));
+    while (Channel_try_send(&mpmc, &item)) {}
+    CoroState *first = NULL;
+    for (size_t i = 0; i < 2; i++) {
+        vars[i]      = (waiterVars){.name = (char)('a' + i)};
+        CoroState *s = Coro_add_new(&schedule, blocked_sender, &vars[i], 0);
+        CHECK(s != NULL);
+        if (i == 0) { first = s; }
+    }
+    CoroSim_run_for(&schedule, 1);
+    CHECK(vars[0].waited && vars[1].waited);
+
+    /* Wakes a, which is cancelled before it runs */
+    CHECK(Channel_try_recv(&mpmc, &item));
+    Coro_cancel(first);
+    CoroSim_run_for(&schedule, 1);
+    CHECK(vars[0].cancelled);
+    CHECK(strcmp(order, "b") == 0);
+    CHECK_EQ(vars[1].n_retries, 0);
+
+    uint32_t last = 0;
+    while (Channel_try_recv(&mpmc, &item)) { last = item; }
+    CHECK_EQ(last, 'b');
+}
+
+
+int main(void) {
+    CoroIdle_set_strategy(&CoroIdle_sim_strategy);
+    RUN_TEST(test_spsc);
+    RUN_TEST(test_mpmc);
+    RUN_TEST(test_wakes_oldest);
+    RUN_TEST(test_timed_out_sender);
+    RUN_TEST(test_cancel_blocked_sender);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,55 @@
+/** \file check.h
+ *
+ * Checks of the tests. A failed check prints where and what failed and exits
+ * with a failure, for ctest to report.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+#ifndef CHECK_H
+#define CHECK_H 1
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+/** \brief Fail the test unless \p expression holds */
+#define CHECK(expression)                        \
+    {                                            \
+        if (!(expression)) {                     \
+            fprintf(stderr,                      \
+                    "%s:%d: CHECK(%s) failed\n", \
+                    __FILE__,                    \
+                    __LINE__,                    \
+                    #expression);                \
+            exit(EXIT_FAILURE);                  \
+        }                                        \
+    }
+
+/** \brief Fail the test unless the integers \p actual and \p expected are
+ * equal, printing both */
+#define CHECK_EQ(actual, expected)                                  \
+    {                                                               \
+        intmax_t check_actual   = (intmax_t)(actual);               \
+        intmax_t check_expected = (intmax_t)(expected);             \
+        if (check_actual != check_expected) {                       \
+            fprintf(stderr,                                         \
+                    "%s:%d: CHECK_EQ(%s, %s) failed: %jd != %jd\n", \
+                    __FILE__,                                       \
+                    __LINE__,                                       \
+                    #actual,                                        \
+                    #expected,                                      \
+                    check_actual,                                   \
+                    check_expected);                                \
+            exit(EXIT_FAILURE);                                     \
+        }                                                           \
+    }
+
+/** \brief Run the test function \p test and report it passed */
+#define RUN_TEST(test)            \
+    {                             \
+        test();                   \
+        printf("ok %s\n", #test); \
+        fflush(stdout);           \
+    }
+
+#endif /* ifndef CHECK_H */
@@ -0,0 +1,147 @@
+/** \file event_test.c
+ *
+ * Events posted from another thread, standing in for an interrupt, while
+ * coroutines take them: every post is taken exactly once, and no wake is
+ * lost. Meant to also be run built with CSL_CORO_TEST_SANITIZER=thread.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include <pthread.h>
+#include <sched.h>
+#include "check.h"
+#include "coro.h"
+#include "linux/idle_futex.h"
+#include "linux/timer_tick.h"
+
+
+/** Posts of each event */
+#define N_POSTS 100000
+/** Items taken at most at once */
+#define N_BATCH 16
+
+
+static CoroState         states_0[8];
+static CoroScheduleQueue queue_0 =
+        CORO_QUEUE_STATIC_INIT(queue_0, 8, states_0);
+static CoroScheduleQueue *const queues[] = {&queue_0};
+static CoroSchedule             schedule = {
+        .queues = queues, .n_priorities = 1, .ready = 0};
+
+
+static CoroEvent counted = CORO_EVENT_STATIC_INIT(NULL);
+CORO_EVENT_DEFINE(carrying, uint32_t, 64);
+
+static CoroGroup    running = CORO_GROUP_INIT;
+static _Atomic bool stop;
+
+
+typedef void stopperVars;
+/** Stops the scheduler once the coroutines of the test are done */
+static void stopper(CoroState *state, void *vars) {
+    CORO_INIT(stopper);
+    (void)v;
+    CORO_AWAIT_ATMOST(30000, &running);
+    CHECK(!Condition_get(&state->timeout.timed_out));
+    atomic_store(&stop, true);
+    CORO_END();
+}
+
+
+/** Posts taken off \c counted, by either taker */
+static uint32_t      n_taken;
+/** Set once all of them were */
+static WakeCondition all_taken = WAKE_CONDITION_INIT;
+
+typedef struct {
+    uint32_t     n_taken;
+    CoroWaitable waitables[2];
+} takerVars;
+/** Takes posts of \c counted one at a time until all of them were taken,
+ * by it or the other taker */
+static void taker(CoroState *state, void *vars) {
+    CORO_INIT(taker);
+    v->waitables[0] = CORO_WAITABLE(&counted);
+    v->waitables[1] = CORO_WAITABLE(&all_taken);
+    while (n_taken < N_POSTS) {
+        CORO_AWAIT_ANY(v->waitables);
+        while (CoroEvent_take(&counted)) {
+            v->n_taken++;
+            n_taken++;
+        }
+    }
+    WakeCondition_set(&all_taken);
+    CoroGroup_done(&running);
+    CORO_END();
+}
+
+
+typedef struct {
+    uint32_t items[N_BATCH];
+    uint32_t n_received;
+    size_t   n;
+    uint32_t n_resumes;
+} receiverVars;
+/** Takes the items of \c carrying in batches, which must come in the order
+ * they were posted */
+static void receiver(CoroState *state, void *vars) {
+    CORO_INIT(receiver);
+    while (v->n_received < N_POSTS) {
+        CORO_AWAIT(&carrying);
+        v->n_resumes++;
+        while ((v->n = CoroEvent_recv_many(&carrying, v->items, N_BATCH))
+               > 0) {
+            for (size_t i = 0; i < v->n; i++) {
+                CHECK_EQ(v->items[i], v->n_received);
+                v->n_received++;
+            }
+        }
+    }
+    CoroGroup_done(&running);
+    CORO_END();
+}
+
+
+/** Posts both events N_POSTS times, retrying an item until it fits */
+static void *post(void *arg) {
+    (void)arg;
+    for (uint32_t i = 0; i < N_POSTS; i++) {
+        CoroEvent_post(&counted);
+        while (!CoroEvent_post_item(&carrying, &i)) { sched_yield(); }
+        if (i % 64 == 0) { sched_yield(); }
+    }
+    return NULL;
+}
+
+
+/** Every post is taken once while another thread posts, and its takers
+ * resume for batches of them rather than once each */
+static void test_concurrent_posts(void) {
+    static takerVars    taken[2];
+    static receiverVars receiver_vars;
+    CoroGroup_add(&running, 3);
+    CHECK(Coro_add_new(&schedule, taker, &taken[0], 0) != NULL);
+    CHECK(Coro_add_new(&schedule, taker, &taken[1], 0) != NULL);
+    CHECK(Coro_add_new(&schedule, receiver, &receiver_vars, 0) != NULL);
+    CHECK(Coro_add_new(&schedule, stopper, NULL, 0) != NULL);
+
+    pthread_t poster;
+    CHECK(pthread_create(&poster, NULL, post, NULL) == 0);
+    schedule_mainloop_until(&schedule, &stop);
+    CHECK(pthread_join(poster, NULL) == 0);
+
+    CHECK_EQ(taken[0].n_taken + taken[1].n_taken, N_POSTS);
+    CHECK_EQ(n_taken, N_POSTS);
+    CHECK_EQ(CoroEvent_take_all(&counted), 0);
+    CHECK_EQ(receiver_vars.n_received, N_POSTS);
+    CHECK(receiver_vars.n_resumes <= N_POSTS);
+    uint32_t item;
+    CHECK_EQ(CoroEvent_recv_many(&carrying, &item, 1), 0);
+}
+
+
+int main(void) {
+    CoroIdle_set_strategy(&CoroIdle_futex_strategy);
+    CHECK(TimerTick_start());
+    RUN_TEST(test_concurrent_posts);
+    return EXIT_SUCCESS;
+}
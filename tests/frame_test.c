@@ -0,0 +1,186 @@
+/** \file frame_test.c
+ *
+ * Coroutines of CORO_DEFINE added with their frame in a slot of the arena of
+ * their schedule, the frames of the coroutines they call nested after
+ * theirs, and calls that do not fit, on the virtual clock of sim.h.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include "check.h"
+#include "coro.h"
+#include "sim.h"
+
+
+#define N_CALLS 3
+
+
+CORO_DEFINE(digit, {
+    int  value;
+    int *out;
+}) {
+    CORO_INIT(digit);
+    CORO_YIELD();
+    *v->out = v->value % 10;
+    CORO_END();
+}
+
+CORO_DEFINE(parse, {
+    int  input;
+    int *out;
+    int  digit;
+    int  i;
+}) {
+    CORO_INIT(parse);
+    /* Kept across the waits, unlike a local */
+    for (v->i = 0; v->i < 2; v->i++) { CORO_YIELD(); }
+    CORO_CALL(digit, .value = v->input, .out = &v->digit);
+    *v->out = v->input * 2 + v->digit;
+    CORO_END();
+}
+
+/** What a server did, kept outside of its frame as that is gone once it
+ * finalized */
+typedef struct {
+    void *     vars;
+    int        results[N_CALLS];
+    CoroState *calls[N_CALLS];
+    bool       done;
+} Report;
+
+CORO_DEFINE(server, {
+    int     i;
+    Report *report;
+}) {
+    CORO_INIT(server);
+    v->report->vars = v;
+    for (v->i = 0; v->i < N_CALLS; v->i++) {
+        CORO_CALL(parse,
+                  .input = 11 * (v->i + 1),
+                  .out   = &v->report->results[v->i]);
+        v->report->calls[v->i] = state->wait.sub_coroutine;
+        CHECK(v->report->calls[v->i] != NULL);
+    }
+    v->report->done = true;
+    CORO_END();
+}
+
+
+/** What an overreacher did, kept outside of its frame */
+typedef struct {
+    bool    called;
+    bool    cancelled;
+    uint8_t cancel;
+    bool    called_again;
+} Overreach;
+
+CORO_DEFINE(overreacher, {
+    int        digit;
+    Overreach *report;
+}) {
+    CORO_INIT(overreacher);
+    CORO_ON_CANCEL(cancelled);
+    CORO_CALL(digit, .value = 1, .out = &v->digit);
+    v->report->called = true;
+cancelled:
+    v->report->cancelled = CORO_CANCELLED();
+    v->report->cancel    = atomic_load(&state->cancel);
+    /* Cancelled already, so it finalizes instead */
+    CORO_CALL(digit, .value = 2, .out = &v->digit);
+    v->report->called_again = true;
+    CORO_END();
+}
+
+
+CORO_ARENA_DEFINE(arena,
+                  2,
+                  CORO_FRAME_SIZE(server) + CORO_FRAME_SIZE(parse)
+                          + CORO_FRAME_SIZE(digit));
+/** Without room for the frames of calls */
+CORO_ARENA_DEFINE(small_arena, 1, CORO_FRAME_SIZE(overreacher));
+
+static CoroState         states_0[4];
+static CoroScheduleQueue queue_0 =
+        CORO_QUEUE_STATIC_INIT(queue_0, 4, states_0);
+static CoroScheduleQueue *const queues[] = {&queue_0};
+static CoroSchedule             schedule = {
+        .queues = queues, .n_priorities = 1, .ready = 0, .arena = &arena};
+
+static CoroState         small_states[2];
+static CoroScheduleQueue small_queue =
+        CORO_QUEUE_STATIC_INIT(small_queue, 2, small_states);
+static CoroScheduleQueue *const small_queues[] = {&small_queue};
+static CoroSchedule             small_schedule = {
+        .queues       = small_queues,
+        .n_priorities = 1,
+        .ready        = 0,
+        .arena        = &small_arena};
+
+
+/** A call runs in the frame right after that of its caller, and the next
+ * call reuses it */
+static void test_calls_nested(void) {
+    static Report report;
+    CoroState *   added =
+            CORO_ADD_FRAMED(&schedule, server, 0, .report = &report);
+    CHECK(added != NULL);
+    CHECK((void *)added == (void *)&arena_frames[0]
+          || (void *)added == (void *)&arena_frames[1]);
+    CoroSim_run_for(&schedule, 1);
+
+    CHECK(report.done);
+    CHECK((char *)report.vars
+          == (char *)added + CORO_FRAME_ALIGN(sizeof(CoroState)));
+    char *frame_end =
+            (char *)report.vars + CORO_FRAME_ALIGN(sizeof(serverVars));
+    for (int i = 0; i < N_CALLS; i++) {
+        CHECK((char *)report.calls[i] == frame_end);
+        CHECK_EQ(report.results[i], 22 * (i + 1) + (11 * (i + 1)) % 10);
+    }
+}
+
+
+/** The arena holds as many frames as it has slots, each given back once
+ * its coroutine finalized */
+static void test_arena_recycled(void) {
+    static Report reports[3];
+    for (int round = 0; round < 3; round++) {
+        for (size_t i = 0; i < 3; i++) { reports[i].done = false; }
+        for (size_t i = 0; i < 2; i++) {
+            CHECK(CORO_ADD_FRAMED(&schedule, server, 0, .report = &reports[i])
+                  != NULL);
+        }
+        CHECK(CORO_ADD_FRAMED(&schedule, server, 0, .report = &reports[2])
+              == NULL);
+        CoroSim_run_for(&schedule, 1);
+        CHECK(reports[0].done && reports[1].done && !reports[2].done);
+        CHECK(reports[0].vars != reports[1].vars);
+    }
+}
+
+
+/** A call whose frame does not fit cancels its caller instead, which
+ * finalizes if one does not fit its clean up either */
+static void test_call_does_not_fit(void) {
+    static Overreach report;
+    for (int round = 0; round < 2; round++) {
+        report = (Overreach){.called = false};
+        CHECK(CORO_ADD_FRAMED(&small_schedule,
+                              overreacher,
+                              0,
+                              .report = &report)
+              != NULL);
+        CoroSim_run_for(&small_schedule, 1);
+        CHECK(!report.called && !report.called_again);
+        CHECK(report.cancelled);
+        CHECK(report.cancel & CORO_CANCEL_NO_FRAME);
+    }
+}
+
+
+int main(void) {
+    CoroIdle_set_strategy(&CoroIdle_sim_strategy);
+    RUN_TEST(test_calls_nested);
+    RUN_TEST(test_arena_recycled);
+    RUN_TEST(test_call_does_not_fit);
+    return EXIT_SUCCESS;
+}
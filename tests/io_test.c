@@ -0,0 +1,437 @@
+/** \file io_test.c
+ *
+ * Reads and writes over pipes and socket pairs through each reactor, and
+ * reads that never complete ended by a timeout, a deadline or a cancel.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "check.h"
+#include "coro.h"
+#include "linux/reactor_epoll.h"
+#include "linux/timer_tick.h"
+#if TEST_HAVE_IO_URING
+#include "linux/reactor_uring.h"
+#endif
+
+
+/** Pipes read at once by test_many_in_flight, more than a ring holds */
+#define N_FANNED 100
+
+static CoroState         states_0[N_FANNED + 8];
+static CoroScheduleQueue queue_0 = CORO_QUEUE_STATIC_INIT(
+        queue_0, CORO_ARRAY_SIZE(states_0), states_0);
+static CoroScheduleQueue *const queues[] = {&queue_0};
+static CoroSchedule             schedule = {
+        .queues = queues, .n_priorities = 1, .ready = 0};
+
+
+/** The coroutines of the current test */
+static CoroGroup    running = CORO_GROUP_INIT;
+static _Atomic bool stop;
+
+typedef void stopperVars;
+/** Stops the scheduler once the coroutines of the test are done */
+static void stopper(CoroState *state, void *vars) {
+    CORO_INIT(stopper);
+    (void)v;
+    CORO_AWAIT_ATMOST(5000, &running);
+    CHECK(!Condition_get(&state->timeout.timed_out));
+    atomic_store(&stop, true);
+    CORO_END();
+}
+
+/** Add a coroutine of the test */
+static CoroState *add(coroutine *function, void *vars) {
+    CoroGroup_add(&running, 1);
+    CoroState *state = Coro_add_new(&schedule, function, vars, 0);
+    CHECK(state != NULL);
+    return state;
+}
+
+/** Run the coroutines added until they are done */
+static void run(void) {
+    CHECK(Coro_add_new(&schedule, stopper, NULL, 0) != NULL);
+    atomic_store(&stop, false);
+    schedule_mainloop_until(&schedule, &stop);
+}
+
+
+static uint64_t now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static void open_pipe(int fds[2]) {
+    CHECK(pipe2(fds, O_NONBLOCK | O_CLOEXEC) == 0);
+}
+
+static void open_socketpair(int fds[2]) {
+    CHECK(socketpair(AF_UNIX,
+                     SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     0,
+                     fds)
+          == 0);
+}
+
+static void close_both(int fds[2]) {
+    close(fds[0]);
+    close(fds[1]);
+}
+
+
+typedef struct {
+    int    fd;
+    char   buffer[32];
+    size_t n_read;
+    size_t n_expected;
+    CoroIo io;
+} readerVars;
+/** Reads until it has n_expected bytes */
+static void reader(CoroState *state, void *vars) {
+    CORO_INIT(reader);
+    while (v->n_read < v->n_expected) {
+        CORO_AWAIT_READ(&v->io,
+                        v->fd,
+                        &v->buffer[v->n_read],
+                        v->n_expected - v->n_read);
+        CHECK(v->io.result > 0);
+        v->n_read += (size_t)v->io.result;
+    }
+    CoroGroup_done(&running);
+    CORO_END();
+}
+
+typedef struct {
+    int                fd;
+    const char *const *messages;
+    size_t             i;
+    CoroIo             io;
+} writerVars;
+/** Writes each of messages, 1 ms apart so that the reader has to wait */
+static void writer(CoroState *state, void *vars) {
+    CORO_INIT(writer);
+    for (v->i = 0; v->messages[v->i] != NULL; v->i++) {
+        CORO_AWAIT_TIMED_EXPLICIT(state, 1);
+        CORO_AWAIT_WRITE(&v->io,
+                         v->fd,
+                         v->messages[v->i],
+                         strlen(v->messages[v->i]));
+        CHECK_EQ(v->io.result, strlen(v->messages[v->i]));
+    }
+    CoroGroup_done(&running);
+    CORO_END();
+}
+
+
+/** What a reader gets of a pipe is what a writer put in, in order */
+static void test_pipe(void) {
+    static const char *const messages[] = {"one", "two", "three", NULL};
+    static readerVars        reader_vars;
+    static writerVars        writer_vars;
+    int                      fds[2];
+    open_pipe(fds);
+    reader_vars = (readerVars){.fd = fds[0], .n_expected = 11};
+    writer_vars = (writerVars){.fd = fds[1], .messages = messages};
+    add(reader, &reader_vars);
+    add(writer, &writer_vars);
+    run();
+    CHECK(memcmp(reader_vars.buffer, "onetwothree", 11) == 0);
+    close_both(fds);
+}
+
+
+typedef struct {
+    int    fd;
+    char   buffer[8];
+    CoroIo io;
+} pingVars;
+/** Sends ping and awaits the answer, polling for it first */
+static void ping(CoroState *state, void *vars) {
+    CORO_INIT(ping);
+    CORO_AWAIT_WRITE(&v->io, v->fd, "ping", 4);
+    CHECK_EQ(v->io.result, 4);
+    CORO_AWAIT_POLL(&v->io, v->fd, CORO_IO_READABLE);
+    CHECK(v->io.result & CORO_IO_READABLE);
+    CORO_AWAIT_READ(&v->io, v->fd, v->buffer, sizeof(v->buffer));
+    CHECK_EQ(v->io.result, 4);
+    CHECK(memcmp(v->buffer, "pong", 4) == 0);
+    CoroGroup_done(&running);
+    CORO_END();
+}
+
+typedef pingVars pongVars;
+/** Answers a ping with pong */
+static void pong(CoroState *state, void *vars) {
+    CORO_INIT(pong);
+    CORO_AWAIT_READ(&v->io, v->fd, v->buffer, sizeof(v->buffer));
+    CHECK_EQ(v->io.result, 4);
+    CHECK(memcmp(v->buffer, "ping", 4) == 0);
+    CORO_AWAIT_WRITE(&v->io, v->fd, "pong", 4);
+    CHECK_EQ(v->io.result, 4);
+    CoroGroup_done(&running);
+    CORO_END();
+}
+
+
+/** Both ends of a socket pair read and write */
+static void test_socketpair(void) {
+    static pingVars ping_vars;
+    static pongVars pong_vars;
+    int             fds[2];
+    open_socketpair(fds);
+    ping_vars = (pingVars){.fd = fds[0]};
+    pong_vars = (pongVars){.fd = fds[1]};
+    add(pong, &pong_vars);
+    add(ping, &ping_vars);
+    run();
+    close_both(fds);
+}
+
+
+/** Nothing is ever written to it while it is read */
+static int silent[2];
+
+/** The data written to \c silent once its read ended, read again here to
+ * check the read that ended did not take it */
+static void check_silent_unread(void) {
+    static readerVars vars;
+    CHECK_EQ(write(silent[1], "late", 4), 4);
+    vars = (readerVars){.fd = silent[0], .n_expected = 4};
+    add(reader, &vars);
+    run();
+    CHECK(memcmp(vars.buffer, "late", 4) == 0);
+}
+
+
+typedef struct {
+    char     buffer[8];
+    CoroIo   io;
+    uint64_t started_at;
+    uint64_t ended_at;
+    bool     cancelled;
+} silentVars;
+
+typedef silentVars read_atmostVars;
+/** Reads \c silent for at most 20 ms */
+static void read_atmost(CoroState *state, void *vars) {
+    CORO_INIT(read_atmost);
+    v->started_at = now_us();
+    CoroIo_read_init(&v->io, silent[0], v->buffer, sizeof(v->buffer));
+    CORO_AWAIT_ATMOST(20, &v->io);
+    v->ended_at = now_us();
+    CHECK(Condition_get(&state->timeout.timed_out));
+    CHECK(!atomic_load(&v->io.done));
+    CoroGroup_done(&running);
+    CORO_END();
+}
+
+typedef silentVars read_deadlineVars;
+/** Reads \c silent with a deadline of 20 ms */
+static void read_deadline(CoroState *state, void *vars) {
+    CORO_INIT(read_deadline);
+    v->started_at = now_us();
+    CORO_DEADLINE(20);
+    CORO_ON_CANCEL(cancelled);
+    CORO_AWAIT_READ(&v->io, silent[0], v->buffer, sizeof(v->buffer));
+    CHECK(!"a read of silent completed");
+cancelled:
+    v->ended_at  = now_us();
+    v->cancelled = CORO_CANCELLED();
+    CHECK(!atomic_load(&v->io.done));
+    CoroGroup_done(&running);
+    CORO_END();
+}
+
+
+/** Microseconds a read of 20 ms took at least: a timer is due after as many
+ * ticks, the first of which may come right after it started */
+#define READ_TIMEOUT_US ((20 - CONF_TIMER_WHEEL_TICK_MS) * 1000)
+
+
+/** A timeout or a deadline ends a read that never completes, and stops it */
+static void test_read_timeout(void) {
+    static silentVars vars;
+    open_pipe(silent);
+
+    vars = (silentVars){.cancelled = false};
+    add(read_atmost, &vars);
+    run();
+    CHECK(vars.ended_at - vars.started_at >= READ_TIMEOUT_US);
+    check_silent_unread();
+
+    vars = (silentVars){.cancelled = false};
+    add(read_deadline, &vars);
+    run();
+    CHECK(vars.cancelled);
+    CHECK(vars.ended_at - vars.started_at >= READ_TIMEOUT_US);
+    check_silent_unread();
+    close_both(silent);
+}
+
+
+typedef struct {
+    CoroState *target;
+} cancellerVars;
+/** Cancels target 5 ms after it started */
+static void canceller(CoroState *state, void *vars) {
+    CORO_INIT(canceller);
+    CORO_AWAIT_TIMED_EXPLICIT(state, 5);
+    Coro_cancel(v->target);
+    CoroGroup_done(&running);
+    CORO_END();
+}
+
+typedef silentVars read_foreverVars;
+/** Reads \c silent until cancelled */
+static void read_forever(CoroState *state, void *vars) {
+    CORO_INIT(read_forever);
+    CORO_ON_CANCEL(cancelled);
+    CORO_AWAIT_READ(&v->io, silent[0], v->buffer, sizeof(v->buffer));
+    CHECK(!"a read of silent completed");
+cancelled:
+    v->cancelled = CORO_CANCELLED();
+    CHECK(!atomic_load(&v->io.done));
+    CoroGroup_done(&running);
+    CORO_END();
+}
+
+
+/** Cancelling a coroutine while its read is in flight stops the read */
+static void test_cancel_read(void) {
+    static silentVars    vars;
+    static cancellerVars canceller_vars;
+    open_pipe(silent);
+    vars                  = (silentVars){.cancelled = false};
+    canceller_vars.target = add(read_forever, &vars);
+    add(canceller, &canceller_vars);
+    run();
+    CHECK(vars.cancelled);
+    check_silent_unread();
+    close_both(silent);
+}
+
+
+static int fanned[N_FANNED][2];
+
+typedef void fannerVars;
+/** Writes its index to each of \c fanned at once, after 1 ms so that every
+ * reader waits */
+static void fanner(CoroState *state, void *vars) {
+    CORO_INIT(fanner);
+    (void)v;
+    CORO_AWAIT_TIMED_EXPLICIT(state, 1);
+    for (size_t i = 0; i < N_FANNED; i++) {
+        char byte = (char)i;
+        CHECK_EQ(write(fanned[i][1], &byte, 1), 1);
+    }
+    CoroGroup_done(&running);
+    CORO_END();
+}
+
+
+/** More reads in flight than a ring has entries, each retried at once */
+static void test_many_in_flight(void) {
+    static readerVars vars[N_FANNED];
+    for (size_t i = 0; i < N_FANNED; i++) {
+        open_pipe(fanned[i]);
+        vars[i] = (readerVars){.fd = fanned[i][0], .n_expected = 1};
+        add(reader, &vars[i]);
+    }
+    add(fanner, NULL);
+    run();
+    for (size_t i = 0; i < N_FANNED; i++) {
+        CHECK_EQ(vars[i].buffer[0], (char)i);
+        close_both(fanned[i]);
+    }
+}
+
+
+static int ordered[2];
+
+typedef struct {
+    char   got;
+    CoroIo io;
+} orderedVars;
+
+typedef orderedVars early_readerVars;
+/** Reads a byte of \c ordered, then writes the next one */
+static void early_reader(CoroState *state, void *vars) {
+    CORO_INIT(early_reader);
+    CORO_AWAIT_READ(&v->io, ordered[0], &v->got, 1);
+    CHECK_EQ(v->io.result, 1);
+    CHECK_EQ(write(ordered[1], "b", 1), 1);
+    CoroGroup_done(&running);
+    CORO_END();
+}
+
+typedef orderedVars late_readerVars;
+/** Writes a byte of \c ordered once early_reader waits, and reads one at
+ * once */
+static void late_reader(CoroState *state, void *vars) {
+    CORO_INIT(late_reader);
+    CORO_AWAIT_TIMED_EXPLICIT(state, 1);
+    CHECK_EQ(write(ordered[1], "a", 1), 1);
+    CORO_AWAIT_READ(&v->io, ordered[0], &v->got, 1);
+    CHECK_EQ(v->io.result, 1);
+    CoroGroup_done(&running);
+    CORO_END();
+}
+
+
+/** A read submitted while an older one waits on the descriptor does not
+ * take what arrives first, even if it could at once */
+static void test_served_in_order(void) {
+    static orderedVars early;
+    static orderedVars late;
+    open_pipe(ordered);
+    early = (orderedVars){.got = 0};
+    late  = (orderedVars){.got = 0};
+    add(early_reader, &early);
+    add(late_reader, &late);
+    run();
+    CHECK_EQ(early.got, 'a');
+    CHECK_EQ(late.got, 'b');
+    close_both(ordered);
+}
+
+
+static void run_tests(void) {
+    RUN_TEST(test_pipe);
+    RUN_TEST(test_socketpair);
+    RUN_TEST(test_read_timeout);
+    RUN_TEST(test_cancel_read);
+    RUN_TEST(test_many_in_flight);
+    RUN_TEST(test_served_in_order);
+}
+
+
+int main(void) {
+    CHECK(TimerTick_start());
+
+    printf("# epoll\n");
+    CHECK(CoroReactor_epoll_start());
+    CoroIo_set_reactor(&CoroReactor_epoll);
+    CoroIdle_set_strategy(&CoroIdle_epoll_strategy);
+    run_tests();
+
+#if TEST_HAVE_IO_URING
+    if (CoroReactor_uring_start()) {
+        printf("# io_uring\n");
+        CoroIo_set_reactor(&CoroReactor_uring);
+        CoroIdle_set_strategy(&CoroIdle_uring_strategy);
+        run_tests();
+    } else {
+        /* e.g. an older kernel, or a sandbox that forbids it */
+        printf("# io_uring skipped: %s\n", strerror(errno));
+    }
+#endif
+    return EXIT_SUCCESS;
+}
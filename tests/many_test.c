@@ -0,0 +1,190 @@
+/** \file many_test.c
+ *
+ * Waits on several waitables at once: resumed once, when all of them (or
+ * the first one) are done, with the index of the winner, on the virtual
+ * clock of sim.h.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include "check.h"
+#include "coro.h"
+#include "sim.h"
+
+
+static CoroState         states_0[16];
+static CoroScheduleQueue queue_0 =
+        CORO_QUEUE_STATIC_INIT(queue_0, 16, states_0);
+static CoroScheduleQueue *const queues[] = {&queue_0};
+static CoroSchedule             schedule = {
+        .queues = queues, .n_priorities = 1, .ready = 0};
+
+
+static Condition     flag;
+static WakeCondition ready = WAKE_CONDITION_INIT;
+static WakeCondition other = WAKE_CONDITION_INIT;
+static CoroGroup     group = CORO_GROUP_INIT;
+static Resource      resource;
+static ResourceOwner test_owner = {.priority = 100};
+
+
+typedef timer_ms_t sleeperVars;
+/** Sleeps for its variable */
+static void sleeper(CoroState *state, void *vars) {
+    CORO_INIT(sleeper);
+    CORO_AWAIT_TIMED_EXPLICIT(state, *v);
+    CORO_END();
+}
+
+typedef timer_ms_t group_memberVars;
+/** Sleeps for its variable, as a task of \c group */
+static void group_member(CoroState *state, void *vars) {
+    CORO_INIT(group_member);
+    CORO_AWAIT_TIMED_EXPLICIT(state, *v);
+    CoroGroup_done(&group);
+    CORO_END();
+}
+
+
+typedef struct {
+    CoroState    sub;
+    sleeperVars  sub_vars;
+    CoroWaitable waitables[4];
+    int          n_resumed;
+    uint64_t     resumed_at;
+} all_waiterVars;
+/** Awaits a sub-coroutine, \c group, \c flag and \c ready all at once */
+static void all_waiter(CoroState *state, void *vars) {
+    CORO_INIT(all_waiter);
+    Coro_init_sub(&v->sub, sleeper, &v->sub_vars);
+    v->waitables[0] = CORO_WAITABLE(&v->sub);
+    v->waitables[1] = CORO_WAITABLE(&group);
+    v->waitables[2] = CORO_WAITABLE(&flag);
+    v->waitables[3] = CORO_WAITABLE(&ready);
+    CORO_AWAIT_ALL(v->waitables);
+    v->n_resumed++;
+    v->resumed_at = CoroSim_now_us();
+    CHECK(Coro_is_finalized(&v->sub));
+    CORO_END();
+}
+
+
+/** Awaiting all is resumed once, when the last of them is done */
+static void test_all(void) {
+    static all_waiterVars   vars     = {.sub_vars = 5};
+    static group_memberVars sleeps[] = {3, 10};
+    Condition_clear(&flag);
+    WakeCondition_clear(&ready);
+    CoroGroup_add(&group, 2);
+    CHECK(Coro_add_new(&schedule, all_waiter, &vars, 0) != NULL);
+    for (size_t i = 0; i < 2; i++) {
+        CHECK(Coro_add_new(&schedule, group_member, &sleeps[i], 0) != NULL);
+    }
+    CoroSim_run_for(&schedule, 20);
+    CHECK_EQ(vars.n_resumed, 0);
+    Condition_set(&flag);
+    CoroSim_run_for(&schedule, 5);
+    CHECK_EQ(vars.n_resumed, 0);
+
+    uint64_t set_at = CoroSim_now_us();
+    WakeCondition_set(&ready);
+    CoroSim_run_for(&schedule, 20);
+    CHECK_EQ(vars.n_resumed, 1);
+    CHECK(vars.resumed_at - set_at < 1000);
+}
+
+
+typedef struct {
+    CoroState    sub;
+    sleeperVars  sub_vars;
+    CoroWaitable waitables[3];
+    int          winners[2];
+    int          round;
+} any_waiterVars;
+/** Races \c ready, \c other and a sub-coroutine, twice */
+static void any_waiter(CoroState *state, void *vars) {
+    CORO_INIT(any_waiter);
+    Coro_init_sub(&v->sub, sleeper, &v->sub_vars);
+    v->waitables[0] = CORO_WAITABLE(&ready);
+    v->waitables[1] = CORO_WAITABLE(&other);
+    v->waitables[2] = CORO_WAITABLE(&v->sub);
+    for (v->round = 0; v->round < 2; v->round++) {
+        CORO_AWAIT_ANY(v->waitables);
+        v->winners[v->round] = state->wait.many.winner;
+        WakeCondition_clear(&other);
+    }
+    /* Still running after the first round */
+    CORO_AWAIT(&v->sub);
+    CORO_END();
+}
+
+
+/** Awaiting any is resumed by the first one done, which it tells */
+static void test_any(void) {
+    static any_waiterVars vars = {.sub_vars = 10};
+    WakeCondition_clear(&ready);
+    WakeCondition_clear(&other);
+    CHECK(Coro_add_new(&schedule, any_waiter, &vars, 0) != NULL);
+    CoroSim_run_for(&schedule, 5);
+    WakeCondition_set(&other);
+    CoroSim_run_for(&schedule, 1);
+    CHECK_EQ(vars.round, 1);
+    CHECK_EQ(vars.winners[0], 1);
+    CoroSim_run_for(&schedule, 10);
+    CHECK_EQ(vars.winners[1], 2);
+    CHECK(Coro_is_finalized(&vars.sub));
+}
+
+
+typedef struct {
+    ResourceOwner       owner;
+    CoroWaitable        waitables[2];
+    int                 winner;
+    bool                timed_out;
+    RetResource_acquire acquired;
+} racerVars;
+/** Races \c resource against \c ready for at most 10 ms, twice */
+static void racer(CoroState *state, void *vars) {
+    CORO_INIT(racer);
+    v->waitables[0] = CORO_WAITABLE(&resource, &v->owner);
+    v->waitables[1] = CORO_WAITABLE(&ready);
+    CORO_AWAIT_ANY_ATMOST(10, v->waitables);
+    v->winner    = state->wait.many.winner;
+    v->timed_out = Condition_get(&state->timeout.timed_out);
+
+    v->waitables[0] = CORO_WAITABLE(&resource, &v->owner);
+    CORO_AWAIT_ANY_ATMOST(10, v->waitables);
+    v->winner   = state->wait.many.winner;
+    v->acquired = v->waitables[0].on.resource.retval;
+    CHECK(Resource_is_owned(&resource, &v->owner));
+    Resource_release(&resource, &v->owner);
+    CORO_END();
+}
+
+
+/** A wait on any that times out has no winner, and a polled resource wins
+ * once it is released */
+static void test_any_timeout(void) {
+    static racerVars vars = {.owner.priority = 0};
+    WakeCondition_clear(&ready);
+    CHECK_EQ(Resource_acquire(&resource, &test_owner),
+             RESOURCE_ACQUIRE_SUCCESS);
+    CHECK(Coro_add_new(&schedule, racer, &vars, 0) != NULL);
+    CoroSim_run_for(&schedule, 15);
+    CHECK(vars.timed_out);
+    CHECK_EQ(vars.winner, -1);
+
+    Resource_release(&resource, &test_owner);
+    CoroSim_run_for(&schedule, 1);
+    CHECK_EQ(vars.winner, 0);
+    CHECK_EQ(vars.acquired, RESOURCE_ACQUIRE_SUCCESS);
+    CHECK(Resource_is_owned(&resource, NULL));
+}
+
+
+int main(void) {
+    CoroIdle_set_strategy(&CoroIdle_sim_strategy);
+    RUN_TEST(test_all);
+    RUN_TEST(test_any);
+    RUN_TEST(test_any_timeout);
+    return EXIT_SUCCESS;
+}
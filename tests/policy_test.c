@@ -0,0 +1,199 @@
+/** \file policy_test.c
+ *
+ * The order in which queues of weighted and deficit round robin policies,
+ * and those that aged, are served, on the virtual clock of sim.h. Only built
+ * with CONF_CORO_POLICIES.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include <string.h>
+#include "check.h"
+#include "coro.h"
+#include "sim.h"
+
+
+static CoroState         states_0[4];
+static CoroState         states_1[4];
+static CoroState         states_2[4];
+static CoroScheduleQueue queue_0 =
+        CORO_QUEUE_STATIC_INIT(queue_0, 4, states_0);
+static CoroScheduleQueue queue_1 =
+        CORO_QUEUE_STATIC_INIT(queue_1, 4, states_1);
+static CoroScheduleQueue queue_2 =
+        CORO_QUEUE_STATIC_INIT(queue_2, 4, states_2);
+static CoroScheduleQueue *const queues[] = {&queue_0, &queue_1, &queue_2};
+static CoroSchedule             schedule = {
+        .queues = queues, .n_priorities = 3, .ready = 0};
+
+
+/** The steps of the coroutines of a test, in order */
+static char   steps[64];
+static size_t n_steps;
+
+static void note(char step) {
+    CHECK(n_steps + 1 < sizeof(steps));
+    steps[n_steps++] = step;
+    steps[n_steps]   = '\0';
+}
+
+/** Every queue strict again, with no round in progress */
+static void start_test(void) {
+    for (size_t i = 0; i < CORO_ARRAY_SIZE(queues); i++) {
+        CoroScheduleQueue_set_policy(queues[i], CORO_POLICY_STRICT, 0);
+        CoroScheduleQueue_set_max_wait(queues[i], 0);
+    }
+    schedule.exhausted = 0;
+    n_steps            = 0;
+    steps[0]           = '\0';
+}
+
+
+/** Keep the cycle counter busy for at least \p cycles */
+static void burn(uint64_t cycles) {
+    uint64_t started = CONF_CORO_STATS_CYCLES();
+    while (CONF_CORO_STATS_CYCLES() - started < cycles) {}
+}
+
+
+typedef struct {
+    char name;
+    int  n;
+    int  i;
+} stepperVars;
+/** Notes its name at each of its \c n steps */
+static void stepper(CoroState *state, void *vars) {
+    CORO_INIT(stepper);
+    for (v->i = 0; v->i < v->n; v->i++) {
+        if (v->i > 0) { CORO_YIELD(); }
+        note(v->name);
+    }
+    CORO_END();
+}
+
+
+/** Strict queues are served until they have nothing ready */
+static void test_strict(void) {
+    static stepperVars vars[] = {{.name = 'a', .n = 3}, {.name = 'b', .n = 3}};
+    start_test();
+    CHECK(Coro_add_new(&schedule, stepper, &vars[1], 1) != NULL);
+    CHECK(Coro_add_new(&schedule, stepper, &vars[0], 0) != NULL);
+    CoroSim_run_for(&schedule, 1);
+    CHECK(strcmp(steps, "aaabbb") == 0);
+}
+
+
+/** A weighted queue is served for its quantum of steps, then a lower
+ * strict one for a single step, round after round */
+static void test_weighted(void) {
+    static stepperVars vars[] = {{.name = 'a', .n = 5}, {.name = 'b', .n = 4}};
+    start_test();
+    CoroScheduleQueue_set_policy(&queue_0, CORO_POLICY_WEIGHTED, 2);
+    CHECK(Coro_add_new(&schedule, stepper, &vars[0], 0) != NULL);
+    CHECK(Coro_add_new(&schedule, stepper, &vars[1], 1) != NULL);
+    CoroSim_run_for(&schedule, 1);
+    CHECK(strcmp(steps, "aabaababb") == 0);
+}
+
+
+/** Quantum of the deficit queue, in cycles */
+#define QUANTUM 2000
+
+/** Steps of the lower queue since the last of the deficit queue, and the
+ * fewest between two of them */
+static int  n_since;
+static int  min_between;
+static bool overran_done;
+
+typedef int overrunnerVars;
+/** Runs steps of 2.5 quanta each */
+static void overrunner(CoroState *state, void *vars) {
+    CORO_INIT(overrunner);
+    for (*v = 0; *v < 4; (*v)++) {
+        if (*v > 0) {
+            CORO_YIELD();
+            if (n_since < min_between) { min_between = n_since; }
+        }
+        n_since = 0;
+        burn(QUANTUM * 5 / 2);
+    }
+    overran_done = true;
+    CORO_END();
+}
+
+typedef void counterVars;
+/** Counts its steps until the overrunner is done */
+static void counter(CoroState *state, void *vars) {
+    CORO_INIT(counter);
+    (void)v;
+    while (!overran_done) {
+        n_since++;
+        CORO_YIELD();
+    }
+    CORO_END();
+}
+
+
+/** A deficit queue pays back a step that overran its quantum over the
+ * next rounds, a lower queue being served once in each */
+static void test_deficit(void) {
+    static overrunnerVars n_overruns;
+    start_test();
+    CoroScheduleQueue_set_policy(&queue_0, CORO_POLICY_DEFICIT, QUANTUM);
+    n_since      = 0;
+    min_between  = 1000;
+    overran_done = false;
+    CHECK(Coro_add_new(&schedule, overrunner, &n_overruns, 0) != NULL);
+    CHECK(Coro_add_new(&schedule, counter, NULL, 1) != NULL);
+    CoroSim_run_for(&schedule, 100);
+    CHECK(overran_done);
+    /* Left at -1.5 quanta or less after each step, so two more rounds */
+    CHECK(min_between >= 2);
+}
+
+
+static bool spin_stop;
+
+typedef int spinnerVars;
+/** Keeps its strict queue ready until \c spin_stop */
+static void spinner(CoroState *state, void *vars) {
+    CORO_INIT(spinner);
+    while (!spin_stop) {
+        (*v)++;
+        burn(1000);
+        CORO_YIELD();
+    }
+    CORO_END();
+}
+
+
+/** A queue passed over for longer than its max_wait is served first, and
+ * starves behind a busy strict one otherwise */
+static void test_aging(void) {
+    static spinnerVars n_spins;
+    static stepperVars vars = {.name = 'c', .n = 3};
+    start_test();
+    spin_stop = false;
+    CHECK(Coro_add_new(&schedule, spinner, &n_spins, 0) != NULL);
+    CHECK(Coro_add_new(&schedule, stepper, &vars, 2) != NULL);
+    CoroSim_run_for(&schedule, 1);
+    CHECK_EQ(n_steps, 0);
+
+    CoroScheduleQueue_set_max_wait(&queue_2, 10000);
+    int spins = n_spins;
+    CoroSim_run_for(&schedule, 1);
+    CHECK(strcmp(steps, "ccc") == 0);
+    /* Passed over again after each of its steps */
+    CHECK(n_spins - spins >= 3);
+    spin_stop = true;
+    CoroSim_run_for(&schedule, 1);
+}
+
+
+int main(void) {
+    CoroIdle_set_strategy(&CoroIdle_sim_strategy);
+    RUN_TEST(test_strict);
+    RUN_TEST(test_weighted);
+    RUN_TEST(test_deficit);
+    RUN_TEST(test_aging);
+    return EXIT_SUCCESS;
+}
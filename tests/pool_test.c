@@ -0,0 +1,124 @@
+/** \file pool_test.c
+ *
+ * Coroutines added from a pool, one at a time or in batches, and their
+ * entries given back as they finalize, on the virtual clock of sim.h.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include <string.h>
+#include "check.h"
+#include "coro.h"
+#include "sim.h"
+
+
+static CoroState         states_0[4];
+static CoroScheduleQueue queue_0 =
+        CORO_QUEUE_STATIC_INIT(queue_0, 4, states_0);
+static CoroScheduleQueue *const queues[] = {&queue_0};
+static CoroSchedule             schedule = {
+        .queues = queues, .n_priorities = 1, .ready = 0};
+
+
+#define N_HANDLERS 8
+
+/** What the handlers of a test did, in order */
+static char   steps[64];
+static size_t n_steps;
+
+static void note(char step) {
+    CHECK(n_steps + 1 < sizeof(steps));
+    steps[n_steps++] = step;
+    steps[n_steps]   = '\0';
+}
+
+static void start_test(void) {
+    n_steps  = 0;
+    steps[0] = '\0';
+}
+
+
+typedef struct {
+    char name;
+    int  n_runs;
+} handlerVars;
+/** Notes its name at each of its two steps */
+static void handler(CoroState *state, void *vars) {
+    CORO_INIT(handler);
+    v->n_runs++;
+    note(v->name);
+    CORO_YIELD();
+    note(v->name);
+    CORO_END();
+}
+
+CORO_POOL_DEFINE(handlers, handler, N_HANDLERS);
+
+
+/** A batch runs in order, and no more of it is added than the pool holds */
+static void test_batch(void) {
+    static const handlerVars vars[N_HANDLERS + 2] = {
+            {.name = 'a'}, {.name = 'b'}, {.name = 'c'}, {.name = 'd'},
+            {.name = 'e'}, {.name = 'f'}, {.name = 'g'}, {.name = 'h'},
+            {.name = 'i'}, {.name = 'j'}};
+    start_test();
+    CHECK_EQ(Coro_add_batch(&schedule, &handlers, 0, vars, 3), 3);
+    CoroSim_run_for(&schedule, 1);
+    CHECK(strcmp(steps, "abcabc") == 0);
+
+    start_test();
+    CHECK_EQ(Coro_add_batch(&schedule, &handlers, 0, vars, N_HANDLERS + 2),
+             N_HANDLERS);
+    CHECK(Coro_add_pooled(&schedule, &handlers, 0, &vars[0]) == NULL);
+    CoroSim_run_for(&schedule, 1);
+    CHECK(strcmp(steps, "abcdefghabcdefgh") == 0);
+}
+
+
+/** Each coroutine gets its variables right after its state in an entry,
+ * which is given back once it finalized */
+static void test_entries_recycled(void) {
+    static const handlerVars vars = {.name = 'x'};
+    CoroState *              added[N_HANDLERS];
+    for (int round = 0; round < 3; round++) {
+        start_test();
+        for (size_t i = 0; i < N_HANDLERS; i++) {
+            added[i] = Coro_add_pooled(&schedule, &handlers, 0, &vars);
+            CHECK(added[i] != NULL);
+            CHECK((char *)added[i]->vars
+                  == (char *)added[i] + handlers.vars_offset);
+            CHECK(added[i] >= &handlers_entries[0].state
+                  && added[i] <= &handlers_entries[N_HANDLERS - 1].state);
+        }
+        CHECK(Coro_add_pooled(&schedule, &handlers, 0, &vars) == NULL);
+        CoroSim_run_for(&schedule, 1);
+        CHECK_EQ(n_steps, 2 * N_HANDLERS);
+    }
+}
+
+
+/** Without initial variables, a coroutine takes them as the previous one of
+ * its entry left them */
+static void test_vars_kept(void) {
+    static const handlerVars vars = {.name = 'k'};
+    start_test();
+    CoroState *first = Coro_add_pooled(&schedule, &handlers, 0, &vars);
+    CHECK(first != NULL);
+    CoroSim_run_for(&schedule, 1);
+    CHECK_EQ(((handlerVars *)first->vars)->n_runs, 1);
+
+    /* The entry given back last is taken first */
+    CoroState *again = Coro_add_pooled(&schedule, &handlers, 0, NULL);
+    CHECK(again == first);
+    CoroSim_run_for(&schedule, 1);
+    CHECK_EQ(((handlerVars *)again->vars)->n_runs, 2);
+    CHECK(strcmp(steps, "kkkk") == 0);
+}
+
+
+int main(void) {
+    CoroIdle_set_strategy(&CoroIdle_sim_strategy);
+    RUN_TEST(test_batch);
+    RUN_TEST(test_entries_recycled);
+    RUN_TEST(test_vars_kept);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+/** \file resource_test.c
+ *
+ * Queued resources handed over to their best waiter, and the owner running
+ * at the priority of its waiters meanwhile, on the virtual clock of sim.h.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include <string.h>
+#include "check.h"
+#include "coro.h"
+#include "sim.h"
+
+
+static CoroState         states_0[8];
+static CoroState         states_1[8];
+static CoroState         states_2[8];
+static CoroScheduleQueue queue_0 =
+        CORO_QUEUE_STATIC_INIT(queue_0, 8, states_0);
+static CoroScheduleQueue queue_1 =
+        CORO_QUEUE_STATIC_INIT(queue_1, 8, states_1);
+static CoroScheduleQueue queue_2 =
+        CORO_QUEUE_STATIC_INIT(queue_2, 8, states_2);
+static CoroScheduleQueue *const queues[] = {&queue_0, &queue_1, &queue_2};
+static CoroSchedule             schedule = {
+        .queues = queues, .n_priorities = 3, .ready = 0};
+
+
+static QueuedResource queued     = QUEUED_RESOURCE_INIT;
+static ResourceOwner  test_owner = {.priority = 0};
+
+/** The order in which the coroutines of a test got \c queued */
+static char   order[16];
+static size_t n_order;
+
+
+typedef struct {
+    char          name;
+    ResourceOwner owner;
+} takerVars;
+/** Acquires \c queued, notes its name and releases it */
+static void taker(CoroState *state, void *vars) {
+    CORO_INIT(taker);
+    CORO_AWAIT(&queued, &v->owner);
+    /* Handed over, not retried */
+    CHECK_EQ(state->wait.resource.retval, RESOURCE_ACQUIRE_SUCCESS);
+    CHECK(QueuedResource_is_owned(&queued, &v->owner));
+    order[n_order++] = v->name;
+    QueuedResource_release(&queued, &v->owner);
+    CORO_END();
+}
+
+
+/** Each release hands the resource to the waiter of the highest priority,
+ * the oldest among equals, whose priority the owner inherits meanwhile */
+static void test_hand_over_order(void) {
+    static takerVars vars[] = {
+            {.name = 'a', .owner.priority = 1},
+            {.name = 'b', .owner.priority = 3},
+            {.name = 'c', .owner.priority = 2},
+            {.name = 'd', .owner.priority = 3},
+            {.name = 'e', .owner.priority = 1},
+    };
+    n_order = 0;
+    memset(order, 0, sizeof(order));
+    CHECK_EQ(QueuedResource_try_acquire(&queued, &test_owner),
+             RESOURCE_ACQUIRE_SUCCESS);
+    for (size_t i = 0; i < CORO_ARRAY_SIZE(vars); i++) {
+        /* One at a time, so that they queue in that order */
+        CHECK(Coro_add_new(&schedule, taker, &vars[i], 1) != NULL);
+        CoroSim_run_for(&schedule, 1);
+    }
+    CHECK_EQ(n_order, 0);
+    CHECK_EQ(QueuedResource_priority(&queued, &test_owner), 3);
+
+    QueuedResource_release(&queued, &test_owner);
+    CoroSim_run_for(&schedule, 1);
+    CHECK(strcmp(order, "bdcae") == 0);
+    CHECK(QueuedResource_is_owned(&queued, NULL));
+    /* Nothing left to inherit once free */
+    CHECK_EQ(QueuedResource_priority(&queued, &test_owner), 0);
+}
+
+
+static WakeCondition go = WAKE_CONDITION_INIT;
+static bool          urgent_done;
+
+typedef struct {
+    ResourceOwner owner;
+    int           i;
+} holderVars;
+/** Acquires \c queued, then once \c go is set works a few steps before it
+ * releases it */
+static void holder(CoroState *state, void *vars) {
+    CORO_INIT(holder);
+    CORO_AWAIT(&queued, &v->owner);
+    CORO_AWAIT(&go);
+    for (v->i = 0; v->i < 5; v->i++) { CORO_YIELD(); }
+    QueuedResource_release(&queued, &v->owner);
+    CORO_END();
+}
+
+typedef int spinnerVars;
+/** Keeps its priority busy until the urgent coroutine is done */
+static void spinner(CoroState *state, void *vars) {
+    CORO_INIT(spinner);
+    while (!urgent_done) {
+        (*v)++;
+        CORO_YIELD();
+    }
+    CORO_END();
+}
+
+typedef ResourceOwner urgentVars;
+/** Acquires \c queued and releases it */
+static void urgent(CoroState *state, void *vars) {
+    CORO_INIT(urgent);
+    CORO_AWAIT(&queued, v);
+    QueuedResource_release(&queued, v);
+    urgent_done = true;
+    CORO_END();
+}
+
+
+/** An owner of low priority runs at the priority of a waiter of high
+ * priority, ahead of the coroutines of the priority in between */
+static void test_priority_inheritance(void) {
+    static holderVars  holder_vars;
+    static spinnerVars n_spins;
+    static urgentVars  urgent_owner;
+    WakeCondition_clear(&go);
+    urgent_done = false;
+    CHECK(Coro_add_new(&schedule, holder, &holder_vars, 2) != NULL);
+    CoroSim_run_for(&schedule, 1);
+    CHECK(QueuedResource_is_owned(&queued, &holder_vars.owner));
+
+    CHECK(Coro_add_new(&schedule, urgent, &urgent_owner, 0) != NULL);
+    CoroSim_run_for(&schedule, 1);
+    CHECK(!urgent_done);
+    CHECK(Coro_add_new(&schedule, spinner, &n_spins, 1) != NULL);
+    WakeCondition_set(&go);
+    CoroSim_run_for(&schedule, 10);
+    CHECK(urgent_done);
+    /* Not starved by the spinner until it gave up */
+    CHECK(n_spins < 100);
+    CHECK(QueuedResource_is_owned(&queued, NULL));
+}
+
+
+int main(void) {
+    CoroIdle_set_strategy(&CoroIdle_sim_strategy);
+    RUN_TEST(test_hand_over_order);
+    RUN_TEST(test_priority_inheritance);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,220 @@
+/** \file scheduler_test.c
+ *
+ * Order of the steps of coroutines and the basic waits, on the virtual clock
+ * of sim.h.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include <string.h>
+#include "check.h"
+#include "coro.h"
+#include "sim.h"
+
+
+static CoroState         states_0[8];
+static CoroState         states_1[8];
+static CoroScheduleQueue queue_0 =
+        CORO_QUEUE_STATIC_INIT(queue_0, 8, states_0);
+static CoroScheduleQueue queue_1 =
+        CORO_QUEUE_STATIC_INIT(queue_1, 8, states_1);
+static CoroScheduleQueue *const queues[] = {&queue_0, &queue_1};
+static CoroSchedule             schedule = {
+        .queues = queues, .n_priorities = 2, .ready = 0};
+
+/** What the coroutines of a test did, in order */
+static char   steps[64];
+static size_t n_steps;
+
+static void note(char step) {
+    CHECK(n_steps + 1 < sizeof(steps));
+    steps[n_steps++] = step;
+    steps[n_steps]   = '\0';
+}
+
+static void start_test(void) {
+    n_steps  = 0;
+    steps[0] = '\0';
+}
+
+
+typedef struct {
+    char name;
+    int  n_steps;
+    int  i;
+} stepperVars;
+/** Notes its name at each of its steps */
+static void stepper(CoroState *state, void *vars) {
+    CORO_INIT(stepper);
+    for (v->i = 0; v->i < v->n_steps; v->i++) {
+        note(v->name);
+        CORO_YIELD();
+    }
+    CORO_END();
+}
+
+
+/** Higher priorities run first, coroutines of the same one round robin */
+static void test_priorities(void) {
+    static stepperVars low_a;
+    static stepperVars low_b;
+    static stepperVars high;
+    low_a = (stepperVars){.name = 'a', .n_steps = 3};
+    low_b = (stepperVars){.name = 'b', .n_steps = 3};
+    high  = (stepperVars){.name = 'H', .n_steps = 2};
+    start_test();
+    CHECK(Coro_add_new(&schedule, stepper, &low_a, 1) != NULL);
+    CHECK(Coro_add_new(&schedule, stepper, &low_b, 1) != NULL);
+    CHECK(Coro_add_new(&schedule, stepper, &high, 0) != NULL);
+    CoroSim_run_for(&schedule, 1);
+    CHECK(strcmp(steps, "HHababab") == 0);
+}
+
+
+/** The states of finalized coroutines are given back to their queue */
+static void test_states_reused(void) {
+    static stepperVars vars[8];
+    for (int round = 0; round < 3; round++) {
+        start_test();
+        for (size_t i = 0; i < 8; i++) {
+            vars[i] = (stepperVars){.name = 'x', .n_steps = 1};
+            CHECK(Coro_add_new(&schedule, stepper, &vars[i], 1) != NULL);
+        }
+        CHECK(Coro_add_new(&schedule, stepper, &vars[0], 1) == NULL);
+        CoroSim_run_for(&schedule, 1);
+        CHECK_EQ(n_steps, 8);
+    }
+}
+
+
+static Condition     condition;
+static WakeCondition wake_condition = WAKE_CONDITION_INIT;
+
+typedef char await_conditionVars;
+/** Notes its name once \c condition is set */
+static void await_condition(CoroState *state, void *vars) {
+    CORO_INIT(await_condition);
+    CORO_AWAIT(&condition);
+    note(*v);
+    CORO_END();
+}
+
+typedef char await_wake_conditionVars;
+/** Notes its name once \c wake_condition is set */
+static void await_wake_condition(CoroState *state, void *vars) {
+    CORO_INIT(await_wake_condition);
+    CORO_AWAIT(&wake_condition);
+    note(*v);
+    CORO_END();
+}
+
+
+/** Waits on conditions end once they are set, not before */
+static void test_conditions(void) {
+    static char names[] = "abc";
+    start_test();
+    Condition_clear(&condition);
+    WakeCondition_clear(&wake_condition);
+    CHECK(Coro_add_new(&schedule, await_condition, &names[0], 1) != NULL);
+    CHECK(Coro_add_new(&schedule, await_wake_condition, &names[1], 1)
+          != NULL);
+    CHECK(Coro_add_new(&schedule, await_wake_condition, &names[2], 1)
+          != NULL);
+    CoroSim_run_for(&schedule, 10);
+    CHECK_EQ(n_steps, 0);
+
+    Condition_set(&condition);
+    CoroSim_run_for(&schedule, 1);
+    CHECK(strcmp(steps, "a") == 0);
+    WakeCondition_set(&wake_condition);
+    CoroSim_run_for(&schedule, 1);
+    /* In any order */
+    CHECK_EQ(n_steps, 3);
+    CHECK(strchr(steps, 'b') != NULL && strchr(steps, 'c') != NULL);
+}
+
+
+typedef struct {
+    uint64_t started_at;
+    uint64_t resumed_at;
+    bool     timed_out;
+} sleeperVars;
+/** Sleeps 10 ms, then waits at most 5 ms for \c condition */
+static void sleeper(CoroState *state, void *vars) {
+    CORO_INIT(sleeper);
+    v->started_at = CoroSim_now_us();
+    CORO_AWAIT_TIMED_EXPLICIT(state, 10);
+    v->resumed_at = CoroSim_now_us();
+    CORO_AWAIT_ATMOST(5, &condition);
+    v->timed_out = Condition_get(&state->timeout.timed_out);
+    CORO_END();
+}
+
+
+/** Timed waits end after their time, on the virtual clock */
+static void test_timed_waits(void) {
+    static sleeperVars vars;
+    vars = (sleeperVars){.timed_out = false};
+    Condition_clear(&condition);
+    CHECK(Coro_add_new(&schedule, sleeper, &vars, 0) != NULL);
+    CoroSim_run_for(&schedule, 9);
+    CHECK_EQ(vars.resumed_at, 0);
+    CoroSim_run_for(&schedule, 10);
+    CHECK(vars.resumed_at - vars.started_at >= 10000);
+    CHECK(vars.resumed_at - vars.started_at < 10000 + 100);
+    CHECK(vars.timed_out);
+}
+
+
+typedef struct {
+    int i;
+    int total;
+} count_upVars;
+/** Adds up 1 to 3, a step at a time */
+static void count_up(CoroState *state, void *vars) {
+    CORO_INIT(count_up);
+    for (v->i = 1; v->i <= 3; v->i++) {
+        v->total += v->i;
+        note('s');
+        CORO_YIELD();
+    }
+    CORO_END();
+}
+
+typedef struct {
+    CoroState    sub;
+    count_upVars sub_vars;
+} parentVars;
+/** Awaits count_up as a sub-coroutine */
+static void parent(CoroState *state, void *vars) {
+    CORO_INIT(parent);
+    v->sub_vars = (count_upVars){.total = 0};
+    Coro_init_sub(&v->sub, count_up, &v->sub_vars);
+    note('p');
+    CORO_AWAIT(&v->sub);
+    CHECK(Coro_is_finalized(&v->sub));
+    CHECK_EQ(v->sub_vars.total, 6);
+    note('p');
+    CORO_END();
+}
+
+
+/** A sub-coroutine runs in place of the coroutine awaiting it, which is
+ * resumed once it finalized */
+static void test_sub_coroutine(void) {
+    static parentVars vars;
+    start_test();
+    CHECK(Coro_add_new(&schedule, parent, &vars, 1) != NULL);
+    CoroSim_run_for(&schedule, 1);
+    CHECK(strcmp(steps, "psssp") == 0);
+}
+
+
+int main(void) {
+    CoroIdle_set_strategy(&CoroIdle_sim_strategy);
+    RUN_TEST(test_priorities);
+    RUN_TEST(test_states_reused);
+    RUN_TEST(test_conditions);
+    RUN_TEST(test_timed_waits);
+    RUN_TEST(test_sub_coroutine);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,165 @@
+/** \file snapshot_test.c
+ *
+ * Coroutines of a pool saved to an image and restored from it into a pool
+ * of the same layout, as on the next boot, on the virtual clock of sim.h.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include <string.h>
+#include "check.h"
+#include "coro.h"
+#include "sim.h"
+#include "snapshot.h"
+
+
+static CoroState         states_before[8];
+static CoroScheduleQueue queue_before =
+        CORO_QUEUE_STATIC_INIT(queue_before, 8, states_before);
+static CoroScheduleQueue *const queues_before[] = {&queue_before};
+/** Where the coroutines ran before the image was saved */
+static CoroSchedule before = {
+        .queues = queues_before, .n_priorities = 1, .ready = 0};
+
+static CoroState         states_after[8];
+static CoroScheduleQueue queue_after =
+        CORO_QUEUE_STATIC_INIT(queue_after, 8, states_after);
+static CoroScheduleQueue *const queues_after[] = {&queue_after};
+/** Where they are restored, as on the next boot */
+static CoroSchedule after = {
+        .queues = queues_after, .n_priorities = 1, .ready = 0};
+
+
+static Condition     flag;
+static WakeCondition ready = WAKE_CONDITION_INIT;
+static uint32_t      channel_data[4];
+static Channel       channel = CHANNEL_STATIC_INIT(
+        sizeof(uint32_t), 4, channel_data, CHANNEL_SPSC);
+
+/** What the waiters did, in order */
+static char   steps[16];
+static size_t n_steps;
+
+static void note(char step) {
+    CHECK(n_steps + 1 < sizeof(steps));
+    steps[n_steps++] = step;
+    steps[n_steps]   = '\0';
+}
+
+
+typedef struct {
+    /** 'c' to await \c flag, 'w' \c ready, 'r' an item of \c channel, and
+     * 'n' nothing */
+    char     kind;
+    int      n_runs;
+    uint32_t item;
+} waiterVars;
+/** Awaits what its kind tells, then notes it */
+static void waiter(CoroState *state, void *vars) {
+    CORO_INIT(waiter);
+    v->n_runs++;
+    if (v->kind == 'c') {
+        CORO_AWAIT(&flag);
+    } else if (v->kind == 'w') {
+        CORO_AWAIT(&ready);
+    } else if (v->kind == 'r') {
+        CORO_AWAIT_RECV(&channel, &v->item);
+        CHECK_EQ(v->item, 42);
+    }
+    note(v->kind);
+    CORO_END();
+}
+
+CORO_POOL_DEFINE(pool_before, waiter, 4);
+CORO_POOL_DEFINE(pool_after, waiter, 4);
+
+static CoroPool *const pools_before[] = {&pool_before};
+static CoroPool *const pools_after[]  = {&pool_after};
+
+
+/** Room for an image of either pool */
+static uint64_t image[8192 / sizeof(uint64_t)];
+static size_t   image_size;
+
+
+/** Quiescent coroutines are saved, waiting or never started */
+static void test_save(void) {
+    static const waiterVars vars[] = {
+            {.kind = 'c'}, {.kind = 'w'}, {.kind = 'r'}, {.kind = 'n'}};
+    CHECK(CoroSnapshot_size(pools_before, 1) <= sizeof(image));
+    CoroState *added[4];
+    for (size_t i = 0; i < 3; i++) {
+        added[i] = Coro_add_pooled(&before, &pool_before, 0, &vars[i]);
+        CHECK(added[i] != NULL);
+    }
+    CoroSim_run_for(&before, 1);
+    CHECK_EQ(n_steps, 0);
+    added[3] = Coro_add_pooled(&before, &pool_before, 0, &vars[3]);
+    CHECK(added[3] != NULL);
+
+    image_size = CoroSnapshot_save(pools_before, 1, image, sizeof(image));
+    CoroSnapshotHeader header;
+    CHECK(image_size > sizeof(header));
+    memcpy(&header, image, sizeof(header));
+    CHECK_EQ(header.n_records, 4);
+
+    /* As the reset would, and the originals no longer wait */
+    for (size_t i = 0; i < 4; i++) { Coro_cancel(added[i]); }
+    CoroSim_run_for(&before, 1);
+    CHECK_EQ(n_steps, 0);
+}
+
+
+/** A torn or stale image is rejected without restoring anything */
+static void test_rejected(void) {
+    static uint64_t copy[sizeof(image) / sizeof(uint64_t)];
+    memcpy(copy, image, image_size);
+    ((char *)copy)[image_size - 1] ^= 1;
+    CHECK_EQ(CoroSnapshot_restore(&after, pools_after, 1, copy, image_size),
+             CORO_SNAPSHOT_RESTORE_CORRUPT);
+
+    CoroSnapshotHeader header;
+    memcpy(copy, image, image_size);
+    memcpy(&header, copy, sizeof(header));
+    header.build_id++;
+    memcpy(copy, &header, sizeof(header));
+    CHECK_EQ(CoroSnapshot_restore(&after, pools_after, 1, copy, image_size),
+             CORO_SNAPSHOT_RESTORE_STALE);
+    CHECK_EQ(atomic_load(&pool_after.entries.n_fresh), 0);
+}
+
+
+/** Restored coroutines keep their variables, and their waits are over as
+ * soon as what they wait on is set again */
+static void test_restored_waits(void) {
+    CHECK_EQ(CoroSnapshot_restore(&after, pools_after, 1, image, image_size),
+             CORO_SNAPSHOT_RESTORE_SUCCESS);
+    CHECK_EQ(CoroSnapshot_restore(&after, pools_after, 1, image, image_size),
+             CORO_SNAPSHOT_RESTORE_BUSY);
+    CoroSim_run_for(&after, 1);
+    CHECK(strcmp(steps, "n") == 0);
+
+    Condition_set(&flag);
+    CoroSim_run_for(&after, 1);
+    CHECK(strcmp(steps, "nc") == 0);
+    WakeCondition_set(&ready);
+    CoroSim_run_for(&after, 1);
+    CHECK(strcmp(steps, "ncw") == 0);
+    uint32_t item = 42;
+    CHECK(Channel_try_send(&channel, &item));
+    CoroSim_run_for(&after, 1);
+    CHECK(strcmp(steps, "ncwr") == 0);
+
+    /* Resumed rather than started over, so each counted its start once */
+    for (size_t i = 0; i < 4; i++) {
+        CHECK_EQ(pool_after_entries[i].vars.n_runs, 1);
+    }
+}
+
+
+int main(void) {
+    CoroIdle_set_strategy(&CoroIdle_sim_strategy);
+    RUN_TEST(test_save);
+    RUN_TEST(test_rejected);
+    RUN_TEST(test_restored_waits);
+    return EXIT_SUCCESS;
+}
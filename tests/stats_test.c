@@ -0,0 +1,164 @@
+/** \file stats_test.c
+ *
+ * Statistics of coroutines and schedules read with their snapshots, on the
+ * virtual clock of sim.h. Only built with CONF_CORO_STATS.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include "check.h"
+#include "coro.h"
+#include "sim.h"
+
+
+static CoroState         states_0[4];
+static CoroScheduleQueue queue_0 =
+        CORO_QUEUE_STATIC_INIT(queue_0, 4, states_0);
+static CoroScheduleQueue *const queues[] = {&queue_0};
+static CoroSchedule             schedule = {
+        .queues = queues, .n_priorities = 1, .ready = 0};
+
+
+static Condition     flag;
+static Condition     done;
+static Resource      resource;
+static ResourceOwner test_owner = {.priority = 0};
+
+
+typedef struct {
+    int i;
+} workerVars;
+/** Yields three times, awaits \c flag, then \c done */
+static void worker(CoroState *state, void *vars) {
+    CORO_INIT(worker);
+    for (v->i = 0; v->i < 3; v->i++) { CORO_YIELD(); }
+    CORO_AWAIT(&flag);
+    CORO_AWAIT(&done);
+    CORO_END();
+}
+
+
+typedef struct {
+    ResourceOwner       owner;
+    RetResource_acquire acquired;
+} preempterVars;
+/** Acquires \c resource from its weaker owner, then awaits \c done */
+static void preempter(CoroState *state, void *vars) {
+    CORO_INIT(preempter);
+    CORO_AWAIT(&resource, &v->owner);
+    v->acquired = state->wait.resource.retval;
+    CORO_AWAIT(&done);
+    Resource_release(&resource, &v->owner);
+    CORO_END();
+}
+
+
+/** A consistent snapshot of \p state, as the scheduler is not running */
+static CoroStats stats_of(const CoroState *state) {
+    CoroStats stats;
+    CHECK(CoroStats_snapshot(state, &stats));
+    return stats;
+}
+
+static CoroScheduleStats schedule_stats(void) {
+    CoroScheduleStats stats;
+    CHECK(CoroScheduleStats_snapshot(&schedule, &stats));
+    return stats;
+}
+
+
+/** Resumes and the time spent running and in each wait add up per step */
+static void test_coroutine_stats(void) {
+    static workerVars vars;
+    Condition_clear(&flag);
+    Condition_clear(&done);
+    CoroScheduleStats before = schedule_stats();
+    CoroState *       added  = Coro_add_new(&schedule, worker, &vars, 0);
+    CHECK(added != NULL);
+    CoroSim_run_for(&schedule, 1);
+
+    /* Started, resumed after each yield, then awaiting flag */
+    CoroStats stats = stats_of(added);
+    CHECK_EQ(stats.n_resumes, 4);
+    CHECK(stats.run_cycles > 0);
+    CHECK(stats.wait_cycles[CORO_STATUS_SUSPENDED] > 0);
+    CHECK_EQ(stats.wait_cycles[CORO_STATUS_WAIT_CONDITION], 0);
+    CHECK_EQ(stats.n_preemptions, 0);
+
+    /* Polling a wait that is not over does not resume it */
+    CoroSim_run_for(&schedule, 5);
+    CHECK_EQ(stats_of(added).n_resumes, 4);
+
+    Condition_set(&flag);
+    CoroSim_run_for(&schedule, 1);
+    CoroStats after = stats_of(added);
+    CHECK_EQ(after.n_resumes, 5);
+    CHECK(after.run_cycles >= stats.run_cycles);
+    CHECK(after.wait_cycles[CORO_STATUS_WAIT_CONDITION] > 0);
+    CHECK_EQ(after.wait_cycles[CORO_STATUS_SUSPENDED],
+             stats.wait_cycles[CORO_STATUS_SUSPENDED]);
+
+    CoroScheduleStats now = schedule_stats();
+    CHECK_EQ(now.n_steps - before.n_steps, 5);
+    CHECK(now.n_passes > before.n_passes);
+    CHECK(now.n_idle_waits > before.n_idle_waits);
+    CHECK(now.run_cycles > before.run_cycles);
+
+    Condition_set(&done);
+    CoroSim_run_for(&schedule, 1);
+}
+
+
+/** Acquiring a resource from a weaker owner counts as a preemption */
+static void test_preemptions(void) {
+    static preempterVars vars = {.owner.priority = 1};
+    Condition_clear(&done);
+    CHECK_EQ(Resource_acquire(&resource, &test_owner),
+             RESOURCE_ACQUIRE_SUCCESS);
+    CoroState *added = Coro_add_new(&schedule, preempter, &vars, 0);
+    CHECK(added != NULL);
+    CoroSim_run_for(&schedule, 1);
+    CHECK_EQ(vars.acquired, RESOURCE_ACQUIRE_PREEMPTED);
+    CHECK_EQ(stats_of(added).n_preemptions, 1);
+    CHECK_EQ(stats_of(added).n_resumes, 2);
+
+    Condition_set(&done);
+    CoroSim_run_for(&schedule, 1);
+    CHECK(Resource_is_owned(&resource, NULL));
+}
+
+
+/** No snapshot is taken while the scheduler is updating the statistics,
+ * and the last consistent one is taken again after */
+static void test_snapshot_torn(void) {
+    static workerVars vars;
+    Condition_clear(&flag);
+    Condition_clear(&done);
+    CoroState *added = Coro_add_new(&schedule, worker, &vars, 0);
+    CHECK(added != NULL);
+    CoroSim_run_for(&schedule, 1);
+    CoroStats stats = stats_of(added);
+
+    /* As the scheduler leaves it halfway through an update */
+    uint32_t seq = atomic_load(&added->stats_seq);
+    CHECK_EQ(seq % 2, 0);
+    atomic_store(&added->stats_seq, seq + 1);
+    CoroStats torn;
+    CHECK(!CoroStats_snapshot(added, &torn));
+    atomic_store(&added->stats_seq, seq);
+    CoroStats again = stats_of(added);
+    CHECK_EQ(again.n_resumes, stats.n_resumes);
+    CHECK_EQ(again.run_cycles, stats.run_cycles);
+
+    Condition_set(&flag);
+    Condition_set(&done);
+    CoroSim_run_for(&schedule, 1);
+}
+
+
+int main(void) {
+    CoroIdle_set_strategy(&CoroIdle_sim_strategy);
+    RUN_TEST(test_coroutine_stats);
+    RUN_TEST(test_preemptions);
+    RUN_TEST(test_snapshot_torn);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,283 @@
+/** \file workers_test.c
+ *
+ * Workers on POSIX threads spawning, waking and cancelling coroutines of one
+ * another, with timed waits on the shared timer wheel. Every coroutine must
+ * finish exactly once. Meant to also be run built with
+ * CSL_CORO_TEST_SANITIZER=thread.
+ */
+/* Copyright 2018 Gaurav Juvekar */
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "check.h"
+#include "coro.h"
+#include "linux/idle_futex.h"
+#include "linux/timer_tick.h"
+#include "linux/workers_pthread.h"
+
+
+#define N_WORKERS 4
+/** Rounds of children each spawner starts */
+#define N_ROUNDS 20
+/** Children a spawner starts per round, N_KINDS of each kind */
+#define N_CHILDREN 8
+#define N_KINDS 4
+/** Coroutines added to worker 0 while it is kept busy */
+#define N_STOLEN 16
+/** Time the test may take */
+#define TIMEOUT_S 30
+
+
+#define WORKER_QUEUES(n)                                               \
+    static CoroState         states_##n##_0[8];                        \
+    static CoroState         states_##n##_1[64];                       \
+    static CoroScheduleQueue queue_##n##_0 =                           \
+            CORO_QUEUE_STATIC_INIT(queue_##n##_0, 8, states_##n##_0);  \
+    static CoroScheduleQueue queue_##n##_1 =                           \
+            CORO_QUEUE_STATIC_INIT(queue_##n##_1, 64, states_##n##_1); \
+    static CoroScheduleQueue *const queues_##n[] = {&queue_##n##_0,    \
+                                                    &queue_##n##_1};   \
+    static CoroSchedule schedule_##n = {                               \
+            .queues = queues_##n, .n_priorities = 2, .ready = 0};
+
+WORKER_QUEUES(0)
+WORKER_QUEUES(1)
+WORKER_QUEUES(2)
+WORKER_QUEUES(3)
+
+static CoroSchedule *const schedules[N_WORKERS] = {
+        &schedule_0, &schedule_1, &schedule_2, &schedule_3};
+static CoroWorkers workers = {.schedules = schedules, .n_workers = N_WORKERS};
+
+
+/** Bit per thread that ran one of the coroutines added to worker 0 */
+static _Atomic uint32_t steal_threads;
+/** Number of those that ran at least once */
+static _Atomic uint32_t n_stolen_started;
+
+/** Records the calling thread in \c steal_threads */
+static void note_thread(void) {
+    static _Atomic uint32_t      n_threads;
+    static _Thread_local uint32_t index = UINT32_MAX;
+    if (index == UINT32_MAX) { index = atomic_fetch_add(&n_threads, 1); }
+    CHECK(index < 32);
+    atomic_fetch_or(&steal_threads, UINT32_C(1) << index);
+}
+
+
+typedef _Atomic uint32_t hogVars;
+/** Keeps its worker busy until every \c stolen coroutine ran once, which
+ * only the other workers can make happen, by stealing from worker 0 */
+static void hog(CoroState *state, void *vars) {
+    CORO_INIT(hog);
+    note_thread();
+    while (atomic_load(&n_stolen_started) < N_STOLEN) { sched_yield(); }
+    atomic_fetch_add(v, 1);
+    CORO_END();
+}
+
+typedef struct {
+    int              i;
+    _Atomic uint32_t finished;
+} stolenVars;
+/** Runs a few steps, in place of worker 0 when it is kept busy */
+static void stolen(CoroState *state, void *vars) {
+    CORO_INIT(stolen);
+    note_thread();
+    atomic_fetch_add(&n_stolen_started, 1);
+    for (v->i = 0; v->i < 20; v->i++) { CORO_YIELD(); }
+    atomic_fetch_add(&v->finished, 1);
+    CORO_END();
+}
+
+
+/** Flapped by \c flapper for the timed waits of the children */
+static WakeCondition flapping;
+/** Never set: the children awaiting it end only once cancelled */
+static WakeCondition never;
+
+static _Atomic uint32_t finished[N_WORKERS][N_ROUNDS][N_CHILDREN];
+static _Atomic uint32_t n_finished;
+static _Atomic uint32_t n_cancelled;
+static _Atomic uint32_t n_spawners_finished;
+
+enum { BUSY, GATED, TIMED, CANCELLED };
+
+typedef struct {
+    int               kind;
+    int               i;
+    /** Set by the spawner, from its own worker */
+    WakeCondition     gate;
+    /** Set by a CANCELLED child before it waits to be cancelled */
+    _Atomic bool      waiting;
+    _Atomic uint32_t *finished;
+    CoroGroup *       group;
+} childVars;
+/** Ends in a way of its kind, on whichever worker runs it */
+static void child(CoroState *state, void *vars) {
+    CORO_INIT(child);
+    if (v->kind == BUSY) {
+        for (v->i = 0; v->i < 20; v->i++) { CORO_YIELD(); }
+    } else if (v->kind == GATED) {
+        CORO_AWAIT(&v->gate);
+    } else if (v->kind == TIMED) {
+        /* Woken by the timer or by flapper, unlinking itself from
+         * flapping meanwhile */
+        for (v->i = 0; v->i < 3; v->i++) {
+            CORO_AWAIT_ATMOST(1 + v->i % 2, &flapping);
+        }
+    } else {
+        CORO_ON_CANCEL(cancelled);
+        atomic_store(&v->waiting, true);
+        CORO_AWAIT(&never);
+        CHECK(!"a child awaiting never was resumed without a cancel");
+    cancelled:
+        CHECK(Coro_is_cancelled(state));
+        atomic_fetch_add(&n_cancelled, 1);
+    }
+    atomic_fetch_add(v->finished, 1);
+    atomic_fetch_add(&n_finished, 1);
+    /* The spawner reuses the variables once the group is done */
+    CoroGroup_done(v->group);
+    CORO_END();
+}
+
+
+typedef struct {
+    size_t     self;
+    int        round;
+    size_t     j;
+    CoroGroup  group;
+    childVars  children[N_CHILDREN];
+    CoroState *states[N_CHILDREN];
+} spawnerVars;
+/** Starts rounds of children on the other workers, one at a time, wakes and
+ * cancels them from its own worker and awaits them all */
+static void spawner(CoroState *state, void *vars) {
+    CORO_INIT(spawner);
+    for (v->round = 0; v->round < N_ROUNDS; v->round++) {
+        CoroGroup_add(&v->group, N_CHILDREN);
+        for (size_t j = 0; j < N_CHILDREN; j++) {
+            childVars *child_vars = &v->children[j];
+            child_vars->kind      = (int)(j % N_KINDS);
+            child_vars->finished  = &finished[v->self][v->round][j];
+            child_vars->group     = &v->group;
+            WakeCondition_clear(&child_vars->gate);
+            atomic_store(&child_vars->waiting, false);
+            v->states[j] = Coro_add_new(
+                    schedules[(v->self + 1 + (size_t)v->round) % N_WORKERS],
+                    child,
+                    child_vars,
+                    1);
+            CHECK(v->states[j] != NULL);
+        }
+        for (size_t j = 0; j < N_CHILDREN; j++) {
+            if (v->children[j].kind == GATED) {
+                WakeCondition_set(&v->children[j].gate);
+            }
+        }
+        for (v->j = 0; v->j < N_CHILDREN; v->j++) {
+            if (v->children[v->j].kind != CANCELLED) { continue; }
+            /* Cancelled in any case, but only counted once it waits */
+            while (!atomic_load(&v->children[v->j].waiting)) {
+                CORO_YIELD();
+            }
+            Coro_cancel(v->states[v->j]);
+        }
+        CORO_AWAIT(&v->group);
+    }
+    atomic_fetch_add(&n_spawners_finished, 1);
+    CORO_END();
+}
+
+
+typedef _Atomic uint32_t flapperVars;
+/** Sets and clears \c flapping until every child finished */
+static void flapper(CoroState *state, void *vars) {
+    CORO_INIT(flapper);
+    while (atomic_load(&n_finished) < N_WORKERS * N_ROUNDS * N_CHILDREN) {
+        WakeCondition_set(&flapping);
+        CORO_YIELD();
+        WakeCondition_clear(&flapping);
+        CORO_YIELD();
+    }
+    atomic_fetch_add(v, 1);
+    CORO_END();
+}
+
+
+static void *run_worker_0(void *arg) {
+    (void)arg;
+    schedule_worker_mainloop(&workers, 0);
+}
+
+
+/** Every coroutine finishes exactly once, whichever worker runs it */
+static void test_workers(void) {
+    static hogVars     hog_finished;
+    static stolenVars  stolen_vars[N_STOLEN];
+    static spawnerVars spawner_vars[N_WORKERS];
+    static flapperVars flapper_finished;
+
+    /* Worker 0 runs the hog first, so the others must steal the rest */
+    CHECK(Coro_add_new(&schedule_0, hog, &hog_finished, 0) != NULL);
+    for (size_t i = 0; i < N_STOLEN; i++) {
+        CHECK(Coro_add_new(&schedule_0, stolen, &stolen_vars[i], 1) != NULL);
+    }
+    for (size_t i = 0; i < N_WORKERS; i++) {
+        spawner_vars[i].self  = i;
+        spawner_vars[i].group = (CoroGroup)CORO_GROUP_INIT;
+        CHECK(Coro_add_new(schedules[i], spawner, &spawner_vars[i], 1)
+              != NULL);
+    }
+    CHECK(Coro_add_new(&schedule_1, flapper, &flapper_finished, 1) != NULL);
+
+    CoroIdle_set_strategy(&CoroIdle_futex_strategy);
+    CHECK(TimerTick_start());
+    CHECK(CoroWorkers_start_pthreads(&workers));
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, run_worker_0, NULL) == 0);
+    CHECK(pthread_detach(thread) == 0);
+
+    /* The workers never return: poll for the coroutines to be done */
+    time_t deadline = time(NULL) + TIMEOUT_S;
+    while (atomic_load(&hog_finished) == 0
+           || atomic_load(&flapper_finished) == 0
+           || atomic_load(&n_spawners_finished) < N_WORKERS) {
+        CHECK(time(NULL) < deadline);
+        nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+    }
+
+    uint32_t threads = atomic_load(&steal_threads);
+    CHECK((threads & (threads - 1)) != 0);
+    for (size_t i = 0; i < N_STOLEN; i++) {
+        /* Stolen ones may be still running their last steps */
+        while (atomic_load(&stolen_vars[i].finished) == 0) {
+            CHECK(time(NULL) < deadline);
+            sched_yield();
+        }
+    }
+    for (size_t i = 0; i < N_WORKERS; i++) {
+        for (size_t round = 0; round < N_ROUNDS; round++) {
+            for (size_t j = 0; j < N_CHILDREN; j++) {
+                CHECK_EQ(atomic_load(&finished[i][round][j]), 1);
+            }
+        }
+    }
+    CHECK_EQ(atomic_load(&n_finished), N_WORKERS * N_ROUNDS * N_CHILDREN);
+    CHECK_EQ(atomic_load(&n_cancelled),
+             N_WORKERS * N_ROUNDS * N_CHILDREN / N_KINDS);
+    CHECK_EQ(atomic_load(&n_spawners_finished), N_WORKERS);
+    CHECK_EQ(atomic_load(&hog_finished), 1);
+    CHECK_EQ(atomic_load(&flapper_finished), 1);
+    for (size_t i = 0; i < N_STOLEN; i++) {
+        CHECK_EQ(atomic_load(&stolen_vars[i].finished), 1);
+    }
+}
+
+
+int main(void) {
+    RUN_TEST(test_workers);
+    return EXIT_SUCCESS;
+}
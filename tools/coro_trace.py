@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+# Copyright 2018 Gaurav Juvekar
+"""Convert a CoroTrace_dump() (see src/trace.h) to Chrome trace JSON.
+
+The output opens in chrome://tracing and in the Perfetto UI
+(https://ui.perfetto.dev). Each coroutine gets a track of slices from its
+resume to its suspend, named after the address of its function and labelled
+with the status it suspended in. Conditions, resources and timers get a track
+each of instant events.
+
+    coro_trace.py dump.bin > trace.json
+    coro_trace.py --cycles-per-us 168 dump.bin > trace.json
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+MAGIC = b"CORO-TRC"
+VERSION = 1
+HEADER = "8sIHHII"
+RECORD = "QQQIB3x"
+
+# CoroTraceKind of trace.h
+RESUME = 1
+SUSPEND = 2
+CONDITION_SET = 3
+RESOURCE_ACQUIRE = 4
+TIMER_START = 5
+TIMER_CANCEL = 6
+TIMER_FIRE = 7
+
+# CoroStatus of coro.h
+STATUSES = [
+    "FINALIZE",
+    "SUSPENDED",
+    "WAIT_TIMED",
+    "WAIT_CONDITION",
+    "WAIT_RESOURCE",
+    "WAIT_SUBCORO",
+    "WAIT_WAKE_CONDITION",
+    "WAIT_MANY",
+    "WAIT_MANY_POLLED",
+    "WAIT_QUEUED_RESOURCE",
+    "WAIT_CHANNEL",
+    "WAIT_IO",
+    "YIELDED",
+]
+
+# RetResource_acquire of resource.h
+OUTCOMES = ["FAILED", "SUCCESS", "PREEMPTED"]
+
+# Tracks of the instant events
+OBJECT_TRACKS = {
+    CONDITION_SET: (1, "conditions"),
+    RESOURCE_ACQUIRE: (2, "resources"),
+    TIMER_START: (3, "timers"),
+    TIMER_CANCEL: (3, "timers"),
+    TIMER_FIRE: (3, "timers"),
+}
+# Coroutine tracks are numbered after these
+FIRST_CORO_TRACK = 16
+
+
+def read_dump(data):
+    """Return (cycles_per_us, records) of the dump in data, without the
+    records of events lost while dumping"""
+    for order in "<>":
+        magic, byte_order, version, record_size, n_records, cycles_per_us = (
+            struct.unpack_from(order + HEADER, data))
+        if byte_order == 0x01020304:
+            break
+    else:
+        raise ValueError("not a trace dump, or of unknown byte order")
+    if magic != MAGIC:
+        raise ValueError("not a trace dump")
+    if version != VERSION:
+        raise ValueError("unsupported dump version %d" % version)
+
+    records = []
+    offset = struct.calcsize(HEADER)
+    for _ in range(n_records):
+        cycles, obj, detail, sequence, kind = struct.unpack_from(
+            order + RECORD, data, offset)
+        offset += record_size
+        if kind != 0:
+            records.append((cycles, obj, detail, sequence, kind))
+    return cycles_per_us, records
+
+
+def name(table, index):
+    return table[index] if index < len(table) else str(index)
+
+
+def convert(cycles_per_us, records):
+    """Return the Chrome trace events for records"""
+    records.sort(key=lambda record: (record[0], record[3]))
+    start = records[0][0] if records else 0
+    per_us = float(cycles_per_us or 1)
+
+    events = []
+    tracks = {}
+    resumed = {}
+
+    def track(key, tid, label):
+        if key not in tracks:
+            tracks[key] = tid
+            events.append({"ph": "M", "name": "thread_name", "pid": 1,
+                           "tid": tid, "args": {"name": label}})
+        return tracks[key]
+
+    for cycles, obj, detail, sequence, kind in records:
+        ts = (cycles - start) / per_us
+        if kind == RESUME:
+            resumed[obj] = (ts, detail)
+        elif kind == SUSPEND:
+            # Without its resume if that was overwritten
+            if obj not in resumed:
+                continue
+            began, func = resumed.pop(obj)
+            tid = track(obj, FIRST_CORO_TRACK + len(tracks),
+                        "coro 0x%x" % obj)
+            events.append({"ph": "X", "name": "0x%x" % func, "pid": 1,
+                           "tid": tid, "ts": began, "dur": ts - began,
+                           "args": {"status": name(STATUSES, detail)}})
+        elif kind in OBJECT_TRACKS:
+            tid = track(OBJECT_TRACKS[kind][0], *OBJECT_TRACKS[kind])
+            args = {"object": "0x%x" % obj}
+            if kind == CONDITION_SET:
+                label = "set"
+            elif kind == RESOURCE_ACQUIRE:
+                label = "acquire " + name(OUTCOMES, detail)
+            elif kind == TIMER_START:
+                label = "start"
+                args["ms"] = detail
+            elif kind == TIMER_CANCEL:
+                label = "cancel"
+            else:
+                label = "fire"
+            events.append({"ph": "i", "s": "t", "name": label, "pid": 1,
+                           "tid": tid, "ts": ts, "args": args})
+    return events
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("dump", help="file written from CoroTrace_dump()")
+    parser.add_argument("--cycles-per-us", type=int, default=0,
+                        help="rate of CONF_CORO_TRACE_CYCLES, if the dump "
+                             "does not give it (times are in cycles without)")
+    args = parser.parse_args()
+
+    with open(args.dump, "rb") as dump:
+        cycles_per_us, records = read_dump(dump.read())
+    if args.cycles_per_us:
+        cycles_per_us = args.cycles_per_us
+    json.dump({"traceEvents": convert(cycles_per_us, records),
+               "displayTimeUnit": "ns"},
+              sys.stdout)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()